@@ -3,14 +3,27 @@ extern crate log;
 use crate::acpi::madt;
 use crate::mm::{io::MemoryIO, VirtualAddress};
 
-use core::sync::atomic::{AtomicBool, Ordering};
+use core::sync::atomic::{AtomicBool, AtomicU64, Ordering};
 
 use madt::PROCESSORS;
 
+/// max number of processors for which per-CPU structures are maintained
+pub const MAX_PROCESSORS: usize = 32;
+
 pub struct ProcessorID(u8);
 
 const IA32_MSR_APIC_BASE: u32 = 0x1B;
 
+/// LAPIC timer interrupt line, used in TSC deadline mode on every processor.
+pub const LAPIC_TIMER_VECTOR: u8 = 0x50;
+
+// interrupt command register bits:
+const ICR_DELIVERY_INIT: u32 = 0x500;
+const ICR_DELIVERY_STARTUP: u32 = 0x600;
+const ICR_DELIVERY_PENDING: u32 = 1 << 12;
+const ICR_LEVEL_ASSERT: u32 = 1 << 14;
+const ICR_TRIGGER_LEVEL: u32 = 1 << 15;
+
 pub fn read_msr_base_address() -> u32 {
     let base_addr_eax: u32;
     unsafe {
@@ -30,6 +43,11 @@ impl ProcessorID {
     pub fn is_bsp(&self) -> bool {
         self.0 == 0
     }
+
+    #[inline]
+    pub fn as_usize(&self) -> usize {
+        self.0 as usize
+    }
 }
 
 pub enum LapicNumbers {
@@ -49,6 +67,7 @@ pub enum LapicNumbers {
     ErrorStatus = 0x280,
     LvtCMCI = 0x2f0,
     InterruptCommandBase = 0x300,
+    InterruptCommandHigh = 0x310,
     LvtTimer = 0x320,
     LvtThermalSensor = 0x330,
     LvtPMCounters = 0x340,
@@ -60,13 +79,24 @@ pub enum LapicNumbers {
     TimerDivideConfig = 0x3e0,
 }
 
+/// virtual address of LAPIC registers, cached to avoid taking the
+/// PROCESSORS lock on every register access. 0 until first used.
+static LAPIC_BASE_ADDRESS: AtomicU64 = AtomicU64::new(0);
+
 /// implements IO functions used by LAPIC
 pub struct LAPICRegistersIO;
 
 impl LAPICRegistersIO {
     #[inline]
     pub fn get_base_addr() -> VirtualAddress {
-        PROCESSORS.lock().lapic_address
+        let cached_addr = LAPIC_BASE_ADDRESS.load(Ordering::Relaxed);
+        if cached_addr != 0 {
+            return VirtualAddress::from_u64(cached_addr);
+        }
+
+        let lapic_address = PROCESSORS.lock().lapic_address;
+        LAPIC_BASE_ADDRESS.store(lapic_address.as_u64(), Ordering::Relaxed);
+        lapic_address
     }
 
     #[inline]
@@ -96,6 +126,22 @@ impl LAPICUtils {
         ProcessorID((lapic_id >> 24) as u8)
     }
 
+    /// lock-free version of `get_processor_id`, returns `None` if the
+    /// LAPIC is not yet set-up.
+    #[inline]
+    pub fn current_processor_id() -> Option<ProcessorID> {
+        let base_addr = LAPIC_BASE_ADDRESS.load(Ordering::Relaxed);
+        if base_addr == 0 {
+            return None;
+        }
+
+        let reader = MemoryIO::new(
+            VirtualAddress::from_u64(base_addr + LapicNumbers::LapicID as u64),
+            false,
+        );
+        Some(ProcessorID((reader.read_u32() >> 24) as u8))
+    }
+
     pub fn eoi() {
         LAPICRegistersIO::write_register(LapicNumbers::Eoi as u64, 0);
     }
@@ -106,6 +152,38 @@ impl LAPICUtils {
         LAPICRegistersIO::write_register(LapicNumbers::LvtTimer as u64, timer_flag);
     }
 
+    /// sends an inter-processor interrupt to the processor with given
+    /// LAPIC ID and waits for the LAPIC to deliver it.
+    pub fn send_ipi(apic_id: u8, command: u32) {
+        LAPICRegistersIO::write_register(
+            LapicNumbers::InterruptCommandHigh as u64,
+            (apic_id as u32) << 24,
+        );
+        LAPICRegistersIO::write_register(LapicNumbers::InterruptCommandBase as u64, command);
+
+        while LAPICRegistersIO::read_register(LapicNumbers::InterruptCommandBase as u64)
+            & ICR_DELIVERY_PENDING
+            != 0
+        {
+            core::hint::spin_loop();
+        }
+    }
+
+    /// puts the processor in wait-for-SIPI state.
+    pub fn send_init_ipi(apic_id: u8) {
+        Self::send_ipi(
+            apic_id,
+            ICR_DELIVERY_INIT | ICR_LEVEL_ASSERT | ICR_TRIGGER_LEVEL,
+        );
+        // de-assert:
+        Self::send_ipi(apic_id, ICR_DELIVERY_INIT | ICR_TRIGGER_LEVEL);
+    }
+
+    /// starts the processor in real mode at `vector_page * 4KiB`.
+    pub fn send_startup_ipi(apic_id: u8, vector_page: u8) {
+        Self::send_ipi(apic_id, ICR_DELIVERY_STARTUP | vector_page as u32);
+    }
+
     #[inline]
     fn write_lapic_reg(offset: u64, data: u32) {
         let lapic_addr = LAPICRegistersIO::get_base_addr();
@@ -149,12 +227,18 @@ pub fn init_bsp_lapic() {
     LAPICUtils::enable_lapic();
 
     // set up LAPIC timer:
-    LAPICUtils::setup_timer(0x50);
+    LAPICUtils::setup_timer(LAPIC_TIMER_VECTOR);
 
     log::info!("Enabled LAPIC and APIC timer for base processor.");
     APIC_BSP_ENABLED.store(true, Ordering::SeqCst);
 }
 
+/// init the LAPIC of an application processor, called by the processor itself.
+pub fn init_ap_lapic() {
+    LAPICUtils::enable_lapic();
+    LAPICUtils::setup_timer(LAPIC_TIMER_VECTOR);
+}
+
 pub fn bsp_apic_enabled() -> bool {
     APIC_BSP_ENABLED.load(Ordering::SeqCst)
 }
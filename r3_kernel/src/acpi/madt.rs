@@ -21,6 +21,15 @@ pub struct PerProcessorLAPIC {
     flags: u32,
 }
 
+impl PerProcessorLAPIC {
+    /// the processor is either enabled or can be brought online.
+    #[inline]
+    pub fn is_usable(&self) -> bool {
+        let flags = self.flags;
+        flags & 0x3 != 0
+    }
+}
+
 #[derive(Debug, Copy, Clone)]
 #[repr(C, packed)]
 pub struct PerProcessorIOAPIC {
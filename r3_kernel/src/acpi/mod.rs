@@ -3,6 +3,7 @@ pub mod lapic;
 pub mod madt;
 pub mod power;
 pub mod rsdt;
+pub mod smp;
 
 use crate::cpu;
 
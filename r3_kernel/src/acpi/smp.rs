@@ -0,0 +1,334 @@
+extern crate alloc;
+extern crate log;
+
+use crate::acpi::lapic::{self, LAPICUtils, MAX_PROCESSORS};
+use crate::acpi::madt::{PerProcessorLAPIC, PROCESSORS};
+use crate::cpu;
+use crate::cpu::exceptions::IDT;
+use crate::cpu::percpu::PerCPU;
+use crate::cpu::segments::{self, KERNEL_TSS};
+use crate::cpu::syscall;
+use crate::cpu::tsc::{safe_ticks_from_ns, TSC};
+use crate::mm::paging::{KernelVirtualMemoryManager, Page, PageEntryFlags};
+use crate::mm::phy::FRAME_ALLOCATOR;
+use crate::mm::{p_to_v, MemorySizes, PhysicalAddress, VirtualAddress};
+use crate::system::timer::{self, SystemTimer};
+
+use alloc::boxed::Box;
+use alloc::vec;
+use alloc::vec::Vec;
+use core::ptr;
+use core::sync::atomic::{AtomicBool, Ordering};
+
+/// stack used by an application processor until it picks up it's first thread
+const AP_BOOT_STACK_SIZE: usize = 64 * MemorySizes::OneKiB as usize;
+
+/// stack of the idle loop a processor runs when there is no thread for it
+const IDLE_STACK_SIZE: usize = 16 * MemorySizes::OneKiB as usize;
+
+/// time given to an application processor to reach `ap_main` after a SIPI
+const AP_STARTUP_TIMEOUT_NS: u64 = 100 * 1000000;
+
+/// the trampoline loads CR3 in 32-bit mode.
+const AP_MAX_CR3: u64 = 4 * MemorySizes::OneGiB as u64;
+
+// AP startup code, it is copied to a frame below 1MiB and started with a SIPI.
+// The processor starts in real mode at the start of the frame, goes through
+// protected mode into long mode on the kernel page tables and calls the entry
+// stored in the data area. The addresses that depend on where the code is
+// copied to are patched by `prepare_trampoline`.
+global_asm!(
+    r#"
+    .intel_syntax noprefix
+    .pushsection .text.ap_trampoline, "ax"
+
+    .code16
+    .global ap_trampoline_start
+    ap_trampoline_start:
+        cli
+        cld
+        mov ax, cs
+        mov ds, ax
+        xor ebx, ebx
+        mov bx, ax
+        shl ebx, 4
+        lgdt [ap_trampoline_gdt_ptr - ap_trampoline_start]
+        mov eax, cr0
+        or eax, 1
+        mov cr0, eax
+        // ljmp 0x08:ap_trampoline_pm_entry
+        .byte 0x66, 0xea
+    .global ap_trampoline_pm_target
+    ap_trampoline_pm_target:
+        .long 0
+        .word 0x08
+
+    .code32
+    .global ap_trampoline_pm_entry
+    ap_trampoline_pm_entry:
+        mov ax, 0x10
+        mov ds, ax
+        mov es, ax
+        mov ss, ax
+        // PAE + PGE
+        mov eax, cr4
+        or eax, 0xa0
+        mov cr4, eax
+        mov eax, [ebx + ap_trampoline_cr3 - ap_trampoline_start]
+        mov cr3, eax
+        // EFER.LME + EFER.NXE
+        mov ecx, 0xc0000080
+        rdmsr
+        or eax, 0x900
+        wrmsr
+        // paging + write protection
+        mov eax, cr0
+        or eax, 0x80010000
+        mov cr0, eax
+        // ljmp 0x18:ap_trampoline_lm_entry
+        .byte 0xea
+    .global ap_trampoline_lm_target
+    ap_trampoline_lm_target:
+        .long 0
+        .word 0x18
+
+    .code64
+    .global ap_trampoline_lm_entry
+    ap_trampoline_lm_entry:
+        xor ax, ax
+        mov ds, ax
+        mov es, ax
+        mov ss, ax
+        mov fs, ax
+        mov gs, ax
+        mov ebx, ebx
+        mov rsp, [rbx + ap_trampoline_stack - ap_trampoline_start]
+        mov rax, [rbx + ap_trampoline_entry - ap_trampoline_start]
+        xor rbp, rbp
+        call rax
+    1:
+        hlt
+        jmp 1b
+
+    .align 16
+    .global ap_trampoline_gdt
+    ap_trampoline_gdt:
+        .quad 0
+        .quad 0x00cf9a000000ffff
+        .quad 0x00cf92000000ffff
+        .quad 0x00af9a000000ffff
+    .global ap_trampoline_gdt_ptr
+    ap_trampoline_gdt_ptr:
+        .word 31
+        .long 0
+
+    .align 8
+    .global ap_trampoline_cr3
+    ap_trampoline_cr3:
+        .quad 0
+    .global ap_trampoline_stack
+    ap_trampoline_stack:
+        .quad 0
+    .global ap_trampoline_entry
+    ap_trampoline_entry:
+        .quad 0
+    .global ap_trampoline_end
+    ap_trampoline_end:
+
+    .popsection
+    "#
+);
+
+extern "C" {
+    static ap_trampoline_start: u8;
+    static ap_trampoline_pm_target: u8;
+    static ap_trampoline_pm_entry: u8;
+    static ap_trampoline_lm_target: u8;
+    static ap_trampoline_lm_entry: u8;
+    static ap_trampoline_gdt: u8;
+    static ap_trampoline_gdt_ptr: u8;
+    static ap_trampoline_cr3: u8;
+    static ap_trampoline_stack: u8;
+    static ap_trampoline_entry: u8;
+    static ap_trampoline_end: u8;
+}
+
+/// set by an application processor once it is ready to schedule threads.
+static AP_STARTED: AtomicBool = AtomicBool::new(false);
+
+/// offset of the trampoline symbol from the start of the trampoline
+#[inline]
+fn symbol_offset(symbol: &u8) -> usize {
+    let start = unsafe { &ap_trampoline_start as *const u8 as usize };
+    symbol as *const u8 as usize - start
+}
+
+/// allocates a stack from the kernel heap, it is never freed.
+#[inline]
+fn alloc_stack(size: usize) -> u64 {
+    let stack: &'static mut [u8] = Box::leak(vec![0u8; size].into_boxed_slice());
+    (stack.as_ptr() as u64 + size as u64) & !0xf
+}
+
+#[inline]
+unsafe fn write_field<T>(trampoline: *mut u8, offset: usize, value: T) {
+    ptr::write_unaligned(trampoline.add(offset) as *mut T, value);
+}
+
+/// copies the startup code into the frame at `base`, returns a pointer
+/// to the copy through the physical memory map.
+fn prepare_trampoline(base: u64, cr3: u64) -> *mut u8 {
+    let trampoline = p_to_v(PhysicalAddress::from_u64(base)).get_mut_ptr::<u8>();
+
+    unsafe {
+        let size = symbol_offset(&ap_trampoline_end);
+        ptr::copy_nonoverlapping(&ap_trampoline_start as *const u8, trampoline, size);
+
+        write_field(
+            trampoline,
+            symbol_offset(&ap_trampoline_pm_target),
+            (base + symbol_offset(&ap_trampoline_pm_entry) as u64) as u32,
+        );
+        write_field(
+            trampoline,
+            symbol_offset(&ap_trampoline_lm_target),
+            (base + symbol_offset(&ap_trampoline_lm_entry) as u64) as u32,
+        );
+        // base of the GDT pointer, after the 16-bit limit:
+        write_field(
+            trampoline,
+            symbol_offset(&ap_trampoline_gdt_ptr) + 2,
+            (base + symbol_offset(&ap_trampoline_gdt) as u64) as u32,
+        );
+        write_field(trampoline, symbol_offset(&ap_trampoline_cr3), cr3);
+        write_field(
+            trampoline,
+            symbol_offset(&ap_trampoline_entry),
+            ap_main as extern "C" fn() -> ! as u64,
+        );
+    }
+
+    trampoline
+}
+
+/// entry point of application processors, called from the trampoline
+/// in long mode on the boot stack.
+extern "C" fn ap_main() -> ! {
+    let (tss, syscall_stack_end) = segments::init_ap_gdt();
+    IDT.lock().load_into_cpu();
+
+    lapic::init_ap_lapic();
+    PerCPU::register_current(tss, syscall_stack_end, alloc_stack(IDLE_STACK_SIZE));
+    syscall::setup_fast_syscalls();
+
+    log::info!("Processor {} is online.", PerCPU::current_index());
+    AP_STARTED.store(true, Ordering::SeqCst);
+
+    // the timer calls into the scheduler, this loop runs whenever
+    // the processor has nothing to do.
+    SystemTimer::start_ticks();
+    cpu::halt_with_interrupts();
+}
+
+#[inline]
+fn wait_for_ap() -> bool {
+    let deadline = TSC::read_tsc().u64() + safe_ticks_from_ns(AP_STARTUP_TIMEOUT_NS).u64();
+    while TSC::read_tsc().u64() < deadline {
+        if AP_STARTED.load(Ordering::SeqCst) {
+            return true;
+        }
+        core::hint::spin_loop();
+    }
+
+    AP_STARTED.load(Ordering::SeqCst)
+}
+
+/// INIT-SIPI-SIPI sequence, returns true if the processor came up.
+fn start_processor(apic_id: u8, trampoline: *mut u8, vector_page: u8) -> bool {
+    let stack_end = alloc_stack(AP_BOOT_STACK_SIZE);
+    unsafe {
+        write_field(trampoline, symbol_offset(&ap_trampoline_stack), stack_end);
+    }
+
+    AP_STARTED.store(false, Ordering::SeqCst);
+
+    // spin instead of sleeping, a timer shot here would enter the scheduler.
+    LAPICUtils::send_init_ipi(apic_id);
+    timer::wait_ns(10 * 1000000);
+
+    // the second SIPI is sent only if the first one was missed.
+    for _ in 0..2 {
+        LAPICUtils::send_startup_ipi(apic_id, vector_page);
+        if wait_for_ap() {
+            return true;
+        }
+    }
+
+    false
+}
+
+/// starts every usable processor listed in the MADT, each of them
+/// sets up it's own tables and joins the scheduler.
+pub fn start_application_processors() {
+    // the BSP keeps using the boot stacks.
+    PerCPU::register_current(&KERNEL_TSS, 0, alloc_stack(IDLE_STACK_SIZE));
+
+    let trampoline_opt = FRAME_ALLOCATOR.lock().ap_trampoline_frame();
+    if trampoline_opt.is_none() {
+        log::warn!("No memory below 1MiB for AP startup code, using only the BSP.");
+        return;
+    }
+
+    let frame = trampoline_opt.unwrap();
+    let base = frame.as_u64();
+
+    let kernel_vmm = KernelVirtualMemoryManager::pt();
+    let cr3 = kernel_vmm.l4_phy_addr.as_u64();
+    if cr3 >= AP_MAX_CR3 {
+        log::warn!(
+            "Kernel page table at 0x{:x} is not reachable from 32-bit mode, using only the BSP.",
+            cr3
+        );
+        return;
+    }
+
+    // the trampoline keeps running from the frame after enabling paging,
+    // so it is identity mapped until all the processors are in long mode.
+    let trampoline_page = Page::from_address(VirtualAddress::from_u64(base));
+    let map_result = kernel_vmm.map_page(trampoline_page, frame, PageEntryFlags::kernel_flags());
+    if map_result.is_err() {
+        log::error!(
+            "Failed to map AP startup code, err={:?}",
+            map_result.unwrap_err()
+        );
+        return;
+    }
+
+    let trampoline = prepare_trampoline(base, cr3);
+    let bsp_id = LAPICUtils::get_processor_id().as_usize();
+    let cores: Vec<PerProcessorLAPIC> = PROCESSORS.lock().cores.clone();
+
+    for core in cores.iter() {
+        let apic_id = core.apic_id;
+        if apic_id as usize == bsp_id || !core.is_usable() {
+            continue;
+        }
+
+        if apic_id as usize >= MAX_PROCESSORS {
+            log::warn!("Ignoring processor with LAPIC ID {}.", apic_id);
+            continue;
+        }
+
+        if !start_processor(apic_id, trampoline, (base >> 12) as u8) {
+            log::error!("Processor with LAPIC ID {} did not start.", apic_id);
+        }
+    }
+
+    let _ = kernel_vmm.unmap_page(trampoline_page);
+
+    log::info!(
+        "Started application processors, {} of {} processors online.",
+        PerCPU::online_processors(),
+        cores.len()
+    );
+}
@@ -163,6 +163,72 @@ lazy_static! {
     pub static ref CPU_FEATURES: CPUFeatures = probe_cpu_features();
 }
 
+/// the registers returned by `cpuid` for `leaf` and `sub_leaf`,
+/// in the order eax, ebx, ecx, edx.
+pub fn cpuid(leaf: u32, sub_leaf: u32) -> (u32, u32, u32, u32) {
+    let (eax, ecx, edx): (u32, u32, u32);
+    let ebx_scratch: u64;
+
+    unsafe {
+        asm!(
+            "xchg {0:r}, rbx",
+            "cpuid",
+            "xchg {0:r}, rbx",
+            out(reg) ebx_scratch,
+            inout("eax") leaf => eax,
+            inout("ecx") sub_leaf => ecx,
+            out("edx") edx,
+            options(nostack, nomem, preserves_flags)
+        );
+    }
+
+    (eax, ebx_scratch as u32, ecx, edx)
+}
+
+/// the TSC keeps a constant rate across P-, C- and T-states.
+const INVARIANT_TSC_EDX: u32 = 1 << 8;
+
+pub fn has_invariant_tsc() -> bool {
+    if CPU_FEATURES.max_extended_level < 0x8000_0007 {
+        return false;
+    }
+
+    let (_, _, _, edx) = cpuid(0x8000_0007, 0);
+    edx & INVARIANT_TSC_EDX != 0
+}
+
+/// TSC frequency in Hz as reported by the processor, `None` if it does not
+/// enumerate it. Leaf 0x15 gives the ratio of the TSC to the core crystal
+/// clock and, on most processors, the crystal frequency. When the crystal
+/// is not given, it is derived from the base frequency of leaf 0x16.
+pub fn tsc_frequency() -> Option<u64> {
+    if CPU_FEATURES.max_standard_level < 0x15 {
+        return None;
+    }
+
+    let (denominator, numerator, crystal_hz, _) = cpuid(0x15, 0);
+    if denominator == 0 || numerator == 0 {
+        return None;
+    }
+
+    if crystal_hz != 0 {
+        return Some(crystal_hz as u64 * numerator as u64 / denominator as u64);
+    }
+
+    if CPU_FEATURES.max_standard_level < 0x16 {
+        return None;
+    }
+
+    // the TSC runs at the base frequency.
+    let (base_mhz, _, _, _) = cpuid(0x16, 0);
+    let base_mhz = base_mhz & 0xffff;
+    if base_mhz == 0 {
+        return None;
+    }
+
+    Some(base_mhz as u64 * 1000000)
+}
+
 pub fn has_feature(flag: FlagsECX) -> bool {
     CPU_FEATURES.ecx.contains(flag)
 }
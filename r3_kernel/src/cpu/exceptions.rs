@@ -9,6 +9,10 @@ use cpu::interrupts::{
 };
 use cpu::interrupts::{InterruptDescriptorTable, InterruptStackFrame};
 use cpu::mmu::{read_cr2, PageFaultExceptionTypes};
+
+use crate::mm::{paging::KernelVirtualMemoryManager, VirtualAddress};
+use crate::system::trace::{self, TraceEvent};
+use crate::system::vma;
 use lazy_static::lazy_static;
 use spin::Mutex;
 
@@ -60,8 +64,41 @@ extern "x86-interrupt" fn double_fault(stk: InterruptStackFrame, _err: u64) -> !
     cpu::halt_no_interrupts();
 }
 
-extern "x86-interrupt" fn page_fault(stk: InterruptStackFrame, err: PageFaultExceptionTypes) -> ! {
+extern "x86-interrupt" fn page_fault(stk: InterruptStackFrame, err: PageFaultExceptionTypes) {
     let cr2_val = read_cr2();
+    trace::record(TraceEvent::PageFault, cr2_val, 0);
+
+    // writes to present pages can be copy-on-write faults, these are
+    // resolved in the current address space and the write is retried.
+    if err.contains(
+        PageFaultExceptionTypes::PROTECTION_VIOLATION | PageFaultExceptionTypes::CAUSED_BY_WRITE,
+    ) {
+        let (vmm, _) = KernelVirtualMemoryManager::current_vmm();
+        if vmm.resolve_cow_fault(VirtualAddress::from_u64(cr2_val)) {
+            return;
+        }
+    }
+
+    // zero filled pages of the program areas are mapped on first access:
+    if !err.contains(PageFaultExceptionTypes::PROTECTION_VIOLATION)
+        && vma::resolve_demand_fault(VirtualAddress::from_u64(cr2_val))
+    {
+        return;
+    }
+
+    // faults from user mode run on the thread's syscall stack, the file
+    // pages are read there with interrupts on while the thread waits.
+    if err.contains(PageFaultExceptionTypes::USER_MODE)
+        && !err.contains(PageFaultExceptionTypes::PROTECTION_VIOLATION)
+    {
+        cpu::enable_interrupts();
+        let loaded = vma::resolve_file_fault(VirtualAddress::from_u64(cr2_val));
+        cpu::disable_interrupts();
+        if loaded {
+            return;
+        }
+    }
+
     // log exception
     log::error!(
         "Page Fault Exception:\n
@@ -3,8 +3,10 @@ extern crate log;
 use crate::acpi::lapic::LAPICUtils;
 use crate::cpu::exceptions;
 use crate::cpu::interrupts;
+use crate::cpu::mmu;
 use crate::cpu::pic;
 use crate::cpu::pit;
+use crate::drivers::disk::ata_dma;
 use crate::drivers::keyboard;
 use crate::system::net::iface::network_interrupt_handler;
 
@@ -77,10 +79,12 @@ extern "x86-interrupt" fn kbd_irq1_handler(_stk: InterruptStackFrame) {
 }
 
 extern "x86-interrupt" fn ata_irq14_handler(_stk: InterruptStackFrame) {
+    ata_dma::on_interrupt(0);
     LAPICUtils::eoi();
 }
 
 extern "x86-interrupt" fn ata_irq15_handler(_stk: InterruptStackFrame) {
+    ata_dma::on_interrupt(1);
     LAPICUtils::eoi();
 }
 
@@ -89,6 +93,11 @@ extern "x86-interrupt" fn net_interrupt_wrapper(_stk: InterruptStackFrame) {
     LAPICUtils::eoi();
 }
 
+extern "x86-interrupt" fn tlb_shootdown_handler(_stk: InterruptStackFrame) {
+    mmu::on_tlb_shootdown();
+    LAPICUtils::eoi();
+}
+
 fn no_irq_fn(irq_no: usize) {
     log::debug!("dev interrupt {:x}", irq_no);
     LAPICUtils::eoi();
@@ -587,6 +596,9 @@ pub fn setup_post_apic_interrupts() {
 
     let irq0x01_handle = prepare_default_handle(kbd_irq1_handler, 2);
     IDT.lock().interrupts[HARDWARE_INTERRUPTS_BASE + KEYBOARD_INTERRUPT_LINE] = irq0x01_handle;
+
+    let shootdown_handle = prepare_default_handle(tlb_shootdown_handler, 0);
+    IDT.lock().interrupts[mmu::TLB_SHOOTDOWN_VECTOR as usize] = shootdown_handle;
 }
 
 pub fn register_network_interrupt(int_no: usize) {
@@ -1,6 +1,11 @@
+extern crate alloc;
 extern crate log;
+
+use crate::cpu::percpu::PerCPU;
 use crate::cpu::segments::TaskStateSegment;
-use crate::cpu::segments::KERNEL_TSS;
+
+use alloc::boxed::Box;
+use alloc::vec;
 
 const STACK_SIZE: usize = 4096 * 16;
 
@@ -21,30 +26,65 @@ static mut PRIVILEGE_STACK: [u8; STACK_SIZE] = [0; STACK_SIZE];
 
 static mut SYSTEM_NETWORK_INTERRUPT_STACK: [u8; STACK_SIZE] = [0; STACK_SIZE];
 
+/// stacks grow down, the TSS needs the address past the last byte.
+#[inline]
+fn stack_end(stack: *const [u8; STACK_SIZE]) -> u64 {
+    stack as u64 + STACK_SIZE as u64
+}
+
 pub fn init_system_stacks(tss: &mut TaskStateSegment) {
     // default interrupt handler is 0th entry
     unsafe {
-        tss.set_interrupt_stack(0, (&DEFAULT_INTERRUPT_STACK as *const _) as u64);
+        tss.set_interrupt_stack(0, stack_end(&DEFAULT_INTERRUPT_STACK));
         // set the privilege stack
-        tss.set_privilege_stack(0, (&PRIVILEGE_STACK as *const _) as u64);
+        tss.set_privilege_stack(0, stack_end(&PRIVILEGE_STACK));
 
         // set the default system call stack
-        tss.set_syscall_stack((&DEFAULT_SYSCALL_STACK as *const _) as u64);
+        tss.set_syscall_stack(stack_end(&DEFAULT_SYSCALL_STACK));
 
         // set the ps/2 keyboard stack
-        tss.set_interrupt_stack(2, (&SYSTEM_KEYBOARD_INTERRUPT_STACK as *const _) as u64);
+        tss.set_interrupt_stack(2, stack_end(&SYSTEM_KEYBOARD_INTERRUPT_STACK));
 
         // set the LAPIC timer stack
-        tss.set_interrupt_stack(3, (&LAPIC_TIMER_INTERRPUT_STACK as *const _) as u64);
+        tss.set_interrupt_stack(3, stack_end(&LAPIC_TIMER_INTERRPUT_STACK));
 
         // set Network stack
-        tss.set_interrupt_stack(4, (&SYSTEM_NETWORK_INTERRUPT_STACK as *const _) as u64);
+        tss.set_interrupt_stack(4, stack_end(&SYSTEM_NETWORK_INTERRUPT_STACK));
     }
 }
 
-pub fn load_default_syscall_stack() {
-    unsafe {
-        let mut tss = KERNEL_TSS.lock();
-        tss.set_syscall_stack((&DEFAULT_SYSCALL_STACK as *const _) as u64);
+/// allocates a stack from the kernel heap, it is never freed.
+#[inline]
+fn alloc_ap_stack() -> u64 {
+    let stack: &'static mut [u8] = Box::leak(vec![0u8; STACK_SIZE].into_boxed_slice());
+    stack.as_ptr() as u64 + STACK_SIZE as u64
+}
+
+/// application processors get their own copy of every system stack,
+/// returns the end of the default syscall stack.
+pub fn init_ap_stacks(tss: &mut TaskStateSegment) -> u64 {
+    let syscall_stack_end = alloc_ap_stack();
+
+    tss.set_interrupt_stack(0, alloc_ap_stack());
+    tss.set_privilege_stack(0, alloc_ap_stack());
+    tss.set_syscall_stack(syscall_stack_end);
+    tss.set_interrupt_stack(2, alloc_ap_stack());
+    tss.set_interrupt_stack(3, alloc_ap_stack());
+    tss.set_interrupt_stack(4, alloc_ap_stack());
+
+    syscall_stack_end
+}
+
+/// returns the end of the stack that was loaded.
+pub fn load_default_syscall_stack() -> u64 {
+    let mut stack_end_addr = PerCPU::default_syscall_stack();
+    if stack_end_addr == 0 {
+        stack_end_addr = unsafe { stack_end(&DEFAULT_SYSCALL_STACK) };
     }
+
+    PerCPU::current_tss()
+        .lock()
+        .set_syscall_stack(stack_end_addr);
+
+    stack_end_addr
 }
@@ -125,7 +125,7 @@ pub type DefaultHandlerFuncNoReturn = extern "x86-interrupt" fn(InterruptStackFr
 pub type HandlerFuncNoReturnWithErr = extern "x86-interrupt" fn(InterruptStackFrame, u64) -> !;
 
 pub type PageFaultHandlerType =
-    extern "x86-interrupt" fn(InterruptStackFrame, PageFaultExceptionTypes) -> !;
+    extern "x86-interrupt" fn(InterruptStackFrame, PageFaultExceptionTypes);
 
 pub type NakedHandlerType = extern "C" fn(&mut InterruptStackFrame);
 
@@ -1,10 +1,25 @@
 extern crate bitflags;
 
+use crate::acpi::lapic::{LAPICUtils, MAX_PROCESSORS};
+use crate::cpu::percpu::PerCPU;
 use crate::mm::PhysicalAddress;
 use bitflags::bitflags;
+use core::sync::atomic::{AtomicBool, AtomicU64, Ordering};
 
 const CR3_PHY_ADDR_MASK: u64 = 0x000ffffffffff000;
 
+/// when set, supervisor writes to read-only pages also fault
+const CR0_WRITE_PROTECT: u64 = 1 << 16;
+
+/// vector of the IPI that makes a processor flush it's TLB.
+pub const TLB_SHOOTDOWN_VECTOR: u8 = 0xf0;
+
+/// processors that still have to flush for the shootdown in flight.
+static SHOOTDOWN_PENDING: AtomicU64 = AtomicU64::new(0);
+
+/// one shootdown is in flight at a time.
+static SHOOTDOWN_BUSY: AtomicBool = AtomicBool::new(false);
+
 bitflags! {
     #[repr(transparent)]
     pub struct PageFaultExceptionTypes: u64 {
@@ -75,3 +90,101 @@ pub fn reload_flush() {
     let cr3_val = read_cr3();
     write_cr3(cr3_val);
 }
+
+/// flushes the TLB of this processor and of every other online one, and
+/// returns once all of them did. Called after entries of a page table were
+/// write protected or removed, before the frames are freed, since threads
+/// of the address space can run on any processor.
+pub fn shootdown_tlb() {
+    reload_flush();
+
+    let current = PerCPU::current_index();
+    let mut targets: u64 = 0;
+    for index in 0..MAX_PROCESSORS {
+        if index != current && PerCPU::is_online(index) {
+            targets |= 1 << index;
+        }
+    }
+
+    if targets == 0 {
+        return;
+    }
+
+    // the processor holding the shootdown can be waiting for this one, so
+    // the shootdowns sent here are served while waiting with interrupts off.
+    while SHOOTDOWN_BUSY
+        .compare_exchange(false, true, Ordering::SeqCst, Ordering::SeqCst)
+        .is_err()
+    {
+        serve_pending_shootdown();
+        core::hint::spin_loop();
+    }
+
+    SHOOTDOWN_PENDING.store(targets, Ordering::SeqCst);
+    for index in 0..MAX_PROCESSORS {
+        if targets & (1 << index) != 0 {
+            LAPICUtils::send_ipi(index as u8, TLB_SHOOTDOWN_VECTOR as u32);
+        }
+    }
+
+    while SHOOTDOWN_PENDING.load(Ordering::SeqCst) != 0 {
+        core::hint::spin_loop();
+    }
+
+    SHOOTDOWN_BUSY.store(false, Ordering::SeqCst);
+}
+
+#[inline]
+fn serve_pending_shootdown() {
+    let bit = 1 << PerCPU::current_index();
+    if SHOOTDOWN_PENDING.load(Ordering::SeqCst) & bit != 0 {
+        reload_flush();
+        SHOOTDOWN_PENDING.fetch_and(!bit, Ordering::SeqCst);
+    }
+}
+
+/// called from the interrupt handler of `TLB_SHOOTDOWN_VECTOR`.
+pub fn on_tlb_shootdown() {
+    let bit = 1 << PerCPU::current_index();
+    reload_flush();
+    SHOOTDOWN_PENDING.fetch_and(!bit, Ordering::SeqCst);
+}
+
+/// invalidates the TLB entry of the page containing `addr`.
+pub fn invalidate_page(addr: u64) {
+    unsafe {
+        asm!(
+            "invlpg [{}]",
+            in(reg) addr,
+            options(nostack, preserves_flags)
+        );
+    }
+}
+
+pub fn read_cr0() -> u64 {
+    let cr0_val: u64;
+    unsafe {
+        asm!(
+            "mov {}, cr0", out(reg) cr0_val,
+            options(nomem, nostack, preserves_flags)
+        );
+    }
+
+    cr0_val
+}
+
+pub fn write_cr0(value: u64) {
+    unsafe {
+        asm!(
+            "mov cr0, {}",
+            in(reg) value,
+            options(nostack, preserves_flags)
+        );
+    }
+}
+
+/// makes kernel writes to copy-on-write user pages fault, so that they
+/// are resolved the same way as user writes.
+pub fn enable_write_protection() {
+    write_cr0(read_cr0() | CR0_WRITE_PROTECT);
+}
@@ -7,6 +7,7 @@ pub mod interrupt_stacks;
 pub mod interrupts;
 pub mod io;
 pub mod mmu;
+pub mod percpu;
 pub mod pic;
 pub mod pit;
 pub mod rflags;
@@ -61,6 +62,22 @@ pub fn halt_no_interrupts() -> ! {
     }
 }
 
+/// switches to the stack and halts with interrupts enabled, the context
+/// that was running before is abandoned.
+pub fn idle_on_stack(stack_end: u64) -> ! {
+    unsafe {
+        asm!(
+            "mov rsp, {}",
+            "sti",
+            "2:",
+            "hlt",
+            "jmp 2b",
+            in(reg) stack_end,
+            options(noreturn)
+        );
+    }
+}
+
 pub fn init_base_processor_tables() {
     segments::init_gdt();
     exceptions::init_exceptions();
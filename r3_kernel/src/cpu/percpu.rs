@@ -0,0 +1,257 @@
+extern crate spin;
+
+use crate::acpi::lapic::{LAPICUtils, MAX_PROCESSORS};
+use crate::cpu;
+use crate::cpu::mmu;
+use crate::cpu::segments::{TaskStateSegment, KERNEL_TSS};
+use crate::mm::paging::KernelVirtualMemoryManager;
+use crate::mm::PhysicalAddress;
+
+use core::cell::UnsafeCell;
+use core::sync::atomic::{AtomicU64, Ordering};
+use spin::Mutex;
+
+/// Read by the SYSCALL entry through GS after `swapgs`, the offsets of
+/// these fields are used by the entry code.
+#[derive(Clone, Copy)]
+#[repr(C)]
+pub struct SyscallEntryBlock {
+    /// stack the entry switches to, same as the syscall stack in the TSS.
+    pub kernel_stack: u64,
+    /// user stack pointer, kept here until it is pushed on the kernel stack.
+    pub user_stack: u64,
+    pub user_cs: u64,
+    pub user_ss: u64,
+}
+
+impl SyscallEntryBlock {
+    const fn empty() -> Self {
+        SyscallEntryBlock {
+            kernel_stack: 0,
+            user_stack: 0,
+            user_cs: 0,
+            user_ss: 0,
+        }
+    }
+}
+
+/// state private to a processor.
+#[derive(Clone, Copy)]
+#[repr(C)]
+pub struct PerCPUData {
+    /// must stay the first field, KERNEL_GS_BASE points here.
+    pub syscall_entry: SyscallEntryBlock,
+    /// TSS loaded on this processor, `None` for the BSP until it is registered.
+    pub tss: Option<&'static Mutex<TaskStateSegment>>,
+    /// syscall stack used by threads that do not have their own.
+    pub default_syscall_stack: u64,
+    /// syscall stack of the thread currently running on this processor.
+    pub syscall_stack: u64,
+    pub current_tid: Option<u64>,
+    pub current_pid: Option<u64>,
+    /// the processor is running it's idle loop, not a thread.
+    pub idle: bool,
+    /// stack of the idle loop, 0 if the processor has none.
+    pub idle_stack: u64,
+}
+
+impl PerCPUData {
+    const fn empty() -> Self {
+        PerCPUData {
+            syscall_entry: SyscallEntryBlock::empty(),
+            tss: None,
+            default_syscall_stack: 0,
+            syscall_stack: 0,
+            current_tid: None,
+            current_pid: None,
+            idle: true,
+            idle_stack: 0,
+        }
+    }
+}
+
+struct PerCPUBlocks {
+    blocks: UnsafeCell<[PerCPUData; MAX_PROCESSORS]>,
+}
+
+// each processor accesses only it's own block
+unsafe impl Sync for PerCPUBlocks {}
+
+static PER_CPU_BLOCKS: PerCPUBlocks = PerCPUBlocks {
+    blocks: UnsafeCell::new([PerCPUData::empty(); MAX_PROCESSORS]),
+};
+
+/// bitmap of the processors that are up and taking part in scheduling.
+static ONLINE_PROCESSORS: AtomicU64 = AtomicU64::new(0);
+
+const NO_PAGE_TABLE: AtomicU64 = AtomicU64::new(0);
+
+/// page tables loaded on each processor, read by the other processors
+/// before the tables of an exited process are freed.
+static LOADED_PAGE_TABLES: [AtomicU64; MAX_PROCESSORS] = [NO_PAGE_TABLE; MAX_PROCESSORS];
+
+/// Provides access to the block of the processor executing the caller.
+pub struct PerCPU;
+
+impl PerCPU {
+    /// index of the processor executing the caller, the BSP is
+    /// assumed until the LAPIC is ready.
+    #[inline]
+    pub fn current_index() -> usize {
+        match LAPICUtils::current_processor_id() {
+            Some(processor_id) if processor_id.as_usize() < MAX_PROCESSORS => {
+                processor_id.as_usize()
+            }
+            _ => 0,
+        }
+    }
+
+    /// runs `func` over the current processor's block with interrupts disabled,
+    /// so the caller cannot be moved to another processor meanwhile.
+    #[inline]
+    fn with_current<R, F>(func: F) -> R
+    where
+        F: FnOnce(&mut PerCPUData) -> R,
+    {
+        let interrupts_enabled = cpu::are_enabled();
+        cpu::disable_interrupts();
+
+        let blocks = unsafe { &mut *PER_CPU_BLOCKS.blocks.get() };
+        let result = func(&mut blocks[Self::current_index()]);
+
+        if interrupts_enabled {
+            cpu::enable_interrupts();
+        }
+
+        result
+    }
+
+    /// registers the calling processor, called once by every processor
+    /// before it starts scheduling threads.
+    pub fn register_current(
+        tss: &'static Mutex<TaskStateSegment>,
+        default_syscall_stack: u64,
+        idle_stack: u64,
+    ) {
+        let index = Self::with_current(|block| {
+            block.tss = Some(tss);
+            block.default_syscall_stack = default_syscall_stack;
+            block.idle_stack = idle_stack;
+            block.idle = true;
+            Self::current_index()
+        });
+
+        ONLINE_PROCESSORS.fetch_or(1 << index, Ordering::SeqCst);
+    }
+
+    #[inline]
+    pub fn is_online(index: usize) -> bool {
+        ONLINE_PROCESSORS.load(Ordering::SeqCst) & (1 << index) != 0
+    }
+
+    #[inline]
+    pub fn online_processors() -> usize {
+        ONLINE_PROCESSORS.load(Ordering::SeqCst).count_ones() as usize
+    }
+
+    #[inline]
+    pub fn current_tss() -> &'static Mutex<TaskStateSegment> {
+        Self::with_current(|block| block.tss).unwrap_or(&*KERNEL_TSS)
+    }
+
+    /// returns 0 if the processor uses the boot syscall stack
+    #[inline]
+    pub fn default_syscall_stack() -> u64 {
+        Self::with_current(|block| block.default_syscall_stack)
+    }
+
+    #[inline]
+    pub fn set_syscall_stack(stack_end: u64) {
+        Self::with_current(|block| block.syscall_stack = stack_end);
+    }
+
+    /// address of the SYSCALL entry block of the current processor.
+    #[inline]
+    pub fn syscall_entry_block() -> u64 {
+        Self::with_current(|block| &block.syscall_entry as *const SyscallEntryBlock as u64)
+    }
+
+    /// sets the stack SYSCALL switches to, `stack_end` is never 0.
+    #[inline]
+    pub fn set_syscall_entry_stack(stack_end: u64) {
+        Self::with_current(|block| block.syscall_entry.kernel_stack = stack_end);
+    }
+
+    #[inline]
+    pub fn set_syscall_entry_segments(user_cs: u64, user_ss: u64) {
+        Self::with_current(|block| {
+            block.syscall_entry.user_cs = user_cs;
+            block.syscall_entry.user_ss = user_ss;
+        });
+    }
+
+    #[inline]
+    pub fn set_current_thread(tid: u64, pid: u64) {
+        Self::with_current(|block| {
+            block.current_tid = Some(tid);
+            block.current_pid = Some(pid);
+            block.idle = false;
+        });
+    }
+
+    #[inline]
+    pub fn clear_current_thread() {
+        Self::with_current(|block| {
+            block.current_tid = None;
+            block.current_pid = None;
+        });
+    }
+
+    #[inline]
+    pub fn current_tid() -> Option<u64> {
+        Self::with_current(|block| block.current_tid)
+    }
+
+    #[inline]
+    pub fn current_pid() -> Option<u64> {
+        Self::with_current(|block| block.current_pid)
+    }
+
+    #[inline]
+    pub fn is_idle() -> bool {
+        Self::with_current(|block| block.idle)
+    }
+
+    /// switches the current processor to the page tables at `root`.
+    #[inline]
+    pub fn load_page_table(root: PhysicalAddress) {
+        Self::with_current(|_| {
+            LOADED_PAGE_TABLES[Self::current_index()].store(root.as_u64(), Ordering::SeqCst);
+            mmu::set_page_table_address(root);
+        });
+    }
+
+    /// true if any processor still has the page tables at `root` loaded.
+    pub fn is_page_table_loaded(root: PhysicalAddress) -> bool {
+        LOADED_PAGE_TABLES
+            .iter()
+            .any(|loaded| loaded.load(Ordering::SeqCst) == root.as_u64())
+    }
+
+    /// leaves the interrupted context and runs the idle loop of the processor
+    /// on a fresh stack, returns if the processor has no idle stack.
+    pub fn enter_idle() {
+        let idle_stack = Self::with_current(|block| {
+            if block.idle_stack != 0 {
+                block.idle = true;
+            }
+            block.idle_stack
+        });
+
+        if idle_stack != 0 {
+            // the address space of the last thread can go away meanwhile.
+            Self::load_page_table(KernelVirtualMemoryManager::pt().l4_phy_addr);
+            cpu::idle_on_stack(idle_stack);
+        }
+    }
+}
@@ -1,12 +1,14 @@
+extern crate alloc;
 extern crate bit_field;
 extern crate spin;
 
+use alloc::boxed::Box;
 use bit_field::BitField;
 use core::mem;
 use lazy_static::lazy_static;
 use spin::Mutex;
 
-use crate::cpu::interrupt_stacks::init_system_stacks;
+use crate::cpu::interrupt_stacks::{init_ap_stacks, init_system_stacks};
 
 #[derive(Debug, Clone, PartialEq, Copy)]
 #[repr(u8)]
@@ -208,6 +210,11 @@ impl TaskStateSegment {
         // syscalls use stack index 1
         self.interrupt_stack_table[1] = stack_end_addr;
     }
+
+    #[inline]
+    pub fn syscall_stack(&self) -> u64 {
+        self.interrupt_stack_table[1]
+    }
 }
 
 struct TaskStateDescriptor {
@@ -369,8 +376,13 @@ lazy_static! {
     pub static ref KERNEL_TSS: Mutex<TaskStateSegment> = Mutex::new(create_tss_for_bp());
 }
 
-// create GDT for the base processor:
-pub fn create_gdt_for_bp() -> GDTContainer {
+/// creates a GDT that uses the given TSS, every processor gets the same
+/// segment layout so the selectors are valid on all of them.
+///
+/// SYSCALL and SYSRET derive the selectors from STAR, they expect the kernel
+/// data segment right after the kernel code segment and the user code segment
+/// right after the user data segment.
+pub fn create_gdt(tss: &'static Mutex<TaskStateSegment>) -> GDTContainer {
     // create a GDT with empty segment
     let mut gdt = GlobalDescritorTable::empty();
     let k_code_segment_res = gdt.set_user_segment(LinuxKernelSegments::KernelCode as u64);
@@ -378,27 +390,26 @@ pub fn create_gdt_for_bp() -> GDTContainer {
         panic!("{}", k_code_segment_res.unwrap_err());
     }
 
-    let tss_descriptor = TaskStateDescriptor::new(&KERNEL_TSS);
+    let kernel_data_selector = gdt
+        .set_user_segment(LinuxKernelSegments::KernelData as u64)
+        .unwrap();
 
-    let k_tss_segment_result = gdt.set_system_segment(tss_descriptor.high, tss_descriptor.low);
-    if k_tss_segment_result.is_err() {
-        panic!("{}", k_tss_segment_result.unwrap_err());
-    }
+    // set user mode selectors:
+    let user_data_selector = gdt
+        .set_user_segment(LinuxKernelSegments::UserData as u64)
+        .unwrap();
 
-    // set user mode selector:
     let user_code_segment_res = gdt.set_user_segment(LinuxKernelSegments::UserCode as u64);
     if user_code_segment_res.is_err() {
         panic!("Failed to set user code segment.");
     }
 
-    // set kernel and user data:
-    let kernel_data_selector = gdt
-        .set_user_segment(LinuxKernelSegments::KernelData as u64)
-        .unwrap();
+    let tss_descriptor = TaskStateDescriptor::new(tss);
 
-    let user_data_selector = gdt
-        .set_user_segment(LinuxKernelSegments::UserData as u64)
-        .unwrap();
+    let k_tss_segment_result = gdt.set_system_segment(tss_descriptor.high, tss_descriptor.low);
+    if k_tss_segment_result.is_err() {
+        panic!("{}", k_tss_segment_result.unwrap_err());
+    }
 
     GDTContainer {
         gdt_table: gdt,
@@ -410,23 +421,27 @@ pub fn create_gdt_for_bp() -> GDTContainer {
     }
 }
 
+// create GDT for the base processor:
+pub fn create_gdt_for_bp() -> GDTContainer {
+    create_gdt(&KERNEL_TSS)
+}
+
 lazy_static! {
     static ref KERNEL_BASE_GDT: GDTContainer = create_gdt_for_bp();
 }
 
-// create the GDT
-pub fn init_gdt() {
+fn load_gdt(container: &'static GDTContainer) {
     // set ss to zero:
 
     // Not setting SS to 0 will make iretq throw double fault
     // because iretq expects SS to be 0 or needs a valid data-segment to be set-up.
     SegmentRegister::SS.set(0);
 
-    let gdt_table = &KERNEL_BASE_GDT.gdt_table;
+    let gdt_table = &container.gdt_table;
     gdt_table.load_into_cpu();
 
     // set the code segment register
-    let kernel_cs = &KERNEL_BASE_GDT.kernel_code_selector;
+    let kernel_cs = &container.kernel_code_selector;
     SegmentRegister::CS.set(kernel_cs.0);
 
     log::info!("Kernel code selector: {}", kernel_cs.0);
@@ -436,16 +451,36 @@ pub fn init_gdt() {
     log::debug!("Verified Code Segment Register value: 0x{:x}", kernel_cs.0);
 
     // set kernel data selector:
-    let kernel_ds = &KERNEL_BASE_GDT.kernel_data_selector;
+    let kernel_ds = &container.kernel_data_selector;
     SegmentRegister::DS.set(kernel_ds.0);
 
     log::info!("Initialized GDT.");
 
-    let tss_sel = &KERNEL_BASE_GDT.kernel_tss_selector;
+    let tss_sel = &container.kernel_tss_selector;
     load_tss(tss_sel.0);
     log::info!("Initialized TSS.");
 }
 
+// create the GDT
+pub fn init_gdt() {
+    load_gdt(&KERNEL_BASE_GDT);
+}
+
+/// creates and loads the GDT and TSS of an application processor,
+/// returns the TSS of the processor and the end of it's default syscall stack.
+pub fn init_ap_gdt() -> (&'static Mutex<TaskStateSegment>, u64) {
+    let mut tss = TaskStateSegment::empty();
+    let syscall_stack_end = init_ap_stacks(&mut tss);
+
+    // these live as long as the processor is running:
+    let ap_tss: &'static Mutex<TaskStateSegment> = Box::leak(Box::new(Mutex::new(tss)));
+    let ap_gdt: &'static GDTContainer = Box::leak(Box::new(create_gdt(ap_tss)));
+
+    load_gdt(ap_gdt);
+
+    (ap_tss, syscall_stack_end)
+}
+
 pub fn get_kernel_cs() -> &'static SegmentSelector {
     &KERNEL_BASE_GDT.kernel_code_selector
 }
@@ -1,7 +1,9 @@
 use crate::cpu::exceptions::IDT;
 use crate::cpu::interrupt_stacks::load_default_syscall_stack;
 use crate::cpu::interrupts::{prepare_syscall_interrupt, InterruptStackFrame};
-use crate::cpu::segments::KERNEL_TSS;
+use crate::cpu::percpu::PerCPU;
+use crate::cpu::rflags::RFlagsStruct;
+use crate::cpu::segments;
 
 #[allow(unused_imports)]
 // called by assembly
@@ -23,7 +25,7 @@ macro_rules! save_syscall_registers {
     };
 }
 
-macro_rules! restore_syscall_registers {
+macro_rules! pop_syscall_registers {
     () => {
         r#"
         pop r11;
@@ -35,11 +37,25 @@ macro_rules! restore_syscall_registers {
         pop rdx;
         pop rcx;
         pop rax;
-        iretq;
         "#
     };
 }
 
+macro_rules! restore_syscall_registers {
+    () => {
+        concat!(pop_syscall_registers!(), "iretq;")
+    };
+}
+
+const IA32_EFER: u32 = 0xC0000080;
+const IA32_STAR: u32 = 0xC0000081;
+const IA32_LSTAR: u32 = 0xC0000082;
+const IA32_FMASK: u32 = 0xC0000084;
+const IA32_KERNEL_GS_BASE: u32 = 0xC0000102;
+
+/// enables SYSCALL and SYSRET
+const EFER_SCE: u64 = 1;
+
 #[naked]
 /// This handle will be called on int 80 soft interrupt
 /// line.
@@ -57,15 +73,131 @@ pub extern "sysv64" fn x80_handle(_stk: &mut InterruptStackFrame) {
     }
 }
 
+#[naked]
+/// Entry of the SYSCALL instruction, interrupts are masked by FMASK.
+/// The kernel never uses GS, so GS is swapped only to switch to the syscall
+/// stack and the handler sees the same frame as with int 0x80.
+pub extern "sysv64" fn syscall_entry() {
+    unsafe {
+        asm!(
+            "swapgs",
+            "mov qword ptr gs:[8], rsp",
+            "mov rsp, qword ptr gs:[0]",
+            // interrupt stack frame of the user context, rcx has the user
+            // rip and r11 the user rflags.
+            "push qword ptr gs:[24]",
+            "push qword ptr gs:[8]",
+            "push r11",
+            "push qword ptr gs:[16]",
+            "push rcx",
+            "swapgs",
+            save_syscall_registers!(),
+            "mov rsi, rsp",
+            "mov rdi, rsp",
+            "add rdi, 72",
+            "call syscall_handler",
+            // the handler can enable interrupts, none must come
+            // once rsp is the user stack.
+            "cli",
+            // SYSRET to a non-canonical rip faults in ring 0 on the user
+            // stack, such returns go through iretq.
+            "mov rcx, [rsp + 72]",
+            "shr rcx, 47",
+            "jnz 2f",
+            pop_syscall_registers!(),
+            "mov rcx, [rsp]",
+            "mov r11, [rsp + 16]",
+            "mov rsp, [rsp + 24]",
+            "sysretq",
+            "2:",
+            restore_syscall_registers!(),
+            options(noreturn)
+        )
+    }
+}
+
+#[inline]
+fn read_msr(msr: u32) -> u64 {
+    let (high, low): (u32, u32);
+    unsafe {
+        asm!(
+            "rdmsr",
+            in("ecx") msr,
+            out("edx") high,
+            out("eax") low,
+            options(nomem, nostack)
+        );
+    }
+
+    (high as u64) << 32 | low as u64
+}
+
+#[inline]
+fn write_msr(msr: u32, value: u64) {
+    unsafe {
+        asm!(
+            "wrmsr",
+            in("ecx") msr,
+            in("edx") (value >> 32) as u32,
+            in("eax") value as u32,
+            options(nomem, nostack)
+        );
+    }
+}
+
+/// enables the SYSCALL instruction on the current processor, called by
+/// every processor once it's GDT, TSS and per-CPU block are set up.
+pub fn setup_fast_syscalls() {
+    let kernel_cs = segments::get_kernel_cs().0;
+    let kernel_ds = segments::get_kernel_ds().0;
+    let user_cs = segments::get_user_cs().0;
+    let user_ds = segments::get_user_ds().0;
+
+    // SYSCALL loads CS from STAR[47:32] and SS 8 bytes after it,
+    // SYSRET loads SS from STAR[63:48] + 8 and CS 16 bytes after it.
+    assert_eq!(kernel_ds & !3, kernel_cs + 8);
+    assert_eq!(user_cs & !3, (user_ds & !3) + 8);
+    let sysret_base = (user_ds & !3) - 8;
+
+    let syscall_stack = PerCPU::current_tss().lock().syscall_stack();
+    PerCPU::set_syscall_entry_stack(syscall_stack);
+    PerCPU::set_syscall_entry_segments(user_cs as u64, user_ds as u64);
+
+    let star = (sysret_base as u64) << 48 | (kernel_cs as u64) << 32;
+    let fmask = RFlagsStruct::INTERRUPT_FLAG
+        | RFlagsStruct::TRAP_FLAG
+        | RFlagsStruct::DIRECTION_FLAG
+        | RFlagsStruct::ALIGNMENT_CHECK
+        | RFlagsStruct::NESTED_TASK;
+
+    write_msr(IA32_STAR, star);
+    write_msr(IA32_LSTAR, syscall_entry as u64);
+    write_msr(IA32_FMASK, fmask.bits());
+    write_msr(IA32_KERNEL_GS_BASE, PerCPU::syscall_entry_block());
+    write_msr(IA32_EFER, read_msr(IA32_EFER) | EFER_SCE);
+}
+
 pub fn setup_syscall_interrupt() {
     let irq0x80_handle = prepare_syscall_interrupt(x80_handle, 1);
     IDT.lock().interrupts[0x80] = irq0x80_handle;
+
+    setup_fast_syscalls();
 }
 
 pub fn set_syscall_stack(addr: u64) {
-    KERNEL_TSS.lock().set_syscall_stack(addr);
+    {
+        let mut tss = PerCPU::current_tss().lock();
+        tss.set_syscall_stack(addr);
+        // traps from user mode land on the thread's stack too, so a page
+        // fault can wait for the disk without sharing the per-cpu stack.
+        tss.set_privilege_stack(0, addr);
+    }
+    PerCPU::set_syscall_stack(addr);
+    PerCPU::set_syscall_entry_stack(addr);
 }
 
 pub fn set_default_syscall_stack() {
-    load_default_syscall_stack();
+    let stack_end = load_default_syscall_stack();
+    PerCPU::set_syscall_stack(0);
+    PerCPU::set_syscall_entry_stack(stack_end);
 }
@@ -1,5 +1,6 @@
 use core::sync::atomic::{AtomicU64, Ordering};
 
+use crate::cpu::cpuid;
 use crate::cpu::pit;
 
 /// Represents the TSC ticks
@@ -7,6 +8,11 @@ use crate::cpu::pit;
 pub struct TSCTicks(u64);
 
 impl TSCTicks {
+    #[inline(always)]
+    pub fn from_u64(ticks: u64) -> Self {
+        TSCTicks(ticks)
+    }
+
     #[inline(always)]
     pub fn u64(&self) -> u64 {
         self.0
@@ -52,7 +58,7 @@ pub fn safe_ticks_from_ns(ns: u64) -> TSCTicks {
         }
         SleepTimeRange::MicroSeconds => {
             let frequency = TSC::read_cpu_frequency();
-            TSCTicks((ns * frequency) * 1000000000)
+            TSCTicks((ns * frequency) / 1000000000)
         }
     }
 }
@@ -103,7 +109,15 @@ impl TSC {
         }
     }
 
+    /// takes the TSC frequency from cpuid when the processor enumerates it,
+    /// otherwise measures it against the PIT.
     pub fn detect_cpu_speed() {
+        if let Some(frequency) = cpuid::tsc_frequency() {
+            CPU_FREQUENCY.store(frequency, Ordering::SeqCst);
+            log::info!("TSC frequency from cpuid, frequency={}Hz", frequency);
+            return;
+        }
+
         let t1 = TSC::read_tsc();
         pit::sleep_ns(10000000);
         let t2 = TSC::read_tsc();
@@ -208,4 +222,14 @@ pub fn init_timer() {
     TSC::detect_cpu_speed();
     let cpu_frequency = TSC::read_cpu_frequency();
     log::info!("Enabled CPU TSC, cpu_frequency={}", cpu_frequency);
+
+    // timer shots are TSC deadlines and system ticks are derived from the
+    // TSC, both assume it runs at a constant rate.
+    if !cpuid::has_feature(cpuid::FlagsECX::TSCD) {
+        log::warn!("CPU does not report TSC deadline mode, timer shots may not fire.");
+    }
+
+    if !cpuid::has_invariant_tsc() {
+        log::warn!("CPU does not report an invariant TSC, system time may drift.");
+    }
 }
@@ -0,0 +1,457 @@
+extern crate alloc;
+extern crate bit_field;
+extern crate log;
+extern crate spin;
+
+use crate::boot_proto::BootProtocol;
+use crate::cpu::io::Port;
+use crate::cpu::percpu::PerCPU;
+use crate::cpu::tsc::{safe_ticks_from_ns, TSC};
+use crate::drivers::disk::ata_pio::{ATADrive, ATAStatus, ATA_BLOCK_SIZE, ATA_DEVICES};
+use crate::drivers::pci::PCIDevice;
+use crate::mm::phy::{DMABuffer, DMAMemoryManager};
+use crate::mm::MemorySizes;
+use crate::system::tasking::wait_queue::WaitEvent;
+use crate::system::tasking::{notify_event, wait_for_event};
+
+use alloc::vec::Vec;
+use core::ptr;
+use core::sync::atomic::{AtomicBool, AtomicU16, Ordering};
+use spin::Mutex;
+
+use lazy_static::lazy_static;
+
+/// offsets of the registers of a channel from it's bus master base
+const BM_COMMAND_OFFSET: usize = 0;
+const BM_STATUS_OFFSET: usize = 2;
+const BM_PRDT_OFFSET: usize = 4;
+
+/// the secondary channel registers follow the primary ones
+const BM_CHANNEL_STRIDE: usize = 8;
+
+/// bus master command bits
+const BM_CMD_START: u8 = 1 << 0;
+const BM_CMD_READ: u8 = 1 << 3;
+
+/// bus master status bits, ERR and IRQ are cleared by writing 1.
+const BM_STATUS_ACTIVE: u8 = 1 << 0;
+const BM_STATUS_ERR: u8 = 1 << 1;
+const BM_STATUS_IRQ: u8 = 1 << 2;
+
+/// marks the last entry of the PRD table
+const PRD_END_OF_TABLE: u16 = 1 << 15;
+
+/// a PRD entry cannot cross a 64KiB boundary
+const PRD_BOUNDARY: u64 = 64 * MemorySizes::OneKiB as u64;
+
+/// PRD entries hold 32 bit addresses, the controller cannot reach above 4GiB.
+const PRD_ADDRESS_LIMIT: u64 = 1 << 32;
+
+/// bounce buffer of each channel, the largest transfer made at once.
+pub const ATA_DMA_BUFFER_SIZE: usize = 64 * MemorySizes::OneKiB as usize;
+
+const PRDT_SIZE: usize = 4 * MemorySizes::OneKiB as usize;
+
+/// transfers made before the scheduler runs spin for at most this long.
+const ATA_DMA_SPIN_TIMEOUT_NS: u64 = 1000 * 1000000;
+
+const N_CHANNELS: usize = 2;
+
+#[derive(Debug, Clone)]
+pub enum ATADMAError {
+    NoController,
+    DriveNotCapable,
+    BufferTooLarge,
+    TransferError,
+    Timeout,
+}
+
+#[repr(C, packed)]
+#[derive(Debug, Clone, Copy)]
+struct PhysicalRegionDescriptor {
+    phy_addr: u32,
+    byte_count: u16,
+    flags: u16,
+}
+
+#[derive(Debug, Clone)]
+/// Bus master registers and DMA memory of one IDE channel.
+pub struct BusMasterChannel {
+    pub command: Port,
+    pub status: Port,
+    pub prdt_addr: Port,
+    prdt: DMABuffer,
+    buffer: DMABuffer,
+}
+
+/// bus master and ATA status ports of each channel, the interrupt
+/// handlers use these without taking any lock.
+static BM_STATUS_PORTS: [AtomicU16; N_CHANNELS] = [AtomicU16::new(0), AtomicU16::new(0)];
+static ATA_STATUS_PORTS: [AtomicU16; N_CHANNELS] = [AtomicU16::new(0), AtomicU16::new(0)];
+
+/// set by the interrupt handler when the transfer of the channel is over.
+static TRANSFER_DONE: [AtomicBool; N_CHANNELS] = [AtomicBool::new(false), AtomicBool::new(false)];
+
+/// the drives of a channel take one command at a time, and the channel has
+/// a single bounce buffer and PRD table for it. The holder sleeps during the
+/// transfer, so other threads block on the event of the channel instead of
+/// spinning on this.
+static CHANNEL_BUSY: [AtomicBool; N_CHANNELS] = [AtomicBool::new(false), AtomicBool::new(false)];
+
+/// released when the holder of the channel is done with it.
+const CHANNEL_EVENTS: [WaitEvent; N_CHANNELS] = [WaitEvent::DiskChannel0, WaitEvent::DiskChannel1];
+
+lazy_static! {
+    static ref DMA_CHANNELS: Mutex<Vec<Option<BusMasterChannel>>> = Mutex::new(Vec::new());
+}
+
+impl BusMasterChannel {
+    fn new(bm_base: usize) -> Option<Self> {
+        let prdt_opt = DMAMemoryManager::alloc(PRDT_SIZE);
+        let buffer_opt = DMAMemoryManager::alloc(ATA_DMA_BUFFER_SIZE);
+        if prdt_opt.is_none() || buffer_opt.is_none() {
+            return None;
+        }
+
+        Some(BusMasterChannel {
+            command: Port::new(bm_base + BM_COMMAND_OFFSET, false),
+            status: Port::new(bm_base + BM_STATUS_OFFSET, false),
+            prdt_addr: Port::new(bm_base + BM_PRDT_OFFSET, false),
+            prdt: prdt_opt.unwrap(),
+            buffer: buffer_opt.unwrap(),
+        })
+    }
+
+    /// describes `size` bytes of physical memory from `phy_addr` in the PRD table
+    fn fill_prdt(&self, phy_addr: u64, size: usize) {
+        let entries = self.prdt.get_mut_ptr::<PhysicalRegionDescriptor>();
+        let mut addr = phy_addr;
+        let end = addr + size as u64;
+        let mut index = 0;
+
+        while addr < end {
+            let boundary = (addr / PRD_BOUNDARY + 1) * PRD_BOUNDARY;
+            let chunk_end = boundary.min(end);
+            let is_last = chunk_end == end;
+
+            // a byte count of 0 means 64KiB.
+            let entry = PhysicalRegionDescriptor {
+                phy_addr: addr as u32,
+                byte_count: (chunk_end - addr) as u16,
+                flags: if is_last { PRD_END_OF_TABLE } else { 0 },
+            };
+
+            unsafe {
+                ptr::write_volatile(entries.add(index), entry);
+            }
+
+            addr = chunk_end;
+            index += 1;
+        }
+    }
+
+    #[inline]
+    fn clear_status(&self) {
+        self.status.write_u8(BM_STATUS_ERR | BM_STATUS_IRQ);
+    }
+}
+
+/// sets up DMA for both channels of the IDE controller, the bus master
+/// registers are at BAR4.
+pub fn init(controller: &PCIDevice) {
+    let bar4 = controller.bars[4];
+    let mut channels = DMA_CHANNELS.lock();
+    channels.clear();
+
+    // bit 0 is set for I/O space BARs
+    if bar4 & 0x1 == 0 || bar4 & !0x3 == 0 {
+        log::warn!("IDE controller has no bus master registers, using PIO.");
+        return;
+    }
+
+    controller.set_bus_mastering();
+
+    let bm_base = (bar4 & !0x3) as usize;
+    let devices = ATA_DEVICES.lock();
+    for channel_no in 0..N_CHANNELS {
+        let channel_base = bm_base + channel_no * BM_CHANNEL_STRIDE;
+        let channel_opt = BusMasterChannel::new(channel_base);
+        if channel_opt.is_none() {
+            log::warn!(
+                "Out of DMA memory for ATA channel {}, using PIO.",
+                channel_no
+            );
+            channels.push(None);
+            continue;
+        }
+
+        let channel = channel_opt.unwrap();
+        channel.command.write_u8(0);
+        channel.clear_status();
+
+        BM_STATUS_PORTS[channel_no]
+            .store((channel_base + BM_STATUS_OFFSET) as u16, Ordering::SeqCst);
+        if let Some(device) = devices.get(channel_no) {
+            ATA_STATUS_PORTS[channel_no].store(device.regs.status.port_no as u16, Ordering::SeqCst);
+        }
+
+        channels.push(Some(channel));
+    }
+
+    log::info!(
+        "Set-up ATA bus master DMA, bm_base=0x{:x}, buffer={}bytes",
+        bm_base,
+        ATA_DMA_BUFFER_SIZE
+    );
+}
+
+/// called from the IDE interrupt of the channel.
+pub fn on_interrupt(channel_no: usize) {
+    let bm_status_port = BM_STATUS_PORTS[channel_no].load(Ordering::SeqCst);
+    if bm_status_port == 0 {
+        return;
+    }
+
+    // reading the drive status acknowledges the interrupt on the drive.
+    let ata_status_port = ATA_STATUS_PORTS[channel_no].load(Ordering::SeqCst);
+    if ata_status_port != 0 {
+        Port::new(ata_status_port as usize, true).read_u8();
+    }
+
+    let bm_status = Port::new(bm_status_port as usize, false);
+    if bm_status.read_u8() & BM_STATUS_IRQ == 0 {
+        return;
+    }
+
+    bm_status.write_u8(BM_STATUS_IRQ);
+    TRANSFER_DONE[channel_no].store(true, Ordering::SeqCst);
+    notify_event(WaitEvent::DiskCompletion);
+}
+
+#[inline]
+fn is_transfer_done(channel_no: usize, channel: &BusMasterChannel) -> bool {
+    // the status is also checked in case the interrupt is not delivered here.
+    TRANSFER_DONE[channel_no].load(Ordering::SeqCst)
+        || channel.status.read_u8() & (BM_STATUS_IRQ | BM_STATUS_ACTIVE) == BM_STATUS_IRQ
+}
+
+/// blocks the calling thread until the channel completes the transfer,
+/// spins if there are no threads to switch to yet.
+fn wait_for_completion(channel_no: usize, channel: &BusMasterChannel) -> Result<(), ATADMAError> {
+    if PerCPU::current_tid().is_none() {
+        let deadline = TSC::read_tsc().u64() + safe_ticks_from_ns(ATA_DMA_SPIN_TIMEOUT_NS).u64();
+        while !is_transfer_done(channel_no, channel) {
+            if TSC::read_tsc().u64() > deadline {
+                return Err(ATADMAError::Timeout);
+            }
+            core::hint::spin_loop();
+        }
+
+        return Ok(());
+    }
+
+    wait_for_event(WaitEvent::DiskCompletion, || {
+        if is_transfer_done(channel_no, channel) {
+            return Ok(Some(()));
+        }
+
+        Ok(None)
+    })
+}
+
+/// physical address of `buffer` if the controller can move it's data in place:
+/// whole blocks in the physical memory map (block cache frames are) below
+/// 4GiB and 2 byte aligned. Other buffers go through the bounce buffer.
+fn direct_phy_addr(buffer: &[u8]) -> Option<u64> {
+    if buffer.len() % ATA_BLOCK_SIZE != 0 {
+        return None;
+    }
+
+    let phy_offset = BootProtocol::get_phy_offset();
+    let addr = buffer.as_ptr() as u64;
+    if phy_offset.is_none() || addr < phy_offset.unwrap() {
+        return None;
+    }
+
+    // the PRD table cannot describe anything else in this range.
+    let phy_addr = addr - phy_offset.unwrap();
+    if phy_addr + buffer.len() as u64 > PRD_ADDRESS_LIMIT || phy_addr & 0x1 != 0 {
+        return None;
+    }
+
+    Some(phy_addr)
+}
+
+/// runs a DMA transfer of `n_blocks` blocks from `block_no` between the drive
+/// and `direct` physical memory, or the bounce buffer of it's channel when
+/// there is none. `copy` then moves the data between the bounce buffer and
+/// the caller's buffer.
+fn transfer<F>(
+    drive: &ATADrive,
+    block_no: u64,
+    n_blocks: usize,
+    is_read: bool,
+    direct: Option<u64>,
+    copy: F,
+) -> Result<(), ATADMAError>
+where
+    F: FnMut(&mut [u8]),
+{
+    if !drive.dma_supported {
+        return Err(ATADMAError::DriveNotCapable);
+    }
+
+    if n_blocks == 0 {
+        return Ok(());
+    }
+
+    let size = n_blocks * ATA_BLOCK_SIZE;
+    if size > ATA_DMA_BUFFER_SIZE {
+        return Err(ATADMAError::BufferTooLarge);
+    }
+
+    let channel_no = drive.bus_no as usize;
+    let channel_opt = DMA_CHANNELS
+        .lock()
+        .get(channel_no)
+        .and_then(|channel| channel.clone());
+    if channel_opt.is_none() {
+        return Err(ATADMAError::NoController);
+    }
+
+    let channel = channel_opt.unwrap();
+
+    lock_channel(channel_no);
+    let result = run_transfer(
+        channel_no, &channel, drive, block_no, n_blocks, is_read, direct, copy,
+    );
+    unlock_channel(channel_no);
+    result
+}
+
+#[inline]
+fn try_lock_channel(channel_no: usize) -> bool {
+    CHANNEL_BUSY[channel_no]
+        .compare_exchange(false, true, Ordering::SeqCst, Ordering::SeqCst)
+        .is_ok()
+}
+
+/// takes the channel, the calling thread sleeps until the holder releases
+/// it. Before the scheduler runs nobody sleeps, so the holder also spins
+/// and the channel is free again soon.
+fn lock_channel(channel_no: usize) {
+    if PerCPU::current_tid().is_none() {
+        while !try_lock_channel(channel_no) {
+            core::hint::spin_loop();
+        }
+        return;
+    }
+
+    let _: Result<(), ()> = wait_for_event(CHANNEL_EVENTS[channel_no], || {
+        if try_lock_channel(channel_no) {
+            return Ok(Some(()));
+        }
+
+        Ok(None)
+    });
+}
+
+#[inline]
+fn unlock_channel(channel_no: usize) {
+    CHANNEL_BUSY[channel_no].store(false, Ordering::SeqCst);
+    notify_event(CHANNEL_EVENTS[channel_no]);
+}
+
+fn run_transfer<F>(
+    channel_no: usize,
+    channel: &BusMasterChannel,
+    drive: &ATADrive,
+    block_no: u64,
+    n_blocks: usize,
+    is_read: bool,
+    direct: Option<u64>,
+    mut copy: F,
+) -> Result<(), ATADMAError>
+where
+    F: FnMut(&mut [u8]),
+{
+    let size = n_blocks * ATA_BLOCK_SIZE;
+    let bounce = &mut channel.buffer.get_mut_slice::<u8>()[0..size];
+    if direct.is_none() && !is_read {
+        copy(bounce);
+    }
+
+    let phy_addr = direct.unwrap_or(channel.buffer.phy_addr.as_u64());
+    channel.fill_prdt(phy_addr, size);
+
+    // bus master reads from the disk are writes to memory.
+    let direction = if is_read { BM_CMD_READ } else { 0 };
+
+    {
+        let bus_lock = ATA_DEVICES.lock();
+        let bus_device = bus_lock.get(channel_no).unwrap();
+        bus_device.select(drive.drive_type.clone());
+
+        channel.command.write_u8(0);
+        channel.clear_status();
+        channel
+            .prdt_addr
+            .write_u32(channel.prdt.phy_addr.as_u64() as u32);
+        channel.command.write_u8(direction);
+
+        TRANSFER_DONE[channel_no].store(false, Ordering::SeqCst);
+
+        bus_device.setup_transfer(drive, block_no, n_blocks);
+        bus_device.send_command(drive.command_for(is_read, true));
+
+        channel.command.write_u8(direction | BM_CMD_START);
+    }
+
+    // interrupts stay enabled while the controller moves the data.
+    let wait_result = wait_for_completion(channel_no, channel);
+
+    let bus_lock = ATA_DEVICES.lock();
+    let bus_device = bus_lock.get(channel_no).unwrap();
+    channel.command.write_u8(0);
+    let bm_status = channel.status.read_u8();
+    channel.clear_status();
+
+    if wait_result.is_err() {
+        return Err(wait_result.unwrap_err());
+    }
+
+    if bm_status & BM_STATUS_ERR != 0 || bus_device.is(ATAStatus::ERR) {
+        return Err(ATADMAError::TransferError);
+    }
+
+    drop(bus_lock);
+    if direct.is_none() && is_read {
+        copy(bounce);
+    }
+
+    Ok(())
+}
+
+/// reads whole blocks from `block_no` into `buffer`, a short buffer gets
+/// the start of the first block.
+pub fn read_blocks(drive: &ATADrive, block_no: u64, buffer: &mut [u8]) -> Result<(), ATADMAError> {
+    let n_blocks = (buffer.len() + ATA_BLOCK_SIZE - 1) / ATA_BLOCK_SIZE;
+    let direct = direct_phy_addr(buffer);
+    transfer(drive, block_no, n_blocks, true, direct, |bounce| {
+        let length = buffer.len();
+        buffer.copy_from_slice(&bounce[0..length]);
+    })
+}
+
+/// writes `buffer` to the blocks from `block_no`, the rest of a partial
+/// last block is written with zeroes.
+pub fn write_blocks(drive: &ATADrive, block_no: u64, buffer: &[u8]) -> Result<(), ATADMAError> {
+    let n_blocks = (buffer.len() + ATA_BLOCK_SIZE - 1) / ATA_BLOCK_SIZE;
+    let direct = direct_phy_addr(buffer);
+    transfer(drive, block_no, n_blocks, false, direct, |bounce| {
+        bounce[0..buffer.len()].copy_from_slice(buffer);
+        for byte in bounce[buffer.len()..].iter_mut() {
+            *byte = 0;
+        }
+    })
+}
@@ -5,6 +5,7 @@ extern crate spin;
 
 use crate::cpu;
 use crate::cpu::io::Port;
+use crate::drivers::disk::ata_dma;
 use crate::system::timer::{wait_ns, Time};
 use bit_field::BitField;
 
@@ -21,6 +22,22 @@ const ATA_SOFT_RESET: u8 = 0x04;
 /// ATA block size - made public because others (ex: fs) may use it.
 pub const ATA_BLOCK_SIZE: usize = 512;
 
+/// blocks addressable without the 48-bit commands
+const ATA_LBA28_MAX_BLOCKS: u64 = 1 << 28;
+
+/// largest run of blocks moved by a single command
+pub const ATA_MAX_BLOCKS_PER_COMMAND: usize = 256;
+
+/// upper bound on the blocks per DRQ used with READ/WRITE MULTIPLE
+const ATA_MAX_MULTIPLE_SECTORS: u16 = 16;
+
+#[derive(Debug, Clone)]
+pub enum ATAError {
+    Unaligned,
+    OutOfRange,
+    DeviceError,
+}
+
 #[derive(Debug, Clone)]
 #[repr(u8)]
 pub enum ATADriveType {
@@ -32,9 +49,15 @@ pub enum ATADriveType {
 pub struct ATADrive {
     pub bus_no: u8,
     pub drive_type: ATADriveType,
-    pub n_blocks: u32,
+    pub n_blocks: u64,
     pub model_name: String,
     pub serial_no: String,
+    /// the drive can do multiword DMA transfers
+    pub dma_supported: bool,
+    /// the drive supports 48-bit LBAs
+    pub lba48: bool,
+    /// blocks per DRQ set with SET MULTIPLE MODE, 0 if not enabled
+    pub multiple_sectors: u16,
 }
 
 impl ATADrive {
@@ -58,62 +81,222 @@ impl ATADrive {
         )
     }
 
+    /// commands for the kind of transfer, the EXT commands take 48-bit LBAs.
     #[inline]
-    pub fn read_block(&self, buffer: &mut [u8], block_no: u32) {
-        // get bus device:
+    pub fn command_for(&self, is_read: bool, is_dma: bool) -> ATACommand {
+        match (is_read, is_dma, self.lba48) {
+            (true, true, false) => ATACommand::READ_DMA,
+            (true, true, true) => ATACommand::READ_DMA_EXT,
+            (false, true, false) => ATACommand::WRITE_DMA,
+            (false, true, true) => ATACommand::WRITE_DMA_EXT,
+            (true, false, false) if self.multiple_sectors > 1 => ATACommand::READ_MULTIPLE,
+            (true, false, true) if self.multiple_sectors > 1 => ATACommand::READ_MULTIPLE_EXT,
+            (false, false, false) if self.multiple_sectors > 1 => ATACommand::WRITE_MULTIPLE,
+            (false, false, true) if self.multiple_sectors > 1 => ATACommand::WRITE_MULTIPLE_EXT,
+            (true, false, false) => ATACommand::READ,
+            (true, false, true) => ATACommand::READ_EXT,
+            (false, false, false) => ATACommand::WRITE,
+            (false, false, true) => ATACommand::WRITE_EXT,
+        }
+    }
 
-        cpu::disable_interrupts();
+    /// blocks moved per DRQ during PIO transfers
+    #[inline]
+    fn blocks_per_drq(&self) -> usize {
+        if self.multiple_sectors > 1 {
+            self.multiple_sectors as usize
+        } else {
+            1
+        }
+    }
 
-        let bus_lock = ATA_DEVICES.lock();
-        let bus_device = bus_lock.get(self.bus_no as usize).unwrap();
-        match self.drive_type {
-            ATADriveType::PRIMARY => {
-                bus_device.sel_primary();
+    #[inline]
+    fn check_range(&self, block_no: u64, n_blocks: usize) -> Result<(), ATAError> {
+        if block_no + n_blocks as u64 > self.n_blocks {
+            return Err(ATAError::OutOfRange);
+        }
+
+        if !self.lba48 && block_no + n_blocks as u64 > ATA_LBA28_MAX_BLOCKS {
+            return Err(ATAError::OutOfRange);
+        }
+
+        Ok(())
+    }
+
+    /// reads the blocks from `block_no` into `buffer`, it's length must be a
+    /// multiple of the block size. Contiguous blocks are read with a command
+    /// per run, through DMA, or with PIO if DMA is not available.
+    pub fn read_blocks(&self, buffer: &mut [u8], block_no: u64) -> Result<(), ATAError> {
+        if buffer.len() % ATA_BLOCK_SIZE != 0 {
+            return Err(ATAError::Unaligned);
+        }
+
+        let check_result = self.check_range(block_no, buffer.len() / ATA_BLOCK_SIZE);
+        if check_result.is_err() {
+            return check_result;
+        }
+
+        let mut current_block = block_no;
+        for run in buffer.chunks_mut(ATA_MAX_BLOCKS_PER_COMMAND * ATA_BLOCK_SIZE) {
+            let mut dma_done = true;
+            for (index, dma_run) in run.chunks_mut(ata_dma::ATA_DMA_BUFFER_SIZE).enumerate() {
+                let dma_block =
+                    current_block + (index * ata_dma::ATA_DMA_BUFFER_SIZE / ATA_BLOCK_SIZE) as u64;
+                let dma_result = ata_dma::read_blocks(self, dma_block, dma_run);
+                if dma_result.is_err() {
+                    log::debug!(
+                        "ATA DMA read failed, using PIO, err={:?}",
+                        dma_result.unwrap_err()
+                    );
+                    dma_done = false;
+                    break;
+                }
             }
-            ATADriveType::SECONDARY => {
-                bus_device.sel_secondary();
+
+            if !dma_done {
+                let pio_result = self.read_blocks_pio(run, current_block);
+                if pio_result.is_err() {
+                    return pio_result;
+                }
             }
+
+            current_block += (run.len() / ATA_BLOCK_SIZE) as u64;
         }
 
-        // setup block for reading
-        bus_device.set_block(self.drive_type.clone(), block_no);
-        // set command:
-        bus_device.send_command(ATACommand::READ);
-        bus_device.wait_while_busy();
+        Ok(())
+    }
+
+    /// writes `buffer` to the blocks from `block_no`, it's length must be
+    /// a multiple of the block size.
+    pub fn write_blocks(&self, buffer: &[u8], block_no: u64) -> Result<(), ATAError> {
+        if buffer.len() % ATA_BLOCK_SIZE != 0 {
+            return Err(ATAError::Unaligned);
+        }
+
+        let check_result = self.check_range(block_no, buffer.len() / ATA_BLOCK_SIZE);
+        if check_result.is_err() {
+            return check_result;
+        }
+
+        let mut current_block = block_no;
+        for run in buffer.chunks(ATA_MAX_BLOCKS_PER_COMMAND * ATA_BLOCK_SIZE) {
+            let mut dma_done = true;
+            for (index, dma_run) in run.chunks(ata_dma::ATA_DMA_BUFFER_SIZE).enumerate() {
+                let dma_block =
+                    current_block + (index * ata_dma::ATA_DMA_BUFFER_SIZE / ATA_BLOCK_SIZE) as u64;
+                let dma_result = ata_dma::write_blocks(self, dma_block, dma_run);
+                if dma_result.is_err() {
+                    log::debug!(
+                        "ATA DMA write failed, using PIO, err={:?}",
+                        dma_result.unwrap_err()
+                    );
+                    dma_done = false;
+                    break;
+                }
+            }
+
+            if !dma_done {
+                let pio_result = self.write_blocks_pio(run, current_block);
+                if pio_result.is_err() {
+                    return pio_result;
+                }
+            }
 
-        // read
-        bus_device.read_current_block_u8(buffer);
-        cpu::enable_interrupts();
+            current_block += (run.len() / ATA_BLOCK_SIZE) as u64;
+        }
+
+        Ok(())
     }
 
     #[inline]
-    pub fn write_block(&self, buffer: &[u8], block_no: u32) {
-        // get bus device:
+    pub fn read_block(&self, buffer: &mut [u8], block_no: u64) -> Result<(), ATAError> {
+        if buffer.len() < ATA_BLOCK_SIZE {
+            return Err(ATAError::Unaligned);
+        }
 
+        self.read_blocks(&mut buffer[0..ATA_BLOCK_SIZE], block_no)
+    }
+
+    #[inline]
+    pub fn write_block(&self, buffer: &[u8], block_no: u64) -> Result<(), ATAError> {
+        if buffer.len() < ATA_BLOCK_SIZE {
+            return Err(ATAError::Unaligned);
+        }
+
+        self.write_blocks(&buffer[0..ATA_BLOCK_SIZE], block_no)
+    }
+
+    /// reads a run of at most `ATA_MAX_BLOCKS_PER_COMMAND` blocks with a single
+    /// command, the drive raises DRQ once per `blocks_per_drq` blocks.
+    pub fn read_blocks_pio(&self, buffer: &mut [u8], block_no: u64) -> Result<(), ATAError> {
+        // get bus device, the thread is not switched out holding the bus lock:
+        let interrupts_enabled = cpu::are_enabled();
         cpu::disable_interrupts();
 
         let bus_lock = ATA_DEVICES.lock();
         let bus_device = bus_lock.get(self.bus_no as usize).unwrap();
-        match self.drive_type {
-            ATADriveType::PRIMARY => {
-                bus_device.sel_primary();
-            }
-            ATADriveType::SECONDARY => {
-                bus_device.sel_secondary();
+        bus_device.select(self.drive_type.clone());
+
+        // setup blocks for reading
+        bus_device.setup_transfer(self, block_no, buffer.len() / ATA_BLOCK_SIZE);
+        // set command:
+        bus_device.send_command(self.command_for(true, false));
+
+        let mut result = Ok(());
+        for chunk in buffer.chunks_mut(self.blocks_per_drq() * ATA_BLOCK_SIZE) {
+            if !bus_device.wait_for_data() {
+                result = Err(ATAError::DeviceError);
+                break;
             }
+
+            // read
+            bus_device.read_current_block_u8(chunk);
+        }
+
+        drop(bus_lock);
+        if interrupts_enabled {
+            cpu::enable_interrupts();
         }
 
-        // setup block for reading
-        bus_device.set_block(self.drive_type.clone(), block_no);
+        result
+    }
+
+    pub fn write_blocks_pio(&self, buffer: &[u8], block_no: u64) -> Result<(), ATAError> {
+        // get bus device, the thread is not switched out holding the bus lock:
+        let interrupts_enabled = cpu::are_enabled();
+        cpu::disable_interrupts();
+
+        let bus_lock = ATA_DEVICES.lock();
+        let bus_device = bus_lock.get(self.bus_no as usize).unwrap();
+        bus_device.select(self.drive_type.clone());
+
+        // setup blocks for writing
+        bus_device.setup_transfer(self, block_no, buffer.len() / ATA_BLOCK_SIZE);
         // set command:
-        bus_device.send_command(ATACommand::WRITE);
-        bus_device.wait_while_busy();
+        bus_device.send_command(self.command_for(false, false));
+
+        let mut result = Ok(());
+        for chunk in buffer.chunks(self.blocks_per_drq() * ATA_BLOCK_SIZE) {
+            if !bus_device.wait_for_data() {
+                result = Err(ATAError::DeviceError);
+                break;
+            }
 
-        // write
-        bus_device.write_current_block_u8(buffer);
+            // write
+            bus_device.write_current_block_u8(chunk);
+        }
 
         bus_device.wait_while_busy();
-        cpu::enable_interrupts();
+        if result.is_ok() {
+            bus_device.flush_cache(self.lba48);
+        }
+
+        drop(bus_lock);
+        if interrupts_enabled {
+            cpu::enable_interrupts();
+        }
+
+        result
     }
 }
 
@@ -134,6 +317,19 @@ pub enum ATACommand {
     IDENTIFY = 0xEC,
     READ = 0x20,
     WRITE = 0x30,
+    READ_EXT = 0x24,
+    WRITE_EXT = 0x34,
+    READ_MULTIPLE = 0xC4,
+    WRITE_MULTIPLE = 0xC5,
+    READ_MULTIPLE_EXT = 0x29,
+    WRITE_MULTIPLE_EXT = 0x39,
+    SET_MULTIPLE_MODE = 0xC6,
+    READ_DMA = 0xC8,
+    WRITE_DMA = 0xCA,
+    READ_DMA_EXT = 0x25,
+    WRITE_DMA_EXT = 0x35,
+    FLUSH_CACHE = 0xE7,
+    FLUSH_CACHE_EXT = 0xEA,
 }
 
 #[derive(Debug, Clone)]
@@ -172,6 +368,14 @@ impl ATADevice {
         self.regs.drive.write_u8(ATADriveType::SECONDARY as u8);
     }
 
+    #[inline]
+    pub fn select(&self, drive_type: ATADriveType) {
+        match drive_type {
+            ATADriveType::PRIMARY => self.sel_primary(),
+            ATADriveType::SECONDARY => self.sel_secondary(),
+        }
+    }
+
     #[inline]
     pub fn approx_400ns_wait(&self) {
         // reads from alt status register,
@@ -262,11 +466,17 @@ impl ATADevice {
 
     #[inline]
     pub fn set_block(&self, drive: ATADriveType, block: u32) {
+        self.set_blocks(drive, block, 1);
+    }
+
+    /// sets up a transfer of `count` blocks from `block`, 0 means 256.
+    #[inline]
+    pub fn set_blocks(&self, drive: ATADriveType, block: u32, count: u8) {
         let drive_id = drive as u8 + 64;
         let drv_bits = block.get_bits(24..28) as u8;
 
         self.regs.drive.write_u8(drive_id | drv_bits & 0x0F);
-        self.regs.sector_count.write_u8(1);
+        self.regs.sector_count.write_u8(count);
         let lba0_bits = block.get_bits(0..8) as u8;
         let lba1_bits = block.get_bits(8..16) as u8;
         let lba2_bits = block.get_bits(16..24) as u8;
@@ -276,6 +486,75 @@ impl ATADevice {
         self.regs.lba2.write_u8(lba2_bits);
     }
 
+    /// 48-bit version of `set_blocks`, the high bytes are written first
+    /// through the same registers. A count of 0 means 65536.
+    #[inline]
+    pub fn set_blocks_lba48(&self, drive: ATADriveType, block: u64, count: u16) {
+        let drive_id = drive as u8 + 64;
+        self.regs.drive.write_u8(drive_id & 0xF0);
+
+        self.regs.sector_count.write_u8((count >> 8) as u8);
+        self.regs.lba0.write_u8(block.get_bits(24..32) as u8);
+        self.regs.lba1.write_u8(block.get_bits(32..40) as u8);
+        self.regs.lba2.write_u8(block.get_bits(40..48) as u8);
+
+        self.regs.sector_count.write_u8(count as u8);
+        self.regs.lba0.write_u8(block.get_bits(0..8) as u8);
+        self.regs.lba1.write_u8(block.get_bits(8..16) as u8);
+        self.regs.lba2.write_u8(block.get_bits(16..24) as u8);
+    }
+
+    /// programs the LBA and the count of a transfer for the drive,
+    /// `count` must not be more than `ATA_MAX_BLOCKS_PER_COMMAND`.
+    #[inline]
+    pub fn setup_transfer(&self, drive: &ATADrive, block: u64, count: usize) {
+        if drive.lba48 {
+            self.set_blocks_lba48(drive.drive_type.clone(), block, count as u16);
+        } else {
+            self.set_blocks(drive.drive_type.clone(), block as u32, count as u8);
+        }
+    }
+
+    /// waits for the drive to be ready for the next data block,
+    /// returns false if the drive reported an error.
+    #[inline]
+    pub fn wait_for_data(&self) -> bool {
+        self.wait_while_busy();
+        if self.is(ATAStatus::ERR) || self.is(ATAStatus::DF) {
+            return false;
+        }
+
+        self.is(ATAStatus::DRQ)
+    }
+
+    #[inline]
+    pub fn flush_cache(&self, lba48: bool) {
+        self.send_command(if lba48 {
+            ATACommand::FLUSH_CACHE_EXT
+        } else {
+            ATACommand::FLUSH_CACHE
+        });
+        self.wait_while_busy();
+    }
+
+    /// enables READ/WRITE MULTIPLE with `count` blocks per DRQ on the selected
+    /// drive, returns the count that is in effect.
+    pub fn set_multiple_mode(&self, count: u16) -> u16 {
+        if count <= 1 {
+            return 0;
+        }
+
+        self.regs.sector_count.write_u8(count as u8);
+        self.send_command(ATACommand::SET_MULTIPLE_MODE);
+        self.wait_while_busy();
+
+        if self.is(ATAStatus::ERR) {
+            return 0;
+        }
+
+        count
+    }
+
     #[inline]
     fn get_ata_info(&self, sector_0: &[u16; 256], drive_type: ATADriveType) -> Option<ATADrive> {
         let serial_no = sector_0[10..20]
@@ -292,7 +571,19 @@ impl ATADevice {
             .collect::<String>()
             .trim()
             .into();
-        let n_blocks = (sector_0[61] as u32) << 16 | (sector_0[60] as u32);
+        let dma_supported = sector_0[49].get_bit(8);
+        let lba48 = sector_0[83].get_bit(10);
+        let n_blocks = if lba48 {
+            (sector_0[103] as u64) << 48
+                | (sector_0[102] as u64) << 32
+                | (sector_0[101] as u64) << 16
+                | (sector_0[100] as u64)
+        } else {
+            (sector_0[61] as u64) << 16 | (sector_0[60] as u64)
+        };
+
+        // the largest count is in the low byte of word 47, a power of 2.
+        let max_multiple = sector_0[47] & 0xFF;
 
         Some(ATADrive {
             bus_no: self.id,
@@ -300,6 +591,9 @@ impl ATADevice {
             model_name,
             serial_no,
             n_blocks,
+            dma_supported,
+            lba48,
+            multiple_sectors: max_multiple.min(ATA_MAX_MULTIPLE_SECTORS),
         })
     }
 
@@ -336,12 +630,24 @@ impl ATADevice {
         return None;
     }
 
+    /// identifies the drive and sets it up for multi block PIO transfers
+    fn identify_and_setup(&self, d_type: ATADriveType) -> Option<ATADrive> {
+        let drive_opt = self.identify(d_type);
+        if drive_opt.is_none() {
+            return None;
+        }
+
+        let mut drive = drive_opt.unwrap();
+        drive.multiple_sectors = self.set_multiple_mode(drive.multiple_sectors);
+        Some(drive)
+    }
+
     pub fn identify_primary(&self) -> Option<ATADrive> {
         self.soft_reset();
         self.approx_400ns_wait();
 
         self.sel_primary();
-        self.identify(ATADriveType::PRIMARY)
+        self.identify_and_setup(ATADriveType::PRIMARY)
     }
 
     pub fn identify_secondary(&self) -> Option<ATADrive> {
@@ -349,7 +655,7 @@ impl ATADevice {
         self.approx_400ns_wait();
 
         self.sel_secondary();
-        self.identify(ATADriveType::SECONDARY)
+        self.identify_and_setup(ATADriveType::SECONDARY)
     }
 }
 
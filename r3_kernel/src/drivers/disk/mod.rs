@@ -1,104 +1,131 @@
 extern crate alloc;
 extern crate log;
 
+use crate::drivers::disk::ata_pio::ATADrive;
+use crate::drivers::pci::PCIDevice;
+use crate::system::filesystem::bcache::{self, BlockDevice};
 use crate::system::filesystem::devfs::{register_device, DevFSDescriptor, DevOps};
 use crate::system::filesystem::{FSError, SeekType};
+use crate::system::trace::{self, TraceEvent};
 
 use alloc::{boxed::Box, format};
 
+pub mod ata_dma;
 pub mod ata_pio;
 
-pub fn init() {
+pub fn init(controller: &PCIDevice) {
     // register devices
     ata_pio::register_devices();
     ata_pio::probe_drives();
     ata_pio::list_drives();
+    ata_dma::init(controller);
 }
 
+/// devfs major number of ATA drives, the minor is the index of the drive.
+pub const ATA_DEVFS_MAJOR: u32 = 2;
+
 pub struct ATAIODriver {
     pub index: usize,
+    /// drives do not change after they are probed, the driver keeps it's own
+    /// copy so transfers neither take `ATA_DRIVES` nor hold it while sleeping.
+    drive: ATADrive,
 }
 
 impl ATAIODriver {
-    pub fn empty(index: usize) -> Self {
-        ATAIODriver { index }
+    pub fn new(index: usize, drive: ATADrive) -> Self {
+        ATAIODriver { index, drive }
+    }
+}
+
+impl BlockDevice for ATAIODriver {
+    fn n_blocks(&self) -> u64 {
+        self.drive.n_blocks
+    }
+
+    fn read_blocks(&self, buffer: &mut [u8], block_no: u64) -> Result<(), FSError> {
+        let n_sectors = (buffer.len() / ata_pio::ATA_BLOCK_SIZE) as u32;
+        trace::record(TraceEvent::DiskRead, block_no, n_sectors);
+
+        let result = self.drive.read_blocks(buffer, block_no);
+        if result.is_err() {
+            log::debug!("ATA read error, err={:?}", result.unwrap_err());
+            return Err(FSError::IOError);
+        }
+
+        Ok(())
+    }
+
+    fn write_blocks(&self, buffer: &[u8], block_no: u64) -> Result<(), FSError> {
+        let n_sectors = (buffer.len() / ata_pio::ATA_BLOCK_SIZE) as u32;
+        trace::record(TraceEvent::DiskWrite, block_no, n_sectors);
+
+        let result = self.drive.write_blocks(buffer, block_no);
+        if result.is_err() {
+            log::debug!("ATA write error, err={:?}", result.unwrap_err());
+            return Err(FSError::IOError);
+        }
+
+        Ok(())
     }
 }
 
+/// reads and writes go through the block cache, which takes care of offsets
+/// and lengths that are not a multiple of the block size.
 impl DevOps for ATAIODriver {
     fn write(&self, fd: &mut DevFSDescriptor, buffer: &[u8]) -> Result<usize, FSError> {
-        let device_lock = ata_pio::ATA_DRIVES.lock();
-        let device = device_lock.get(self.index).unwrap().as_ref().unwrap();
-        let block_start = fd.offset / ata_pio::ATA_BLOCK_SIZE as u32;
-
-        let is_short_block: bool;
-
-        let n_blocks = if buffer.len() > ata_pio::ATA_BLOCK_SIZE {
-            is_short_block = false;
-            buffer.len() / ata_pio::ATA_BLOCK_SIZE
-        } else {
-            is_short_block = true;
-            1
-        };
-
-        for block_offset in 0..n_blocks {
-            let start = block_offset * ata_pio::ATA_BLOCK_SIZE;
-            let end = if is_short_block {
-                buffer.len()
-            } else {
-                start + ata_pio::ATA_BLOCK_SIZE
-            };
-            device.write_block(&buffer[start..end], block_start + block_offset as u32);
+        let result = bcache::write(
+            self,
+            ATA_DEVFS_MAJOR,
+            self.index as u32,
+            fd.offset as usize,
+            buffer,
+        );
+        if result.is_err() {
+            return result;
         }
 
-        Ok(buffer.len())
+        let written = result.unwrap();
+        fd.offset += written as u64;
+        Ok(written)
     }
 
     fn read(&self, fd: &mut DevFSDescriptor, buffer: &mut [u8]) -> Result<usize, FSError> {
-        let device_lock = ata_pio::ATA_DRIVES.lock();
-        let device = device_lock.get(self.index).unwrap().as_ref().unwrap();
-        let block_start = fd.offset / ata_pio::ATA_BLOCK_SIZE as u32;
-
-        let is_short_block: bool;
-
-        let n_blocks = if buffer.len() > ata_pio::ATA_BLOCK_SIZE {
-            is_short_block = false;
-            buffer.len() / ata_pio::ATA_BLOCK_SIZE
-        } else {
-            is_short_block = true;
-            1
-        };
-
-        for block_offset in 0..n_blocks {
-            let start = block_offset * ata_pio::ATA_BLOCK_SIZE;
-            let end = if is_short_block {
-                buffer.len()
-            } else {
-                start + ata_pio::ATA_BLOCK_SIZE
-            };
-            device.read_block(&mut buffer[start..end], block_start + block_offset as u32);
+        let result = bcache::read(
+            self,
+            ATA_DEVFS_MAJOR,
+            self.index as u32,
+            fd.offset as usize,
+            buffer,
+        );
+        if result.is_err() {
+            return result;
         }
 
-        Ok(buffer.len())
+        let read = result.unwrap();
+        fd.offset += read as u64;
+        Ok(read)
     }
 
     fn ioctl(&self, _command: usize, _arg: usize) -> Result<usize, FSError> {
         Err(FSError::NotYetImplemented)
     }
 
+    /// the position is returned in 32 bits, a seek that would end past 4GiB
+    /// fails and leaves the offset alone. Reads and writes move it past that.
     fn seek(&self, fd: &mut DevFSDescriptor, offset: u32, st: SeekType) -> Result<u32, FSError> {
-        match st {
-            SeekType::SEEK_SET => {
-                fd.offset = offset;
-            }
-            SeekType::SEEK_CUR => {
-                fd.offset = fd.offset + offset;
-            }
+        let new_offset = match st {
+            SeekType::SEEK_SET => offset as u64,
+            SeekType::SEEK_CUR => fd.offset + offset as u64,
             SeekType::SEEK_END => {
                 return Err(FSError::InvalidSeek);
             }
+        };
+
+        if new_offset > u32::MAX as u64 {
+            return Err(FSError::InvalidSeek);
         }
 
+        fd.offset = new_offset;
         Ok(fd.offset as u32)
     }
 }
@@ -106,14 +133,14 @@ impl DevOps for ATAIODriver {
 pub fn register_hdd_devices() {
     let locked_drives = ata_pio::ATA_DRIVES.lock();
     for (index, drive_opt) in locked_drives.iter().enumerate() {
-        if drive_opt.is_some() {
+        if let Some(drive) = drive_opt {
             // register this drive:
             let char_suffix = (97 + index) as u8 as char;
             let drive_name = format!("hd{}", char_suffix);
             // mount the driver:
-            let driver = ATAIODriver::empty(index);
+            let driver = ATAIODriver::new(index, drive.clone());
 
-            register_device(&drive_name, 2, index as u32, Box::new(driver))
+            register_device(&drive_name, ATA_DEVFS_MAJOR, index as u32, Box::new(driver))
                 .expect("Failed to register hard disk device to devfs");
 
             log::info!("Registered devfs device {}", drive_name);
@@ -4,6 +4,7 @@ extern crate spin;
 
 use crate::drivers::display::font::{get_bit_for_char, FONT_HEIGHT, FONT_WIDTH, LINUX_BOOT_FONT};
 use crate::drivers::display::framebuffer;
+use crate::drivers::display::glyph_cache::{GlyphCache, GLYPH_CACHE};
 
 use alloc::string::ToString;
 use core::fmt;
@@ -22,16 +23,6 @@ pub struct FramebufferText;
 
 impl FramebufferText {
     pub fn scroll(fb: &mut MutexGuard<framebuffer::FramebufferMemory>, n_lines: usize) {
-        let total_bytes = fb.buffer.len();
-        let offset = n_lines * FONT_HEIGHT * fb.width * fb.bytes_per_pixel;
-
-        let offset_slice = framebuffer::FramebufferMemory::get_slice_from(offset);
-        let target_slice =
-            framebuffer::FramebufferMemory::get_slice_bounded(0, total_bytes - offset);
-
-        // copy from offset:
-        target_slice.unwrap().copy_from_slice(offset_slice.unwrap());
-
         let black = framebuffer::Pixel {
             b: 0,
             g: 0,
@@ -39,8 +30,7 @@ impl FramebufferText {
             channel: 0,
         };
 
-        let to_clear_slice = framebuffer::FramebufferMemory::get_slice_from(total_bytes - offset);
-        framebuffer::Framebuffer::fill_region(to_clear_slice.unwrap(), black, fb.bytes_per_pixel);
+        framebuffer::Framebuffer::scroll_rows(fb, n_lines * FONT_HEIGHT, black);
     }
 
     #[inline]
@@ -119,6 +109,62 @@ impl FramebufferText {
         }
     }
 
+    /// copies a rendered glyph to the cell at `r_line`, `c_line` a row at a time,
+    /// the glyph is clipped once against the edges of the screen.
+    pub fn blit_glyph(
+        fb: &mut MutexGuard<framebuffer::FramebufferMemory>,
+        glyph: &[u8],
+        r_line: usize,
+        c_line: usize,
+    ) {
+        let start_y = r_line * FONT_HEIGHT;
+        let start_x = c_line * FONT_WIDTH;
+        if start_x >= fb.width || start_y >= fb.height {
+            return;
+        }
+
+        let bps = fb.bytes_per_pixel;
+        let visible_width = FONT_WIDTH.min(fb.width - start_x);
+        let visible_height = FONT_HEIGHT.min(fb.height - start_y);
+
+        let glyph_row_bytes = FONT_WIDTH * bps;
+        let (start, end) = (start_x * bps, (start_x + visible_width) * bps);
+        for i in 0..visible_height {
+            let src = &glyph[i * glyph_row_bytes..i * glyph_row_bytes + visible_width * bps];
+            framebuffer::copy_wide(&mut fb.draw_row(start_y + i)[start..end], src);
+        }
+
+        fb.mark_dirty(framebuffer::DirtyRect {
+            x0: start_x,
+            y0: start_y,
+            x1: start_x + visible_width,
+            y1: start_y + visible_height,
+        });
+    }
+
+    #[inline]
+    fn draw_char(
+        fb: &mut MutexGuard<framebuffer::FramebufferMemory>,
+        cache: &mut Option<GlyphCache>,
+        ch: u8,
+        color: framebuffer::Pixel,
+        r_line: usize,
+        c_line: usize,
+        n_cols: usize,
+        n_rows: usize,
+    ) {
+        match cache.as_mut() {
+            Some(glyphs) => {
+                let bps = fb.bytes_per_pixel;
+                let glyph = glyphs.glyph(ch, color, bps);
+                FramebufferText::blit_glyph(fb, glyph, r_line, c_line);
+            }
+            None => {
+                FramebufferText::print_ascii_char(fb, ch, color, &r_line, &c_line, n_cols, n_rows);
+            }
+        }
+    }
+
     pub fn print_string(
         fb: &mut MutexGuard<framebuffer::FramebufferMemory>,
         string: &str,
@@ -131,6 +177,9 @@ impl FramebufferText {
         let mut c_row = pos.row_line;
         let mut c_col = pos.col_line;
 
+        // always taken with the framebuffer held, so it is never contended.
+        let mut cache = GLYPH_CACHE.lock();
+
         for ch in string.as_bytes() {
             if *ch <= 0x20 && *ch >= 0x7e {
                 // skip non-printable characters
@@ -157,7 +206,9 @@ impl FramebufferText {
                     c_col = 0;
                 }
 
-                FramebufferText::print_ascii_char(fb, *ch, color, &c_row, &c_col, n_cols, n_rows);
+                FramebufferText::draw_char(
+                    fb, &mut cache, *ch, color, c_row, c_col, n_cols, n_rows,
+                );
                 c_col += 1;
             }
         }
@@ -167,6 +218,37 @@ impl FramebufferText {
             col_line: c_col,
         }
     }
+
+    /// draws `string` into the back buffer taking the framebuffer once per
+    /// line, a long write does not keep the other writers off the screen for
+    /// all of it. Nothing is flushed.
+    pub fn draw_lines(
+        locked_buffer: &framebuffer::LockedFramebuffer,
+        string: &str,
+        color: framebuffer::Pixel,
+        pos: &FramebufferLines,
+    ) -> FramebufferLines {
+        let mut lines = pos.clone();
+        for line in string.split_inclusive('\n') {
+            let mut fb = locked_buffer.lock();
+            lines = FramebufferText::print_string(&mut fb, line, color, &lines);
+        }
+
+        lines
+    }
+
+    /// draws `string` like `draw_lines`, the rows it changed are flushed
+    /// once at the end.
+    pub fn print_lines(
+        locked_buffer: &framebuffer::LockedFramebuffer,
+        string: &str,
+        color: framebuffer::Pixel,
+        pos: &FramebufferLines,
+    ) -> FramebufferLines {
+        let lines = FramebufferText::draw_lines(locked_buffer, string, color, pos);
+        framebuffer::Framebuffer::flush(&mut locked_buffer.lock());
+        lines
+    }
 }
 
 pub struct FramebufferLogger {
@@ -189,21 +271,30 @@ impl FramebufferLogger {
         self.color = color;
     }
 
+    /// draws `string`, it shows up on the screen with the next `flush`.
     pub fn write(&mut self, string: &str) {
         let locked_buffer_opt = framebuffer::Framebuffer::get_buffer_lock();
         if locked_buffer_opt.is_none() {
             return;
         }
 
-        let mut locked_buffer = locked_buffer_opt.as_ref().unwrap().lock();
-
-        self.current_lines = FramebufferText::print_string(
-            &mut locked_buffer,
+        self.current_lines = FramebufferText::draw_lines(
+            locked_buffer_opt.as_ref().unwrap(),
             string,
             self.color,
             &self.current_lines,
         );
     }
+
+    /// copies everything written since the last flush to the framebuffer.
+    pub fn flush(&self) {
+        let locked_buffer_opt = framebuffer::Framebuffer::get_buffer_lock();
+        if locked_buffer_opt.is_none() {
+            return;
+        }
+
+        framebuffer::Framebuffer::flush(&mut locked_buffer_opt.as_ref().unwrap().lock());
+    }
 }
 
 impl fmt::Write for FramebufferLogger {
@@ -1,7 +1,10 @@
+extern crate alloc;
 extern crate log;
 extern crate spin;
 
 use crate::boot_proto::BootProtocol;
+use alloc::{vec, vec::Vec};
+use core::{ptr, slice};
 use lazy_static::lazy_static;
 use spin::{Mutex, MutexGuard};
 
@@ -17,6 +20,14 @@ pub struct Pixel {
     pub channel: u8,
 }
 
+impl Pixel {
+    /// the pixel as it is laid out in memory with 4 bytes per pixel.
+    #[inline]
+    pub fn as_u32(&self) -> u32 {
+        u32::from_le_bytes([self.b, self.g, self.r, self.channel])
+    }
+}
+
 /// Represents a framebuffer memory region and other metadata used to control
 /// different functions of framebuffer.
 pub struct FramebufferMemory {
@@ -25,6 +36,9 @@ pub struct FramebufferMemory {
     pub width: usize,
     pub height: usize,
     pub bytes_per_pixel: usize,
+    /// everything is drawn here once it is set up, the framebuffer is only
+    /// written when the changed region is flushed.
+    pub back_buffer: Option<BackBuffer>,
 }
 
 pub struct FramebufferIndex {
@@ -32,6 +46,85 @@ pub struct FramebufferIndex {
     pub y: usize,
 }
 
+/// region of the screen changed since the last flush, in pixels. The end
+/// is exclusive.
+#[derive(Debug, Clone, Copy)]
+pub struct DirtyRect {
+    pub x0: usize,
+    pub y0: usize,
+    pub x1: usize,
+    pub y1: usize,
+}
+
+impl DirtyRect {
+    #[inline]
+    fn merge(&mut self, other: &DirtyRect) {
+        self.x0 = self.x0.min(other.x0);
+        self.y0 = self.y0.min(other.y0);
+        self.x1 = self.x1.max(other.x1);
+        self.y1 = self.y1.max(other.y1);
+    }
+}
+
+/// A copy of the screen in RAM. The rows are used as a ring, row `y` of
+/// the screen is row `(origin + y) % height` here, so scrolling only moves
+/// `origin` and clears the rows that come in at the bottom.
+pub struct BackBuffer {
+    /// u64 words keep the rows aligned for the wide copies.
+    pixels: Vec<u64>,
+    row_bytes: usize,
+    height: usize,
+    origin: usize,
+    dirty: Option<DirtyRect>,
+}
+
+impl BackBuffer {
+    fn new(row_bytes: usize, height: usize) -> Self {
+        let n_words = (row_bytes * height + 7) / 8;
+        BackBuffer {
+            pixels: vec![0; n_words],
+            row_bytes,
+            height,
+            origin: 0,
+            dirty: None,
+        }
+    }
+
+    #[inline]
+    fn bytes_mut(&mut self) -> &mut [u8] {
+        let length = self.row_bytes * self.height;
+        unsafe { slice::from_raw_parts_mut(self.pixels.as_mut_ptr() as *mut u8, length) }
+    }
+
+    #[inline]
+    fn row_offset(&self, y: usize) -> usize {
+        ((self.origin + y) % self.height) * self.row_bytes
+    }
+
+    #[inline]
+    fn row(&self, y: usize) -> &[u8] {
+        let offset = self.row_offset(y);
+        let length = self.row_bytes * self.height;
+        let bytes = unsafe { slice::from_raw_parts(self.pixels.as_ptr() as *const u8, length) };
+        &bytes[offset..offset + self.row_bytes]
+    }
+
+    #[inline]
+    fn row_mut(&mut self, y: usize) -> &mut [u8] {
+        let offset = self.row_offset(y);
+        let row_bytes = self.row_bytes;
+        &mut self.bytes_mut()[offset..offset + row_bytes]
+    }
+
+    #[inline]
+    fn mark_dirty(&mut self, rect: DirtyRect) {
+        match self.dirty.as_mut() {
+            Some(dirty) => dirty.merge(&rect),
+            None => self.dirty = Some(rect),
+        }
+    }
+}
+
 impl FramebufferMemory {
     /// creates a new frame buffer memory region over the framebuffer area
     /// provided by the bootloader.
@@ -48,7 +141,7 @@ impl FramebufferMemory {
         let fb_info_opt = BootProtocol::get_framebuffer_info();
         if fb_info_opt.is_none() {
             log::error!(
-                "Could not initialize framebuffer, 
+                "Could not initialize framebuffer,
                  because the bootloader did not provide framebuffer info."
             );
             return None;
@@ -61,25 +154,32 @@ impl FramebufferMemory {
             width: fb_info.horizontal_resolution,
             height: fb_info.vertical_resolution,
             bytes_per_pixel: fb_info.bytes_per_pixel,
+            back_buffer: None,
         })
     }
 
-    pub fn get_slice_bounded(start: usize, end: usize) -> Option<&'static mut [u8]> {
-        let fb_slice_opt = BootProtocol::get_framebuffer_slice();
-        if fb_slice_opt.is_none() {
-            return None;
-        }
-
-        Some(&mut fb_slice_opt.unwrap()[start..end])
+    #[inline]
+    pub fn row_bytes(&self) -> usize {
+        self.width * self.bytes_per_pixel
     }
 
-    pub fn get_slice_from(start: usize) -> Option<&'static mut [u8]> {
-        let fb_slice_opt = BootProtocol::get_framebuffer_slice();
-        if fb_slice_opt.is_none() {
-            return None;
+    /// the bytes of row `y` of the screen in the buffer that is drawn to.
+    #[inline]
+    pub fn draw_row(&mut self, y: usize) -> &mut [u8] {
+        let row_bytes = self.row_bytes();
+        match self.back_buffer.as_mut() {
+            Some(back) => back.row_mut(y),
+            None => &mut self.buffer[y * row_bytes..(y + 1) * row_bytes],
         }
+    }
 
-        Some(&mut fb_slice_opt.unwrap()[start..])
+    /// records that the pixels in `rect` were drawn, they are copied to the
+    /// framebuffer on the next flush.
+    #[inline]
+    pub fn mark_dirty(&mut self, rect: DirtyRect) {
+        if let Some(back) = self.back_buffer.as_mut() {
+            back.mark_dirty(rect);
+        }
     }
 }
 
@@ -100,6 +200,56 @@ lazy_static! {
     pub static ref FRAMEBUFFER: Option<LockedFramebuffer> = init_framebuffer();
 }
 
+/// copies `src` to `dst` eight bytes at a time, both have the same length.
+/// The kernel is built without SSE, u64 is the widest register it uses.
+#[inline]
+pub fn copy_wide(dst: &mut [u8], src: &[u8]) {
+    let length = dst.len().min(src.len());
+    let n_words = length / 8;
+    unsafe {
+        let dst_ptr = dst.as_mut_ptr();
+        let src_ptr = src.as_ptr();
+        for word in 0..n_words {
+            let value = ptr::read_unaligned(src_ptr.add(word * 8) as *const u64);
+            ptr::write_unaligned(dst_ptr.add(word * 8) as *mut u64, value);
+        }
+    }
+
+    for offset in n_words * 8..length {
+        dst[offset] = src[offset];
+    }
+}
+
+/// fills `region` with `pixel`, two pixels per store when a pixel is 4 bytes.
+#[inline]
+pub fn fill_wide(region: &mut [u8], pixel: Pixel, bps: usize) {
+    if bps != 4 {
+        let mut offset = 0;
+        while offset + bps <= region.len() {
+            region[offset] = pixel.b;
+            region[offset + 1] = pixel.g;
+            region[offset + 2] = pixel.r;
+            offset += bps;
+        }
+        return;
+    }
+
+    let value = pixel.as_u32() as u64;
+    let pattern = value | value << 32;
+    let n_words = region.len() / 8;
+    unsafe {
+        let region_ptr = region.as_mut_ptr();
+        for word in 0..n_words {
+            ptr::write_unaligned(region_ptr.add(word * 8) as *mut u64, pattern);
+        }
+    }
+
+    if region.len() - n_words * 8 >= 4 {
+        let offset = n_words * 8;
+        region[offset..offset + 4].copy_from_slice(&pixel.as_u32().to_le_bytes());
+    }
+}
+
 /// Set of control functions used for writing pixels to frame buffer
 pub struct Framebuffer;
 
@@ -115,32 +265,34 @@ impl Framebuffer {
     }
 
     #[inline]
-    fn index_to_offset(fb: &FramebufferMemory, index: FramebufferIndex) -> Option<usize> {
+    pub fn set_pixel(fb: &mut FramebufferMemory, pixel: Pixel, index: FramebufferIndex) {
         if Framebuffer::index_in_bounds(&fb, &index) {
-            Some((index.y * fb.width + index.x) * fb.bytes_per_pixel)
-        } else {
-            None
-        }
-    }
+            let offset = index.x * fb.bytes_per_pixel;
+            let row = fb.draw_row(index.y);
+            row[offset] = pixel.b;
+            row[offset + 1] = pixel.g;
+            row[offset + 2] = pixel.r;
+            row[offset + 3] = pixel.channel;
 
-    #[inline]
-    pub fn set_pixel(fb: &mut FramebufferMemory, pixel: Pixel, index: FramebufferIndex) {
-        if let Some(offset) = Framebuffer::index_to_offset(&fb, index) {
-            fb.buffer[offset] = pixel.b;
-            fb.buffer[offset + 1] = pixel.g;
-            fb.buffer[offset + 2] = pixel.r;
-            fb.buffer[offset + 3] = pixel.channel;
+            fb.mark_dirty(DirtyRect {
+                x0: index.x,
+                y0: index.y,
+                x1: index.x + 1,
+                y1: index.y + 1,
+            });
         }
     }
 
     #[inline]
-    pub fn get_pixel(fb: &FramebufferMemory, index: FramebufferIndex) -> Option<Pixel> {
-        if let Some(offset) = Framebuffer::index_to_offset(fb, index) {
+    pub fn get_pixel(fb: &mut FramebufferMemory, index: FramebufferIndex) -> Option<Pixel> {
+        if Framebuffer::index_in_bounds(fb, &index) {
+            let offset = index.x * fb.bytes_per_pixel;
+            let row = fb.draw_row(index.y);
             return Some(Pixel {
-                b: fb.buffer[offset],
-                g: fb.buffer[offset + 1],
-                r: fb.buffer[offset + 2],
-                channel: fb.buffer[offset + 4],
+                b: row[offset],
+                g: row[offset + 1],
+                r: row[offset + 2],
+                channel: row[offset + 3],
             });
         }
 
@@ -148,22 +300,77 @@ impl Framebuffer {
     }
 
     pub fn fill(fb: &mut MutexGuard<FramebufferMemory>, pixel: Pixel) {
+        let height = fb.height;
+        Framebuffer::fill_rows(fb, pixel, 0, height);
+    }
+
+    /// fills the rows `start..end` of the screen with `pixel`.
+    pub fn fill_rows(fb: &mut FramebufferMemory, pixel: Pixel, start: usize, end: usize) {
+        let end = end.min(fb.height);
         let bps = fb.bytes_per_pixel;
-        Framebuffer::fill_region(fb.buffer, pixel, bps);
+        for y in start..end {
+            fill_wide(fb.draw_row(y), pixel, bps);
+        }
+
+        let width = fb.width;
+        fb.mark_dirty(DirtyRect {
+            x0: 0,
+            y0: start,
+            x1: width,
+            y1: end,
+        });
+    }
+
+    /// moves the screen up by `n_rows` pixel rows and clears the rows that
+    /// come in at the bottom. With a back buffer this only rotates the ring,
+    /// the framebuffer gets the whole screen on the next flush.
+    pub fn scroll_rows(fb: &mut FramebufferMemory, n_rows: usize, clear: Pixel) {
+        let height = fb.height;
+        let n_rows = n_rows.min(height);
+
+        if let Some(back) = fb.back_buffer.as_mut() {
+            back.origin = (back.origin + n_rows) % back.height;
+        } else {
+            let row_bytes = fb.row_bytes();
+            let offset = n_rows * row_bytes;
+            let total_bytes = height * row_bytes;
+            fb.buffer.copy_within(offset..total_bytes, 0);
+        }
+
+        Framebuffer::fill_rows(fb, clear, height - n_rows, height);
+        let width = fb.width;
+        fb.mark_dirty(DirtyRect {
+            x0: 0,
+            y0: 0,
+            x1: width,
+            y1: height,
+        });
     }
 
-    pub fn fill_region(fb_region_slice: &mut [u8], pixel: Pixel, bps: usize) {
-        if fb_region_slice.len() % bps != 0 {
+    /// copies the region changed since the last flush from the back buffer
+    /// to the framebuffer, rows are written once and never read back.
+    pub fn flush(fb: &mut FramebufferMemory) {
+        let row_bytes = fb.row_bytes();
+        let bps = fb.bytes_per_pixel;
+        let back_opt = fb.back_buffer.as_mut();
+        if back_opt.is_none() {
             return;
         }
 
-        let mut offset = 0;
-        while offset < fb_region_slice.len() {
-            fb_region_slice[offset] = pixel.b;
-            fb_region_slice[offset + 1] = pixel.g;
-            fb_region_slice[offset + 2] = pixel.r;
-            fb_region_slice[offset + 3] = pixel.channel;
-            offset += bps;
+        let back = back_opt.unwrap();
+        let dirty_opt = back.dirty.take();
+        if dirty_opt.is_none() {
+            return;
+        }
+
+        let dirty = dirty_opt.unwrap();
+        let (start, end) = (dirty.x0 * bps, dirty.x1 * bps);
+        for y in dirty.y0..dirty.y1 {
+            let row_offset = y * row_bytes;
+            copy_wide(
+                &mut fb.buffer[row_offset + start..row_offset + end],
+                &back.row(y)[start..end],
+            );
         }
     }
 }
@@ -185,3 +392,24 @@ pub fn setup_framebuffer() {
         fb_ref.height
     );
 }
+
+/// starts drawing to a back buffer in RAM, needs the heap. What is on the
+/// screen is copied to it once.
+pub fn setup_back_buffer() {
+    if FRAMEBUFFER.is_none() {
+        return;
+    }
+
+    let mut fb = FRAMEBUFFER.as_ref().unwrap().lock();
+    let row_bytes = fb.row_bytes();
+    let height = fb.height;
+
+    let mut back = BackBuffer::new(row_bytes, height);
+    let length = row_bytes * height;
+    copy_wide(back.bytes_mut(), &fb.buffer[0..length]);
+    fb.back_buffer = Some(back);
+
+    // the logger draws to the framebuffer too.
+    drop(fb);
+    log::info!("Framebuffer back buffer enabled, size={} bytes.", length);
+}
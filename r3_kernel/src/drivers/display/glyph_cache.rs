@@ -0,0 +1,108 @@
+extern crate alloc;
+extern crate spin;
+
+use crate::drivers::display::font::{get_bit_for_char, FONT_HEIGHT, FONT_WIDTH, LINUX_BOOT_FONT};
+use crate::drivers::display::framebuffer::Pixel;
+
+use alloc::{boxed::Box, vec, vec::Vec};
+use spin::Mutex;
+
+/// most colors that have their glyphs cached, the console uses a handful.
+const GLYPH_CACHE_MAX_SETS: usize = 8;
+
+const N_GLYPHS: usize = 256;
+
+const BACKGROUND: Pixel = Pixel {
+    b: 0,
+    g: 0,
+    r: 0,
+    channel: 0,
+};
+
+/// the glyphs of the font rendered in one color and pixel format, each is
+/// `FONT_HEIGHT` rows of `FONT_WIDTH` pixels laid out like the framebuffer.
+struct GlyphSet {
+    color: u32,
+    bytes_per_pixel: usize,
+    glyphs: Vec<Option<Box<[u8]>>>,
+}
+
+impl GlyphSet {
+    fn new(color: Pixel, bytes_per_pixel: usize) -> Self {
+        GlyphSet {
+            color: color.as_u32(),
+            bytes_per_pixel,
+            glyphs: vec![None; N_GLYPHS],
+        }
+    }
+
+    /// renders `ch` once, the first column of a glyph is always blank.
+    fn render(ch: u8, color: Pixel, bytes_per_pixel: usize) -> Box<[u8]> {
+        let fg = color.as_u32().to_le_bytes();
+        let bg = BACKGROUND.as_u32().to_le_bytes();
+
+        let mut bitmap = vec![0u8; FONT_HEIGHT * FONT_WIDTH * bytes_per_pixel];
+        for i in 0..FONT_HEIGHT {
+            let char_font = LINUX_BOOT_FONT[ch as usize][i];
+            for j in 0..FONT_WIDTH {
+                let is_set = j >= 1 && get_bit_for_char(char_font, j - 1) != 0;
+                let pixel = if is_set { &fg } else { &bg };
+
+                let offset = (i * FONT_WIDTH + j) * bytes_per_pixel;
+                let length = bytes_per_pixel.min(pixel.len());
+                bitmap[offset..offset + length].copy_from_slice(&pixel[0..length]);
+            }
+        }
+
+        bitmap.into_boxed_slice()
+    }
+}
+
+/// Glyphs rendered the first time they are printed in a color, printing
+/// then copies whole rows of pixels instead of testing every font bit.
+pub struct GlyphCache {
+    sets: Vec<GlyphSet>,
+}
+
+impl GlyphCache {
+    pub fn empty() -> Self {
+        GlyphCache { sets: Vec::new() }
+    }
+
+    /// the bitmap of `ch` in `color`, rendered now if it is not cached.
+    pub fn glyph(&mut self, ch: u8, color: Pixel, bytes_per_pixel: usize) -> &[u8] {
+        let color_value = color.as_u32();
+        let set_opt = self
+            .sets
+            .iter()
+            .position(|set| set.color == color_value && set.bytes_per_pixel == bytes_per_pixel);
+
+        let set_index = match set_opt {
+            Some(index) => index,
+            None => {
+                // the oldest color goes when there are too many.
+                if self.sets.len() == GLYPH_CACHE_MAX_SETS {
+                    self.sets.remove(0);
+                }
+
+                self.sets.push(GlyphSet::new(color, bytes_per_pixel));
+                self.sets.len() - 1
+            }
+        };
+
+        let set = &mut self.sets[set_index];
+        let glyph = &mut set.glyphs[ch as usize];
+        if glyph.is_none() {
+            *glyph = Some(GlyphSet::render(ch, color, bytes_per_pixel));
+        }
+
+        glyph.as_ref().unwrap()
+    }
+}
+
+/// `None` until the heap is set up, glyphs are drawn pixel by pixel till then.
+pub static GLYPH_CACHE: Mutex<Option<GlyphCache>> = Mutex::new(None);
+
+pub fn setup_glyph_cache() {
+    *GLYPH_CACHE.lock() = Some(GlyphCache::empty());
+}
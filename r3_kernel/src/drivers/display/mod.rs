@@ -1,8 +1,9 @@
 pub mod fb_text;
 pub mod font;
 pub mod framebuffer;
+pub mod glyph_cache;
 
-use framebuffer::{setup_framebuffer, Framebuffer, Pixel};
+use framebuffer::{setup_back_buffer, setup_framebuffer, Framebuffer, Pixel};
 
 pub fn init() {
     setup_framebuffer();
@@ -20,3 +21,10 @@ pub fn init() {
         Framebuffer::fill(&mut fb_lock, black);
     }
 }
+
+/// draws to a back buffer from now on and caches the rendered glyphs,
+/// called once the heap is set up.
+pub fn init_back_buffer() {
+    setup_back_buffer();
+    glyph_cache::setup_glyph_cache();
+}
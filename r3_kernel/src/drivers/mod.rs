@@ -4,7 +4,10 @@ extern crate log;
 use crate::system::filesystem::devfs::register_device;
 use alloc::{boxed::Box, vec::Vec};
 
+use crate::system::kmsg;
 use crate::system::net::iface::PhyNetDevType;
+use crate::system::profiler;
+use crate::system::trace;
 
 pub mod disk;
 pub mod display;
@@ -27,6 +30,18 @@ pub fn register_buultin_devices() {
     register_device("rand", 1, 2, Box::new(random::RandomIODriver::empty()))
         .expect("Failed to register Random generator to devfs");
 
+    register_device("kmsg", 1, 3, Box::new(kmsg::KmsgDriver::empty()))
+        .expect("Failed to register kernel log to devfs");
+
+    register_device("trace", 1, 4, Box::new(trace::TraceDriver::empty()))
+        .expect("Failed to register trace points to devfs");
+
+    register_device("stats", 1, 5, Box::new(trace::StatsDriver::empty()))
+        .expect("Failed to register kernel counters to devfs");
+
+    register_device("profile", 1, 6, Box::new(profiler::ProfileDriver::empty()))
+        .expect("Failed to register the profiler to devfs");
+
     log::info!("Registered devfs devices - uart");
 }
 
@@ -38,17 +53,15 @@ const RTL_NETWORK_INTERFACE: (u16, u16) = (0x8139, 0x10EC);
 /// uses vendor_id and device_id to determine which driver can
 /// serve this device.
 pub fn load_pci_drivers() {
-    let mut devices: Vec<(u16, u16)> = Vec::new();
-    for &device in pci::PCI_DEVICES.lock().iter() {
-        devices.push((device.device_id, device.vendor_id));
-    }
+    let devices: Vec<pci::PCIDevice> = pci::PCI_DEVICES.lock().clone();
 
-    for (device_id, vendor_id) in devices.iter() {
-        match (*device_id, *vendor_id) {
+    for device in devices.iter() {
+        let (device_id, vendor_id) = (device.device_id, device.vendor_id);
+        match (device_id, vendor_id) {
             ATA_CONTROLLER => {
                 // load the ATA controller driver
                 log::info!("Found driver for device {:x}:{:x}.", device_id, vendor_id);
-                disk::init();
+                disk::init(device);
                 disk::register_hdd_devices();
             }
             RTL_NETWORK_INTERFACE => {
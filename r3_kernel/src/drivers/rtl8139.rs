@@ -4,6 +4,7 @@ use crate::cpu::io::Port;
 use crate::drivers::pci;
 use crate::mm::phy;
 use crate::system::net::iface;
+use crate::system::trace::{self, TraceEvent};
 
 /// increase the size factor by 1 to double the receive buffer size
 /// the base size is 8k
@@ -35,16 +36,30 @@ const RTL_TX_DMA2: usize = 1 << 10;
 
 // RTL basic device flags
 const RTL_RECV_OK: usize = 0x01;
+
+// RTL transmit status flags, one status register per tx descriptor
 const RTL_TX_OK: usize = 1 << 15;
-const RTL_DMA_COMPLETE: usize = 1 << 13;
+const RTL_TX_UNDERRUN: usize = 1 << 14;
+const RTL_TX_ABORTED: usize = 1 << 30;
 
 const RTL_WRAP_BUFFER: usize = 1 << 7;
 const RTL_INTERFRAME_TIME_GAP: usize = 1 << 24;
 const RTL_RX_BUFFER_PAD: usize = 16;
 const RTL_TX_BUFFER_SIZE: usize = 4096;
 
-const RTL_RX_BUFFER_SIZE: usize = ((8 * 1024) << RTL_RX_SIZE_FACTOR) + RTL_RX_BUFFER_PAD;
+const RTL_RX_RING_SIZE: usize = (8 * 1024) << RTL_RX_SIZE_FACTOR;
+const RTL_RX_BUFFER_SIZE: usize = RTL_RX_RING_SIZE + RTL_RX_BUFFER_PAD;
 const RTL_PHY_MTU_SIZE: usize = 1500;
+
+/// with `RTL_WRAP_BUFFER` the device writes a frame that crosses the end of
+/// the ring on past it, so the buffer has room for one more full frame.
+const RTL_RX_WRAP_SLACK: usize = 2048;
+
+/// largest frame length in a receive header, with the ethernet header,
+/// a vlan tag and the CRC.
+const RTL_RX_MAX_LENGTH: usize = RTL_PHY_MTU_SIZE + 22;
+const RTL_RX_CRC_SIZE: usize = 4;
+const RTL_RX_HEADER_SIZE: usize = 4;
 const RTL_N_TX_BUFFERS: usize = 4;
 const RTL_RC_EMPTY_BUFFER: usize = 1 << 0;
 
@@ -52,8 +67,8 @@ const RTL_RC_EMPTY_BUFFER: usize = 1 << 0;
 const RTL_LENGTH_BITS: usize = 0x1FFF;
 
 // RTL interrupts flags
-const RTL_INTERRUPT_RECVOK: usize = 0x01;
 const RTL_INTERRUPT_TXOK: usize = 0x04;
+const RTL_INTERRUPT_TXERR: usize = 0x08;
 
 #[repr(u8)]
 pub enum RTLDeviceCommand {
@@ -63,11 +78,16 @@ pub enum RTLDeviceCommand {
     EnableRx = 1 << 3,
 }
 
+/// The device sends the four tx descriptors in order, so they are used as a
+/// ring: frames are queued at `next`, the oldest frame still owned by the
+/// device is at `dirty`.
 struct DeviceTx {
     cmds: [Port; 4],
     addr: [Port; 4],
     config: Port,
-    tx_id: usize,
+    next: usize,
+    dirty: usize,
+    in_flight: usize,
 }
 
 impl DeviceTx {
@@ -87,9 +107,16 @@ impl DeviceTx {
                 Port::new(io_base + 0x2C, false),
             ],
             config: Port::new(io_base + 0x040, false),
-            tx_id: RTL_N_TX_BUFFERS - 1,
+            next: 0,
+            dirty: 0,
+            in_flight: 0,
         }
     }
+
+    #[inline]
+    pub fn is_full(&self) -> bool {
+        self.in_flight == RTL_N_TX_BUFFERS
+    }
 }
 
 struct DeviceConfig {
@@ -133,13 +160,17 @@ impl DeviceRx {
 struct DeviceBuffers {
     tx_dma: [phy::DMABuffer; RTL_N_TX_BUFFERS],
     rx_dma: phy::DMABuffer,
+    /// where the next frame starts, it counts up to 64KiB like the CAPR
+    /// and is taken modulo the ring size to index the buffer.
     read_offset: usize,
+    /// length of the frame at `read_offset` handed out and not yet released.
+    rx_frame_length: usize,
 }
 
 impl DeviceBuffers {
     #[inline]
     pub fn new() -> Self {
-        let rx_dma = phy::DMAMemoryManager::alloc(RTL_RX_BUFFER_SIZE + RTL_PHY_MTU_SIZE)
+        let rx_dma = phy::DMAMemoryManager::alloc(RTL_RX_BUFFER_SIZE + RTL_RX_WRAP_SLACK)
             .expect("Failed to allocate DMA buffer");
 
         let tx_dma: [phy::DMABuffer; RTL_N_TX_BUFFERS] = [(); RTL_N_TX_BUFFERS].map(|_| {
@@ -150,6 +181,7 @@ impl DeviceBuffers {
             rx_dma,
             tx_dma,
             read_offset: 0,
+            rx_frame_length: 0,
         }
     }
 }
@@ -254,6 +286,29 @@ impl Realtek8139Device {
         self.config.isr.write_u16(0x05);
     }
 
+    /// gives the descriptors the device is done with back to the ring,
+    /// returns the number of descriptors freed.
+    fn reap_tx_descriptors(&mut self) -> usize {
+        let mut n_reaped = 0;
+        while self.tx_line.in_flight > 0 {
+            let status = self.tx_line.cmds[self.tx_line.dirty].read_u32() as usize;
+            if status & (RTL_TX_OK | RTL_TX_UNDERRUN | RTL_TX_ABORTED) == 0 {
+                // still being sent, the ones after it are too.
+                break;
+            }
+
+            if status & RTL_TX_OK != RTL_TX_OK {
+                log::debug!("RTL tx failed, status: {:032b}", status);
+            }
+
+            self.tx_line.dirty = (self.tx_line.dirty + 1) % RTL_N_TX_BUFFERS;
+            self.tx_line.in_flight -= 1;
+            n_reaped += 1;
+        }
+
+        n_reaped
+    }
+
     #[inline]
     fn finalize_config(&self) {
         // setup operation modes of buffers
@@ -278,39 +333,64 @@ impl Realtek8139Device {
         !(cmd_data & RTL_RC_EMPTY_BUFFER == RTL_RC_EMPTY_BUFFER)
     }
 
-    #[inline]
-    pub fn receive_packet(&mut self) -> Result<&'static [u8], iface::PhyNetdevError> {
-        // is this an empty packet?
-        let cmd_data = self.config.cmd.read_u32() as usize;
-        if cmd_data & RTL_RC_EMPTY_BUFFER == RTL_RC_EMPTY_BUFFER {
+    /// drops everything in the ring and starts over where the device writes next,
+    /// used when a receive header makes no sense.
+    fn resync_rx_ring(&mut self) {
+        let cbr_data = self.config.cbr.read_u16() as usize;
+        self.buffers.read_offset = cbr_data;
+        self.buffers.rx_frame_length = 0;
+        self.config
+            .capr
+            .write_u16(cbr_data.wrapping_sub(RTL_RX_BUFFER_PAD) as u16);
+    }
+
+    /// returns the frame at the head of the receive ring without copying it,
+    /// the frame stays in the ring until `advance_rx_ring` is called.
+    pub fn peek_rx_frame(&mut self) -> Result<&'static mut [u8], iface::PhyNetdevError> {
+        if !self.has_packet() {
             return Err(iface::PhyNetdevError::EmptyInterruptRecvBuffer);
         }
 
-        let capr_data = self.config.capr.read_u16() as usize;
-        let cbr_data = self.config.cbr.read_u32() as usize;
-        let bounded_offset = (capr_data + RTL_RX_BUFFER_PAD) % (1 << 16);
         // parse the buffer:
         // structure: | header - (2 bytes, u16) | length - (2 bytes, u16) | data - (length - 4 bytes [u8]) | crc - (4 bytes, u32)
+        let ring_offset = self.buffers.read_offset % RTL_RX_RING_SIZE;
+        let ring: &'static mut [u8] = self.buffers.rx_dma.get_mut_slice::<u8>();
+
+        let header = u16::from_le_bytes([ring[ring_offset], ring[ring_offset + 1]]) as usize;
+        let length = u16::from_le_bytes([ring[ring_offset + 2], ring[ring_offset + 3]]) as usize;
 
-        let buffer_slice: &[u8] = &(self.buffers.rx_dma.get_slice::<u8>())[bounded_offset..];
-        let header = u16::from_le_bytes([buffer_slice[0], buffer_slice[1]]) as usize;
         // header must have ROK flag set
-        if header as usize & RTL_RECV_OK != RTL_RECV_OK {
-            self.config.capr.write_u16(cbr_data as u16);
+        if header & RTL_RECV_OK != RTL_RECV_OK
+            || length <= RTL_RX_CRC_SIZE
+            || length > RTL_RX_MAX_LENGTH
+        {
+            self.resync_rx_ring();
             return Err(iface::PhyNetdevError::InvalidRecvHeader);
         }
 
-        let buffer_length = u16::from_le_bytes([buffer_slice[2], buffer_slice[3]]) as usize;
+        // a frame crossing the end of the ring continues in the slack after it.
+        self.buffers.rx_frame_length = length;
+        let data_start = ring_offset + RTL_RX_HEADER_SIZE;
+        Ok(&mut ring[data_start..data_start + length - RTL_RX_CRC_SIZE])
+    }
+
+    /// gives the frame returned by `peek_rx_frame` back to the device.
+    pub fn advance_rx_ring(&mut self) -> Result<(), iface::PhyNetdevError> {
+        if self.buffers.rx_frame_length == 0 {
+            return Err(iface::PhyNetdevError::EmptyInterruptRecvBuffer);
+        }
 
-        self.buffers.read_offset = (bounded_offset + buffer_length + 3 + 4) & !3;
+        trace::record(TraceEvent::NetRx, 0, self.buffers.rx_frame_length as u32);
+        let next_offset =
+            (self.buffers.read_offset + self.buffers.rx_frame_length + RTL_RX_HEADER_SIZE + 3) & !3;
+        self.buffers.read_offset = next_offset % (1 << 16);
+        self.buffers.rx_frame_length = 0;
 
         // write back the updated offset back to the capr
         self.config
             .capr
-            .write_u16((self.buffers.read_offset - RTL_RX_BUFFER_PAD) as u16);
-
-        self.ack_probable_isr();
-        Ok(&buffer_slice[4..buffer_length])
+            .write_u16(self.buffers.read_offset.wrapping_sub(RTL_RX_BUFFER_PAD) as u16);
+        Ok(())
     }
 
     pub fn prepare_interface(&mut self) {
@@ -339,45 +419,39 @@ impl Realtek8139Device {
 
 impl iface::PhysicalNetworkDevice for Realtek8139Device {
     fn get_current_tx_buffer(&mut self) -> Result<&'static mut [u8], iface::PhyNetdevError> {
-        let tx_id = (self.tx_line.tx_id + 1) % RTL_N_TX_BUFFERS;
-        if tx_id >= RTL_N_TX_BUFFERS {
+        if self.tx_line.is_full() {
+            self.reap_tx_descriptors();
+        }
+
+        if self.tx_line.is_full() {
             return Err(iface::PhyNetdevError::NoTxBuffer);
         }
 
-        Ok(self.buffers.tx_dma[tx_id].get_mut_slice::<u8>())
+        Ok(self.buffers.tx_dma[self.tx_line.next].get_mut_slice::<u8>())
     }
 
-    fn transmit_and_wait(
-        &mut self,
-        _buffer: &mut [u8],
-        length: usize,
-    ) -> Result<(), iface::PhyNetdevError> {
-
-        self.tx_line.tx_id = (self.tx_line.tx_id + 1) % RTL_N_TX_BUFFERS;
-        
-        self.ack_probable_isr();
-
-        let current_imr = self.config.imr.read_u16();
-
-        // disable interrupts: (This is not required later)
-        self.config.imr.write_u16(0x0000);
+    fn transmit(&mut self, _buffer: &mut [u8], length: usize) -> Result<(), iface::PhyNetdevError> {
+        if self.tx_line.is_full() {
+            return Err(iface::PhyNetdevError::NoTxBuffer);
+        }
 
-        // get current command port
-        let tx_cmd_port = self.tx_line.cmds[self.tx_line.tx_id];
-        // write the length:
+        // writing the length hands the descriptor to the device, it's
+        // completion is reaped later from the TXOK interrupt.
+        let tx_cmd_port = self.tx_line.cmds[self.tx_line.next];
         tx_cmd_port.write_u32((RTL_LENGTH_BITS & length) as u32);
 
-        // wait for packet to be moved from DMA to FIFO queue
-        while (tx_cmd_port.read_u32() as usize & RTL_DMA_COMPLETE) != RTL_DMA_COMPLETE {}
-        // wait for Tx to complete
-        while (tx_cmd_port.read_u32() as usize & RTL_TX_OK) != RTL_TX_OK {}
+        self.tx_line.next = (self.tx_line.next + 1) % RTL_N_TX_BUFFERS;
+        self.tx_line.in_flight += 1;
+        trace::record(TraceEvent::NetTx, 0, length as u32);
+        Ok(())
+    }
 
-        // Tx is not complete
-        // write back the current imr
-        self.config.imr.write_u16(current_imr);
+    fn can_transmit(&mut self) -> Result<bool, iface::PhyNetdevError> {
+        if self.tx_line.is_full() {
+            self.reap_tx_descriptors();
+        }
 
-        self.ack_probable_isr();
-        Ok(())
+        Ok(!self.tx_line.is_full())
     }
 
     fn get_interrupt_no(&self) -> Result<usize, iface::PhyNetdevError> {
@@ -390,28 +464,16 @@ impl iface::PhysicalNetworkDevice for Realtek8139Device {
     }
 
     fn handle_interrupt(&mut self) -> Result<(), iface::PhyNetdevError> {
-        let interrupt_code = self.config.isr.read_u32() as usize;
-        log::debug!("network interrupt: {:032b}", interrupt_code);
-
-        // Transmit OK signal, we have already handled it
-        if interrupt_code & RTL_INTERRUPT_TXOK == RTL_INTERRUPT_TXOK {
-            self.ack_probable_isr();
-            return Ok(());
-        }
-        // Receive OK signal, receive the packet and process it
-        if interrupt_code & RTL_INTERRUPT_RECVOK == RTL_INTERRUPT_RECVOK {
-            let recv_result = self.receive_packet();
-            self.ack_probable_isr();
-            if recv_result.is_err() {
-                return Err(recv_result.unwrap_err());
-            }
-
-            // call the on_packet_handler:
-            iface::handle_recv_packet(recv_result.unwrap());
-            return Ok(());
+        let interrupt_code = self.config.isr.read_u16() as usize;
+        // ack everything seen, received frames are taken from the ring
+        // by the interface, as many as there are.
+        self.config.isr.write_u16(interrupt_code as u16);
+
+        // Transmit OK or error signal, free the descriptors that were sent
+        if interrupt_code & (RTL_INTERRUPT_TXOK | RTL_INTERRUPT_TXERR) != 0 {
+            self.reap_tx_descriptors();
         }
 
-        self.ack_probable_isr();
         Ok(())
     }
 
@@ -437,20 +499,31 @@ impl iface::PhysicalNetworkDevice for Realtek8139Device {
         Ok(self.is_polling)
     }
 
-    fn poll_for_frame(&mut self, max_polls: usize) -> Result<&'static [u8], iface::PhyNetdevError> {
+    fn poll_for_frame(
+        &mut self,
+        max_polls: usize,
+    ) -> Result<&'static mut [u8], iface::PhyNetdevError> {
         // loop until there is no packet
         for _ in 0..max_polls {
             if !self.has_packet() {
                 continue;
             }
 
-            if let Ok(data_slice) = self.receive_packet() {
+            if let Ok(data_slice) = self.peek_rx_frame() {
                 return Ok(data_slice);
             }
         }
 
         Err(iface::PhyNetdevError::PollingModeError)
     }
+
+    fn next_rx_frame(&mut self) -> Result<&'static mut [u8], iface::PhyNetdevError> {
+        self.peek_rx_frame()
+    }
+
+    fn release_rx_frame(&mut self) -> Result<(), iface::PhyNetdevError> {
+        self.advance_rx_ring()
+    }
 }
 
 unsafe impl Sync for RTLDeviceCommand {}
@@ -9,8 +9,9 @@ use crate::drivers::display::framebuffer::{Framebuffer, Pixel};
 use crate::drivers::keyboard::PC_KEYBOARD;
 
 use crate::system::filesystem::devfs::{DevFSDescriptor, DevOps};
-use crate::system::filesystem::{FSError, SeekType};
-use crate::system::tasking::wait_until_return;
+use crate::system::filesystem::{FSError, PollEvents, SeekType};
+use crate::system::tasking::wait_queue::WaitEvent;
+use crate::system::tasking::{notify_event, wait_for_event};
 
 use alloc::{format, string::String, vec::Vec};
 use lazy_static::lazy_static;
@@ -97,6 +98,7 @@ impl BlockingSystemTerminal {
                 channel: 0,
             },
         );
+        Framebuffer::flush(&mut fb);
 
         self.lines.row_line = 0;
         self.lines.col_line = 0;
@@ -169,6 +171,7 @@ impl BlockingSystemTerminal {
                     }
 
                     FramebufferText::print_string(&mut fb, &format!("_"), self.color, &self.lines);
+                    Framebuffer::flush(&mut fb);
                 }
             }
         } else {
@@ -189,6 +192,7 @@ impl BlockingSystemTerminal {
                 self.lines = new_lines;
 
                 FramebufferText::print_string(&mut fb, &format!("_"), self.color, &self.lines);
+                Framebuffer::flush(&mut fb);
             }
         }
     }
@@ -197,10 +201,10 @@ impl BlockingSystemTerminal {
     pub fn write(&mut self, buffer: &[u8]) {
         let string = String::from_utf8_lossy(buffer);
 
-        // write this string:
-        let mut fb_lock = Framebuffer::get_buffer_lock().as_ref().unwrap().lock();
+        // write this string, only the rows that changed go to the framebuffer.
+        let locked_buffer = Framebuffer::get_buffer_lock().as_ref().unwrap();
         let new_lines =
-            FramebufferText::print_string(&mut fb_lock, &string, self.color, &self.lines);
+            FramebufferText::print_lines(locked_buffer, &string, self.color, &self.lines);
         self.lines = new_lines;
     }
 
@@ -275,7 +279,7 @@ pub fn polling_read_till(till: char, buffer: &mut [u8]) -> usize {
 
 pub fn blocked_read_till(till: char, buffer: &mut [u8]) -> Result<usize, FSError> {
     cpu::enable_interrupts();
-    let ret_val = wait_until_return(|| {
+    let ret_val = wait_for_event(WaitEvent::KeyboardInput, || {
         let mut stdin = STDIN_QUEUE.lock();
         let read_size = if !stdin.keybuf.is_empty() && stdin.has_end(till) {
             stdin.keybuf.truncate(buffer.len() - 1);
@@ -299,6 +303,8 @@ pub fn blocked_read_till(till: char, buffer: &mut [u8]) -> Result<usize, FSError
 
 pub fn on_kbd_data(c: char) {
     SYSTEM_TTY.lock().process_key(c);
+    notify_event(WaitEvent::KeyboardInput);
+    notify_event(WaitEvent::Readiness);
 }
 
 pub fn register_consumer() {
@@ -318,11 +324,11 @@ impl DevOps for TTYDriver {
         // timer::pause_events();
         let mut tty_lock = SYSTEM_TTY.lock();
         // update the fd to current row, col
-        fd.offset = tty_lock.to_offset() as u32;
+        fd.offset = tty_lock.to_offset() as u64;
         // write to the framebuffer:
         tty_lock.write(&buffer);
         // update the file-descriptor
-        fd.offset = tty_lock.to_offset() as u32;
+        fd.offset = tty_lock.to_offset() as u64;
         // timer::resume_events();
         Ok(buffer.len())
     }
@@ -346,8 +352,8 @@ impl DevOps for TTYDriver {
         match st {
             SeekType::SEEK_END => {
                 let end = SYSTEM_TTY.lock().end();
-                fd.offset = end as u32;
-                return Ok(fd.offset);
+                fd.offset = end as u64;
+                return Ok(fd.offset as u32);
             }
             SeekType::SEEK_SET => {
                 let set_res = SYSTEM_TTY.lock().to_lines(offset as usize);
@@ -355,25 +361,36 @@ impl DevOps for TTYDriver {
                     return Err(set_res.unwrap_err());
                 }
                 // set the new offset
-                fd.offset = offset;
+                fd.offset = offset as u64;
             }
             SeekType::SEEK_CUR => {
-                let set_res = SYSTEM_TTY.lock().to_lines((fd.offset + offset) as usize);
+                let set_res = SYSTEM_TTY
+                    .lock()
+                    .to_lines((fd.offset + offset as u64) as usize);
                 if set_res.is_err() {
                     return Err(set_res.unwrap_err());
                 }
 
                 // set the new offset
-                fd.offset = offset + fd.offset;
+                fd.offset = offset as u64 + fd.offset;
             }
         }
 
-        Ok(fd.offset)
+        Ok(fd.offset as u32)
     }
 
     fn ioctl(&self, _command: usize, _arg: usize) -> Result<usize, FSError> {
         Ok(0)
     }
+
+    /// readable once a full line is queued, that is what a read returns.
+    fn poll_events(&self) -> PollEvents {
+        if STDIN_QUEUE.lock().has_end('\n') {
+            return PollEvents::POLLIN | PollEvents::POLLOUT;
+        }
+
+        PollEvents::POLLOUT
+    }
 }
 
 // TODO: Find a best wat to mitigate this
@@ -1,97 +1,86 @@
 // provides macros for basic logging with log levels
 extern crate log;
 
-use core::fmt::Write;
+use core::fmt;
 use core::panic::PanicInfo;
 
 use log::{Level, LevelFilter, Metadata, Record};
 
-use crate::drivers::{display::fb_text::FRAMEBUFFER_LOGGER, display::framebuffer::Pixel, uart};
-use uart::UART_DRIVER;
+use crate::system::kmsg;
 
 // a logger that implements kernel logging functionalities
 pub struct KernelLogger;
 
-fn get_color(level: Level) -> Pixel {
-    match level {
-        Level::Error => Pixel {
-            b: 0,
-            g: 0,
-            r: 255,
-            channel: 0,
-        },
-        Level::Warn => Pixel {
-            b: 0,
-            g: 255,
-            r: 255,
-            channel: 0,
-        },
-        _ => Pixel {
-            b: 255,
-            g: 255,
-            r: 255,
-            channel: 0,
-        },
+/// levels above this are compiled out by the `max_level_*` features of the
+/// log crate, this only filters what is left at run time.
+const KERNEL_LOG_LEVEL: LevelFilter = LevelFilter::Debug;
+
+impl log::Log for KernelLogger {
+    #[inline]
+    fn enabled(&self, meta: &Metadata) -> bool {
+        meta.level() <= KERNEL_LOG_LEVEL
     }
-}
 
-// a macro that takes care of writing string to UART:
-macro_rules! print_uart {
-    ($fmt:expr, $($arg:tt)*) => (
-        if UART_DRIVER.is_some() {
-            let mutexed_uart = UART_DRIVER.as_ref().unwrap();
-            if let Some(mut uart) = mutexed_uart.try_lock() {
-                uart.write_fmt(
-                    format_args!(concat!($fmt, "\n"), $($arg)*)
-                ).unwrap();
-            }
+    /// records go to the ring of the processor and are written to the UART
+    /// and the framebuffer by the drainer thread. Before the heap is set up
+    /// there are no rings, so they are written out here.
+    fn log(&self, record: &Record) {
+        if !self.enabled(record.metadata()) {
+            return;
         }
-    );
-}
 
-macro_rules! print_framebuffer {
-    ($level:expr, $fmt:expr, $($arg:tt)*) => {
-        let mut fb_lgr_lock = FRAMEBUFFER_LOGGER.lock();
-        fb_lgr_lock.set_color(get_color($level));
-        let _ = fb_lgr_lock.write_fmt(
-            format_args!(concat!($fmt, "\n"), $($arg)*)
+        let level = record.level();
+        write_record(
+            level,
+            format_args!("{:20} {:5} {}", record.target(), level, record.args()),
         );
-    };
-}
+    }
 
-impl log::Log for KernelLogger {
+    fn flush(&self) {
+        kmsg::flush();
+    }
+}
 
-    #[inline]
-    fn enabled(&self, _meta: &Metadata) -> bool {
-        // TOOD: Add level based filtering
-        true
+fn write_record(level: Level, args: fmt::Arguments) {
+    if kmsg::record(level, args) {
+        return;
     }
 
-    fn log(&self, record: &Record) {
-        let level = record.level();
+    let mut line = FixedLine::new();
+    let _ = fmt::write(&mut line, args);
+    kmsg::write_outputs(level, line.as_str(), false);
+}
 
-        if level <= LevelFilter::Trace {
-            print_uart!(
-                "{:20} {:5} {}",
-                record.target(),
-                record.level(),
-                record.args()
-            );
-        }
+/// a line formatted on the stack, used while there is no heap.
+struct FixedLine {
+    buffer: [u8; 256],
+    length: usize,
+}
 
-        if level <= LevelFilter::Info {
-            print_framebuffer!(
-                level,
-                "{:20} {:5} {}",
-                record.target(),
-                record.level(),
-                record.args()
-            );
+impl FixedLine {
+    fn new() -> Self {
+        FixedLine {
+            buffer: [0; 256],
+            length: 0,
         }
     }
 
-    fn flush(&self) {
-        // TODO: Will be used in future for dmesg
+    fn as_str(&self) -> &str {
+        unsafe { core::str::from_utf8_unchecked(&self.buffer[0..self.length]) }
+    }
+}
+
+impl fmt::Write for FixedLine {
+    fn write_str(&mut self, string: &str) -> fmt::Result {
+        let mut length = string.len().min(self.buffer.len() - self.length);
+        while !string.is_char_boundary(length) {
+            length -= 1;
+        }
+
+        self.buffer[self.length..self.length + length]
+            .copy_from_slice(&string.as_bytes()[0..length]);
+        self.length += length;
+        Ok(())
     }
 }
 
@@ -100,12 +89,14 @@ static KERNEL_LOGGER: KernelLogger = KernelLogger;
 pub fn init() {
     // unuse the result
     let _ = log::set_logger(&KERNEL_LOGGER);
-    log::set_max_level(LevelFilter::Debug);
+    log::set_max_level(KERNEL_LOG_LEVEL);
 }
 
 #[panic_handler]
 fn panic(info: &PanicInfo) -> ! {
-    // write the panic info and loop infinitely:
+    // write the panic info and loop infinitely, the drainer will not run
+    // again so whatever is left in the rings is written out here.
     log::error!("{}", info);
+    log::logger().flush();
     loop {}
 }
@@ -5,6 +5,7 @@
 #![feature(alloc_error_handler)] // enable allocation errors
 #![feature(naked_functions)] // allow naked calling convention
 #![feature(drain_filter)] // used to remove threads to wake up from sleep queue
+#![feature(global_asm)] // AP startup trampoline
 
 extern crate alloc;
 extern crate bootloader;
@@ -40,6 +41,8 @@ fn init_basic_setup(boot_info: &'static BootInfo) {
     cpu::init_features_detection();
     cpu::run_test_breakpoint_recovery();
     mm::init();
+    system::kmsg::setup_log_rings();
+    drivers::display::init_back_buffer();
 
     // init PCI device list.
     drivers::pci::detect_devices();
@@ -73,6 +76,12 @@ fn start_idle_kthread() {
     // run this thread
     log::info!("Started system idle thread in background.");
 
+    // the network protocol stack runs in it's own kernel thread.
+    system::net::iface::start_network_worker(&process);
+
+    // log records are written out by a kernel thread from now on.
+    system::kmsg::start_log_drainer(&process);
+
     // start the echo client process
     let pid = system::process::new(format!("test"), true, "/sbin/sys_shell");
     let thread_result = system::thread::new_main_thread(&pid, format!("main"));
@@ -105,6 +114,9 @@ fn init_functionalities() {
     // setup multi-tasking
     system::init_tasking();
 
+    // bring up the other processors, they join the scheduler.
+    acpi::smp::start_application_processors();
+
     // start the idle thread that just keeps the scheduler filled.
     start_idle_kthread();
 
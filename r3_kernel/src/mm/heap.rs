@@ -1,73 +1,58 @@
 use crate::mm;
 
 extern crate alloc;
-extern crate linked_list_allocator;
 extern crate log;
 
-// we are using LinkedListAllocator from osdev-rust comminity.
-// Future plan is to use our own allocator.
 use alloc::vec::Vec;
-use linked_list_allocator::LockedHeap;
 
-use crate::mm::paging;
+use crate::mm::slab::{FallbackHeapStats, SizeClassStats, SlabAllocator, SLAB_N_CLASSES};
 
 pub const HEAP_START_ADDRESS: u64 = 0xffffa00000000000;
 
-// 50 MB of heap initially
-pub const HEAP_SIZE: u64 = 50 * (mm::MemorySizes::OneMib as u64);
+// 16 MB of heap initially, the heap grows on demand
+pub const HEAP_INITIAL_SIZE: u64 = 16 * (mm::MemorySizes::OneMib as u64);
+
+// the heap can grow till the start of kernel stacks region
+pub const HEAP_MAX_SIZE: u64 = 0xffffb00000000000 - HEAP_START_ADDRESS;
 
 #[global_allocator]
-static KERNEL_HEAP_ALLOCATOR: LockedHeap = LockedHeap::empty();
+static KERNEL_HEAP_ALLOCATOR: SlabAllocator = SlabAllocator::empty();
 
 #[alloc_error_handler]
 fn alloc_error_handler(layout: alloc::alloc::Layout) -> ! {
     panic!("allocation error: {:?}", layout)
 }
 
-fn map_virtual_memory() {
-    let n_4k_frames: usize = (HEAP_SIZE / paging::PageSize::Page4KiB.size()) as usize;
-    log::debug!("n_heap_pages={}.", n_4k_frames);
-
-    let heap_pages = paging::PageRange::new(
-        mm::VirtualAddress::from_u64(HEAP_START_ADDRESS),
-        (HEAP_SIZE / paging::PageSize::Page2MiB.size()) as usize,
-        paging::PageSize::Page2MiB,
-    );
-
-    // map the virtual memory for heap:
+pub fn init_heap() {
     log::debug!(
         "Mapping kernel virtual memory for heap at 0x{:x}",
         HEAP_START_ADDRESS
     );
 
-    let alloc_result = paging::KernelVirtualMemoryManager::alloc_huge_page_region(
-        heap_pages,
-        paging::PageEntryFlags::kernel_hugepage_flags(),
-    );
-
-    if alloc_result.is_err() {
-        panic!(
-            "Failed to allocate kernel heap, err={:?}",
-            alloc_result.unwrap_err()
-        );
+    if !KERNEL_HEAP_ALLOCATOR.init(HEAP_START_ADDRESS, HEAP_INITIAL_SIZE, HEAP_MAX_SIZE) {
+        panic!("Failed to allocate kernel heap.");
     }
 
-    log::info!("Allocated {}bytes at 0x{:x}", HEAP_SIZE, HEAP_START_ADDRESS);
-}
-
-pub fn init_heap() {
-    map_virtual_memory();
-
-    unsafe {
-        KERNEL_HEAP_ALLOCATOR
-            .lock()
-            .init(HEAP_START_ADDRESS as usize, HEAP_SIZE as usize);
-    }
+    log::info!(
+        "Allocated {}bytes at 0x{:x}",
+        HEAP_INITIAL_SIZE,
+        HEAP_START_ADDRESS
+    );
 
     test_heap_alloc();
     log::info!("Setting up Kernel heap as Rust Global allocator is successful.");
 }
 
+/// per size class stats of the kernel heap
+pub fn heap_class_stats() -> [SizeClassStats; SLAB_N_CLASSES] {
+    KERNEL_HEAP_ALLOCATOR.class_stats()
+}
+
+/// stats of the large object heap
+pub fn heap_fallback_stats() -> FallbackHeapStats {
+    KERNEL_HEAP_ALLOCATOR.fallback_stats()
+}
+
 fn test_heap_alloc() {
     log::debug!("Testing heap by allocating a vector: ");
     let mut test_vec: Vec<u64> = Vec::new();
@@ -6,6 +6,7 @@ pub mod heap;
 pub mod io;
 pub mod paging;
 pub mod phy;
+pub mod slab;
 pub mod stack;
 
 // some types related to memory management
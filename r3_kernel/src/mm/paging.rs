@@ -1,16 +1,22 @@
+extern crate alloc;
 extern crate bit_field;
 extern crate bitflags;
 extern crate log;
+extern crate spin;
 
 use crate::cpu::mmu;
+use crate::cpu::percpu::PerCPU;
 
 use crate::boot_proto::BootProtocol;
 use crate::mm;
 use crate::mm::phy::{Frame, PhysicalMemoryManager};
 use lazy_static::lazy_static;
 
+use alloc::vec::Vec;
 use bit_field::BitField;
 use bitflags::bitflags;
+use core::ptr;
+use spin::Mutex;
 
 const MAX_ENTRIES_PER_LEVEL: u16 = 512;
 const ENTRY_ADDR_BIT_MASK: u64 = 0x000ffffffffff000;
@@ -145,6 +151,15 @@ bitflags! {
         const DIRTY = 1 << 6;
         const HUGE_PAGE = 1 << 7;
         const GLOBAL = 1 << 8;
+        /// software bit, the page is write protected because it's frame is
+        /// shared, a write fault on it makes a private copy.
+        const COPY_ON_WRITE = 1 << 9;
+        /// software bit, the page belongs to a shared mapping, a forked
+        /// child maps the same frame instead of a copy-on-write one.
+        const SHARED = 1 << 10;
+        /// software bit, the frame belongs to the kernel for good and is not
+        /// reference counted, unmapping it or forking never frees or shares it.
+        const PERMANENT = 1 << 11;
         const RW_ONLY = 1 << 63;
     }
 }
@@ -241,6 +256,11 @@ impl PageEntry {
         self.0 = self.addr().as_u64() | flags.bits()
     }
 
+    #[inline]
+    pub fn flags(&self) -> PageEntryFlags {
+        PageEntryFlags::from_bits_truncate(self.0)
+    }
+
     #[inline]
     pub fn has_flag(&self, flag: PageEntryFlags) -> bool {
         PageEntryFlags::from_bits_truncate(self.0).contains(flag)
@@ -565,6 +585,17 @@ impl VirtualMemoryManager {
     }
 
     fn unmap_single(&self, page: Page) -> Result<(), PagingError> {
+        let result = self.unmap_single_frame(page);
+        if result.is_err() {
+            return Err(result.unwrap_err());
+        }
+
+        Ok(())
+    }
+
+    /// unmaps the page and returns the frame it was mapped to along
+    /// with the huge page flag.
+    fn unmap_single_frame(&self, page: Page) -> Result<(Frame, bool), PagingError> {
         let resolved_opt = self.walk_hierarchy(&page.addr(), false, false, false);
         if resolved_opt.is_none() {
             return Err(PagingError::PageNotMapped(page.as_u64()));
@@ -578,8 +609,9 @@ impl VirtualMemoryManager {
         }
 
         if l2_entry.has_flag(PageEntryFlags::HUGE_PAGE) {
+            let frame = Frame::from_address(l2_entry.addr());
             l2_entry.unmap_entry();
-            return Ok(());
+            return Ok((frame, true));
         }
 
         // reset the region to zero:
@@ -596,8 +628,9 @@ impl VirtualMemoryManager {
         }
 
         // unmap the page
+        let frame = Frame::from_address(l1_entry.addr());
         l1_table.entries[l1_index.as_usize()].unmap_entry();
-        return Ok(());
+        return Ok((frame, false));
     }
 
     pub fn unmap_page(&self, page: Page) -> Result<(), PagingError> {
@@ -606,9 +639,363 @@ impl VirtualMemoryManager {
             return result;
         }
 
-        mmu::reload_flush();
+        mmu::shootdown_tlb();
         return result;
     }
+
+    /// returns the frame of a page unmapped with `unmap_page_deferred` to the
+    /// physical allocator, unless it is still mapped copy-on-write by another
+    /// address space. No processor may have the page in it's TLB anymore.
+    #[inline]
+    pub fn free_unmapped_frame(frame: Frame, is_huge: bool) {
+        if PhysicalMemoryManager::unshare(frame) {
+            return;
+        }
+
+        if is_huge {
+            PhysicalMemoryManager::free_huge_page(frame);
+        } else {
+            PhysicalMemoryManager::free(frame);
+        }
+    }
+
+    /// unmaps the page without flushing any TLB or freeing the frame, so that
+    /// a range can be unmapped with a single shootdown. Returns the frame and
+    /// if it is a huge page.
+    #[inline]
+    pub fn unmap_page_deferred(&self, page: Page) -> Result<(Frame, bool), PagingError> {
+        self.unmap_single_frame(page)
+    }
+
+    /// unmaps the page and frees the frame backing it, frames shared
+    /// copy-on-write are freed only when their last mapping goes away.
+    pub fn unmap_and_free_page(&self, page: Page) -> Result<(), PagingError> {
+        let result = self.unmap_single_frame(page);
+        if result.is_err() {
+            return Err(result.unwrap_err());
+        }
+
+        // the frame can still be reached through the TLBs until this.
+        mmu::shootdown_tlb();
+        let (frame, is_huge) = result.unwrap();
+        Self::free_unmapped_frame(frame, is_huge);
+        Ok(())
+    }
+
+    #[inline]
+    fn table_at(&self, entry: &PageEntry) -> &'static mut PageTable {
+        unsafe { &mut *self.get_level_address(entry.addr().as_u64()).get_mut_ptr() }
+    }
+
+    /// frees the frames still mapped in the user half, the tables of the user
+    /// half and the L4 table itself. The kernel half is shared, it is left
+    /// alone. No processor may have the tables loaded anymore.
+    pub fn free_user_half(&self) {
+        let l4_table: &mut PageTable = unsafe { &mut *self.l4_virtual_address.get_mut_ptr() };
+        for l4_entry in l4_table.entries[..256].iter() {
+            if !l4_entry.is_mapped() {
+                continue;
+            }
+
+            let l3_table = self.table_at(l4_entry);
+            for l3_entry in l3_table.entries.iter() {
+                if !l3_entry.is_mapped() {
+                    continue;
+                }
+
+                let l2_table = self.table_at(l3_entry);
+                for l2_entry in l2_table.entries.iter() {
+                    if !l2_entry.is_mapped() {
+                        continue;
+                    }
+
+                    if l2_entry.has_flag(PageEntryFlags::HUGE_PAGE) {
+                        Self::free_unmapped_frame(Frame::from_address(l2_entry.addr()), true);
+                        continue;
+                    }
+
+                    let l1_table = self.table_at(l2_entry);
+                    for l1_entry in l1_table.entries.iter() {
+                        if l1_entry.is_mapped() && !l1_entry.has_flag(PageEntryFlags::PERMANENT) {
+                            Self::free_unmapped_frame(Frame::from_address(l1_entry.addr()), false);
+                        }
+                    }
+
+                    PhysicalMemoryManager::free(Frame::from_address(l2_entry.addr()));
+                }
+
+                PhysicalMemoryManager::free(Frame::from_address(l3_entry.addr()));
+            }
+
+            PhysicalMemoryManager::free(Frame::from_address(l4_entry.addr()));
+        }
+
+        PhysicalMemoryManager::free(Frame::from_address(self.l4_phy_addr));
+    }
+
+    /// writes a leaf entry at `addr`, creating the tables on the way.
+    /// The TLB is not flushed, the caller must do it.
+    fn install_entry(
+        &self,
+        addr: &mm::VirtualAddress,
+        entry: PageEntry,
+        huge_page: bool,
+    ) -> Result<(), PagingError> {
+        let resolved_opt = self.walk_hierarchy(addr, true, false, huge_page);
+        if resolved_opt.is_none() {
+            return Err(PagingError::MappingError(addr.as_u64()));
+        }
+
+        let upper_entry = resolved_opt.unwrap();
+        let (table, index) = if huge_page {
+            (
+                self.get_or_create_table(upper_entry, true),
+                addr.get_level_index(mm::PageTableLevel::Level2),
+            )
+        } else {
+            if upper_entry.has_flag(PageEntryFlags::HUGE_PAGE) {
+                return Err(PagingError::IsAlreadyMapped(addr.as_u64()));
+            }
+            (
+                self.get_or_create_table(upper_entry, true),
+                addr.get_level_index(mm::PageTableLevel::Level1),
+            )
+        };
+
+        if table.is_none() {
+            return Err(PagingError::MappingError(addr.as_u64()));
+        }
+
+        let leaf: &mut PageEntry = &mut table.unwrap().entries[index.as_usize()];
+        if leaf.is_mapped() {
+            return Err(PagingError::IsAlreadyMapped(addr.as_u64()));
+        }
+
+        *leaf = entry;
+        Ok(())
+    }
+
+    /// shares a leaf entry of this table with `child`. Writable pages are
+    /// write protected on both sides unless they belong to a shared mapping,
+    /// if the frame cannot be shared the child gets a private copy instead.
+    fn share_entry(
+        &self,
+        child: &VirtualMemoryManager,
+        addr: &mm::VirtualAddress,
+        entry: &mut PageEntry,
+        huge_page: bool,
+    ) -> Result<(), PagingError> {
+        // read-only kernel frames are mapped as they are.
+        if entry.has_flag(PageEntryFlags::PERMANENT) {
+            return child.install_entry(addr, entry.clone(), huge_page);
+        }
+
+        let frame = Frame::from_address(entry.addr());
+
+        if !PhysicalMemoryManager::share(frame) {
+            let (frame_opt, size) = if huge_page {
+                (
+                    PhysicalMemoryManager::alloc_huge_page(),
+                    PageSize::Page2MiB.size(),
+                )
+            } else {
+                (PhysicalMemoryManager::alloc(), PageSize::Page4KiB.size())
+            };
+
+            if frame_opt.is_none() {
+                return Err(PagingError::OOM);
+            }
+
+            let private_frame = frame_opt.unwrap();
+            unsafe {
+                ptr::copy_nonoverlapping(
+                    (frame.as_u64() + self.phy_offset) as *const u8,
+                    (private_frame.as_u64() + self.phy_offset) as *mut u8,
+                    size as usize,
+                );
+            }
+
+            let mut private_entry = PageEntry::empty();
+            private_entry.set_phy_frame(private_frame, entry.flags());
+            return child.install_entry(addr, private_entry, huge_page);
+        }
+
+        if entry.has_flag(PageEntryFlags::READ_WRITE) && !entry.has_flag(PageEntryFlags::SHARED) {
+            let mut flags = entry.flags();
+            flags.remove(PageEntryFlags::READ_WRITE);
+            flags.insert(PageEntryFlags::COPY_ON_WRITE);
+            entry.set_flags(flags);
+        }
+
+        child.install_entry(addr, entry.clone(), huge_page)
+    }
+
+    /// maps all the pages present in [start, end) into `child` copy-on-write,
+    /// unmapped parts of the range are skipped table by table.
+    pub fn clone_cow_range(
+        &self,
+        child: &VirtualMemoryManager,
+        start: mm::VirtualAddress,
+        end: mm::VirtualAddress,
+    ) -> Result<(), PagingError> {
+        let l4_table: &mut PageTable = unsafe { &mut *self.l4_virtual_address.get_mut_ptr() };
+
+        let l3_span = PageSize::Page1GiB.size() * MAX_ENTRIES_PER_LEVEL as u64;
+        let next_boundary = |addr: u64, span: u64| mm::Alignment::align_down(addr, span) + span;
+
+        let mut current = start.as_u64();
+        while current < end.as_u64() {
+            let addr = mm::VirtualAddress::from_u64(current);
+
+            let l4_entry =
+                &l4_table.entries[addr.get_level_index(mm::PageTableLevel::Level4).as_usize()];
+            if !l4_entry.is_mapped() {
+                current = next_boundary(current, l3_span);
+                continue;
+            }
+
+            let l3_table = self.table_at(l4_entry);
+            let l3_entry =
+                &l3_table.entries[addr.get_level_index(mm::PageTableLevel::Level3).as_usize()];
+            if !l3_entry.is_mapped() {
+                current = next_boundary(current, PageSize::Page1GiB.size());
+                continue;
+            }
+
+            let l2_table = self.table_at(l3_entry);
+            let l2_entry =
+                &mut l2_table.entries[addr.get_level_index(mm::PageTableLevel::Level2).as_usize()];
+            if !l2_entry.is_mapped() {
+                current = next_boundary(current, PageSize::Page2MiB.size());
+                continue;
+            }
+
+            if l2_entry.has_flag(PageEntryFlags::HUGE_PAGE) {
+                let result = self.share_entry(child, &addr, l2_entry, true);
+                if result.is_err() {
+                    return result;
+                }
+
+                current = next_boundary(current, PageSize::Page2MiB.size());
+                continue;
+            }
+
+            let l1_table = self.table_at(l2_entry);
+            let l1_entry =
+                &mut l1_table.entries[addr.get_level_index(mm::PageTableLevel::Level1).as_usize()];
+            if l1_entry.is_mapped() {
+                let result = self.share_entry(child, &addr, l1_entry, false);
+                if result.is_err() {
+                    return result;
+                }
+            }
+
+            current = current + PageSize::Page4KiB.size();
+        }
+
+        // pages of this table could have been write protected, threads of
+        // the address space may be running on other processors.
+        mmu::shootdown_tlb();
+        Ok(())
+    }
+
+    /// resolves a write fault on a copy-on-write page. A private copy of the
+    /// frame is made if it is still shared, otherwise the page is made writable
+    /// in place. Returns false if `addr` is not mapped copy-on-write.
+    pub fn resolve_cow_fault(&self, addr: mm::VirtualAddress) -> bool {
+        let resolved_opt = self.walk_hierarchy(&addr, false, false, false);
+        if resolved_opt.is_none() {
+            return false;
+        }
+
+        let l2_entry = resolved_opt.unwrap();
+        if !l2_entry.is_mapped() {
+            return false;
+        }
+
+        let is_huge = l2_entry.has_flag(PageEntryFlags::HUGE_PAGE);
+        let entry: &mut PageEntry = if is_huge {
+            l2_entry
+        } else {
+            let l1_table = self.table_at(l2_entry);
+            &mut l1_table.entries[addr.get_level_index(mm::PageTableLevel::Level1).as_usize()]
+        };
+
+        if !entry.is_mapped() {
+            return false;
+        }
+
+        // another processor resolved it already, this one had a stale entry.
+        if entry.has_flag(PageEntryFlags::READ_WRITE) {
+            mmu::invalidate_page(addr.as_u64());
+            return true;
+        }
+
+        if !entry.has_flag(PageEntryFlags::COPY_ON_WRITE) {
+            return false;
+        }
+
+        let mut flags = entry.flags();
+        flags.remove(PageEntryFlags::COPY_ON_WRITE);
+        flags.insert(PageEntryFlags::READ_WRITE);
+
+        let shared_frame = Frame::from_address(entry.addr());
+        if PhysicalMemoryManager::is_shared(shared_frame) {
+            let (frame_opt, size) = if is_huge {
+                (
+                    PhysicalMemoryManager::alloc_huge_page(),
+                    PageSize::Page2MiB.size(),
+                )
+            } else {
+                (PhysicalMemoryManager::alloc(), PageSize::Page4KiB.size())
+            };
+
+            if frame_opt.is_none() {
+                log::error!(
+                    "Out of memory while resolving copy-on-write fault at 0x{:x}",
+                    addr.as_u64()
+                );
+                return false;
+            }
+
+            let private_frame = frame_opt.unwrap();
+            unsafe {
+                ptr::copy_nonoverlapping(
+                    (shared_frame.as_u64() + self.phy_offset) as *const u8,
+                    (private_frame.as_u64() + self.phy_offset) as *mut u8,
+                    size as usize,
+                );
+            }
+
+            entry.set_phy_frame(private_frame, flags);
+
+            // other processors must stop reading the shared frame through
+            // this address space before it can be freed.
+            mmu::shootdown_tlb();
+
+            // the other owners could have dropped their references meanwhile,
+            // free the frame if this was the last one.
+            if !PhysicalMemoryManager::unshare(shared_frame) {
+                if is_huge {
+                    PhysicalMemoryManager::free_huge_page(shared_frame);
+                } else {
+                    PhysicalMemoryManager::free(shared_frame);
+                }
+            }
+            return true;
+        }
+
+        // the last owner, the page can be written in place. Other processors
+        // keep the read-only entry until they fault on it, see above.
+        entry.set_flags(flags);
+        if is_huge {
+            mmu::reload_flush();
+        } else {
+            mmu::invalidate_page(addr.as_u64());
+        }
+
+        true
+    }
 }
 
 #[derive(Clone, Debug)]
@@ -672,10 +1059,14 @@ pub fn init_kernel_vmm() -> VirtualMemoryManager {
 
 lazy_static! {
     pub static ref KERNEL_PAGING: VirtualMemoryManager = init_kernel_vmm();
+    /// page tables of exited processes, a processor may still run on them
+    /// until it switches to another thread.
+    static ref RETIRED_TABLES: Mutex<Vec<mm::PhysicalAddress>> = Mutex::new(Vec::new());
 }
 
 pub fn setup_paging() {
     // this function will make static lazy function to initialize
+    mmu::enable_write_protection();
     log::info!(
         "Kernel paging is initialized, address at: 0x{:x}",
         KERNEL_PAGING.l4_virtual_address.as_u64()
@@ -783,23 +1174,24 @@ impl KernelVirtualMemoryManager {
     }
 
     pub fn free_page(address: mm::VirtualAddress) -> Result<(), PagingError> {
-        KERNEL_PAGING.unmap_page(Page::from_address(address))
+        KERNEL_PAGING.unmap_and_free_page(Page::from_address(address))
     }
 
     pub fn free_region(region: PageRange) -> Result<(), PagingError> {
+        // every frame is freed only once no TLB has it.
         for page in PageRangeIterator::new(region) {
-            let result = KERNEL_PAGING.unmap_single(page);
+            let result = KERNEL_PAGING.unmap_and_free_page(page);
             if result.is_err() {
                 return result;
             }
         }
 
-        // flush tlb:
-        mmu::reload_flush();
         Ok(())
     }
 
     pub fn new_vmm() -> (VirtualMemoryManager, mm::PhysicalAddress) {
+        Self::free_retired();
+
         let k_vmm = KernelVirtualMemoryManager::pt();
         // allocate a new virtual address at 4k aligned region for new virtual address:
         let frame_opt = PhysicalMemoryManager::alloc();
@@ -818,6 +1210,11 @@ impl KernelVirtualMemoryManager {
         // copy the pages of kernel p4 table:
         let kernel_table: &mut PageTable = unsafe { &mut *k_vmm.l4_virtual_address.get_mut_ptr() };
 
+        // the frame can be a recycled one, clear the user half:
+        for idx in 0..256 {
+            page_table.entries[idx].unmap_entry();
+        }
+
         for idx in 256..kernel_table.entries.len() {
             page_table.entries[idx] = kernel_table.entries[idx].clone();
             page_table.entries[idx].set_usermode_flag();
@@ -837,20 +1234,41 @@ impl KernelVirtualMemoryManager {
     }
 
     pub fn current_vmm() -> (VirtualMemoryManager, mm::PhysicalAddress) {
-        let k_vmm = Self::pt();
         let phy_addr = mmu::get_page_table_address();
+        (Self::vmm_at(phy_addr), phy_addr)
+    }
+
+    #[inline]
+    fn vmm_at(phy_addr: mm::PhysicalAddress) -> VirtualMemoryManager {
+        let k_vmm = Self::pt();
         let pt_vaddr = mm::VirtualAddress::from_u64(k_vmm.phy_offset + phy_addr.as_u64());
 
-        (
-            VirtualMemoryManager {
-                n_tables: 1,
-                l4_virtual_address: pt_vaddr,
-                l4_phy_addr: phy_addr,
-                phy_offset: k_vmm.phy_offset,
-                offset_base_addr: k_vmm.l4_phy_addr,
-                l4_offset_addr: k_vmm.l4_virtual_address,
-            },
-            phy_addr,
-        )
+        VirtualMemoryManager {
+            n_tables: 1,
+            l4_virtual_address: pt_vaddr,
+            l4_phy_addr: phy_addr,
+            phy_offset: k_vmm.phy_offset,
+            offset_base_addr: k_vmm.l4_phy_addr,
+            l4_offset_addr: k_vmm.l4_virtual_address,
+        }
+    }
+
+    /// the address space at `phy_addr` is not used anymore, it's tables are
+    /// freed once no processor has them loaded.
+    pub fn retire_vmm(phy_addr: mm::PhysicalAddress) {
+        RETIRED_TABLES.lock().push(phy_addr);
+        Self::free_retired();
+    }
+
+    /// frees the retired address spaces that no processor runs on anymore.
+    pub fn free_retired() {
+        RETIRED_TABLES.lock().retain(|phy_addr| {
+            if PerCPU::is_page_table_loaded(*phy_addr) {
+                return true;
+            }
+
+            Self::vmm_at(*phy_addr).free_user_half();
+            false
+        });
     }
 }
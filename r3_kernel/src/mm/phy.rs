@@ -2,14 +2,22 @@ extern crate bootloader;
 extern crate log;
 extern crate spin;
 
+use crate::acpi::lapic;
 use crate::boot_proto::BootProtocol;
+use crate::cpu;
 use crate::mm;
 use crate::mm::paging::{PageSize, PagingError};
 use crate::mm::MemorySizes;
+use crate::system::filesystem::bcache;
+use crate::system::page_cache;
+use crate::system::trace::{self, TraceEvent};
 use bootloader::boot_info::{MemoryRegionKind, MemoryRegions};
 
+use core::cell::UnsafeCell;
+use core::ptr;
+use core::sync::atomic::{AtomicUsize, Ordering};
 use lazy_static::lazy_static;
-use spin::{Mutex, MutexGuard};
+use spin::Mutex;
 
 #[derive(Debug, Clone, Copy)]
 #[repr(C)]
@@ -21,6 +29,9 @@ const MAX_FREE_REGIONS: usize = 64;
 const DMA_REGION_SIZE: usize = 2 * MemorySizes::OneMib as usize;
 const DMA_FRAME_SIZE: usize = MemorySizes::OneKiB as usize * 4;
 
+/// startup IPIs can only point to code below 1MiB.
+const AP_TRAMPOLINE_LIMIT: u64 = MemorySizes::OneMib as u64;
+
 impl Frame {
     pub fn from_aligned_address(addr: mm::PhysicalAddress) -> Result<Self, PagingError> {
         if !addr.is_aligned_at(PageSize::Page4KiB.size()) {
@@ -56,10 +67,61 @@ pub trait PhyFrameAllocator {
     fn frame_alloc(&mut self) -> Option<Frame>;
 
     /// deallocate a frame
-    fn frame_dealloc(&mut self, index: usize);
+    fn frame_dealloc(&mut self, frame: Frame);
 
-    /// allocate 2MiB amount of Frames i.e 2MiB / 4KiB Frames
+    /// allocate N contiguous frames, N is rounded up to the next power of 2,
+    /// if `align_huge_page` is set, the run starts at a 2MiB boundary.
     fn frame_alloc_n(&mut self, n: usize, align_huge_page: bool) -> Option<Frame>;
+
+    /// deallocate N contiguous frames allocated using `frame_alloc_n`, with
+    /// the same `n` and `align_huge_page` so the same block size is freed.
+    fn frame_dealloc_n(&mut self, frame: Frame, n: usize, align_huge_page: bool);
+}
+
+/// highest order of the buddy allocator, a block of this order spans
+/// 2^9 4KiB frames i.e a 2MiB huge page.
+pub const BUDDY_MAX_ORDER: usize = 9;
+const BUDDY_N_ORDERS: usize = BUDDY_MAX_ORDER + 1;
+
+/// marks the end of a free-list
+const BUDDY_NIL: u64 = u64::MAX;
+
+const FRAME_SIZE: u64 = MemorySizes::OneKiB as u64 * 4;
+
+/// header written at the start of every free block, links the free blocks
+/// of the same order using their physical addresses.
+#[repr(C)]
+struct FreeBlockHeader {
+    next: u64,
+    prev: u64,
+}
+
+#[inline]
+fn block_size(order: usize) -> u64 {
+    FRAME_SIZE << order
+}
+
+/// returns the smallest order that can hold `n` frames
+#[inline]
+pub fn order_for_frames(n: usize) -> usize {
+    let mut order = 0;
+    while (1 << order) < n {
+        order += 1;
+    }
+
+    order
+}
+
+/// order of the block `frame_alloc_n` takes for `n` frames, a 2MiB aligned
+/// run needs a block of the highest order.
+#[inline]
+fn order_for_run(n: usize, align_huge_page: bool) -> usize {
+    let order = order_for_frames(n);
+    if align_huge_page && order < BUDDY_MAX_ORDER {
+        return BUDDY_MAX_ORDER;
+    }
+
+    order
 }
 
 #[derive(Debug, Copy, Clone)]
@@ -67,7 +129,12 @@ pub struct MemoryRegion {
     start: mm::PhysicalAddress,
     size: usize,
     n_frames: usize,
-    current: usize,
+    /// one byte per frame, stores `order + 1` if the frame is the head
+    /// of a free block of that order, `0` otherwise.
+    order_map: mm::VirtualAddress,
+    /// one byte per frame, number of extra mappings sharing the frame,
+    /// `0` means the frame has a single owner.
+    share_map: mm::VirtualAddress,
 }
 
 impl MemoryRegion {
@@ -75,13 +142,18 @@ impl MemoryRegion {
     pub fn new(start: u64, end: u64) -> Self {
         let aligned_start = mm::Alignment::align_up(start, PageSize::Page4KiB.size());
         let aligned_end = mm::Alignment::align_down(end, PageSize::Page4KiB.size());
-        let size = (aligned_end - aligned_start) as usize;
+        let size = if aligned_end > aligned_start {
+            (aligned_end - aligned_start) as usize
+        } else {
+            0
+        };
         let n_frames = size / PageSize::Page4KiB.size() as usize;
         MemoryRegion {
             start: mm::PhysicalAddress::from_u64(aligned_start),
             size,
             n_frames,
-            current: 0,
+            order_map: mm::VirtualAddress::from_u64(0),
+            share_map: mm::VirtualAddress::from_u64(0),
         }
     }
 
@@ -91,78 +163,94 @@ impl MemoryRegion {
             start: mm::PhysicalAddress::from_u64(0),
             size: 0,
             n_frames: 0,
-            current: 0,
+            order_map: mm::VirtualAddress::from_u64(0),
+            share_map: mm::VirtualAddress::from_u64(0),
         }
     }
 
-    /// returns the number of bytes free in this region
     #[inline]
-    pub fn free_size(&self) -> usize {
-        let current_size = self.current * PageSize::Page4KiB.size() as usize;
-        self.size - current_size
+    pub fn end(&self) -> u64 {
+        self.start.as_u64() + self.size as u64
     }
 
-    /// returns the number of frames of 4KB size free
     #[inline]
-    pub fn free_frames(&self) -> usize {
-        self.n_frames - self.current
+    pub fn contains(&self, addr: u64, size: u64) -> bool {
+        addr >= self.start.as_u64() && addr + size <= self.end()
     }
 
-    /// check whether N frames can be allocated here or not.
+    /// removes `size` bytes from the start of the region and returns the
+    /// start address of the removed part.
     #[inline]
-    pub fn can_allocate(&self, n: usize) -> bool {
-        self.current + n < self.n_frames
+    fn carve_front(&mut self, size: usize) -> mm::PhysicalAddress {
+        let carved = self.start;
+        self.start = mm::PhysicalAddress::from_u64(carved.as_u64() + size as u64);
+        self.size = self.size - size;
+        self.n_frames = self.size / FRAME_SIZE as usize;
+        carved
     }
 
+    /// the order and share maps are placed at the end of the region itself,
+    /// this takes 2 bytes per frame out of the region.
     #[inline]
-    pub fn can_allocate_aligned(&self, n: usize) -> bool {
-        let offset = {
-            let current_address =
-                self.start.as_u64() + (self.current as u64 * PageSize::Page4KiB.size());
-            let alignd_addr = mm::Alignment::align_up(current_address, PageSize::Page2MiB.size());
-            ((alignd_addr - current_address) / PageSize::Page4KiB.size()) as usize
-        };
+    fn place_frame_maps(&mut self, phy_offset: u64) {
+        let map_bytes = mm::Alignment::align_up(2 * self.n_frames as u64, FRAME_SIZE);
+        if map_bytes >= self.size as u64 {
+            self.size = 0;
+            self.n_frames = 0;
+            return;
+        }
 
-        self.current + offset + n < self.n_frames
-    }
+        self.size = self.size - map_bytes as usize;
+        self.n_frames = self.size / FRAME_SIZE as usize;
+        self.order_map = mm::VirtualAddress::from_u64(self.end() + phy_offset);
+        self.share_map =
+            mm::VirtualAddress::from_u64(self.order_map.as_u64() + self.n_frames as u64);
 
-    /// allocate N frames in the current region
-    pub fn allocate_n(&mut self, n: usize, align_huge_page: bool) -> Option<Frame> {
-        if !align_huge_page && !self.can_allocate(n) {
-            return None;
+        unsafe {
+            ptr::write_bytes(self.order_map.get_mut_ptr::<u8>(), 0, 2 * self.n_frames);
         }
+    }
 
-        if align_huge_page && !self.can_allocate_aligned(n) {
-            return None;
-        }
+    #[inline]
+    fn order_entry(&self, addr: u64) -> &'static mut u8 {
+        let index = ((addr - self.start.as_u64()) / FRAME_SIZE) as usize;
+        unsafe { &mut *self.order_map.get_mut_ptr::<u8>().add(index) }
+    }
 
-        if align_huge_page {
-            // align the address at multiple of 2MiB
-            let current_addr =
-                self.start.as_u64() + (self.current as u64 * PageSize::Page4KiB.size());
-            let aligned_addr = mm::Alignment::align_up(current_addr, PageSize::Page2MiB.size());
-            let diff_addr = aligned_addr - current_addr;
-            let offset_frames = (diff_addr / PageSize::Page4KiB.size()) as usize;
-            self.current = self.current + n + offset_frames;
-            return Some(Frame::from_address(mm::PhysicalAddress::from_u64(
-                aligned_addr,
-            )));
-        } else {
-            let current_address = mm::PhysicalAddress::from_u64(
-                self.start.as_u64() + (self.current as u64 * PageSize::Page4KiB.size()),
-            );
-            self.current = self.current + n;
-            return Some(Frame::from_address(current_address));
-        }
+    #[inline]
+    fn share_entry(&self, addr: u64) -> &'static mut u8 {
+        let index = ((addr - self.start.as_u64()) / FRAME_SIZE) as usize;
+        unsafe { &mut *self.share_map.get_mut_ptr::<u8>().add(index) }
     }
 }
 
-pub struct LinearFrameAllocator {
+#[derive(Debug, Clone)]
+pub struct FrameAllocatorStats {
+    pub total_frames: usize,
+    pub free_frames: usize,
+    /// frames held in per-CPU caches, not counted in `free_frames`
+    pub cached_frames: usize,
+    pub free_blocks: [usize; BUDDY_N_ORDERS],
+}
+
+/// Buddy system allocator over the usable physical memory regions.
+/// Every free block is naturally aligned to it's size, so the buddy of a
+/// block is found by flipping the bit of it's order in the address.
+pub struct BuddyFrameAllocator {
     pub memory_regions: [MemoryRegion; MAX_FREE_REGIONS],
     pub regions: usize,
+    free_lists: [u64; BUDDY_N_ORDERS],
+    free_blocks: [usize; BUDDY_N_ORDERS],
+    free_frames: usize,
+    total_frames: usize,
+    phy_offset: u64,
+    /// region reserved for the DMA allocator, (start, size)
+    dma_region: Option<(mm::PhysicalAddress, usize)>,
+    /// frame below 1MiB reserved for the AP startup code
+    ap_trampoline: Option<Frame>,
 }
 
-impl LinearFrameAllocator {
+impl BuddyFrameAllocator {
     #[inline]
     fn create_combined_regions(
         boot_regions: &MemoryRegions,
@@ -175,46 +263,110 @@ impl LinearFrameAllocator {
         for idx in 0..boot_regions.len() {
             let region = &boot_regions[idx];
             // ignore the region below 4K
-            if region.end <= 4096 {
+            if region.end <= 4096 || region.kind != MemoryRegionKind::Usable {
+                continue;
+            }
+
+            if current_start == 0 && current_end == 0 {
+                current_start = region.start;
+                current_end = region.end;
+                continue;
+            }
+
+            if current_end == region.start {
+                // linear
+                current_end = region.end;
                 continue;
             }
 
-            if region.kind == MemoryRegionKind::Usable {
-                if current_start == 0 && current_end == 0 {
-                    current_start = region.start;
-                    current_end = region.end;
-                }
-                if current_end == region.start {
-                    // linear
-                    current_end = region.end;
-                } else {
-                    // non-linear
-                    let memory_region = MemoryRegion::new(current_start, current_end);
-                    log::info!(
-                        "Found memory region of size: {} bytes. start=0x{:x}, end=0x{:x}",
-                        current_end - current_start,
-                        current_start,
-                        current_end
-                    );
-                    os_regions[n_regions] = memory_region;
-                    n_regions += 1;
-
-                    // re-init start and end
-                    current_start = region.start;
-                    current_end = region.end;
-                }
+            // non-linear
+            if n_regions < MAX_FREE_REGIONS {
+                os_regions[n_regions] = Self::log_region(current_start, current_end);
+                n_regions += 1;
             }
+
+            // re-init start and end
+            current_start = region.start;
+            current_end = region.end;
+        }
+
+        // the last contiguous region:
+        if current_end > current_start && n_regions < MAX_FREE_REGIONS {
+            os_regions[n_regions] = Self::log_region(current_start, current_end);
+            n_regions += 1;
         }
 
         n_regions
     }
 
+    #[inline]
+    fn log_region(start: u64, end: u64) -> MemoryRegion {
+        log::info!(
+            "Found memory region of size: {} bytes. start=0x{:x}, end=0x{:x}",
+            end - start,
+            start,
+            end
+        );
+        MemoryRegion::new(start, end)
+    }
+
+    /// reserves DMA memory from the first region below 16MiB,
+    /// before the region is handed over to the buddy lists.
+    #[inline]
+    fn reserve_dma_region(&mut self) {
+        for idx in 0..self.regions {
+            let region = &mut self.memory_regions[idx];
+            if region.start.as_u64() < 16 * MemorySizes::OneMib as u64
+                && region.size > DMA_REGION_SIZE
+            {
+                let dma_start = region.carve_front(DMA_REGION_SIZE);
+                log::debug!(
+                    "Moved the start address of memory region below 16MiB from 0x{:x} to 0x{:x}",
+                    dma_start.as_u64(),
+                    region.start.as_u64()
+                );
+                self.dma_region = Some((dma_start, DMA_REGION_SIZE));
+                return;
+            }
+        }
+    }
+
+    /// reserves a frame below 1MiB, application processors start executing
+    /// in real mode from it.
+    #[inline]
+    fn reserve_trampoline_frame(&mut self) {
+        for idx in 0..self.regions {
+            let region = &mut self.memory_regions[idx];
+            if region.start.as_u64() + FRAME_SIZE <= AP_TRAMPOLINE_LIMIT
+                && region.size > FRAME_SIZE as usize
+            {
+                let trampoline_start = region.carve_front(FRAME_SIZE as usize);
+                log::debug!(
+                    "Reserved frame 0x{:x} for AP startup code",
+                    trampoline_start.as_u64()
+                );
+                self.ap_trampoline = Some(Frame(trampoline_start));
+                return;
+            }
+        }
+    }
+
+    #[inline]
+    pub fn ap_trampoline_frame(&self) -> Option<Frame> {
+        self.ap_trampoline
+    }
+
     pub fn init() -> Self {
         let memory_map_opt = BootProtocol::get_memory_regions();
         if memory_map_opt.is_none() {
             panic!("Bootloader did not provide memory map.");
         }
 
+        let phy_offset_opt = BootProtocol::get_phy_offset();
+        if phy_offset_opt.is_none() {
+            panic!("Boot protocol did not provide physical memory offset.");
+        }
+
         let memory_map = memory_map_opt.unwrap();
         // iterate over the memory map and prepare regions:
         let mut memory_regions = [MemoryRegion::empty(); MAX_FREE_REGIONS];
@@ -222,65 +374,509 @@ impl LinearFrameAllocator {
         let n_regions = Self::create_combined_regions(memory_map, &mut memory_regions);
 
         log::info!("Found {} memory regions as usable.", n_regions);
-        LinearFrameAllocator {
+        let mut allocator = BuddyFrameAllocator {
             memory_regions,
             regions: n_regions,
+            free_lists: [BUDDY_NIL; BUDDY_N_ORDERS],
+            free_blocks: [0; BUDDY_N_ORDERS],
+            free_frames: 0,
+            total_frames: 0,
+            phy_offset: phy_offset_opt.unwrap(),
+            dma_region: None,
+            ap_trampoline: None,
+        };
+
+        allocator.reserve_trampoline_frame();
+        allocator.reserve_dma_region();
+
+        for idx in 0..allocator.regions {
+            allocator.memory_regions[idx].place_frame_maps(allocator.phy_offset);
+            allocator.populate_region(idx);
         }
+
+        allocator.total_frames = allocator.free_frames;
+        allocator
     }
-}
 
-impl PhyFrameAllocator for LinearFrameAllocator {
-    fn frame_alloc(&mut self) -> Option<Frame> {
-        for region_idx in 0..self.regions {
-            if self.memory_regions[region_idx].can_allocate(1) {
-                let frame_opt = self.memory_regions[region_idx].allocate_n(1, false);
-                return frame_opt;
+    /// splits the region into largest naturally aligned blocks
+    /// and puts them on the free lists.
+    fn populate_region(&mut self, region_idx: usize) {
+        let region = self.memory_regions[region_idx];
+        let mut current = region.start.as_u64();
+
+        while current + FRAME_SIZE <= region.end() {
+            let mut order = BUDDY_MAX_ORDER;
+            while order > 0
+                && (current & (block_size(order) - 1) != 0
+                    || current + block_size(order) > region.end())
+            {
+                order -= 1;
             }
+
+            self.push_free(&region, current, order);
+            current += block_size(order);
         }
-        None
     }
 
-    fn frame_dealloc(&mut self, index: usize) {
-        log::warn!("Got index={}, Frame deallocation not implemented", index);
+    #[inline]
+    fn header(&self, addr: u64) -> &'static mut FreeBlockHeader {
+        unsafe { &mut *((addr + self.phy_offset) as *mut FreeBlockHeader) }
     }
 
-    fn frame_alloc_n(&mut self, n: usize, align_huge_page: bool) -> Option<Frame> {
-        for region_idx in 0..self.regions {
-            let can_allocate = if !align_huge_page {
-                self.memory_regions[region_idx].can_allocate(n)
-            } else {
-                self.memory_regions[region_idx].can_allocate_aligned(n)
-            };
-            if can_allocate {
-                let frame_opt = self.memory_regions[region_idx].allocate_n(n, align_huge_page);
-                return frame_opt;
+    #[inline]
+    fn region_of(&self, addr: u64) -> Option<MemoryRegion> {
+        for idx in 0..self.regions {
+            if self.memory_regions[idx].contains(addr, FRAME_SIZE) {
+                return Some(self.memory_regions[idx]);
             }
         }
 
         None
     }
+
+    #[inline]
+    fn push_free(&mut self, region: &MemoryRegion, addr: u64, order: usize) {
+        let head = self.free_lists[order];
+        let header = self.header(addr);
+        header.next = head;
+        header.prev = BUDDY_NIL;
+
+        if head != BUDDY_NIL {
+            self.header(head).prev = addr;
+        }
+
+        self.free_lists[order] = addr;
+        *region.order_entry(addr) = order as u8 + 1;
+
+        self.free_blocks[order] += 1;
+        self.free_frames += 1 << order;
+    }
+
+    #[inline]
+    fn remove_free(&mut self, region: &MemoryRegion, addr: u64, order: usize) {
+        let header = self.header(addr);
+        let (next, prev) = (header.next, header.prev);
+
+        if prev != BUDDY_NIL {
+            self.header(prev).next = next;
+        } else {
+            self.free_lists[order] = next;
+        }
+
+        if next != BUDDY_NIL {
+            self.header(next).prev = prev;
+        }
+
+        *region.order_entry(addr) = 0;
+
+        self.free_blocks[order] -= 1;
+        self.free_frames -= 1 << order;
+    }
+
+    /// allocates a block of given order, splits a larger block if needed.
+    pub fn alloc_order(&mut self, order: usize) -> Option<Frame> {
+        if order > BUDDY_MAX_ORDER {
+            return None;
+        }
+
+        let mut current_order = order;
+        while current_order <= BUDDY_MAX_ORDER && self.free_lists[current_order] == BUDDY_NIL {
+            current_order += 1;
+        }
+
+        if current_order > BUDDY_MAX_ORDER {
+            return None;
+        }
+
+        let addr = self.free_lists[current_order];
+        let region = self.region_of(addr).unwrap();
+        self.remove_free(&region, addr, current_order);
+
+        // give back the upper halves:
+        while current_order > order {
+            current_order -= 1;
+            self.push_free(&region, addr + block_size(current_order), current_order);
+        }
+
+        Some(Frame(mm::PhysicalAddress::from_u64(addr)))
+    }
+
+    /// frees a block of given order, merges it with it's buddy as long as
+    /// the buddy is also free.
+    pub fn free_order(&mut self, frame: Frame, order: usize) {
+        let mut addr = frame.as_u64();
+        let region_opt = self.region_of(addr);
+        if region_opt.is_none() || order > BUDDY_MAX_ORDER {
+            log::warn!(
+                "Attempt to free frame=0x{:x} not owned by frame allocator.",
+                addr
+            );
+            return;
+        }
+
+        let region = region_opt.unwrap();
+        if addr & (block_size(order) - 1) != 0 || !region.contains(addr, block_size(order)) {
+            log::warn!(
+                "Attempt to free unaligned block=0x{:x}, order={}",
+                addr,
+                order
+            );
+            return;
+        }
+
+        if *region.order_entry(addr) != 0 {
+            log::warn!("Double free of frame=0x{:x} detected.", addr);
+            return;
+        }
+
+        let mut current_order = order;
+        while current_order < BUDDY_MAX_ORDER {
+            let buddy = addr ^ block_size(current_order);
+            if !region.contains(buddy, block_size(current_order)) {
+                break;
+            }
+
+            if *region.order_entry(buddy) != current_order as u8 + 1 {
+                break;
+            }
+
+            self.remove_free(&region, buddy, current_order);
+            if buddy < addr {
+                addr = buddy;
+            }
+            current_order += 1;
+        }
+
+        self.push_free(&region, addr, current_order);
+    }
+
+    /// adds a reference to an allocated frame, used when the frame gets mapped
+    /// copy-on-write into another address space. Returns false if the frame
+    /// is not owned by the allocator or has too many sharers.
+    pub fn share_frame(&mut self, frame: Frame) -> bool {
+        let region_opt = self.region_of(frame.as_u64());
+        if region_opt.is_none() {
+            return false;
+        }
+
+        let share_entry = region_opt.unwrap().share_entry(frame.as_u64());
+        if *share_entry == u8::MAX {
+            log::warn!("Frame=0x{:x} has too many sharers.", frame.as_u64());
+            return false;
+        }
+
+        *share_entry += 1;
+        true
+    }
+
+    /// drops a reference added by `share_frame`, returns false if the caller
+    /// was the only owner of the frame, in that case the frame can be freed.
+    pub fn unshare_frame(&mut self, frame: Frame) -> bool {
+        let region_opt = self.region_of(frame.as_u64());
+        if region_opt.is_none() {
+            return false;
+        }
+
+        let share_entry = region_opt.unwrap().share_entry(frame.as_u64());
+        if *share_entry == 0 {
+            return false;
+        }
+
+        *share_entry -= 1;
+        true
+    }
+
+    #[inline]
+    pub fn is_shared(&self, frame: Frame) -> bool {
+        match self.region_of(frame.as_u64()) {
+            Some(region) => *region.share_entry(frame.as_u64()) > 0,
+            None => false,
+        }
+    }
+
+    #[inline]
+    pub fn free_frames(&self) -> usize {
+        self.free_frames
+    }
+
+    #[inline]
+    pub fn stats(&self) -> FrameAllocatorStats {
+        FrameAllocatorStats {
+            total_frames: self.total_frames,
+            free_frames: self.free_frames,
+            cached_frames: 0,
+            free_blocks: self.free_blocks,
+        }
+    }
+}
+
+impl PhyFrameAllocator for BuddyFrameAllocator {
+    fn frame_alloc(&mut self) -> Option<Frame> {
+        self.alloc_order(0)
+    }
+
+    fn frame_dealloc(&mut self, frame: Frame) {
+        self.free_order(frame, 0);
+    }
+
+    fn frame_alloc_n(&mut self, n: usize, align_huge_page: bool) -> Option<Frame> {
+        self.alloc_order(order_for_run(n, align_huge_page))
+    }
+
+    fn frame_dealloc_n(&mut self, frame: Frame, n: usize, align_huge_page: bool) {
+        self.free_order(frame, order_for_run(n, align_huge_page));
+    }
 }
 
 lazy_static! {
-    pub static ref LINEAR_ALLOCATOR: Mutex<LinearFrameAllocator> =
-        Mutex::new(LinearFrameAllocator::init());
+    pub static ref FRAME_ALLOCATOR: Mutex<BuddyFrameAllocator> =
+        Mutex::new(BuddyFrameAllocator::init());
+}
+
+/// number of 4KiB frames in a 2MiB huge page
+const HUGE_PAGE_FRAMES: usize = (2 * MemorySizes::OneMib as usize) / FRAME_SIZE as usize;
+
+/// max frames cached per processor
+const MAGAZINE_CAPACITY: usize = 64;
+
+/// number of frames moved between a magazine and the buddy allocator at once
+const MAGAZINE_BATCH: usize = MAGAZINE_CAPACITY / 2;
+
+/// a per-CPU stack of free frames. A magazine is only touched by the
+/// processor that owns it with interrupts disabled, so it needs no lock.
+#[derive(Clone, Copy)]
+struct FrameMagazine {
+    frames: [u64; MAGAZINE_CAPACITY],
+    count: usize,
+}
+
+impl FrameMagazine {
+    const fn empty() -> Self {
+        FrameMagazine {
+            frames: [0; MAGAZINE_CAPACITY],
+            count: 0,
+        }
+    }
+
+    /// takes frames from the buddy allocator until the magazine is half full
+    #[inline]
+    fn refill(&mut self) {
+        let mut allocator = FRAME_ALLOCATOR.lock();
+        while self.count < MAGAZINE_BATCH {
+            let frame_opt = allocator.frame_alloc();
+            if frame_opt.is_none() {
+                break;
+            }
+
+            self.frames[self.count] = frame_opt.unwrap().as_u64();
+            self.count += 1;
+        }
+    }
+
+    /// gives back `n` frames to the buddy allocator
+    #[inline]
+    fn drain(&mut self, n: usize) {
+        let mut allocator = FRAME_ALLOCATOR.lock();
+        for _ in 0..n {
+            if self.count == 0 {
+                break;
+            }
+
+            self.count -= 1;
+            let addr = mm::PhysicalAddress::from_u64(self.frames[self.count]);
+            allocator.frame_dealloc(Frame(addr));
+        }
+    }
+
+    #[inline]
+    fn pop(&mut self) -> Option<Frame> {
+        if self.count == 0 {
+            self.refill();
+            if self.count == 0 {
+                return None;
+            }
+        }
+
+        self.count -= 1;
+        Some(Frame(mm::PhysicalAddress::from_u64(
+            self.frames[self.count],
+        )))
+    }
+
+    #[inline]
+    fn push(&mut self, frame: Frame) {
+        if self.count == MAGAZINE_CAPACITY {
+            self.drain(MAGAZINE_BATCH);
+        }
+
+        self.frames[self.count] = frame.as_u64();
+        self.count += 1;
+    }
+}
+
+struct PerCPUMagazines {
+    magazines: UnsafeCell<[FrameMagazine; lapic::MAX_PROCESSORS]>,
+}
+
+// each processor accesses only it's own magazine
+unsafe impl Sync for PerCPUMagazines {}
+
+static FRAME_MAGAZINES: PerCPUMagazines = PerCPUMagazines {
+    magazines: UnsafeCell::new([FrameMagazine::empty(); lapic::MAX_PROCESSORS]),
+};
+
+/// runs `func` over the current processor's magazine with interrupts disabled,
+/// returns `None` if there is no magazine for this processor (ex: LAPIC is not
+/// ready yet), in that case the caller must fall back to the global allocator.
+#[inline]
+fn with_current_magazine<R, F>(func: F) -> Option<R>
+where
+    F: FnOnce(&mut FrameMagazine) -> R,
+{
+    let interrupts_enabled = cpu::are_enabled();
+    cpu::disable_interrupts();
+
+    let result = match lapic::LAPICUtils::current_processor_id() {
+        Some(processor_id) if processor_id.as_usize() < lapic::MAX_PROCESSORS => {
+            let magazines = unsafe { &mut *FRAME_MAGAZINES.magazines.get() };
+            Some(func(&mut magazines[processor_id.as_usize()]))
+        }
+        _ => None,
+    };
+
+    if interrupts_enabled {
+        cpu::enable_interrupts();
+    }
+
+    result
 }
 
+/// frames asked back from the caches when an allocation finds none.
+const RECLAIM_BATCH: usize = 32;
+
+/// number of kernel heap growths in progress. The caches free heap memory
+/// when they shrink, so they are not reclaimed while the heap holds it's
+/// locks to map more frames.
+static HEAP_GROWTHS: AtomicUsize = AtomicUsize::new(0);
+
 pub struct PhysicalMemoryManager;
 
 impl PhysicalMemoryManager {
+    #[inline]
+    fn alloc_frame() -> Option<Frame> {
+        match with_current_magazine(|magazine| magazine.pop()) {
+            Some(frame_opt) => frame_opt,
+            None => FRAME_ALLOCATOR.lock().frame_alloc(),
+        }
+    }
+
+    /// gives frames of the block and page caches back to the allocator,
+    /// caches that are locked by the caller are skipped.
+    fn reclaim(n_frames: usize) -> usize {
+        if HEAP_GROWTHS.load(Ordering::SeqCst) != 0 {
+            return 0;
+        }
+
+        let released = page_cache::shrink(n_frames);
+        released + bcache::shrink(n_frames.saturating_sub(released))
+    }
+
+    /// called by the kernel heap around mapping more memory, see above.
+    #[inline]
+    pub fn begin_heap_growth() {
+        HEAP_GROWTHS.fetch_add(1, Ordering::SeqCst);
+    }
+
+    #[inline]
+    pub fn end_heap_growth() {
+        HEAP_GROWTHS.fetch_sub(1, Ordering::SeqCst);
+    }
+
     pub fn alloc() -> Option<Frame> {
-        LINEAR_ALLOCATOR.lock().frame_alloc()
+        let mut frame_opt = Self::alloc_frame();
+        if frame_opt.is_none() && Self::reclaim(RECLAIM_BATCH) > 0 {
+            frame_opt = Self::alloc_frame();
+        }
+
+        if let Some(frame) = frame_opt {
+            trace::record(TraceEvent::FrameAlloc, frame.as_u64(), 1);
+        }
+
+        frame_opt
     }
 
     pub fn alloc_huge_page() -> Option<Frame> {
-        let n_frames = (2 * mm::MemorySizes::OneMib as usize) / PageSize::Page4KiB.size() as usize;
-        LINEAR_ALLOCATOR.lock().frame_alloc_n(n_frames, true)
+        let mut frame_opt = FRAME_ALLOCATOR.lock().frame_alloc_n(HUGE_PAGE_FRAMES, true);
+        if frame_opt.is_none() {
+            // cached frames may be holding back a huge page from being merged:
+            Self::drain_current_cache();
+            frame_opt = FRAME_ALLOCATOR.lock().frame_alloc_n(HUGE_PAGE_FRAMES, true);
+        }
+
+        if frame_opt.is_none() && Self::reclaim(HUGE_PAGE_FRAMES) > 0 {
+            Self::drain_current_cache();
+            frame_opt = FRAME_ALLOCATOR.lock().frame_alloc_n(HUGE_PAGE_FRAMES, true);
+        }
+
+        if let Some(frame) = frame_opt {
+            trace::record(
+                TraceEvent::FrameAlloc,
+                frame.as_u64(),
+                HUGE_PAGE_FRAMES as u32,
+            );
+        }
+
+        frame_opt
+    }
+
+    pub fn free(frame: Frame) {
+        if with_current_magazine(|magazine| magazine.push(frame)).is_none() {
+            FRAME_ALLOCATOR.lock().frame_dealloc(frame);
+        }
+    }
+
+    pub fn free_huge_page(frame: Frame) {
+        FRAME_ALLOCATOR
+            .lock()
+            .frame_dealloc_n(frame, HUGE_PAGE_FRAMES, true);
+    }
+
+    /// adds a reference to the frame for one more mapping of it
+    pub fn share(frame: Frame) -> bool {
+        FRAME_ALLOCATOR.lock().share_frame(frame)
+    }
+
+    /// drops a reference to the frame, returns true if the frame is still
+    /// mapped elsewhere and must not be freed.
+    pub fn unshare(frame: Frame) -> bool {
+        FRAME_ALLOCATOR.lock().unshare_frame(frame)
+    }
+
+    pub fn is_shared(frame: Frame) -> bool {
+        FRAME_ALLOCATOR.lock().is_shared(frame)
     }
 
-    pub fn free(_frame: Frame) {
-        // Not implemented yet
-        LINEAR_ALLOCATOR.lock().frame_dealloc(0);
+    /// returns all the frames cached by the current processor
+    pub fn drain_current_cache() {
+        with_current_magazine(|magazine| magazine.drain(MAGAZINE_CAPACITY));
+    }
+
+    /// number of frames held in per-CPU caches, the value is approximate
+    /// because other processors can modify their caches concurrently.
+    pub fn cached_frames() -> usize {
+        let magazines = unsafe { &*FRAME_MAGAZINES.magazines.get() };
+        magazines.iter().map(|magazine| magazine.count).sum()
+    }
+
+    /// number of free 4KiB frames, including the ones cached per-CPU
+    pub fn free_frames() -> usize {
+        FRAME_ALLOCATOR.lock().free_frames() + Self::cached_frames()
+    }
+
+    pub fn stats() -> FrameAllocatorStats {
+        let mut stats = FRAME_ALLOCATOR.lock().stats();
+        stats.cached_frames = Self::cached_frames();
+        stats
     }
 }
 
@@ -337,39 +933,23 @@ pub struct DMAAllocator {
 
 impl DMAAllocator {
     pub fn empty() -> Self {
-        // is there a free region below 16MiB?
-        let mut alloc_lock: MutexGuard<LinearFrameAllocator> = LINEAR_ALLOCATOR.lock();
-        for region in alloc_lock.memory_regions.iter_mut() {
-            if region.start.as_u64() < 16 * MemorySizes::OneMib as u64 {
-                let dma_start = region.start;
-                let dma_end =
-                    mm::PhysicalAddress::from_u64(dma_start.as_u64() + DMA_REGION_SIZE as u64);
-                region.start = dma_end;
-                region.size = region.size - DMA_REGION_SIZE;
-                region.n_frames = (region.size) / (4 * MemorySizes::OneKiB as usize);
-
-                log::debug!(
-                    "Moved the start address of memory region below 16MiB from 0x{:x} to 0x{:x}",
-                    dma_start.as_u64(),
-                    region.start.as_u64()
-                );
-
-                let aligned_start =
-                    mm::Alignment::align_up(dma_start.as_u64(), DMA_FRAME_SIZE as u64);
+        // the frame allocator reserves a region below 16MiB during init
+        let dma_region = FRAME_ALLOCATOR.lock().dma_region;
+        if dma_region.is_none() {
+            panic!("DMA Region could not be found.");
+        }
 
-                let aligned_end =
-                    mm::Alignment::align_down(dma_end.as_u64(), DMA_FRAME_SIZE as u64);
-                let max_frames = (aligned_end - aligned_start) / (DMA_FRAME_SIZE as u64);
+        let (dma_start, dma_size) = dma_region.unwrap();
+        let aligned_start = mm::Alignment::align_up(dma_start.as_u64(), DMA_FRAME_SIZE as u64);
+        let aligned_end =
+            mm::Alignment::align_down(dma_start.as_u64() + dma_size as u64, DMA_FRAME_SIZE as u64);
+        let max_frames = (aligned_end - aligned_start) / (DMA_FRAME_SIZE as u64);
 
-                return DMAAllocator {
-                    max_frames: max_frames as usize,
-                    current_index: 0,
-                    start_addr: mm::PhysicalAddress::from_u64(aligned_start),
-                };
-            }
+        DMAAllocator {
+            max_frames: max_frames as usize,
+            current_index: 0,
+            start_addr: mm::PhysicalAddress::from_u64(aligned_start),
         }
-
-        panic!("DMA Region could not be found.")
     }
 
     #[inline]
@@ -402,11 +982,13 @@ impl DMAMemoryManager {
     }
 }
 
-/// a function that lazy initializes LIEAR_ALLOCATOR
+/// a function that lazy initializes FRAME_ALLOCATOR
 pub fn setup_physical_memory() {
+    let stats = PhysicalMemoryManager::stats();
     log::info!(
-        "Set-up Linear memory allocator for Physical memory successfull, regions={}",
-        LINEAR_ALLOCATOR.lock().regions
+        "Set-up Buddy allocator for Physical memory successfull, regions={}, free_frames={}",
+        FRAME_ALLOCATOR.lock().regions,
+        stats.free_frames
     );
 
     let dma_lock = DMA_ALLOCATOR.lock();
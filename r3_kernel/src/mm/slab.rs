@@ -0,0 +1,376 @@
+extern crate linked_list_allocator;
+extern crate spin;
+
+use crate::mm;
+use crate::mm::paging::{KernelVirtualMemoryManager, PageEntryFlags, PageRange, PageSize};
+use crate::mm::phy::PhysicalMemoryManager;
+
+use core::alloc::{GlobalAlloc, Layout};
+use core::ptr::{self, NonNull};
+use core::sync::atomic::{AtomicUsize, Ordering};
+
+use linked_list_allocator::Heap;
+use spin::Mutex;
+
+/// objects upto 2KiB are served from size classes, larger ones from the fallback heap.
+pub const SLAB_N_CLASSES: usize = 8;
+const SLAB_MIN_OBJECT_SIZE: usize = 16;
+const SLAB_MAX_OBJECT_SIZE: usize = SLAB_MIN_OBJECT_SIZE << (SLAB_N_CLASSES - 1);
+
+/// every refill of a size class takes a chunk of this size from the fallback heap.
+const SLAB_CHUNK_SIZE: usize = 64 * mm::MemorySizes::OneKiB as usize;
+const SLAB_CHUNK_ALIGN: usize = 4 * mm::MemorySizes::OneKiB as usize;
+
+const HUGE_PAGE_SIZE: u64 = 2 * mm::MemorySizes::OneMib as u64;
+
+/// a free object, the link to the next free object is stored in the object itself.
+struct FreeObject {
+    next: *mut FreeObject,
+}
+
+struct SizeClass {
+    object_size: usize,
+    free_list: *mut FreeObject,
+}
+
+// the free-list is only accessed under the size class lock
+unsafe impl Send for SizeClass {}
+
+impl SizeClass {
+    const fn new(object_size: usize) -> Self {
+        SizeClass {
+            object_size,
+            free_list: ptr::null_mut(),
+        }
+    }
+
+    #[inline]
+    fn pop(&mut self) -> *mut u8 {
+        let object = self.free_list;
+        if !object.is_null() {
+            self.free_list = unsafe { (*object).next };
+        }
+
+        object as *mut u8
+    }
+
+    #[inline]
+    fn push(&mut self, object: *mut u8) {
+        let free_object = object as *mut FreeObject;
+        unsafe {
+            (*free_object).next = self.free_list;
+        }
+        self.free_list = free_object;
+    }
+
+    /// splits the chunk into objects and puts them on the free-list,
+    /// returns the number of objects created.
+    #[inline]
+    fn add_chunk(&mut self, chunk: *mut u8) -> usize {
+        let n_objects = SLAB_CHUNK_SIZE / self.object_size;
+        for idx in (0..n_objects).rev() {
+            self.push(unsafe { chunk.add(idx * self.object_size) });
+        }
+
+        n_objects
+    }
+}
+
+struct SizeClassCounters {
+    hits: AtomicUsize,
+    misses: AtomicUsize,
+    live_objects: AtomicUsize,
+    total_objects: AtomicUsize,
+}
+
+impl SizeClassCounters {
+    const fn new() -> Self {
+        SizeClassCounters {
+            hits: AtomicUsize::new(0),
+            misses: AtomicUsize::new(0),
+            live_objects: AtomicUsize::new(0),
+            total_objects: AtomicUsize::new(0),
+        }
+    }
+}
+
+#[derive(Debug, Clone, Copy)]
+pub struct SizeClassStats {
+    pub object_size: usize,
+    /// allocations served directly from the free-list
+    pub hits: usize,
+    /// allocations that required a refill from the fallback heap
+    pub misses: usize,
+    pub live_objects: usize,
+    pub total_objects: usize,
+}
+
+impl SizeClassStats {
+    /// percentage of the objects carved for this class that are unused
+    #[inline]
+    pub fn fragmentation(&self) -> usize {
+        if self.total_objects == 0 {
+            return 0;
+        }
+
+        ((self.total_objects - self.live_objects) * 100) / self.total_objects
+    }
+}
+
+#[derive(Debug, Clone, Copy)]
+pub struct FallbackHeapStats {
+    pub size: usize,
+    pub used: usize,
+    pub grow_count: usize,
+}
+
+/// the large object heap, grows by mapping 2MiB pages at the end of it.
+struct FallbackHeap {
+    heap: Heap,
+    mapped_end: u64,
+    max_end: u64,
+    grow_count: usize,
+}
+
+impl FallbackHeap {
+    const fn empty() -> Self {
+        FallbackHeap {
+            heap: Heap::empty(),
+            mapped_end: 0,
+            max_end: 0,
+            grow_count: 0,
+        }
+    }
+
+    /// maps `size` more bytes of virtual memory at the end of the heap.
+    /// This runs inside the allocator with it's locks held, so it must not
+    /// log, the failure is returned to the allocation instead.
+    fn map_more(&mut self, size: u64) -> bool {
+        let aligned_size = mm::Alignment::align_up(size, HUGE_PAGE_SIZE);
+        if self.mapped_end + aligned_size > self.max_end {
+            return false;
+        }
+
+        let heap_pages = PageRange::new(
+            mm::VirtualAddress::from_u64(self.mapped_end),
+            (aligned_size / HUGE_PAGE_SIZE) as usize,
+            PageSize::Page2MiB,
+        );
+
+        PhysicalMemoryManager::begin_heap_growth();
+        let alloc_result = KernelVirtualMemoryManager::alloc_huge_page_region(
+            heap_pages,
+            PageEntryFlags::kernel_hugepage_flags(),
+        );
+        PhysicalMemoryManager::end_heap_growth();
+
+        if alloc_result.is_err() {
+            return false;
+        }
+
+        self.mapped_end = self.mapped_end + aligned_size;
+        true
+    }
+
+    fn init(&mut self, start: u64, initial_size: u64, max_size: u64) -> bool {
+        self.mapped_end = start;
+        self.max_end = start + max_size;
+
+        if !self.map_more(initial_size) {
+            return false;
+        }
+
+        unsafe {
+            self.heap
+                .init(start as usize, (self.mapped_end - start) as usize);
+        }
+
+        true
+    }
+
+    fn grow(&mut self, min_size: usize) -> bool {
+        // grow by atleast the size of the object and some slack for the
+        // linked-list allocator's own alignment needs.
+        let grow_size =
+            mm::Alignment::align_up((min_size + SLAB_CHUNK_SIZE) as u64, HUGE_PAGE_SIZE);
+
+        let old_end = self.mapped_end;
+        if !self.map_more(grow_size) {
+            return false;
+        }
+
+        unsafe {
+            self.heap.extend((self.mapped_end - old_end) as usize);
+        }
+
+        self.grow_count += 1;
+        true
+    }
+
+    fn alloc(&mut self, layout: Layout) -> *mut u8 {
+        if let Ok(allocation) = self.heap.allocate_first_fit(layout) {
+            return allocation.as_ptr();
+        }
+
+        if !self.grow(layout.size() + layout.align()) {
+            return ptr::null_mut();
+        }
+
+        match self.heap.allocate_first_fit(layout) {
+            Ok(allocation) => allocation.as_ptr(),
+            Err(_) => ptr::null_mut(),
+        }
+    }
+
+    fn dealloc(&mut self, object: *mut u8, layout: Layout) {
+        unsafe {
+            self.heap.deallocate(NonNull::new_unchecked(object), layout);
+        }
+    }
+}
+
+/// Kernel heap allocator, small objects are served from power of 2 size
+/// classes (16B to 2KiB), each class has it's own lock and free-list.
+/// Larger objects go to the fallback linked-list heap which also provides
+/// the 64KiB chunks used to refill the size classes.
+pub struct SlabAllocator {
+    classes: [Mutex<SizeClass>; SLAB_N_CLASSES],
+    counters: [SizeClassCounters; SLAB_N_CLASSES],
+    fallback: Mutex<FallbackHeap>,
+}
+
+impl SlabAllocator {
+    pub const fn empty() -> Self {
+        SlabAllocator {
+            classes: [
+                Mutex::new(SizeClass::new(16)),
+                Mutex::new(SizeClass::new(32)),
+                Mutex::new(SizeClass::new(64)),
+                Mutex::new(SizeClass::new(128)),
+                Mutex::new(SizeClass::new(256)),
+                Mutex::new(SizeClass::new(512)),
+                Mutex::new(SizeClass::new(1024)),
+                Mutex::new(SizeClass::new(2048)),
+            ],
+            counters: [
+                SizeClassCounters::new(),
+                SizeClassCounters::new(),
+                SizeClassCounters::new(),
+                SizeClassCounters::new(),
+                SizeClassCounters::new(),
+                SizeClassCounters::new(),
+                SizeClassCounters::new(),
+                SizeClassCounters::new(),
+            ],
+            fallback: Mutex::new(FallbackHeap::empty()),
+        }
+    }
+
+    /// maps the initial heap region, the heap can grow upto `max_size` bytes.
+    pub fn init(&self, start: u64, initial_size: u64, max_size: u64) -> bool {
+        self.fallback.lock().init(start, initial_size, max_size)
+    }
+
+    /// returns the size class index for the layout, objects are aligned at
+    /// their size in a class, so alignment is served by picking a bigger class.
+    #[inline]
+    fn class_index(layout: &Layout) -> Option<usize> {
+        let size = if layout.size() > layout.align() {
+            layout.size()
+        } else {
+            layout.align()
+        };
+
+        if size > SLAB_MAX_OBJECT_SIZE {
+            return None;
+        }
+
+        let mut index = 0;
+        while (SLAB_MIN_OBJECT_SIZE << index) < size {
+            index += 1;
+        }
+
+        Some(index)
+    }
+
+    #[inline]
+    fn alloc_from_class(&self, index: usize) -> *mut u8 {
+        let mut class = self.classes[index].lock();
+        let counters = &self.counters[index];
+
+        let mut object = class.pop();
+        if object.is_null() {
+            counters.misses.fetch_add(1, Ordering::Relaxed);
+
+            let chunk_layout = Layout::from_size_align(SLAB_CHUNK_SIZE, SLAB_CHUNK_ALIGN).unwrap();
+            let chunk = self.fallback.lock().alloc(chunk_layout);
+            if chunk.is_null() {
+                return ptr::null_mut();
+            }
+
+            let n_objects = class.add_chunk(chunk);
+            counters
+                .total_objects
+                .fetch_add(n_objects, Ordering::Relaxed);
+            object = class.pop();
+        } else {
+            counters.hits.fetch_add(1, Ordering::Relaxed);
+        }
+
+        counters.live_objects.fetch_add(1, Ordering::Relaxed);
+        object
+    }
+
+    pub fn class_stats(&self) -> [SizeClassStats; SLAB_N_CLASSES] {
+        let mut stats = [SizeClassStats {
+            object_size: 0,
+            hits: 0,
+            misses: 0,
+            live_objects: 0,
+            total_objects: 0,
+        }; SLAB_N_CLASSES];
+
+        for (index, counters) in self.counters.iter().enumerate() {
+            stats[index] = SizeClassStats {
+                object_size: SLAB_MIN_OBJECT_SIZE << index,
+                hits: counters.hits.load(Ordering::Relaxed),
+                misses: counters.misses.load(Ordering::Relaxed),
+                live_objects: counters.live_objects.load(Ordering::Relaxed),
+                total_objects: counters.total_objects.load(Ordering::Relaxed),
+            };
+        }
+
+        stats
+    }
+
+    pub fn fallback_stats(&self) -> FallbackHeapStats {
+        let fallback = self.fallback.lock();
+        FallbackHeapStats {
+            size: fallback.heap.size(),
+            used: fallback.heap.used(),
+            grow_count: fallback.grow_count,
+        }
+    }
+}
+
+unsafe impl GlobalAlloc for SlabAllocator {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        if let Some(index) = Self::class_index(&layout) {
+            return self.alloc_from_class(index);
+        }
+
+        self.fallback.lock().alloc(layout)
+    }
+
+    unsafe fn dealloc(&self, object: *mut u8, layout: Layout) {
+        if let Some(index) = Self::class_index(&layout) {
+            self.classes[index].lock().push(object);
+            self.counters[index]
+                .live_objects
+                .fetch_sub(1, Ordering::Relaxed);
+            return;
+        }
+
+        self.fallback.lock().dealloc(object, layout);
+    }
+}
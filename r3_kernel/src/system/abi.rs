@@ -10,6 +10,7 @@ use crate::system::utils::{USER_VIRT_END, USER_VIRT_START};
 use crate::mm::VirtualAddress;
 
 use crate::system::posix::dispatch_syscall;
+use crate::system::trace;
 use alloc::{string::String, vec};
 use core::{mem, ptr, str};
 
@@ -33,17 +34,27 @@ pub type CClockID = CInt;
 #[derive(Debug, Clone)]
 #[repr(i32)]
 pub enum Errno {
+    EPERM = 1,
     ENOENT = 2,
     EIO = 5,
     EBADF = 9,
+    EAGAIN = 11,
     ENOMEM = 12,
+    EACCES = 13,
     EFAULT = 14,
     EEXIST = 17,
+    ENODEV = 19,
     ENOSYS = 32,
     EINVAL = 22,
     EMFILE = 24,
     ENOTTY = 25,
+    ESPIPE = 29,
     ENAMETOOLONG = 63,
+    ENOTSOCK = 88,
+    EDESTADDRREQ = 89,
+    EPROTONOSUPPORT = 93,
+    EAFNOSUPPORT = 97,
+    EADDRINUSE = 98,
 }
 
 pub type UserAddress = VirtualAddress;
@@ -54,7 +65,10 @@ pub extern "sysv64" fn syscall_handler(
     regs: &mut SyscallRegsState,
 ) {
     LAPICUtils::eoi();
+    let sys_no = regs.rax as usize;
+    let entered_at = trace::syscall_enter(sys_no);
     let result = dispatch_syscall(regs, frame);
+    trace::syscall_exit(sys_no, entered_at);
     regs.rax = result as u64;
 }
 
@@ -0,0 +1,636 @@
+extern crate alloc;
+extern crate log;
+extern crate spin;
+
+use crate::mm::p_to_v;
+use crate::mm::phy::{Frame, PhysicalMemoryManager};
+use crate::system::filesystem::FSError;
+
+use alloc::{vec, vec::Vec};
+use core::slice;
+use lazy_static::lazy_static;
+use spin::Mutex;
+
+/// block size of the devices that go through the cache
+pub const BCACHE_BLOCK_SIZE: usize = 512;
+
+/// the cache keeps blocks in groups of one frame each
+const BCACHE_PAGE_SIZE: usize = 4096;
+const BCACHE_BLOCKS_PER_PAGE: usize = BCACHE_PAGE_SIZE / BCACHE_BLOCK_SIZE;
+
+/// upper bound on the frames held by the cache, 4MiB.
+const BCACHE_MAX_FRAMES: usize = 1024;
+
+/// the cache gives frames back once the free frames drop below this.
+const BCACHE_LOW_WATERMARK: usize = 2048;
+const BCACHE_SHRINK_BATCH: usize = 32;
+
+/// pages fetched past a sequential miss
+const BCACHE_READ_AHEAD_PAGES: usize = 8;
+/// largest single fill from the device, 128KiB.
+const BCACHE_MAX_FILL_PAGES: usize = 32;
+
+const BCACHE_N_BUCKETS: usize = 256;
+
+/// Devices that can be read and written in whole blocks through the cache.
+pub trait BlockDevice {
+    fn n_blocks(&self) -> u64;
+    fn read_blocks(&self, buffer: &mut [u8], block_no: u64) -> Result<(), FSError>;
+    fn write_blocks(&self, buffer: &[u8], block_no: u64) -> Result<(), FSError>;
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+struct BlockKey {
+    major: u32,
+    minor: u32,
+    /// index of the page on the device, i.e LBA / blocks per page.
+    page_no: u64,
+}
+
+impl BlockKey {
+    #[inline]
+    fn bucket(&self) -> usize {
+        let mut hash = (self.major as u64) << 32 | self.minor as u64;
+        hash ^= self.page_no.wrapping_mul(0x9E37_79B9_7F4A_7C15);
+        (hash ^ (hash >> 29)) as usize % BCACHE_N_BUCKETS
+    }
+}
+
+struct CacheEntry {
+    key: BlockKey,
+    frame: Frame,
+    /// cleared by the clock hand, set on every hit.
+    referenced: bool,
+}
+
+impl CacheEntry {
+    #[inline]
+    fn data(&self) -> &'static mut [u8] {
+        let data_ptr = p_to_v(self.frame.addr()).get_mut_ptr::<u8>();
+        unsafe { slice::from_raw_parts_mut(data_ptr, BCACHE_PAGE_SIZE) }
+    }
+}
+
+/// where the last read of a device ended, a miss there is treated as
+/// a sequential read.
+struct ReadStream {
+    major: u32,
+    minor: u32,
+    next_page: u64,
+}
+
+#[derive(Debug, Clone, Copy, Default)]
+pub struct BlockCacheStats {
+    pub hits: u64,
+    pub misses: u64,
+    /// pages fetched ahead of the reader
+    pub read_ahead: u64,
+    pub evictions: u64,
+    /// frames given back to the physical allocator
+    pub released: u64,
+    pub frames: usize,
+}
+
+pub struct BlockCache {
+    entries: Vec<Option<CacheEntry>>,
+    free_slots: Vec<usize>,
+    buckets: Vec<Vec<usize>>,
+    clock_hand: usize,
+    streams: Vec<ReadStream>,
+    stats: BlockCacheStats,
+}
+
+impl BlockCache {
+    pub fn empty() -> Self {
+        let mut buckets = Vec::with_capacity(BCACHE_N_BUCKETS);
+        for _ in 0..BCACHE_N_BUCKETS {
+            buckets.push(Vec::new());
+        }
+
+        BlockCache {
+            entries: Vec::new(),
+            free_slots: Vec::new(),
+            buckets,
+            clock_hand: 0,
+            streams: Vec::new(),
+            stats: BlockCacheStats::default(),
+        }
+    }
+
+    #[inline]
+    fn lookup(&self, key: &BlockKey) -> Option<usize> {
+        for &slot in self.buckets[key.bucket()].iter() {
+            if let Some(entry) = &self.entries[slot] {
+                if entry.key == *key {
+                    return Some(slot);
+                }
+            }
+        }
+
+        None
+    }
+
+    #[inline]
+    fn contains(&self, key: &BlockKey) -> bool {
+        self.lookup(key).is_some()
+    }
+
+    /// copies from the cached page into `buffer`, returns false on a miss.
+    fn copy_from(&mut self, key: &BlockKey, page_offset: usize, buffer: &mut [u8]) -> bool {
+        if let Some(slot) = self.lookup(key) {
+            let entry = self.entries[slot].as_mut().unwrap();
+            entry.referenced = true;
+            let length = buffer.len();
+            buffer.copy_from_slice(&entry.data()[page_offset..page_offset + length]);
+            self.stats.hits += 1;
+            return true;
+        }
+
+        self.stats.misses += 1;
+        false
+    }
+
+    /// same as `copy_from`, without counting it as a hit.
+    fn peek(&self, key: &BlockKey, page_offset: usize, buffer: &mut [u8]) -> bool {
+        if let Some(slot) = self.lookup(key) {
+            let length = buffer.len();
+            let data = self.entries[slot].as_ref().unwrap().data();
+            buffer.copy_from_slice(&data[page_offset..page_offset + length]);
+            return true;
+        }
+
+        false
+    }
+
+    #[inline]
+    fn unlink(&mut self, slot: usize) -> Option<CacheEntry> {
+        let entry_opt = self.entries[slot].take();
+        if let Some(entry) = &entry_opt {
+            self.buckets[entry.key.bucket()].retain(|&index| index != slot);
+        }
+
+        entry_opt
+    }
+
+    /// runs the clock hand until it finds an entry that was not used since
+    /// the last pass, the entry is removed and it's frame is returned.
+    fn evict(&mut self) -> Option<Frame> {
+        let n_entries = self.entries.len();
+        if n_entries == self.free_slots.len() {
+            return None;
+        }
+
+        // two passes clear every reference bit at most once.
+        for _ in 0..(2 * n_entries) {
+            let slot = self.clock_hand;
+            self.clock_hand = (self.clock_hand + 1) % n_entries;
+
+            let in_use = match self.entries[slot].as_mut() {
+                Some(entry) if entry.referenced => {
+                    entry.referenced = false;
+                    true
+                }
+                Some(_) => false,
+                None => true,
+            };
+
+            if !in_use {
+                let entry = self.unlink(slot).unwrap();
+                self.free_slots.push(slot);
+                return Some(entry.frame);
+            }
+        }
+
+        None
+    }
+
+    /// gives up to `n_frames` frames back to the physical allocator.
+    fn shrink(&mut self, n_frames: usize) -> usize {
+        let mut released = 0;
+        while released < n_frames {
+            let frame_opt = self.evict();
+            if frame_opt.is_none() {
+                break;
+            }
+
+            PhysicalMemoryManager::free(frame_opt.unwrap());
+            released += 1;
+        }
+
+        self.stats.released += released as u64;
+        self.stats.frames -= released;
+        released
+    }
+
+    /// a frame for a new entry: a fresh one while memory is plenty,
+    /// otherwise the one of an evicted entry.
+    fn take_frame(&mut self) -> Option<Frame> {
+        let free_frames = PhysicalMemoryManager::free_frames();
+        if free_frames < BCACHE_LOW_WATERMARK {
+            self.shrink(BCACHE_SHRINK_BATCH);
+        } else if self.stats.frames < BCACHE_MAX_FRAMES {
+            if let Some(frame) = PhysicalMemoryManager::alloc() {
+                self.stats.frames += 1;
+                return Some(frame);
+            }
+        }
+
+        let frame_opt = self.evict();
+        if frame_opt.is_some() {
+            self.stats.evictions += 1;
+        }
+
+        frame_opt
+    }
+
+    /// up to `n_frames` frames for new entries, fewer if memory runs out.
+    fn take_frames(&mut self, n_frames: usize) -> Vec<Frame> {
+        let mut frames = Vec::with_capacity(n_frames);
+        while frames.len() < n_frames {
+            let frame_opt = self.take_frame();
+            if frame_opt.is_none() {
+                break;
+            }
+            frames.push(frame_opt.unwrap());
+        }
+
+        frames
+    }
+
+    /// gives a frame of the cache back to the physical allocator.
+    #[inline]
+    fn release_frame(&mut self, frame: Frame) {
+        PhysicalMemoryManager::free(frame);
+        self.stats.frames -= 1;
+        self.stats.released += 1;
+    }
+
+    #[inline]
+    fn link(&mut self, entry: CacheEntry) {
+        let bucket = entry.key.bucket();
+        let slot = if let Some(slot) = self.free_slots.pop() {
+            self.entries[slot] = Some(entry);
+            slot
+        } else {
+            self.entries.push(Some(entry));
+            self.entries.len() - 1
+        };
+
+        self.buckets[bucket].push(slot);
+    }
+
+    /// stores `data` as the page of `key`, an existing copy is overwritten
+    /// only if `overwrite` is set. Nothing is cached if there is no memory.
+    fn insert(&mut self, key: BlockKey, data: &[u8], overwrite: bool) {
+        if let Some(slot) = self.lookup(&key) {
+            if overwrite {
+                let entry = self.entries[slot].as_mut().unwrap();
+                entry.data().copy_from_slice(data);
+                entry.referenced = true;
+            }
+            return;
+        }
+
+        let frame_opt = self.take_frame();
+        if frame_opt.is_none() {
+            return;
+        }
+
+        let entry = CacheEntry {
+            key,
+            frame: frame_opt.unwrap(),
+            referenced: true,
+        };
+        entry.data().copy_from_slice(data);
+        self.link(entry);
+    }
+
+    /// caches `frame`, already filled from the device, as the page of `key`.
+    /// A copy cached meanwhile is newer, the frame is released then.
+    fn insert_frame(&mut self, key: BlockKey, frame: Frame) {
+        if self.contains(&key) {
+            self.release_frame(frame);
+            return;
+        }
+
+        self.link(CacheEntry {
+            key,
+            frame,
+            referenced: true,
+        });
+    }
+
+    fn remove(&mut self, key: &BlockKey) {
+        if let Some(slot) = self.lookup(key) {
+            let entry = self.unlink(slot).unwrap();
+            self.free_slots.push(slot);
+            self.release_frame(entry.frame);
+        }
+    }
+
+    #[inline]
+    fn is_sequential(&self, major: u32, minor: u32, page_no: u64) -> bool {
+        self.streams.iter().any(|stream| {
+            stream.major == major && stream.minor == minor && stream.next_page == page_no
+        })
+    }
+
+    #[inline]
+    fn note_read(&mut self, major: u32, minor: u32, next_page: u64) {
+        for stream in self.streams.iter_mut() {
+            if stream.major == major && stream.minor == minor {
+                stream.next_page = next_page;
+                return;
+            }
+        }
+
+        self.streams.push(ReadStream {
+            major,
+            minor,
+            next_page,
+        });
+    }
+
+    /// drops every page of the device
+    fn invalidate(&mut self, major: u32, minor: u32) {
+        for slot in 0..self.entries.len() {
+            let matches = match &self.entries[slot] {
+                Some(entry) => entry.key.major == major && entry.key.minor == minor,
+                None => false,
+            };
+
+            if matches {
+                let entry = self.unlink(slot).unwrap();
+                self.free_slots.push(slot);
+                self.release_frame(entry.frame);
+            }
+        }
+
+        self.streams
+            .retain(|stream| stream.major != major || stream.minor != minor);
+    }
+}
+
+lazy_static! {
+    pub static ref BLOCK_CACHE: Mutex<BlockCache> = Mutex::new(BlockCache::empty());
+    /// orders write-through updates of the cache with their device writes.
+    static ref WRITE_LOCK: Mutex<()> = Mutex::new(());
+}
+
+/// reads `n_pages` pages from `page_no` of the device, blocks past the
+/// end of the device read as zeroes.
+fn read_pages(device: &dyn BlockDevice, page_no: u64, n_pages: usize) -> Result<Vec<u8>, FSError> {
+    let mut data = vec![0u8; n_pages * BCACHE_PAGE_SIZE];
+    let first_block = page_no * BCACHE_BLOCKS_PER_PAGE as u64;
+    let n_blocks = (n_pages * BCACHE_BLOCKS_PER_PAGE) as u64;
+    let valid_blocks = n_blocks.min(device.n_blocks() - first_block) as usize;
+
+    let read_result =
+        device.read_blocks(&mut data[0..valid_blocks * BCACHE_BLOCK_SIZE], first_block);
+    if read_result.is_err() {
+        return Err(read_result.unwrap_err());
+    }
+
+    Ok(data)
+}
+
+/// reads the pages from `page_no` of the device straight into `frames`, one
+/// device read for every run of physically adjacent frames. Blocks past the
+/// end of the device read as zeroes.
+fn fill_frames(device: &dyn BlockDevice, page_no: u64, frames: &[Frame]) -> Result<(), FSError> {
+    let dev_blocks = device.n_blocks();
+    let mut index = 0;
+    while index < frames.len() {
+        let run_start = frames[index].as_u64();
+        let mut run = 1;
+        while index + run < frames.len()
+            && frames[index + run].as_u64() == run_start + (run * BCACHE_PAGE_SIZE) as u64
+        {
+            run += 1;
+        }
+
+        // the frames are adjacent in the physical memory map as well.
+        let data_ptr = p_to_v(frames[index].addr()).get_mut_ptr::<u8>();
+        let data = unsafe { slice::from_raw_parts_mut(data_ptr, run * BCACHE_PAGE_SIZE) };
+
+        let first_block = (page_no + index as u64) * BCACHE_BLOCKS_PER_PAGE as u64;
+        let n_blocks = (run * BCACHE_BLOCKS_PER_PAGE) as u64;
+        let valid_bytes = n_blocks.min(dev_blocks - first_block) as usize * BCACHE_BLOCK_SIZE;
+        for byte in data[valid_bytes..].iter_mut() {
+            *byte = 0;
+        }
+
+        let read_result = device.read_blocks(&mut data[0..valid_bytes], first_block);
+        if read_result.is_err() {
+            return Err(read_result.unwrap_err());
+        }
+
+        index += run;
+    }
+
+    Ok(())
+}
+
+/// reads from `offset` of the device through the cache, returns the number of
+/// bytes read, which is less than the buffer if the device ends before it.
+/// Misses are filled with one device read covering the rest of the request,
+/// plus read-ahead if the reader continues where it's last read ended. The
+/// device writes into the frames of the new entries directly.
+pub fn read(
+    device: &dyn BlockDevice,
+    major: u32,
+    minor: u32,
+    offset: usize,
+    buffer: &mut [u8],
+) -> Result<usize, FSError> {
+    let dev_size = device.n_blocks() as usize * BCACHE_BLOCK_SIZE;
+    if offset >= dev_size || buffer.len() == 0 {
+        return Ok(0);
+    }
+
+    let total = buffer.len().min(dev_size - offset);
+    let dev_pages = ((dev_size + BCACHE_PAGE_SIZE - 1) / BCACHE_PAGE_SIZE) as u64;
+    let last_page = ((offset + total - 1) / BCACHE_PAGE_SIZE) as u64;
+
+    let mut done = 0;
+    while done < total {
+        let position = offset + done;
+        let page_no = (position / BCACHE_PAGE_SIZE) as u64;
+        let page_offset = position % BCACHE_PAGE_SIZE;
+        let length = (BCACHE_PAGE_SIZE - page_offset).min(total - done);
+        let key = BlockKey {
+            major,
+            minor,
+            page_no,
+        };
+
+        let mut cache = BLOCK_CACHE.lock();
+        if cache.copy_from(&key, page_offset, &mut buffer[done..done + length]) {
+            done += length;
+            continue;
+        }
+
+        // everything up to the next cached page in one device read.
+        let mut n_pages = (last_page - page_no + 1) as usize;
+        if cache.is_sequential(major, minor, page_no) {
+            n_pages += BCACHE_READ_AHEAD_PAGES;
+        }
+        n_pages = n_pages
+            .min(BCACHE_MAX_FILL_PAGES)
+            .min((dev_pages - page_no) as usize);
+
+        for index in 1..n_pages {
+            let next_key = BlockKey {
+                major,
+                minor,
+                page_no: page_no + index as u64,
+            };
+            if cache.contains(&next_key) {
+                n_pages = index;
+                break;
+            }
+        }
+
+        let frames = cache.take_frames(n_pages);
+        drop(cache);
+
+        if frames.is_empty() {
+            // no memory for the cache, the page is read for this request only.
+            let read_result = read_pages(device, page_no, 1);
+            if read_result.is_err() {
+                return Err(read_result.unwrap_err());
+            }
+
+            let page = read_result.unwrap();
+            buffer[done..done + length].copy_from_slice(&page[page_offset..page_offset + length]);
+            done += length;
+            continue;
+        }
+
+        let n_pages = frames.len();
+        let fill_result = fill_frames(device, page_no, &frames);
+        if fill_result.is_err() {
+            let mut cache = BLOCK_CACHE.lock();
+            for frame in frames {
+                cache.release_frame(frame);
+            }
+            return Err(fill_result.unwrap_err());
+        }
+
+        let mut cache = BLOCK_CACHE.lock();
+        for (index, frame) in frames.into_iter().enumerate() {
+            let fill_key = BlockKey {
+                major,
+                minor,
+                page_no: page_no + index as u64,
+            };
+            cache.insert_frame(fill_key, frame);
+        }
+
+        let requested = (last_page - page_no + 1) as usize;
+        if n_pages > requested {
+            cache.stats.read_ahead += (n_pages - requested) as u64;
+        }
+
+        // the filled part of the request is served before the lock is
+        // dropped, the new entries can be evicted right after.
+        let fill_end = (page_no as usize + n_pages) * BCACHE_PAGE_SIZE;
+        while done < total && offset + done < fill_end {
+            let position = offset + done;
+            let page_offset = position % BCACHE_PAGE_SIZE;
+            let length = (BCACHE_PAGE_SIZE - page_offset).min(total - done);
+            let fill_key = BlockKey {
+                major,
+                minor,
+                page_no: (position / BCACHE_PAGE_SIZE) as u64,
+            };
+            cache.peek(&fill_key, page_offset, &mut buffer[done..done + length]);
+            done += length;
+        }
+    }
+
+    BLOCK_CACHE.lock().note_read(major, minor, last_page + 1);
+    Ok(total)
+}
+
+/// writes `buffer` at `offset` of the device, the cached pages are updated
+/// once the device accepted the write.
+pub fn write(
+    device: &dyn BlockDevice,
+    major: u32,
+    minor: u32,
+    offset: usize,
+    buffer: &[u8],
+) -> Result<usize, FSError> {
+    let dev_size = device.n_blocks() as usize * BCACHE_BLOCK_SIZE;
+    if offset + buffer.len() > dev_size {
+        return Err(FSError::InvalidSeek);
+    }
+
+    let _write_guard = WRITE_LOCK.lock();
+
+    let mut done = 0;
+    while done < buffer.len() {
+        let position = offset + done;
+        let page_no = (position / BCACHE_PAGE_SIZE) as u64;
+        let page_offset = position % BCACHE_PAGE_SIZE;
+        let length = (BCACHE_PAGE_SIZE - page_offset).min(buffer.len() - done);
+        let key = BlockKey {
+            major,
+            minor,
+            page_no,
+        };
+
+        let page_start = page_no as usize * BCACHE_PAGE_SIZE;
+        let page_valid = BCACHE_PAGE_SIZE.min(dev_size - page_start);
+
+        // the page as it is now, unless the write replaces all of it.
+        let mut page = vec![0u8; BCACHE_PAGE_SIZE];
+        let cached = BLOCK_CACHE.lock().peek(&key, 0, &mut page);
+        if !cached && !(page_offset == 0 && length == page_valid) {
+            let read_result = read_pages(device, page_no, 1);
+            if read_result.is_err() {
+                return Err(read_result.unwrap_err());
+            }
+            page = read_result.unwrap();
+        }
+
+        page[page_offset..page_offset + length].copy_from_slice(&buffer[done..done + length]);
+
+        let first_block = page_offset / BCACHE_BLOCK_SIZE;
+        let end_block = (page_offset + length + BCACHE_BLOCK_SIZE - 1) / BCACHE_BLOCK_SIZE;
+        let write_result = device.write_blocks(
+            &page[first_block * BCACHE_BLOCK_SIZE..end_block * BCACHE_BLOCK_SIZE],
+            page_no * BCACHE_BLOCKS_PER_PAGE as u64 + first_block as u64,
+        );
+
+        if write_result.is_err() {
+            // the disk may hold a part of the write now.
+            BLOCK_CACHE.lock().remove(&key);
+            return Err(write_result.unwrap_err());
+        }
+
+        BLOCK_CACHE.lock().insert(key, &page, true);
+        done += length;
+    }
+
+    Ok(buffer.len())
+}
+
+/// drops the cached pages of the device, called when the device goes away.
+pub fn invalidate(major: u32, minor: u32) {
+    BLOCK_CACHE.lock().invalidate(major, minor);
+}
+
+/// gives up to `n_frames` frames back to the physical allocator, returns
+/// the number of frames released. Called by the physical allocator when it
+/// runs out, nothing is released if the cache is busy.
+pub fn shrink(n_frames: usize) -> usize {
+    BLOCK_CACHE
+        .try_lock()
+        .map_or(0, |mut cache| cache.shrink(n_frames))
+}
+
+pub fn stats() -> BlockCacheStats {
+    BLOCK_CACHE.lock().stats
+}
@@ -2,21 +2,23 @@ extern crate alloc;
 extern crate log;
 extern crate spin;
 
-use crate::system::filesystem::devfs::{DevFSDescriptor, DevOps, DEV_FS};
+use crate::system::filesystem::devfs::{DevFSDescriptor, DevFSDevice, DEV_FS};
 use crate::system::filesystem::ustar::mount_tarfs;
 
-use alloc::boxed::Box;
+use alloc::{string::String, vec::Vec};
 
 /// Devices capable of storage have major number 2
 const STORAGE_DEVICE_MAJOR: usize = 2;
 
-pub fn check_tarfs(major: u32, minor: u32, device: &Box<dyn DevOps + Sync + Send>) -> bool {
+pub fn check_tarfs(major: u32, minor: u32, device: &DevFSDevice) -> bool {
     // 1. create a file-descriptor
     let mut fd = DevFSDescriptor {
         flags: 0,
         major,
         minor,
         offset: 0,
+        device: device.clone(),
+        text: None,
     };
 
     let mut buffer: [u8; 512] = [0; 512];
@@ -37,16 +39,27 @@ pub fn check_tarfs(major: u32, minor: u32, device: &Box<dyn DevOps + Sync + Send
 }
 
 pub fn detect_filesystems() {
-    // dealing with locks!
+    // dealing with locks! mounting opens the device, so the devfs
+    // must not be locked meanwhile.
+    let mut storage_devices: Vec<(String, u32, u32, DevFSDevice)> = Vec::new();
     for dev_entry in DEV_FS.lock().iter() {
         if dev_entry.major == STORAGE_DEVICE_MAJOR as u32 {
-            if check_tarfs(dev_entry.major, dev_entry.minor, &dev_entry.device) {
-                // detected a tarfs
-                log::info!("Detected TAR filesystem on device /dev/{}", dev_entry.name);
-                mount_tarfs(&dev_entry.name, "/sbin");
-            } else {
-                log::warn!("No usuable filesystem detected on /dev/{}", dev_entry.name);
-            }
+            storage_devices.push((
+                dev_entry.name.clone(),
+                dev_entry.major,
+                dev_entry.minor,
+                dev_entry.device.clone(),
+            ));
+        }
+    }
+
+    for (name, major, minor, device) in storage_devices {
+        if check_tarfs(major, minor, &device) {
+            // detected a tarfs
+            log::info!("Detected TAR filesystem on device /dev/{}", name);
+            mount_tarfs(&name, "/sbin");
+        } else {
+            log::warn!("No usuable filesystem detected on /dev/{}", name);
         }
     }
 }
@@ -2,10 +2,14 @@ extern crate alloc;
 extern crate log;
 extern crate spin;
 
-use crate::system::filesystem::vfs::{FILESYSTEM, VFS};
-use crate::system::filesystem::{FDOps, FSError, FSOps, FileDescriptor, MountInfo, SeekType};
-use alloc::{boxed::Box, string::String, vec::Vec};
+use crate::system::filesystem::bcache;
+use crate::system::filesystem::vfs::FILESYSTEM;
+use crate::system::filesystem::{
+    FDOps, FSError, FSOps, FileDescriptor, MountInfo, PollEvents, SeekType,
+};
+use alloc::{boxed::Box, string::String, sync::Arc, vec::Vec};
 
+use core::fmt;
 use lazy_static::lazy_static;
 use spin::{Mutex, MutexGuard};
 
@@ -14,13 +18,21 @@ pub trait DevOps {
     fn write(&self, fd: &mut DevFSDescriptor, buffer: &[u8]) -> Result<usize, FSError>;
     fn ioctl(&self, command: usize, arg: usize) -> Result<usize, FSError>;
     fn seek(&self, fd: &mut DevFSDescriptor, offset: u32, st: SeekType) -> Result<u32, FSError>;
+
+    /// what a read or a write would not block on, devices that never block
+    /// are always ready.
+    fn poll_events(&self) -> PollEvents {
+        PollEvents::POLLIN | PollEvents::POLLOUT
+    }
 }
 
+pub type DevFSDevice = Arc<dyn DevOps + Sync + Send>;
+
 pub struct DevFSEntry {
     pub name: String,
     pub major: u32,
     pub minor: u32,
-    pub device: Box<dyn DevOps + Sync + Send>,
+    pub device: DevFSDevice,
     pub ref_count: usize,
 }
 
@@ -28,13 +40,30 @@ lazy_static! {
     pub static ref DEV_FS: Mutex<Vec<DevFSEntry>> = Mutex::new(Vec::new());
 }
 
-#[derive(Debug, Clone)]
+#[derive(Clone)]
 pub struct DevFSDescriptor {
     pub flags: u32,
     pub major: u32,
     pub minor: u32,
-    /// some devices that require offset based reads/writes can use this.
-    pub offset: u32,
+    /// some devices that require offset based reads/writes can use this,
+    /// it is 64 bits wide so disks larger than 4GiB can be read to the end.
+    pub offset: u64,
+    /// taken at open, reads and writes go to the device without
+    /// looking it up. The device stays alive while it is open.
+    pub device: DevFSDevice,
+    /// contents of devices that generate them as text, see `read_text`.
+    pub text: Option<Arc<String>>,
+}
+
+impl fmt::Debug for DevFSDescriptor {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("DevFSDescriptor")
+            .field("flags", &self.flags)
+            .field("major", &self.major)
+            .field("minor", &self.minor)
+            .field("offset", &self.offset)
+            .finish()
+    }
 }
 
 #[derive(Debug, Clone)]
@@ -62,11 +91,12 @@ fn get_dev_index(
 }
 
 impl FSOps for DevFSDriver {
-    fn open(&mut self, path: &str, flags: u32) -> Result<FileDescriptor, FSError> {
+    fn open(&self, path: &str, flags: u32) -> Result<FileDescriptor, FSError> {
         // look for the device by it's path and return the file-descriptor:
+        let name = path.trim_start_matches('/');
         let mut devfs_lock = DEV_FS.lock();
         for entry in devfs_lock.iter_mut() {
-            if entry.name == path {
+            if entry.name == name {
                 entry.ref_count += 1;
                 // prepare devfs handle:
                 return Ok(FileDescriptor::DevFSNode(DevFSDescriptor {
@@ -74,6 +104,8 @@ impl FSOps for DevFSDriver {
                     major: entry.major,
                     minor: entry.minor,
                     offset: 0,
+                    device: entry.device.clone(),
+                    text: None,
                 }));
             }
         }
@@ -102,16 +134,15 @@ impl FSOps for DevFSDriver {
     }
 }
 
+/// the device is called without holding the devfs lock, reads from a
+/// device can block for a long time.
 impl FDOps for DevFSDriver {
     fn read(&self, fd: &mut FileDescriptor, buffer: &mut [u8]) -> Result<usize, FSError> {
         match fd {
             FileDescriptor::DevFSNode(devfd) => {
-                let mut dev_lock = DEV_FS.lock();
-                if let Some(dev_index) = get_dev_index(&dev_lock, devfd.major, devfd.minor) {
-                    let entry: &mut DevFSEntry = dev_lock.get_mut(dev_index).unwrap();
-                    // perform read operation on the device
-                    return entry.device.as_ref().read(devfd, buffer);
-                }
+                // perform read operation on the device
+                let device = devfd.device.clone();
+                return device.read(devfd, buffer);
             }
             _ => {}
         }
@@ -122,12 +153,9 @@ impl FDOps for DevFSDriver {
     fn write(&self, fd: &mut FileDescriptor, buffer: &[u8]) -> Result<usize, FSError> {
         match fd {
             FileDescriptor::DevFSNode(devfd) => {
-                let mut dev_lock = DEV_FS.lock();
-                if let Some(dev_index) = get_dev_index(&dev_lock, devfd.major, devfd.minor) {
-                    let entry: &mut DevFSEntry = dev_lock.get_mut(dev_index).unwrap();
-                    // perform write operation on the device
-                    return entry.device.as_ref().write(devfd, &buffer);
-                }
+                // perform write operation on the device
+                let device = devfd.device.clone();
+                return device.write(devfd, &buffer);
             }
             _ => {}
         }
@@ -138,12 +166,8 @@ impl FDOps for DevFSDriver {
     fn ioctl(&self, fd: &mut FileDescriptor, command: usize, arg: usize) -> Result<usize, FSError> {
         match fd {
             FileDescriptor::DevFSNode(devfd) => {
-                let mut dev_lock = DEV_FS.lock();
-                if let Some(dev_index) = get_dev_index(&dev_lock, devfd.major, devfd.minor) {
-                    let entry: &mut DevFSEntry = dev_lock.get_mut(dev_index).unwrap();
-                    // perform ioctl operation on the device
-                    return entry.device.as_ref().ioctl(command, arg);
-                }
+                // perform ioctl operation on the device
+                return devfd.device.ioctl(command, arg);
             }
             _ => {}
         }
@@ -154,12 +178,8 @@ impl FDOps for DevFSDriver {
     fn seek(&self, fd: &mut FileDescriptor, offset: u32, st: SeekType) -> Result<u32, FSError> {
         match fd {
             FileDescriptor::DevFSNode(devfd) => {
-                let mut dev_lock = DEV_FS.lock();
-                if let Some(dev_index) = get_dev_index(&dev_lock, devfd.major, devfd.minor) {
-                    let entry: &mut DevFSEntry = dev_lock.get_mut(dev_index).unwrap();
-                    // perform read operation on the device
-                    return entry.device.as_ref().seek(devfd, offset, st);
-                }
+                let device = devfd.device.clone();
+                return device.seek(devfd, offset, st);
             }
             _ => {}
         }
@@ -171,8 +191,7 @@ impl FDOps for DevFSDriver {
 /// mounts the devfs on the given path:
 pub fn mount_devfs(path: &str) {
     let mount_info = MountInfo::DevFS(DevFSDriver::new());
-    let mut fs_lock: MutexGuard<VFS> = FILESYSTEM.lock();
-    fs_lock
+    FILESYSTEM
         .mount_at(path, mount_info)
         .expect("Error when mounting devfs");
     log::info!("Mounted devfs at {}", path);
@@ -195,7 +214,7 @@ pub fn register_device(
         name: String::from(name),
         major,
         minor,
-        device,
+        device: Arc::from(device),
         ref_count: 0,
     };
 
@@ -208,8 +227,54 @@ pub fn unregister_device(major: u32, minor: u32) -> Result<(), FSError> {
     let mut devfs_lock = DEV_FS.lock();
     if let Some(index) = get_dev_index(&devfs_lock, major, minor) {
         devfs_lock.remove(index);
+        bcache::invalidate(major, minor);
         return Ok(());
     }
 
     Err(FSError::NotFound)
 }
+
+/// the text of the descriptor, generated by `generate` if there is none
+/// yet or if `refresh` is set. It is kept with the descriptor, so a reader
+/// going through it in small reads sees one snapshot at fixed offsets.
+fn text_of<F>(fd: &mut DevFSDescriptor, refresh: bool, generate: F) -> Arc<String>
+where
+    F: FnOnce() -> String,
+{
+    if refresh || fd.text.is_none() {
+        fd.text = Some(Arc::new(generate()));
+    }
+
+    fd.text.as_ref().unwrap().clone()
+}
+
+/// serves a read of a device whose contents are generated as text, from
+/// the offset of the descriptor on. A read at offset 0 takes a new snapshot.
+pub fn read_text<F>(fd: &mut DevFSDescriptor, buffer: &mut [u8], generate: F) -> usize
+where
+    F: FnOnce() -> String,
+{
+    let refresh = fd.offset == 0;
+    let text = text_of(fd, refresh, generate);
+    let start = (fd.offset as usize).min(text.len());
+    let length = buffer.len().min(text.len() - start);
+
+    buffer[0..length].copy_from_slice(&text.as_bytes()[start..start + length]);
+    fd.offset += length as u64;
+    length
+}
+
+/// seeks in the text served by `read_text`, the end is that of the snapshot
+/// kept with the descriptor.
+pub fn seek_text<F>(fd: &mut DevFSDescriptor, offset: u32, st: SeekType, generate: F) -> u32
+where
+    F: FnOnce() -> String,
+{
+    match st {
+        SeekType::SEEK_SET => fd.offset = offset as u64,
+        SeekType::SEEK_CUR => fd.offset += offset as u64,
+        SeekType::SEEK_END => fd.offset = text_of(fd, false, generate).len() as u64,
+    }
+
+    fd.offset as u32
+}
@@ -0,0 +1,141 @@
+extern crate alloc;
+extern crate spin;
+
+use crate::system::filesystem::devfs::DevFSDevice;
+use crate::system::filesystem::{FileDescriptor, PollEvents};
+use crate::system::net::types::SocketRef;
+
+use alloc::{collections::BTreeMap, sync::Arc, vec::Vec};
+use core::fmt;
+use spin::Mutex;
+
+/// Things whose readiness can be watched, the interest keeps it alive
+/// even if the descriptor it was added with is closed.
+#[derive(Clone)]
+pub enum PollSource {
+    Device(DevFSDevice),
+    Socket(SocketRef),
+}
+
+impl PollSource {
+    /// the source behind the descriptor, `None` if it is always ready
+    /// like a regular file, or can't be watched.
+    pub fn from_fd(fd: &FileDescriptor) -> Option<PollSource> {
+        match fd {
+            FileDescriptor::DevFSNode(devfd) => Some(PollSource::Device(devfd.device.clone())),
+            FileDescriptor::SocketNode(sockfd) => Some(PollSource::Socket(sockfd.socket.clone())),
+            _ => None,
+        }
+    }
+
+    #[inline]
+    pub fn poll_events(&self) -> PollEvents {
+        match self {
+            PollSource::Device(device) => device.poll_events(),
+            PollSource::Socket(socket) => socket.poll_events(),
+        }
+    }
+}
+
+#[derive(Clone)]
+pub struct EpollInterest {
+    pub source: PollSource,
+    pub events: PollEvents,
+    /// returned as it is with the events
+    pub data: u64,
+}
+
+/// The interest list of an epoll descriptor, keyed by the descriptor index
+/// the source was added with. Readiness is level triggered, a source is
+/// reported for as long as it is ready.
+pub struct EpollInstance {
+    interests: BTreeMap<usize, EpollInterest>,
+}
+
+#[derive(Debug)]
+pub enum EpollError {
+    AlreadyExist,
+    NotFound,
+}
+
+impl EpollInstance {
+    pub fn empty() -> Self {
+        EpollInstance {
+            interests: BTreeMap::new(),
+        }
+    }
+
+    pub fn add(&mut self, fd_index: usize, interest: EpollInterest) -> Result<(), EpollError> {
+        if self.interests.contains_key(&fd_index) {
+            return Err(EpollError::AlreadyExist);
+        }
+
+        self.interests.insert(fd_index, interest);
+        Ok(())
+    }
+
+    pub fn modify(
+        &mut self,
+        fd_index: usize,
+        events: PollEvents,
+        data: u64,
+    ) -> Result<(), EpollError> {
+        let interest_opt = self.interests.get_mut(&fd_index);
+        if interest_opt.is_none() {
+            return Err(EpollError::NotFound);
+        }
+
+        let interest = interest_opt.unwrap();
+        interest.events = events;
+        interest.data = data;
+        Ok(())
+    }
+
+    pub fn remove(&mut self, fd_index: usize) -> Result<(), EpollError> {
+        if self.interests.remove(&fd_index).is_none() {
+            return Err(EpollError::NotFound);
+        }
+
+        Ok(())
+    }
+
+    /// the sources ready for what they are watched for, `max_events` at most.
+    /// Errors and hang ups are always reported.
+    pub fn ready_events(&self, max_events: usize) -> Vec<(PollEvents, u64)> {
+        let mut ready = Vec::new();
+        for interest in self.interests.values() {
+            if ready.len() == max_events {
+                break;
+            }
+
+            let watched = interest.events | PollEvents::POLLERR | PollEvents::POLLHUP;
+            let events = interest.source.poll_events() & watched;
+            if !events.is_empty() {
+                ready.push((events, interest.data));
+            }
+        }
+
+        ready
+    }
+}
+
+/// An epoll instance in the descriptor table of a process, shared by the
+/// descriptors cloned from it.
+#[derive(Clone)]
+pub struct EpollDescriptor {
+    pub instance: Arc<Mutex<EpollInstance>>,
+}
+
+impl EpollDescriptor {
+    pub fn new() -> Self {
+        EpollDescriptor {
+            instance: Arc::new(Mutex::new(EpollInstance::empty())),
+        }
+    }
+}
+
+impl fmt::Debug for EpollDescriptor {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("EpollDescriptor").finish()
+    }
+}
@@ -1,12 +1,17 @@
 extern crate alloc;
 extern crate bitflags;
 
+pub mod bcache;
 pub mod detect;
 pub mod devfs;
+pub mod epoll;
 pub mod paths;
 pub mod ustar;
 pub mod vfs;
 
+use crate::system::net::types::SocketDescriptor;
+
+use alloc::sync::Arc;
 use bitflags::bitflags;
 use core::fmt;
 
@@ -26,6 +31,16 @@ bitflags! {
     }
 }
 
+bitflags! {
+    /// readiness of a descriptor, same values as the epoll events.
+    pub struct PollEvents: u32 {
+        const POLLIN = 0x001;
+        const POLLOUT = 0x004;
+        const POLLERR = 0x008;
+        const POLLHUP = 0x010;
+    }
+}
+
 #[allow(non_camel_case_types)]
 #[repr(u8)]
 pub enum SeekType {
@@ -64,7 +79,7 @@ pub enum MountInfo {
     DevFS(devfs::DevFSDriver),
     MemFS,
     BlockFS,
-    TarFS(ustar::TarFSDriver),
+    TarFS(Arc<ustar::TarFSDriver>),
 }
 
 #[derive(Debug, Clone)]
@@ -73,6 +88,8 @@ pub enum FileDescriptor {
     DevFSNode(devfs::DevFSDescriptor),
     Ext2Node,
     TarFSNode(ustar::TarFileDescriptor),
+    SocketNode(SocketDescriptor),
+    EpollNode(epoll::EpollDescriptor),
     Empty,
 }
 
@@ -96,13 +113,18 @@ pub enum FSError {
 
 /// Represents the operations performed on File-System
 pub trait FSOps {
-    fn open(&mut self, _path: &str, _flags: u32) -> Result<FileDescriptor, FSError> {
+    fn open(&self, _path: &str, _flags: u32) -> Result<FileDescriptor, FSError> {
         Err(FSError::NotYetImplemented)
     }
 
     fn close(&self, _fd: &FileDescriptor) -> Result<(), FSError> {
         Err(FSError::NotYetImplemented)
     }
+
+    /// status of the file at `path`, without opening it.
+    fn stat(&self, _path: &str) -> Result<FStatInfo, FSError> {
+        Err(FSError::NotYetImplemented)
+    }
 }
 
 /// operations on file-descriptor
@@ -1,14 +1,15 @@
 extern crate alloc;
 extern crate log;
 
-use crate::system::filesystem::devfs::DevFSDriver;
+use crate::system::filesystem::devfs::{DevFSDescriptor, DevFSDriver};
 use crate::system::filesystem::vfs::FILESYSTEM;
 use crate::system::filesystem::MountInfo;
 use crate::system::filesystem::{FDOps, FSOps};
 use crate::system::filesystem::{FSError, FileDescriptor, SeekType, FStatInfo};
 use crate::mm::Alignment;
 
-use alloc::{format, string::String};
+use alloc::{collections::BTreeMap, format, string::String, sync::Arc};
+use core::fmt;
 use core::mem;
 use core::str;
 
@@ -44,12 +45,17 @@ pub struct TarFileDescriptor {
     pub offset: usize,
     /// size of the file
     pub size: usize,
+    /// permission bits from the header
+    pub mode: usize,
     /// open flags
     pub flags: u32,
     ///seeked offset
     pub seeked_offset: usize,
-    /// driver name
-    pub driver_name: String,
+    /// the mounted archive the file is in, operations on the file go to it
+    /// without looking up the mount again.
+    pub driver: Arc<TarFSDriver>,
+    /// handle of the device the archive is on, reads go straight to it.
+    pub device: DevFSDescriptor,
 }
 
 #[inline]
@@ -69,98 +75,169 @@ fn oct_to_usize(buffer: &[u8]) -> usize {
     number
 }
 
-impl TarFS {
-    pub fn find_offset(devfd: &mut FileDescriptor, path: &str) -> Option<(usize, usize)> {
-        // iterate over the structure:
+/// an archive member, offsets are from the start of the device.
+#[derive(Debug, Clone)]
+pub struct TarEntry {
+    /// offset of the file data
+    pub offset: usize,
+    pub size: usize,
+    pub mode: usize,
+}
 
-        let mut buffer: [u8; HEADER_SIZE] = [0; HEADER_SIZE];
-        let mut block_no = 0;
+/// status of a member, the header has no more than it's size and mode.
+fn member_stat(size: usize, mode: usize) -> FStatInfo {
+    // TODO: fill in all the descriptors, as of now, they will be zeroes
+    let mut fstat_info = FStatInfo::default();
+    fstat_info.file_size = size;
+    fstat_info.mode = mode;
 
-        unsafe {
-            let devfs_driver = DevFSDriver::new();
-            // open the device:
-            loop {
-                let read_result = devfs_driver.read(devfd, &mut buffer);
-                if read_result.is_err() {
-                    log::debug!(
-                        "Disk IO error when reading from Tarfs, err={:?}",
-                        read_result.unwrap_err()
-                    );
-                    return None;
-                }
+    let aligned_size = Alignment::align_up(size as u64, 512);
+    fstat_info.blocks = (aligned_size / 512) as usize;
+    fstat_info.block_size = 512;
 
-                let (head, body, _tail) = buffer.align_to::<TarHeader>();
-                assert_eq!(head.is_empty(), true);
-                let tar_header = &body[0];
+    fstat_info
+}
 
-                let signature = str::from_utf8_unchecked(&tar_header.signature);
+/// the paths of all the members of a mounted archive
+pub struct TarIndex {
+    pub entries: BTreeMap<String, TarEntry>,
+}
 
-                if !signature.starts_with("ustar") {
-                    break;
-                }
+impl fmt::Debug for TarIndex {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("TarIndex")
+            .field("n_entries", &self.entries.len())
+            .finish()
+    }
+}
 
-                let read_path = str::from_utf8_unchecked(&tar_header.name);
-                // check path, are they equal?
-                if read_path.starts_with(path) {
-                    let file_entry = (block_no + 1) * mem::size_of::<TarHeader>();
-                    return Some((file_entry, oct_to_usize(&tar_header.size)));
-                }
+/// the header fields are NUL padded
+#[inline]
+fn header_str(field: &[u8]) -> &str {
+    let length = field
+        .iter()
+        .position(|&byte| byte == 0)
+        .unwrap_or(field.len());
+    unsafe { str::from_utf8_unchecked(&field[0..length]) }
+}
+
+impl TarFS {
+    /// walks all the headers of the archive once, the index maps the full
+    /// path of every member to where it's data is.
+    pub fn build_index(devfd: &mut FileDescriptor) -> TarIndex {
+        let mut entries = BTreeMap::new();
+        let mut buffer: [u8; HEADER_SIZE] = [0; HEADER_SIZE];
+        let mut block_no = 0;
 
-                let to_skip_bytes = oct_to_usize(&tar_header.size);
-                block_no += (to_skip_bytes + HEADER_SIZE - 1) / HEADER_SIZE;
-                block_no += 1;
+        let devfs_driver = DevFSDriver::new();
+        loop {
+            let seek_result =
+                devfs_driver.seek(devfd, (block_no * HEADER_SIZE) as u32, SeekType::SEEK_SET);
+            if seek_result.is_err() {
+                log::debug!("IO error on disk seek");
+                break;
+            }
 
-                let seek_result =
-                    devfs_driver.seek(devfd, (block_no * HEADER_SIZE) as u32, SeekType::SEEK_SET);
-                if seek_result.is_err() {
-                    log::debug!("IO error on disk seek");
-                    break;
-                }
+            let read_result = devfs_driver.read(devfd, &mut buffer);
+            if read_result.is_err() {
+                log::debug!(
+                    "Disk IO error when reading from Tarfs, err={:?}",
+                    read_result.unwrap_err()
+                );
+                break;
             }
+
+            let (head, body, _tail) = unsafe { buffer.align_to::<TarHeader>() };
+            assert_eq!(head.is_empty(), true);
+            let tar_header = &body[0];
+
+            if !header_str(&tar_header.signature).starts_with("ustar") {
+                break;
+            }
+
+            let name = header_str(&tar_header.name);
+            let prefix = header_str(&tar_header.name_prefix);
+            let path = if prefix.is_empty() {
+                String::from(name)
+            } else {
+                format!("{}/{}", prefix, name)
+            };
+
+            let size = oct_to_usize(&tar_header.size);
+            entries.insert(
+                path,
+                TarEntry {
+                    offset: (block_no + 1) * HEADER_SIZE,
+                    size,
+                    mode: oct_to_usize(&tar_header.mode),
+                },
+            );
+
+            block_no += (size + HEADER_SIZE - 1) / HEADER_SIZE;
+            block_no += 1;
         }
 
-        None
+        TarIndex { entries }
     }
 }
 
-#[derive(Debug, Clone)]
+#[derive(Debug)]
 pub struct TarFSDriver {
     pub device: String,
+    /// built when the archive is mounted.
+    pub index: TarIndex,
+    /// the device stays open while the archive is mounted, every file
+    /// opened from the archive gets a copy of this handle.
+    pub device_fd: DevFSDescriptor,
 }
 
 impl TarFSDriver {
-    pub fn new_from_drive(device: &str) -> Self {
-        TarFSDriver {
-            device: String::from(device),
+    /// reads the headers of the archive on the device and indexes them.
+    pub fn mount_drive(device: &str) -> Result<Self, FSError> {
+        let devfs_driver = DevFSDriver::new();
+        let devfd_result = devfs_driver.open(device, 0);
+        if devfd_result.is_err() {
+            log::debug!("error=Attempt to open unknown device {}", device);
+            return Err(FSError::DeviceNotFound);
+        }
+
+        let mut devfd = devfd_result.unwrap();
+        let index = TarFS::build_index(&mut devfd);
+
+        log::debug!(
+            "Indexed {} tarfs entries on {}",
+            index.entries.len(),
+            device
+        );
+
+        match devfd {
+            FileDescriptor::DevFSNode(device_fd) => Ok(TarFSDriver {
+                device: String::from(device),
+                index,
+                device_fd,
+            }),
+            _ => Err(FSError::DeviceNotFound),
         }
     }
 }
 
-impl FSOps for TarFSDriver {
-    fn open(&mut self, path: &str, flags: u32) -> Result<FileDescriptor, FSError> {
+/// the archive is mounted behind an `Arc`, which every opened file keeps.
+impl FSOps for Arc<TarFSDriver> {
+    fn open(&self, path: &str, flags: u32) -> Result<FileDescriptor, FSError> {
         let path = format!("tarfs{}", path);
 
-        let mut devfs_driver = DevFSDriver::new();
-
-        let devfd_result = devfs_driver.open(&self.device, 0);
-        if devfd_result.is_err() {
-            log::debug!("error=Attempt to open unknown device {}", self.device);
-            return Err(FSError::NotFound);
-        }
-
-        let mut devfd = devfd_result.unwrap();
-        if let Some((offset, size)) = TarFS::find_offset(&mut devfd, &path) {
-            let _ = devfs_driver.close(&devfd);
+        if let Some(entry) = self.index.entries.get(&path) {
             return Ok(FileDescriptor::TarFSNode(TarFileDescriptor {
-                offset,
-                size,
+                offset: entry.offset,
+                size: entry.size,
+                mode: entry.mode,
                 flags,
                 seeked_offset: 0,
-                driver_name: self.device.clone(),
+                driver: self.clone(),
+                device: self.device_fd.clone(),
             }));
         }
 
-        let _ = devfs_driver.close(&devfd);
         Err(FSError::NotFound)
     }
 
@@ -168,6 +245,16 @@ impl FSOps for TarFSDriver {
         // a stub
         Ok(())
     }
+
+    fn stat(&self, path: &str) -> Result<FStatInfo, FSError> {
+        let path = format!("tarfs{}", path);
+
+        if let Some(entry) = self.index.entries.get(&path) {
+            return Ok(member_stat(entry.size, entry.mode));
+        }
+
+        Err(FSError::NotFound)
+    }
 }
 
 impl FDOps for TarFSDriver {
@@ -176,45 +263,41 @@ impl FDOps for TarFSDriver {
         Err(FSError::InvalidOperation)
     }
 
+    /// reads from the current offset of the file and moves it past the
+    /// bytes read, the read is cut short at the end of the file.
     fn read(&self, fd: &mut FileDescriptor, buffer: &mut [u8]) -> Result<usize, FSError> {
-        let mut dev_driver = DevFSDriver::new();
-        let dev_result = dev_driver.open(&self.device, 0);
-
-        if dev_result.is_err() {
-            return Err(FSError::DeviceNotFound);
-        }
-        let mut dev_handle = dev_result.unwrap();
-
         match fd {
             FileDescriptor::TarFSNode(tarfd) => {
-                if buffer.len() != 512 {
-                    // as of now, we can read buffers at 512 sizes.
-                    return Err(FSError::InvalidOperation);
+                if tarfd.seeked_offset >= tarfd.size {
+                    return Ok(0);
                 }
 
-                let block_offset = tarfd.offset + tarfd.seeked_offset;
-
-                // seek to this offset
-                let seek_result =
-                    dev_driver.seek(&mut dev_handle, block_offset as u32, SeekType::SEEK_SET);
-                if seek_result.is_err() {
-                    return Err(FSError::InvalidSeek);
+                let n_read = buffer.len().min(tarfd.size - tarfd.seeked_offset);
+                if n_read == 0 {
+                    return Ok(0);
                 }
 
-                // read the block:
-                let read_result = dev_driver.read(&mut dev_handle, buffer);
+                // a private copy of the device handle, so concurrent readers
+                // of the archive don't share the device offset. It is placed
+                // directly, the 32 bit seek would cut offsets past 4GiB.
+                let dev_driver = DevFSDriver::new();
+                let mut device = tarfd.device.clone();
+                device.offset = (tarfd.offset + tarfd.seeked_offset) as u64;
+                let mut dev_handle = FileDescriptor::DevFSNode(device);
+
+                // the whole range is read with a single device read:
+                let read_result = dev_driver.read(&mut dev_handle, &mut buffer[0..n_read]);
+
                 if read_result.is_err() {
-                    return Err(FSError::IOError);
+                    return Err(read_result.unwrap_err());
                 }
 
-                // determine where to end the slice:
-                let remaining_size = tarfd.size - tarfd.seeked_offset;
-                let n_read = if remaining_size < 512 {
-                    remaining_size
-                } else {
-                    512
-                };
+                if read_result.unwrap() != n_read {
+                    // the archive is shorter than it's headers say.
+                    return Err(FSError::IOError);
+                }
 
+                tarfd.seeked_offset += n_read;
                 return Ok(n_read);
             }
             _ => {}
@@ -225,14 +308,9 @@ impl FDOps for TarFSDriver {
     fn seek(&self, fd: &mut FileDescriptor, offset: u32, st: SeekType) -> Result<u32, FSError> {
         match fd {
             FileDescriptor::TarFSNode(tarfd) => {
-                if offset % 512 != 0 {
-                    // seek offset must be a % 512
-                    return Err(FSError::InvalidSeek);
-                }
-
                 match st {
                     SeekType::SEEK_SET => {
-                        if tarfd.seeked_offset > tarfd.size {
+                        if offset as usize > tarfd.size {
                             return Err(FSError::InvalidSeek);
                         }
                         tarfd.seeked_offset = offset as usize;
@@ -259,15 +337,7 @@ impl FDOps for TarFSDriver {
     fn fstat(&self, fd: &mut FileDescriptor) -> Result<FStatInfo, FSError> {
         match fd {
             FileDescriptor::TarFSNode(tarfd) => {
-                // TODO: fill in all the descriptors, as of now, they will be zeroes
-                let mut fstat_info = FStatInfo::default();
-                fstat_info.file_size = tarfd.size;
-
-                let aligned_size = Alignment::align_up(tarfd.size as u64, 512);
-                fstat_info.blocks = (aligned_size / 512) as usize;
-                fstat_info.block_size = 512;
-
-                return Ok(fstat_info);
+                return Ok(member_stat(tarfd.size, tarfd.mode));
             }
             _ => {}
         }
@@ -286,11 +356,16 @@ impl FDOps for TarFSDriver {
 }
 
 pub fn mount_tarfs(device: &str, path: &str) {
-    let mut fs_lock = FILESYSTEM.lock();
-    let tarfs = TarFSDriver::new_from_drive(device);
-    let mount_info = MountInfo::TarFS(tarfs);
+    let tarfs_result = TarFSDriver::mount_drive(device);
+    if tarfs_result.is_err() {
+        log::error!("Failed to mount tarfs from {}", device);
+        return;
+    }
+
+    let tarfs = tarfs_result.unwrap();
+    let mount_info = MountInfo::TarFS(Arc::new(tarfs));
 
-    fs_lock
+    FILESYSTEM
         .mount_at(path, mount_info)
         .expect("Failed to mount tarfs");
     log::info!("Mounted tarfs at {}", path);
@@ -3,18 +3,17 @@ extern crate spin;
 
 use crate::system::filesystem::devfs::DevFSDriver;
 use crate::system::filesystem::paths;
-use crate::system::filesystem::ustar::TarFSDriver;
 use crate::system::filesystem::{FDOps, FSError, FSOps, FileDescriptor, MountInfo, SeekType, FStatInfo};
 
-use alloc::{boxed::Box, string::String, vec::Vec};
-use spin::Mutex;
+use alloc::{collections::BTreeMap, string::String, sync::Arc, vec::Vec};
+use spin::RwLock;
 
 use lazy_static::lazy_static;
 
 #[derive(Debug, Clone)]
 pub struct VFSMountPoint {
     pub path: String,
-    pub mountinfo: Box<MountInfo>,
+    pub mountinfo: Arc<MountInfo>,
     pub ref_count: usize,
 }
 
@@ -32,97 +31,179 @@ impl VFSMountPoint {
     }
 }
 
-#[derive(Debug, Clone)]
+/// A node per path component, a mount hangs off the node of it's path.
+#[derive(Debug)]
+struct MountNode {
+    children: BTreeMap<String, MountNode>,
+    mountpoint: Option<VFSMountPoint>,
+}
+
+impl MountNode {
+    fn empty() -> Self {
+        MountNode {
+            children: BTreeMap::new(),
+            mountpoint: None,
+        }
+    }
+
+    fn find(&self, path: &str) -> Option<&MountNode> {
+        let mut node = self;
+        for component in components(path) {
+            node = node.children.get(component)?;
+        }
+        Some(node)
+    }
+
+    fn find_mut(&mut self, path: &str) -> Option<&mut MountNode> {
+        let mut node = self;
+        for component in components(path) {
+            node = node.children.get_mut(component)?;
+        }
+        Some(node)
+    }
+
+    fn count(&self) -> usize {
+        let mut count = if self.mountpoint.is_some() { 1 } else { 0 };
+        for child in self.children.values() {
+            count += child.count();
+        }
+        count
+    }
+
+    fn dump(&self) {
+        if let Some(mp) = &self.mountpoint {
+            log::debug!("mountpath={}, mount_type={:?}", mp.path, mp.mountinfo)
+        }
+
+        for child in self.children.values() {
+            child.dump();
+        }
+    }
+}
+
+/// components of the path, empty ones are skipped so "/dev/" and "/dev"
+/// are the same path.
+#[inline]
+fn components<'a>(path: &'a str) -> impl Iterator<Item = &'a str> {
+    paths::create_iter(path).filter(|component| !component.is_empty())
+}
+
+/// Mounts are looked up by path component, open files refer to their
+/// file-system directly so reads and writes do not go through the VFS.
 pub struct VFS {
-    pub mountpoints: Vec<VFSMountPoint>,
+    mounts: RwLock<MountNode>,
 }
 
 impl VFS {
     pub fn empty() -> Self {
         VFS {
-            mountpoints: Vec::new(),
+            mounts: RwLock::new(MountNode::empty()),
         }
     }
 
-    pub fn mount_at(&mut self, path: &str, mountinfo: MountInfo) -> Result<(), FSError> {
+    pub fn mount_at(&self, path: &str, mountinfo: MountInfo) -> Result<(), FSError> {
+        let mut mounts = self.mounts.write();
+        let mut node: &mut MountNode = &mut mounts;
+        for component in components(path) {
+            node = node
+                .children
+                .entry(String::from(component))
+                .or_insert_with(MountNode::empty);
+        }
+
         // exists?
-        if let Some(_) = self.get_mount_index(&path) {
+        if node.mountpoint.is_some() {
             return Err(FSError::AlreadyExist);
         }
 
         // create a mount:
-        let mountpoint = VFSMountPoint {
+        node.mountpoint = Some(VFSMountPoint {
             path: String::from(path),
-            mountinfo: Box::new(mountinfo),
+            mountinfo: Arc::new(mountinfo),
             ref_count: 0,
-        };
+        });
 
-        self.mountpoints.push(mountpoint);
         return Ok(());
     }
 
-    /// is the mount point exists at given path? if yes return the index
-    /// or return `None`.
-    pub fn get_mount_index(&self, path: &str) -> Option<usize> {
-        for (idx, mount) in self.mountpoints.iter().enumerate() {
-            if mount.path == path {
-                return Some(idx);
-            }
+    /// is there a mount point at the given path?
+    pub fn is_mounted(&self, path: &str) -> bool {
+        match self.mounts.read().find(path) {
+            Some(node) => node.mountpoint.is_some(),
+            None => false,
         }
-        None
     }
 
-    pub fn remove_mount(&mut self, path: &str) -> Result<(), FSError> {
-        if let Some(mount_index) = self.get_mount_index(path) {
-            if (&self.mountpoints[mount_index]).ref_count != 0 {
+    pub fn remove_mount(&self, path: &str) -> Result<(), FSError> {
+        let mut mounts = self.mounts.write();
+        let node_opt = mounts.find_mut(path);
+        if node_opt.is_none() {
+            return Err(FSError::NotFound);
+        }
+
+        let node = node_opt.unwrap();
+        match &node.mountpoint {
+            None => Err(FSError::NotFound),
+            Some(mountpoint) if mountpoint.ref_count != 0 => {
                 // device is being referenced by other mountpoints:
-                return Err(FSError::Busy);
+                Err(FSError::Busy)
+            }
+            Some(_) => {
+                // the empty nodes on the way are left, there are not many of them.
+                node.mountpoint = None;
+                Ok(())
             }
-
-            self.mountpoints.remove(mount_index);
-            return Ok(());
         }
-        Err(FSError::NotFound)
     }
 
-    /// returns the index of matching mountpoint
-    /// resolves the path using longest prefix search to get the
-    /// latest mountpoint matching the given path prefix
-    /// the path provided to this function must be cananoized path.
-    pub fn get_matching_mountpoint(&self, path: &str) -> Result<(usize, usize), FSError> {
-        let mut curr_prefix_length = 0;
-        let mut curr_index: i32 = -1;
+    /// returns the deepest mountpoint on the path along with the rest of the
+    /// path below it, starting with a '/'. The path provided to this function
+    /// must be a canonical path.
+    pub fn get_matching_mountpoint(&self, path: &str) -> Result<(Arc<MountInfo>, String), FSError> {
+        let mounts = self.mounts.read();
+        let mut node: &MountNode = &mounts;
 
-        for (idx, mountpoint) in self.mountpoints.iter().enumerate() {
-            if path.starts_with(&mountpoint.path) {
-                // longest prefix?
-                let new_length = mountpoint.path.len();
-                if mountpoint.path.len() > curr_prefix_length {
-                    curr_prefix_length = new_length;
-                    curr_index = idx as i32;
-                }
+        let all_components: Vec<&str> = components(path).collect();
+        let mut matched: Option<(Arc<MountInfo>, usize)> =
+            node.mountpoint.as_ref().map(|mp| (mp.mountinfo.clone(), 0));
+
+        for (depth, component) in all_components.iter().enumerate() {
+            let child_opt = node.children.get(*component);
+            if child_opt.is_none() {
+                break;
+            }
+
+            node = child_opt.unwrap();
+            if let Some(mp) = &node.mountpoint {
+                matched = Some((mp.mountinfo.clone(), depth + 1));
             }
         }
 
-        if curr_index < 0 {
+        if matched.is_none() {
             // no mountpoint found:
             return Err(FSError::NotFound);
         }
 
-        // safe to convert because index >= 0
-        Ok((curr_index as usize, curr_prefix_length))
+        let (mountinfo, depth) = matched.unwrap();
+        let mut remaining_path = String::from("/");
+        remaining_path.push_str(&all_components[depth..].join("/"));
+
+        Ok((mountinfo, remaining_path))
+    }
+
+    #[inline]
+    pub fn n_mountpoints(&self) -> usize {
+        self.mounts.read().count()
     }
 
     /// dumps all the mountpoints
     pub fn debug_dump_mountpoints(&self) {
-        for mp in &self.mountpoints {
-            log::debug!("mountpath={}, mount_type={:?}", mp.path, mp.mountinfo)
-        }
+        self.mounts.read().dump();
     }
 }
 
 impl FSOps for VFS {
-    fn open(&mut self, path: &str, flags: u32) -> Result<FileDescriptor, FSError> {
+    fn open(&self, path: &str, flags: u32) -> Result<FileDescriptor, FSError> {
         // get the longest prefix mountpoint:
         let formatted_path_opt = paths::resolve(path);
         if formatted_path_opt.is_none() {
@@ -136,15 +217,13 @@ impl FSOps for VFS {
             return Err(FSError::NotFound);
         }
 
-        let (mp_index, spl_pos) = mp_result.unwrap();
-        let entry: &mut VFSMountPoint = self.mountpoints.get_mut(mp_index).unwrap();
-        match entry.mountinfo.as_mut() {
+        // the mount table is not locked while the file-system opens the file.
+        let (mountinfo, remaining_path) = mp_result.unwrap();
+        match mountinfo.as_ref() {
             MountInfo::DevFS(dev_driver) => {
-                let (_, remaining_path) = formatted_path.split_at(spl_pos);
                 return dev_driver.open(&remaining_path, flags);
             }
             MountInfo::TarFS(tar_driver) => {
-                let (_, remaining_path) = formatted_path.split_at(spl_pos);
                 return tar_driver.open(&remaining_path, flags);
             }
             _ => {
@@ -161,6 +240,37 @@ impl FSOps for VFS {
                 let devfs_driver = DevFSDriver::new();
                 return devfs_driver.close(fd);
             }
+            FileDescriptor::TarFSNode(tarfd) => {
+                return tarfd.driver.close(fd);
+            }
+            FileDescriptor::SocketNode(_) | FileDescriptor::EpollNode(_) => {
+                // released with the last descriptor that refers to them.
+                return Ok(());
+            }
+            _ => {
+                return Err(FSError::NotYetImplemented);
+            }
+        }
+    }
+
+    fn stat(&self, path: &str) -> Result<FStatInfo, FSError> {
+        let formatted_path_opt = paths::resolve(path);
+        if formatted_path_opt.is_none() {
+            return Err(FSError::IllegalPath);
+        }
+
+        let formatted_path = formatted_path_opt.unwrap();
+
+        let mp_result = self.get_matching_mountpoint(&formatted_path);
+        if mp_result.is_err() {
+            return Err(FSError::NotFound);
+        }
+
+        let (mountinfo, remaining_path) = mp_result.unwrap();
+        match mountinfo.as_ref() {
+            MountInfo::TarFS(tar_driver) => {
+                return tar_driver.stat(&remaining_path);
+            }
             _ => {
                 return Err(FSError::NotYetImplemented);
             }
@@ -168,6 +278,8 @@ impl FSOps for VFS {
     }
 }
 
+/// Reads, writes, seeks, ioctls and stats are served by the file-system
+/// recorded in the descriptor, they take no VFS lock.
 impl FDOps for VFS {
     fn read(&self, fd: &mut FileDescriptor, buffer: &mut [u8]) -> Result<usize, FSError> {
         match fd {
@@ -176,7 +288,7 @@ impl FDOps for VFS {
                 return devfs_driver.read(fd, buffer);
             }
             FileDescriptor::TarFSNode(tarfd) => {
-                let tarfs_driver = TarFSDriver::new_from_drive(&tarfd.driver_name);
+                let tarfs_driver = tarfd.driver.clone();
                 return tarfs_driver.read(fd, buffer);
             }
             _ => {
@@ -192,7 +304,7 @@ impl FDOps for VFS {
                 return devfs_driver.write(fd, &buffer);
             }
             FileDescriptor::TarFSNode(tarfd) => {
-                let tarfs_driver = TarFSDriver::new_from_drive(&tarfd.driver_name);
+                let tarfs_driver = tarfd.driver.clone();
                 return tarfs_driver.write(fd, buffer);
             }
             _ => {
@@ -220,7 +332,7 @@ impl FDOps for VFS {
                 return devfs_driver.seek(fd, offset, st);
             }
             FileDescriptor::TarFSNode(tarfd) => {
-                let tar_driver = TarFSDriver::new_from_drive(&tarfd.driver_name);
+                let tar_driver = tarfd.driver.clone();
                 return tar_driver.seek(fd, offset, st);
             }
             _ => {
@@ -232,7 +344,7 @@ impl FDOps for VFS {
     fn fstat(&self, fd: &mut FileDescriptor) -> Result<FStatInfo, FSError> {
         match fd {
             FileDescriptor::TarFSNode(tarfd) => {
-                let trafs_driver = TarFSDriver::new_from_drive(&tarfd.driver_name);
+                let trafs_driver = tarfd.driver.clone();
                 return trafs_driver.fstat(fd);
             }
             _ => {
@@ -243,12 +355,12 @@ impl FDOps for VFS {
 }
 
 lazy_static! {
-    pub static ref FILESYSTEM: Mutex<VFS> = Mutex::new(VFS::empty());
+    pub static ref FILESYSTEM: VFS = VFS::empty();
 }
 
 pub fn setup_fs() {
     log::info!(
         "VFS set-up successful, n_mountpoints={}",
-        FILESYSTEM.lock().mountpoints.len()
+        FILESYSTEM.n_mountpoints()
     )
 }
@@ -0,0 +1,459 @@
+extern crate alloc;
+extern crate log;
+extern crate spin;
+
+use crate::acpi::lapic::MAX_PROCESSORS;
+use crate::cpu;
+use crate::cpu::percpu::PerCPU;
+use crate::cpu::tsc::TSC;
+use crate::drivers::display::fb_text::FRAMEBUFFER_LOGGER;
+use crate::drivers::display::framebuffer::Pixel;
+use crate::drivers::uart::UART_DRIVER;
+use crate::mm::VirtualAddress;
+use crate::system::filesystem::devfs::{self, DevFSDescriptor, DevOps};
+use crate::system::filesystem::{FSError, SeekType};
+use crate::system::process::PID;
+use crate::system::ring::RecordRing;
+use crate::system::tasking;
+use crate::system::tasking::wait_queue::WaitEvent;
+use crate::system::thread;
+use crate::system::timer::SystemTimer;
+
+use alloc::{boxed::Box, format, string::String, vec, vec::Vec};
+use core::fmt::{self, Write};
+use core::ptr;
+use core::sync::atomic::{AtomicBool, AtomicPtr, AtomicU64, Ordering};
+use log::Level;
+use spin::Mutex;
+
+/// entries kept per processor, older ones are overwritten. The drainer is
+/// woken up when a ring is half full, the other half takes the lines logged
+/// until it runs.
+const KMSG_RING_ENTRIES: usize = 128;
+/// longer lines are cut.
+const KMSG_TEXT_LEN: usize = 160;
+
+/// system ticks between two runs of the drainer, if no ring fills up before.
+const KMSG_DRAIN_TICKS: u64 = 1;
+
+#[derive(Clone, Copy)]
+struct LogEntry {
+    tsc: u64,
+    level: Level,
+    length: usize,
+    text: [u8; KMSG_TEXT_LEN],
+}
+
+impl LogEntry {
+    #[inline]
+    fn text(&self) -> &str {
+        // the text is cut at a character boundary when it is written.
+        unsafe { core::str::from_utf8_unchecked(&self.text[0..self.length]) }
+    }
+}
+
+/// formats into the text of an entry, cutting what does not fit.
+struct EntryWriter<'a> {
+    entry: &'a mut LogEntry,
+}
+
+impl<'a> fmt::Write for EntryWriter<'a> {
+    fn write_str(&mut self, string: &str) -> fmt::Result {
+        let free = KMSG_TEXT_LEN - self.entry.length;
+        let mut length = string.len().min(free);
+        while !string.is_char_boundary(length) {
+            length -= 1;
+        }
+
+        let start = self.entry.length;
+        self.entry.text[start..start + length].copy_from_slice(&string.as_bytes()[0..length]);
+        self.entry.length += length;
+        Ok(())
+    }
+}
+
+/// A ring written only by it's own processor with interrupts disabled,
+/// see `RecordRing`. The drainer follows every ring with it's own cursor.
+type LogRing = RecordRing<LogEntry, Box<[LogEntry]>>;
+
+const LOG_ENTRY_INIT: LogEntry = LogEntry {
+    tsc: 0,
+    level: Level::Info,
+    length: 0,
+    text: [0; KMSG_TEXT_LEN],
+};
+
+/// one ring per processor, set up once the heap is ready. Records logged
+/// before that only go to the outputs.
+static LOG_RINGS: AtomicPtr<Vec<LogRing>> = AtomicPtr::new(ptr::null_mut());
+
+/// the drainer thread runs, records are left to it.
+static DRAINER_RUNNING: AtomicBool = AtomicBool::new(false);
+
+/// set when a ring got half full, the drainer runs again right away.
+static DRAIN_REQUESTED: AtomicBool = AtomicBool::new(false);
+
+const NOT_DRAINED: AtomicU64 = AtomicU64::new(0);
+
+/// the drain cursor of every ring, read without the drain state lock by the
+/// processors that log to see how far behind the drainer is.
+static DRAINED: [AtomicU64; MAX_PROCESSORS] = [NOT_DRAINED; MAX_PROCESSORS];
+
+/// next entry to drain on every ring, and the entries lost since the last drain.
+struct DrainState {
+    cursors: [u64; MAX_PROCESSORS],
+    lost: u64,
+}
+
+static DRAIN_STATE: Mutex<DrainState> = Mutex::new(DrainState {
+    cursors: [0; MAX_PROCESSORS],
+    lost: 0,
+});
+
+#[inline]
+fn rings() -> Option<&'static Vec<LogRing>> {
+    let rings_ptr = LOG_RINGS.load(Ordering::Acquire);
+    if rings_ptr.is_null() {
+        return None;
+    }
+
+    Some(unsafe { &*rings_ptr })
+}
+
+/// takes the entries after `cursors` from all the rings, oldest first.
+fn merge_entries<F>(rings: &Vec<LogRing>, cursors: &mut [u64], lost: &mut u64, mut func: F)
+where
+    F: FnMut(&LogEntry),
+{
+    loop {
+        let mut oldest: Option<(usize, LogEntry)> = None;
+        for (index, ring) in rings.iter().enumerate() {
+            let head = ring.head();
+            while cursors[index] < head {
+                // anything older than the tail is gone.
+                let tail = ring.tail();
+                if cursors[index] < tail {
+                    *lost += tail - cursors[index];
+                    cursors[index] = tail;
+                }
+
+                match ring.read(cursors[index]) {
+                    Some(entry) => {
+                        let is_older = match oldest.as_ref() {
+                            Some((_, current)) => entry.tsc < current.tsc,
+                            None => true,
+                        };
+                        if is_older {
+                            oldest = Some((index, entry));
+                        }
+                        break;
+                    }
+                    None => {
+                        *lost += 1;
+                        cursors[index] += 1;
+                    }
+                }
+            }
+        }
+
+        match oldest {
+            Some((index, entry)) => {
+                cursors[index] += 1;
+                func(&entry);
+            }
+            None => return,
+        }
+    }
+}
+
+fn get_color(level: Level) -> Pixel {
+    match level {
+        Level::Error => Pixel {
+            b: 0,
+            g: 0,
+            r: 255,
+            channel: 0,
+        },
+        Level::Warn => Pixel {
+            b: 0,
+            g: 255,
+            r: 255,
+            channel: 0,
+        },
+        _ => Pixel {
+            b: 255,
+            g: 255,
+            r: 255,
+            channel: 0,
+        },
+    }
+}
+
+/// writes a line to the UART, and to the framebuffer up to `Info`. Outside
+/// of the drainer the outputs are only tried, the interrupted code may hold them.
+pub fn write_outputs(level: Level, text: &str, blocking: bool) {
+    write_line(level, text, blocking);
+    flush_framebuffer(blocking);
+}
+
+/// like `write_outputs`, but the framebuffer is not flushed.
+fn write_line(level: Level, text: &str, blocking: bool) {
+    if UART_DRIVER.is_some() {
+        let mutexed_uart = UART_DRIVER.as_ref().unwrap();
+        let uart_opt = if blocking {
+            Some(mutexed_uart.lock())
+        } else {
+            mutexed_uart.try_lock()
+        };
+
+        if let Some(mut uart) = uart_opt {
+            let _ = write!(uart, "{}\n", text);
+        }
+    }
+
+    if level <= Level::Info {
+        let fb_lgr_opt = if blocking {
+            Some(FRAMEBUFFER_LOGGER.lock())
+        } else {
+            FRAMEBUFFER_LOGGER.try_lock()
+        };
+
+        if let Some(mut fb_lgr_lock) = fb_lgr_opt {
+            fb_lgr_lock.set_color(get_color(level));
+            let _ = write!(fb_lgr_lock, "{}\n", text);
+        }
+    }
+}
+
+fn flush_framebuffer(blocking: bool) {
+    let fb_lgr_opt = if blocking {
+        Some(FRAMEBUFFER_LOGGER.lock())
+    } else {
+        FRAMEBUFFER_LOGGER.try_lock()
+    };
+
+    if let Some(fb_lgr_lock) = fb_lgr_opt {
+        fb_lgr_lock.flush();
+    }
+}
+
+/// writes the entries not drained yet to the outputs.
+fn drain(blocking: bool) {
+    let rings_opt = rings();
+    if rings_opt.is_none() {
+        return;
+    }
+
+    // whoever holds it drains these entries too.
+    let state_opt = if blocking {
+        Some(DRAIN_STATE.lock())
+    } else {
+        DRAIN_STATE.try_lock()
+    };
+
+    if state_opt.is_none() {
+        return;
+    }
+
+    let mut state = state_opt.unwrap();
+    let state = &mut *state;
+    merge_entries(
+        rings_opt.unwrap(),
+        &mut state.cursors,
+        &mut state.lost,
+        |entry| {
+            write_line(entry.level, entry.text(), blocking);
+        },
+    );
+
+    for (index, cursor) in state.cursors.iter().enumerate() {
+        DRAINED[index].store(*cursor, Ordering::Relaxed);
+    }
+
+    if state.lost != 0 {
+        let lost_line = format!("kmsg: {} messages lost", state.lost);
+        write_line(Level::Warn, &lost_line, blocking);
+        state.lost = 0;
+    }
+
+    // the whole batch goes to the screen at once.
+    flush_framebuffer(blocking);
+}
+
+/// records a line in the ring of the calling processor. Returns false if
+/// the rings are not set up yet.
+pub fn record(level: Level, args: fmt::Arguments) -> bool {
+    let rings_opt = rings();
+    if rings_opt.is_none() {
+        return false;
+    }
+
+    let mut entry = LogEntry {
+        tsc: TSC::read_tsc().u64(),
+        level,
+        ..LOG_ENTRY_INIT
+    };
+    let _ = EntryWriter { entry: &mut entry }.write_fmt(args);
+
+    let interrupts_enabled = cpu::are_enabled();
+    cpu::disable_interrupts();
+
+    let index = PerCPU::current_index();
+    let ring = &rings_opt.unwrap()[index];
+    ring.push(entry);
+    let backlog = ring.head() - DRAINED[index].load(Ordering::Relaxed);
+
+    if interrupts_enabled {
+        cpu::enable_interrupts();
+    }
+
+    // until the drainer runs, whoever logs writes the outputs.
+    if !DRAINER_RUNNING.load(Ordering::Relaxed) {
+        drain(false);
+        return true;
+    }
+
+    // the drainer is woken up once, not for every line after that.
+    if backlog >= KMSG_RING_ENTRIES as u64 / 2 && !DRAIN_REQUESTED.swap(true, Ordering::SeqCst) {
+        tasking::notify_event(WaitEvent::KmsgBacklog);
+    }
+
+    true
+}
+
+/// writes out what the drainer did not get to yet, used when the system
+/// is going down.
+pub fn flush() {
+    drain(false);
+}
+
+pub fn setup_log_rings() {
+    let mut log_rings = Vec::with_capacity(MAX_PROCESSORS);
+    for _ in 0..MAX_PROCESSORS {
+        log_rings.push(RecordRing::new(
+            vec![LOG_ENTRY_INIT; KMSG_RING_ENTRIES].into_boxed_slice(),
+        ));
+    }
+
+    LOG_RINGS.store(Box::into_raw(Box::new(log_rings)), Ordering::Release);
+}
+
+fn log_drainer() {
+    DRAINER_RUNNING.store(true, Ordering::SeqCst);
+    loop {
+        drain(true);
+
+        let till_ticks = SystemTimer::current_ticks() + KMSG_DRAIN_TICKS;
+        let _ = tasking::wait_for_event_until(
+            WaitEvent::KmsgBacklog,
+            Some(till_ticks),
+            || -> Result<Option<()>, ()> {
+                if DRAIN_REQUESTED.swap(false, Ordering::SeqCst) {
+                    return Ok(Some(()));
+                }
+
+                Ok(None)
+            },
+        );
+    }
+}
+
+/// starts the drainer as a thread of the kernel process `pid`, log calls
+/// only record their lines from then on.
+pub fn start_log_drainer(pid: &PID) {
+    if rings().is_none() {
+        return;
+    }
+
+    let th_result = thread::new_from_function(
+        pid,
+        format!("log_drainer"),
+        VirtualAddress::from_u64(log_drainer as fn() as u64),
+    );
+
+    if th_result.is_err() {
+        log::error!(
+            "failed to start the log drainer: {:?}",
+            th_result.unwrap_err()
+        );
+        return;
+    }
+
+    log::info!("Started log drainer thread.");
+}
+
+/// microseconds since the TSC started for `tsc`, 0 before it is calibrated.
+#[inline]
+fn tsc_to_us(tsc: u64) -> u64 {
+    let frequency = TSC::read_cpu_frequency();
+    if frequency == 0 {
+        return 0;
+    }
+
+    (tsc / frequency) * 1000000 + (tsc % frequency) * 1000000 / frequency
+}
+
+/// the lines in the rings now, oldest first, each with it's time stamp.
+fn snapshot() -> String {
+    let mut text = String::new();
+    let rings_opt = rings();
+    if rings_opt.is_none() {
+        return text;
+    }
+
+    let rings = rings_opt.unwrap();
+    let mut cursors = [0u64; MAX_PROCESSORS];
+    for (index, ring) in rings.iter().enumerate() {
+        cursors[index] = ring.tail();
+    }
+
+    let mut lost = 0;
+    merge_entries(rings, &mut cursors, &mut lost, |entry| {
+        let us = tsc_to_us(entry.tsc);
+        let _ = write!(
+            text,
+            "[{:5}.{:06}] {}\n",
+            us / 1000000,
+            us % 1000000,
+            entry.text()
+        );
+    });
+
+    text
+}
+
+/// `/dev/kmsg`, reads return the lines kept in the rings like dmesg.
+pub struct KmsgDriver;
+
+impl KmsgDriver {
+    pub fn empty() -> Self {
+        KmsgDriver {}
+    }
+}
+
+impl DevOps for KmsgDriver {
+    fn read(&self, fd: &mut DevFSDescriptor, buffer: &mut [u8]) -> Result<usize, FSError> {
+        Ok(devfs::read_text(fd, buffer, snapshot))
+    }
+
+    /// lines written here are logged like kernel lines.
+    fn write(&self, _fd: &mut DevFSDescriptor, buffer: &[u8]) -> Result<usize, FSError> {
+        let string = String::from_utf8_lossy(buffer);
+        for line in string.lines() {
+            log::info!("{}", line);
+        }
+
+        Ok(buffer.len())
+    }
+
+    fn ioctl(&self, _command: usize, _arg: usize) -> Result<usize, FSError> {
+        Ok(0)
+    }
+
+    fn seek(&self, fd: &mut DevFSDescriptor, offset: u32, st: SeekType) -> Result<u32, FSError> {
+        Ok(devfs::seek_text(fd, offset, st, snapshot))
+    }
+}
+
+unsafe impl Sync for KmsgDriver {}
+unsafe impl Send for KmsgDriver {}
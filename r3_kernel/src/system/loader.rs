@@ -2,17 +2,62 @@ extern crate alloc;
 
 use crate::system::filesystem::vfs::FILESYSTEM;
 
-use crate::system::filesystem::{FDOps, FSOps, SeekType};
+use crate::system::filesystem::{FDOps, FSOps, FileDescriptor, SeekType};
 
 use alloc::vec::Vec;
+use core::convert::TryInto;
 use core::str;
 
+const ELF_HEADER_SIZE: usize = 64;
+const ELF_PROGRAM_HEADER_SIZE: usize = 56;
+const ELF_CLASS_64: u8 = 2;
+const ELF_PT_LOAD: u32 = 1;
+
+/// segment permission bits of the program header
+pub const ELF_PF_X: u32 = 1;
+pub const ELF_PF_W: u32 = 2;
+pub const ELF_PF_R: u32 = 4;
+
 #[derive(Debug, Clone)]
 pub enum LoadError {
     InvalidFormat,
     FileReadError,
 }
 
+/// a loadable segment of the executable as described by it's program header
+#[derive(Debug, Clone)]
+pub struct ProgramSegment {
+    pub vaddr: u64,
+    pub mem_size: u64,
+    pub file_offset: u64,
+    pub file_size: u64,
+    pub flags: u32,
+}
+
+/// executable header info, the segment contents stay in the file
+#[derive(Debug, Clone)]
+pub struct ExecutableInfo {
+    pub entry: u64,
+    pub segments: Vec<ProgramSegment>,
+    pub fd: FileDescriptor,
+    pub file_size: usize,
+}
+
+#[inline]
+fn read_u16(buffer: &[u8], offset: usize) -> u16 {
+    u16::from_le_bytes(buffer[offset..offset + 2].try_into().unwrap())
+}
+
+#[inline]
+fn read_u32(buffer: &[u8], offset: usize) -> u32 {
+    u32::from_le_bytes(buffer[offset..offset + 4].try_into().unwrap())
+}
+
+#[inline]
+fn read_u64(buffer: &[u8], offset: usize) -> u64 {
+    u64::from_le_bytes(buffer[offset..offset + 8].try_into().unwrap())
+}
+
 pub fn is_elf(binary: &[u8]) -> bool {
     if binary.len() < 4 {
         return false;
@@ -23,7 +68,7 @@ pub fn is_elf(binary: &[u8]) -> bool {
 
 pub fn read_executable(path: &str) -> Result<Vec<u8>, LoadError> {
     // open the path
-    let fd_res = FILESYSTEM.lock().open(path, 0);
+    let fd_res = FILESYSTEM.open(path, 0);
     if fd_res.is_err() {
         log::debug!("ELF load failed, {:?}", fd_res.unwrap_err());
         return Err(LoadError::FileReadError);
@@ -31,46 +76,126 @@ pub fn read_executable(path: &str) -> Result<Vec<u8>, LoadError> {
 
     let mut fd = fd_res.unwrap();
 
-    let fstat_info_res = FILESYSTEM.lock().fstat(&mut fd);
+    let fstat_info_res = FILESYSTEM.fstat(&mut fd);
 
     if fstat_info_res.is_err() {
         return Err(LoadError::FileReadError);
     }
 
-    let fstat_info = fstat_info_res.unwrap();
-
-    // allocate a temp buffer to read one block at a time
-    let mut temp_buffer: Vec<u8> = Vec::new();
-    temp_buffer.resize(fstat_info.block_size, 0);
+    let file_size = fstat_info_res.unwrap().file_size;
 
-    // data will be copied to this buffer
+    // tarfs reads any length, the whole binary is read with one call.
     let mut binary_buffer: Vec<u8> = Vec::new();
-    binary_buffer.resize(fstat_info.file_size, 0);
+    binary_buffer.resize(file_size, 0);
 
-    // log::debug!("FSTAT: {} {} {}", fstat_info.file_size, fstat_info.blocks, fstat_info.block_size);
+    let read_res = FILESYSTEM.read(&mut fd, &mut binary_buffer);
+    if read_res.is_err() {
+        log::debug!("ELF load failed, {:?}", read_res.unwrap_err());
+        return Err(LoadError::FileReadError);
+    }
 
-    for idx in 0..fstat_info.blocks {
-        let read_res = FILESYSTEM.lock().read(&mut fd, &mut temp_buffer);
-        if read_res.is_err() {
-            log::debug!("ELF load failed, {:?}", read_res.unwrap_err());
-            return Err(LoadError::FileReadError);
-        }
+    let n_read = read_res.unwrap();
+    binary_buffer.truncate(n_read);
 
-        let n_read = read_res.unwrap();
-        let slice_ref: &mut [u8] = binary_buffer.as_mut();
+    Ok(binary_buffer)
+}
 
-        let current_start = idx * fstat_info.block_size;
-        slice_ref[current_start..current_start + n_read].copy_from_slice(&temp_buffer[0..n_read]);
+/// reads `buffer.len()` bytes of the file starting at `offset`, the range
+/// must be within the file. Returns the number of bytes copied.
+pub fn read_file_at(
+    fd: &mut FileDescriptor,
+    offset: usize,
+    buffer: &mut [u8],
+) -> Result<usize, LoadError> {
+    let seek_result = FILESYSTEM.seek(fd, offset as u32, SeekType::SEEK_SET);
+    if seek_result.is_err() {
+        return Err(LoadError::FileReadError);
+    }
+
+    let read_res = FILESYSTEM.read(fd, buffer);
+    if read_res.is_err() {
+        log::debug!("File read failed, {:?}", read_res.unwrap_err());
+        return Err(LoadError::FileReadError);
+    }
 
-        if n_read < 512 {
-            break;
+    Ok(read_res.unwrap())
+}
+
+/// reads only the ELF and program headers of the executable, segments are
+/// read later from the returned file descriptor when their pages are touched.
+pub fn read_executable_headers(path: &str) -> Result<ExecutableInfo, LoadError> {
+    let fd_res = FILESYSTEM.open(path, 0);
+    if fd_res.is_err() {
+        log::debug!("ELF load failed, {:?}", fd_res.unwrap_err());
+        return Err(LoadError::FileReadError);
+    }
+
+    let mut fd = fd_res.unwrap();
+
+    let fstat_info_res = FILESYSTEM.fstat(&mut fd);
+    if fstat_info_res.is_err() {
+        return Err(LoadError::FileReadError);
+    }
+
+    let file_size = fstat_info_res.unwrap().file_size;
+    if file_size < ELF_HEADER_SIZE {
+        return Err(LoadError::InvalidFormat);
+    }
+
+    let mut header: [u8; ELF_HEADER_SIZE] = [0; ELF_HEADER_SIZE];
+    let read_res = read_file_at(&mut fd, 0, &mut header);
+    if read_res.is_err() {
+        return Err(read_res.unwrap_err());
+    }
+
+    if !is_elf(&header) || header[4] != ELF_CLASS_64 {
+        return Err(LoadError::InvalidFormat);
+    }
+
+    let entry = read_u64(&header, 24);
+    let ph_offset = read_u64(&header, 32) as usize;
+    let ph_entry_size = read_u16(&header, 54) as usize;
+    let ph_count = read_u16(&header, 56) as usize;
+
+    if ph_entry_size < ELF_PROGRAM_HEADER_SIZE || ph_offset + ph_entry_size * ph_count > file_size {
+        return Err(LoadError::InvalidFormat);
+    }
+
+    let mut program_headers: Vec<u8> = Vec::new();
+    program_headers.resize(ph_entry_size * ph_count, 0);
+    let read_res = read_file_at(&mut fd, ph_offset, &mut program_headers);
+    if read_res.is_err() {
+        return Err(read_res.unwrap_err());
+    }
+
+    let mut segments: Vec<ProgramSegment> = Vec::new();
+    for idx in 0..ph_count {
+        let ph = &program_headers[idx * ph_entry_size..(idx + 1) * ph_entry_size];
+        if read_u32(ph, 0) != ELF_PT_LOAD {
+            continue;
         }
 
-        let seek_result = FILESYSTEM.lock().seek(&mut fd, 512, SeekType::SEEK_CUR);
-        if seek_result.is_err() {
-            break;
+        let segment = ProgramSegment {
+            flags: read_u32(ph, 4),
+            file_offset: read_u64(ph, 8),
+            vaddr: read_u64(ph, 16),
+            file_size: read_u64(ph, 32),
+            mem_size: read_u64(ph, 40),
+        };
+
+        if segment.file_size > segment.mem_size
+            || segment.file_offset + segment.file_size > file_size as u64
+        {
+            return Err(LoadError::InvalidFormat);
         }
+
+        segments.push(segment);
     }
 
-    Ok(binary_buffer)
+    Ok(ExecutableInfo {
+        entry,
+        segments,
+        fd,
+        file_size,
+    })
 }
@@ -1,15 +1,22 @@
 pub mod abi;
 pub mod filesystem;
+pub mod kmsg;
 pub mod loader;
 pub mod net;
+pub mod page_cache;
 pub mod posix;
 pub mod process;
+pub mod profiler;
+pub mod ring;
 pub mod tasking;
 pub mod thread;
+pub mod time_page;
 pub mod timer;
+pub mod trace;
 pub mod utils;
+pub mod vma;
 
-use tasking::Sched;
+use crate::cpu::percpu::PerCPU;
 
 pub fn init_tasking() {
     process::setup_process_pool();
@@ -29,12 +36,14 @@ pub fn init_networking() {
     net::init_networking();
 }
 
+/// the running thread is tracked per processor, so these do not
+/// need the scheduler lock.
 #[inline]
 pub fn current_tid() -> Option<thread::ThreadID> {
-    tasking::SCHEDULER.lock().current_tid()
+    PerCPU::current_tid().map(|tid| thread::ThreadID::new(tid))
 }
 
 #[inline]
 pub fn current_pid() -> Option<process::PID> {
-    tasking::SCHEDULER.lock().current_pid()
+    PerCPU::current_pid().map(|pid| process::PID::new(pid))
 }
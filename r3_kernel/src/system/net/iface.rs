@@ -6,9 +6,13 @@ extern crate spin;
 
 use crate::cpu::hw_interrupts;
 use crate::drivers;
+use crate::mm::VirtualAddress;
 use crate::system::net::ip_utils;
 use crate::system::net::process::process_network_packet_event;
-use crate::system::net::types;
+use crate::system::process::PID;
+use crate::system::tasking::{self, wait_queue::WaitEvent};
+use crate::system::thread;
+use crate::system::timer::{SystemTimer, SYSTEM_TICK_DURATION};
 
 use smoltcp::iface::{EthernetInterface, EthernetInterfaceBuilder, NeighborCache, Routes};
 use smoltcp::phy::Device;
@@ -18,13 +22,23 @@ use smoltcp::wire::{EthernetAddress, IpAddress, IpCidr, Ipv4Address};
 use smoltcp::Error as NetError;
 use smoltcp::Result as NetResult;
 
-use core::sync::atomic::AtomicU64;
+use core::sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering};
 
 use spin::{Mutex, MutexGuard};
 
 const NET_DEFAULT_MTU: usize = 1500;
 const MAX_POLL_CYCLES: usize = 100;
 
+/// frames taken from the device per round of the network interrupt.
+const NET_RX_BUDGET: usize = 64;
+/// rounds of the network worker per wake up, the frames left after them
+/// are taken once the other threads had the CPU.
+const NET_RX_MAX_ROUNDS: usize = 8;
+
+/// longest the network worker sleeps without a poll, smoltcp's own timers
+/// and the DHCP client are served at least this often.
+const NET_MAX_IDLE_TICKS: u64 = 10;
+
 // TODO: Make these as variables passed from boot-info
 const DEFAULT_GATEWAY: &str = "192.168.0.1";
 const DEFAULT_STATIC_IP: &str = "192.168.0.6/24";
@@ -37,6 +51,17 @@ static PHY_ETHERNET_DRIVER: Mutex<Option<Box<PhyNetDevType>>> = Mutex::new(None)
 /// Ethernet interface type
 pub static ETHERNET_INTERFACE: Mutex<Option<EthernetInterfaceType>> = Mutex::new(None);
 
+/// frames the interface can still take from the device in this round,
+/// only the network worker limits it.
+static RX_BUDGET: AtomicUsize = AtomicUsize::new(usize::MAX);
+
+/// set by the interrupt and the senders, cleared by the network worker
+/// when it starts a poll.
+static NET_WORK_PENDING: AtomicBool = AtomicBool::new(false);
+
+/// the network worker masked the device interrupts to poll for frames.
+static RX_MASKED: AtomicBool = AtomicBool::new(false);
+
 #[derive(Debug, Clone)]
 pub enum PhyNetdevError {
     NoPhysicalDevice,
@@ -59,12 +84,16 @@ pub struct VirtualNetworkDeviceStats {
 
 /// the core trait implemented by physical network device driver
 pub trait PhysicalNetworkDevice {
-    /// get the buffer region where the next packet must be copied to
+    /// get the buffer region where the next packet must be copied to,
+    /// fails with `NoTxBuffer` while all the tx buffers are in flight.
     fn get_current_tx_buffer(&mut self) -> Result<&'static mut [u8], PhyNetdevError>;
 
-    /// call the transmit on device's side and wait for the hardware driver to return back
-    fn transmit_and_wait(&mut self, buffer: &mut [u8], length: usize)
-        -> Result<(), PhyNetdevError>;
+    /// queue the packet copied to the current tx buffer, returns without
+    /// waiting for the hardware to send it.
+    fn transmit(&mut self, buffer: &mut [u8], length: usize) -> Result<(), PhyNetdevError>;
+
+    /// is there a free tx buffer for the next packet?
+    fn can_transmit(&mut self) -> Result<bool, PhyNetdevError>;
 
     /// get the interrupt handler details from the network device
     fn handle_interrupt(&mut self) -> Result<(), PhyNetdevError>;
@@ -84,8 +113,16 @@ pub trait PhysicalNetworkDevice {
     /// is polling enabled?
     fn is_polling_enabled(&self) -> Result<bool, PhyNetdevError>;
 
-    /// poll for packet
-    fn poll_for_frame(&mut self, max_polls: usize) -> Result<&'static [u8], PhyNetdevError>;
+    /// poll for packet, the frame stays with the device until it is released.
+    fn poll_for_frame(&mut self, max_polls: usize) -> Result<&'static mut [u8], PhyNetdevError>;
+
+    /// the next received frame, in place in the device's buffer. It
+    /// stays there until it is released.
+    fn next_rx_frame(&mut self) -> Result<&'static mut [u8], PhyNetdevError>;
+
+    /// gives the frame returned by `next_rx_frame` or `poll_for_frame`
+    /// back to the device.
+    fn release_rx_frame(&mut self) -> Result<(), PhyNetdevError>;
 }
 
 pub type PhyNetDevType = dyn PhysicalNetworkDevice + Sync + Send;
@@ -102,8 +139,9 @@ pub struct VirtualTx {}
 
 /// Smoltcp token type for Reception
 pub struct VirtualRx {
-    /// recv_buffer is a vector view over the DMA slice of the packet
-    pub recv_buffer: Vec<u8>,
+    /// the frame in the DMA buffer of the device, it is given back to
+    /// the device when the token is dropped.
+    pub frame: &'static mut [u8],
 }
 
 impl TxToken for VirtualTx {
@@ -140,7 +178,7 @@ impl TxToken for VirtualTx {
             return Err(NetError::Illegal);
         }
 
-        let transmit_result = phy_dev.transmit_and_wait(buffer, len);
+        let transmit_result = phy_dev.transmit(buffer, len);
         if transmit_result.is_err() {
             log::error!("interface error: {:?}", transmit_result.unwrap_err());
             // timer::release_cpu_lock();
@@ -158,7 +196,18 @@ impl RxToken for VirtualRx {
     where
         F: FnOnce(&mut [u8]) -> NetResult<R>,
     {
-        f(&mut self.recv_buffer)
+        f(&mut *self.frame)
+    }
+}
+
+impl Drop for VirtualRx {
+    fn drop(&mut self) {
+        let mut phy_lock = PHY_ETHERNET_DRIVER.lock();
+        if let Some(phy_dev) = phy_lock.as_mut() {
+            if let Err(err) = phy_dev.release_rx_frame() {
+                log::debug!("interface error: {:?}", err);
+            }
+        }
     }
 }
 
@@ -176,23 +225,38 @@ impl<'a> Device<'a> for VirtualNetworkDevice {
         let mut phy_dev_lock = PHY_ETHERNET_DRIVER.lock();
 
         if let Some(phy_dev) = phy_dev_lock.as_mut() {
-            if let Ok(true) = phy_dev.is_polling_enabled() {
+            if RX_BUDGET.load(Ordering::Relaxed) == 0 {
+                return None;
+            }
+
+            let frame_result = if let Ok(true) = phy_dev.is_polling_enabled() {
                 // poll for frame
-                let poll_result = phy_dev.poll_for_frame(MAX_POLL_CYCLES);
-                if let Ok(buffer) = poll_result {
-                    let recv_buffer = buffer.to_vec();
-                    return Some((VirtualRx { recv_buffer }, VirtualTx {}));
-                }
+                phy_dev.poll_for_frame(MAX_POLL_CYCLES)
             } else {
-                if let Ok(recv_buffer) = types::NETWORK_IFACE_QUEUE.lock().pop() {
-                    return Some((VirtualRx { recv_buffer }, VirtualTx {}));
-                }
+                phy_dev.next_rx_frame()
+            };
+
+            // the frame is handed over as it is in the DMA buffer.
+            if let Ok(frame) = frame_result {
+                let _ = RX_BUDGET.fetch_update(Ordering::Relaxed, Ordering::Relaxed, |budget| {
+                    budget.checked_sub(1)
+                });
+                return Some((VirtualRx { frame }, VirtualTx {}));
             }
         }
         None
     }
 
     fn transmit(&'a mut self) -> Option<Self::TxToken> {
+        // no token while the device's tx ring is full, smoltcp keeps the
+        // packet and retries it on a later poll.
+        let mut phy_dev_lock = PHY_ETHERNET_DRIVER.lock();
+        if let Some(phy_dev) = phy_dev_lock.as_mut() {
+            if let Ok(false) = phy_dev.can_transmit() {
+                return None;
+            }
+        }
+
         Some(VirtualTx {})
     }
 
@@ -222,17 +286,6 @@ impl<'a> Device<'a> for VirtualNetworkDevice {
         caps
     }
 }
-/// the function will be called from the device's receiver function
-/// triggered by the network interrupt and there is a frame in DMA buffer.
-/// The parameter `buffer` contains the read-only slice view of the
-/// DMA buffer.
-pub fn handle_recv_packet(buffer: &[u8]) {
-    let packet_vec = buffer.to_vec();
-    if let Err(_) = types::NETWORK_IFACE_QUEUE.lock().push(packet_vec) {
-        log::debug!("dropping network packet because interface queue is full")
-    }
-}
-
 fn create_unspecified_interface(mac_addr: &[u8]) -> EthernetInterfaceType {
     let neighbor_cache = NeighborCache::new(BTreeMap::new());
     let routes = Routes::new(BTreeMap::new());
@@ -337,12 +390,60 @@ pub fn setup_network_interface() {
     if let Ok(mac_addr) = mac_result {
         *ETHERNET_INTERFACE.lock() = Some(create_unspecified_interface(&mac_addr));
     }
+}
+
+/// takes the received frames in rounds of `NET_RX_BUDGET`. While one round
+/// is not enough the device interrupts are masked and the frames are polled,
+/// they are unmasked again once the device has no more frames. Returns the
+/// poll delay of the last round and whether the device was drained.
+fn receive_in_rounds() -> (Option<u64>, bool) {
+    let mut poll_delay = None;
+    let mut drained = false;
+    for _ in 0..NET_RX_MAX_ROUNDS {
+        RX_BUDGET.store(NET_RX_BUDGET, Ordering::Relaxed);
+        poll_delay = process_network_packet_event();
+
+        // received data is in the sockets only after processing.
+        tasking::notify_event(WaitEvent::NetworkReceive);
+
+        if RX_BUDGET.load(Ordering::Relaxed) != 0 {
+            // the device ran out of frames first.
+            drained = true;
+            break;
+        }
+
+        if !RX_MASKED.load(Ordering::Relaxed) {
+            let mut phy_lock = PHY_ETHERNET_DRIVER.lock();
+            if let Some(phy_dev) = phy_lock.as_mut() {
+                if let Ok(false) = phy_dev.is_polling_enabled() {
+                    RX_MASKED.store(phy_dev.set_polling_mode(true).is_ok(), Ordering::Relaxed);
+                }
+            }
+        }
+    }
 
-    types::setup_interface_queue();
+    RX_BUDGET.store(usize::MAX, Ordering::Relaxed);
+    if drained && RX_MASKED.swap(false, Ordering::Relaxed) {
+        let mut phy_lock = PHY_ETHERNET_DRIVER.lock();
+        if let Some(phy_dev) = phy_lock.as_mut() {
+            let _ = phy_dev.set_polling_mode(false);
+        }
+    }
+
+    (poll_delay, drained)
 }
 
-pub fn network_interrupt_handler() {
+/// wakes up the network worker, interrupts and sends that come in before
+/// it runs are taken by the same poll.
+#[inline]
+pub fn schedule_network_work() {
+    NET_WORK_PENDING.store(true, Ordering::SeqCst);
+    tasking::notify_event(WaitEvent::NetworkWork);
+}
 
+/// only acks the device and frees the sent tx descriptors, the frames are
+/// taken by the network worker.
+pub fn network_interrupt_handler() {
     if let Some(mut net_dev_lock) = PHY_ETHERNET_DRIVER.try_lock() {
         if net_dev_lock.is_some() {
             let result = net_dev_lock.as_mut().unwrap().handle_interrupt();
@@ -353,10 +454,85 @@ pub fn network_interrupt_handler() {
                 );
             }
         }
-    
-        drop(net_dev_lock);
-        process_network_packet_event();
     }
+
+    // the worker acks the device itself if it held the driver just now.
+    schedule_network_work();
+}
+
+/// the system ticks until the next timer-driven poll, `poll_delay` is
+/// what smoltcp asked for in milliseconds.
+#[inline]
+fn poll_delay_ticks(poll_delay: Option<u64>) -> u64 {
+    match poll_delay {
+        None => NET_MAX_IDLE_TICKS,
+        Some(delay_ms) => {
+            let ticks = (delay_ms * 1000000 + SYSTEM_TICK_DURATION - 1) / SYSTEM_TICK_DURATION;
+            ticks.max(1).min(NET_MAX_IDLE_TICKS)
+        }
+    }
+}
+
+/// runs the protocol stack outside of the interrupt context. It sleeps until
+/// the device interrupts, a socket sends or smoltcp's next timer is due,
+/// then takes all the frames the device has in budgeted rounds.
+fn network_worker() {
+    let mut next_poll = SystemTimer::current_ticks();
+    loop {
+        let _ = tasking::wait_for_event_until(
+            WaitEvent::NetworkWork,
+            Some(next_poll),
+            || -> Result<Option<()>, ()> {
+                if NET_WORK_PENDING.swap(false, Ordering::SeqCst) {
+                    return Ok(Some(()));
+                }
+
+                Ok(None)
+            },
+        );
+
+        // an interrupt that found the driver locked was not acked.
+        {
+            let mut phy_lock = PHY_ETHERNET_DRIVER.lock();
+            if let Some(phy_dev) = phy_lock.as_mut() {
+                let _ = phy_dev.handle_interrupt();
+            }
+        }
+
+        let (poll_delay, drained) = receive_in_rounds();
+        if !drained {
+            // frames are left with the interrupts masked, come back to them
+            // after the other threads had the CPU.
+            NET_WORK_PENDING.store(true, Ordering::SeqCst);
+            tasking::schedule_yield();
+        }
+
+        next_poll = SystemTimer::current_ticks() + poll_delay_ticks(poll_delay);
+    }
+}
+
+/// starts the network worker as a thread of the kernel process `pid`.
+pub fn start_network_worker(pid: &PID) {
+    if ETHERNET_INTERFACE.lock().is_none() {
+        log::error!("no network interface, not starting the network worker.");
+        return;
+    }
+
+    let th_result = thread::new_from_function(
+        pid,
+        format!("network_worker"),
+        VirtualAddress::from_u64(network_worker as fn() as u64),
+    );
+
+    if th_result.is_err() {
+        log::error!(
+            "failed to start the network worker: {:?}",
+            th_result.unwrap_err()
+        );
+        return;
+    }
+
+    log::info!("Started network worker thread.");
 }
 
 pub fn get_formatted_mac() -> Option<String> {
@@ -2,6 +2,7 @@ extern crate log;
 extern crate smoltcp;
 
 use crate::system::net;
+use crate::system::tasking::{self, wait_queue::WaitEvent};
 use crate::system::timer;
 
 use smoltcp::time::Instant;
@@ -12,7 +13,10 @@ use net::iface::ETHERNET_INTERFACE;
 use net::types::SOCKETS_SET;
 
 
-pub fn process_network_packet_event() {
+/// runs the interface over the received frames and the pending transmits,
+/// returns the milliseconds after which smoltcp wants to be polled again,
+/// `None` if it has no timers pending.
+pub fn process_network_packet_event() -> Option<u64> {
 
     let mut iface_lock = ETHERNET_INTERFACE.lock();
     let mut dhcp_lock = DHCP_CLIENT.lock();
@@ -57,5 +61,15 @@ pub fn process_network_packet_event() {
 
     DHCPClient::dhcp_next_poll(&mut dhcp_lock, instant);
 
-    if let Some(_ts) = iface_lock.as_mut().unwrap().poll_delay(&sockets, instant) {}
+    let poll_delay = iface_lock
+        .as_mut()
+        .unwrap()
+        .poll_delay(&sockets, instant)
+        .map(|delay| delay.total_millis());
+
+    // sockets may have become readable or writable.
+    drop(sockets_lock);
+    tasking::notify_event(WaitEvent::Readiness);
+
+    poll_delay
 }
@@ -5,72 +5,22 @@ extern crate smoltcp;
 extern crate spin;
 
 use crate::mm;
+use crate::system::filesystem::PollEvents;
 
-use alloc::{collections::BTreeSet, vec, vec::Vec};
+use alloc::{collections::BTreeSet, sync::Arc, vec};
+use core::fmt;
 use lazy_static::lazy_static;
 use smoltcp::socket::SocketSet;
 use smoltcp::wire::{IpAddress, IpEndpoint, Ipv4Address};
 use spin::Mutex;
 
-const MAX_IFACE_QUEUE_SIZE: usize = 64;
-
-type NetworkInterfacePacket = Vec<u8>;
-
-pub enum NetworkInterfaceQueueError {
-    QueueEmpty = 0,
-    QueueFull = 1,
-}
-
-pub struct NetworkInterfaceQueue {
-    pub queue: Vec<NetworkInterfacePacket>,
-}
-
 pub static SOCKETS_SET: Mutex<Option<SocketSet>> = Mutex::new(None);
 
-lazy_static! {
-    pub static ref NETWORK_IFACE_QUEUE: Mutex<NetworkInterfaceQueue> =
-        Mutex::new(NetworkInterfaceQueue::new());
-}
-
 lazy_static! {
     pub static ref CURRENT_TL_PORTS: Mutex<TransportLayerPorts> =
         Mutex::new(TransportLayerPorts::new());
 }
 
-impl NetworkInterfaceQueue {
-    pub fn new() -> Self {
-        Self {
-            queue: Vec::with_capacity(MAX_IFACE_QUEUE_SIZE),
-        }
-    }
-
-    #[inline]
-    pub fn push(&mut self, data: NetworkInterfacePacket) -> Result<(), NetworkInterfaceQueueError> {
-        if self.queue.len() < MAX_IFACE_QUEUE_SIZE {
-            self.queue.push(data);
-            return Ok(());
-        }
-
-        Err(NetworkInterfaceQueueError::QueueFull)
-    }
-
-    #[inline]
-    pub fn pop(&mut self) -> Result<NetworkInterfacePacket, NetworkInterfaceQueueError> {
-        if let Some(data) = self.queue.pop() {
-            return Ok(data);
-        }
-
-        Err(NetworkInterfaceQueueError::QueueEmpty)
-    }
-}
-
-pub fn setup_interface_queue() {
-    log::info!(
-        "initialized network interface queue with size={}",
-        NETWORK_IFACE_QUEUE.lock().queue.capacity()
-    );
-}
-
 pub fn setup_socket_set() {
     *SOCKETS_SET.lock() = Some(SocketSet::new(vec![]));
 }
@@ -229,6 +179,8 @@ pub enum SocketError {
     SendError,
     RecvError,
     BindError,
+    /// nothing to receive, or no room to send, right now
+    WouldBlock,
     WIP
 }
 
@@ -239,4 +191,26 @@ pub trait SocketFn {
     fn sendto(&self, addr: SocketAddr, buffer: &[u8]) -> Result<usize, SocketError>;
     /// receive data from the destination address, throw SocketError if not possible 
     fn recvfrom(&self, buffer: &mut [u8]) -> Result<(usize, SocketAddr), SocketError>; 
+    /// like `recvfrom`, but fails with `WouldBlock` instead of waiting
+    fn try_recvfrom(&self, buffer: &mut [u8]) -> Result<(usize, SocketAddr), SocketError>;
+    /// can the socket be read from or written to without blocking?
+    fn poll_events(&self) -> PollEvents;
+}
+
+pub type SocketRef = Arc<dyn SocketFn + Sync + Send>;
+
+/// A socket in the descriptor table of a process, the socket is closed
+/// when the last descriptor referring to it goes away.
+#[derive(Clone)]
+pub struct SocketDescriptor {
+    pub flags: u32,
+    pub socket: SocketRef,
+}
+
+impl fmt::Debug for SocketDescriptor {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_struct("SocketDescriptor")
+            .field("flags", &self.flags)
+            .finish()
+    }
 }
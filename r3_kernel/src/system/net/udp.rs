@@ -1,21 +1,30 @@
 extern crate smoltcp;
 extern crate alloc;
+extern crate spin;
 
-use crate::system::net::{types, process::process_network_packet_event};
+use crate::system::net::{iface, types};
 use crate::cpu;
+use crate::system::filesystem::PollEvents;
 use crate::system::tasking;
+use crate::system::tasking::wait_queue::WaitEvent;
 
 use smoltcp::socket;
 use alloc::vec;
+use spin::Mutex;
 
 pub struct UDPSocket {
-    sock_handle: socket::SocketHandle
+    sock_handle: socket::SocketHandle,
+    /// the port the socket is bound to, released when the socket is dropped.
+    port: Mutex<Option<types::TransportLayerPort>>,
 }
 
 const UDP_TX_BUFFER_LENGTH: usize = 4096;
 const UDP_RX_BUFFER_LENGTH: usize = 4096;
 const UDP_METADATA_LENGTH: usize = 64;
 
+/// ports given to the sockets that send before they are bound.
+const UDP_EPHEMERAL_PORTS_START: types::TransportLayerPort = 49152;
+
 impl UDPSocket {
     /// creates a UDP socket with all the buffers but does not bind it to any port
     pub fn empty() -> UDPSocket {
@@ -32,42 +41,76 @@ impl UDPSocket {
 
         let socket = socket::UdpSocket::new(udp_rx_buf, udp_tx_buf);
         let sock_handle = types::SOCKETS_SET.lock().as_mut().unwrap().add(socket);
-        UDPSocket { sock_handle } 
+        UDPSocket {
+            sock_handle,
+            port: Mutex::new(None),
+        }
     }
-}
 
-impl types::SocketFn for UDPSocket {
-    fn bind(&self, addr: types::SocketAddr) -> Result<(), types::SocketError> {
-        let ip_endpoint_opt = addr.to_inet_addr();
-        if ip_endpoint_opt.is_none() {
-            return Err(types::SocketError::InvalidAddress);
+    /// binds the socket to `port`, or to a free ephemeral port if `port` is 0.
+    fn bind_port(&self, port: types::TransportLayerPort) -> Result<(), types::SocketError> {
+        let mut bound_port = self.port.lock();
+        if bound_port.is_some() {
+            return Err(types::SocketError::BindError);
         }
 
-        let ip_endpoint = ip_endpoint_opt.unwrap();
-
         let mut current_endpoints = types::CURRENT_TL_PORTS.lock();
+        let port = if port != 0 {
+            if current_endpoints.contains(&port) {
+                return Err(types::SocketError::PortAlreadyInUse);
+            }
+            port
+        } else {
+            let free_port =
+                (UDP_EPHEMERAL_PORTS_START..=u16::MAX).find(|port| !current_endpoints.contains(port));
+            if free_port.is_none() {
+                return Err(types::SocketError::PortAlreadyInUse);
+            }
+            free_port.unwrap()
+        };
 
-        if current_endpoints.contains(&ip_endpoint.port) {
-            return Err(types::SocketError::PortAlreadyInUse);
-        }
-
-        // create a socket
         let mut sock_set_lock = types::SOCKETS_SET.lock();
         let sock_set = sock_set_lock.as_mut().unwrap();
 
         let mut udp_socket = sock_set.get::<socket::UdpSocket>(self.sock_handle);
 
         // bind to this port
-        let bind_res = udp_socket.bind(ip_endpoint.port);
+        let bind_res = udp_socket.bind(port);
         if bind_res.is_err() {
             return Err(types::SocketError::BindError);
         }
 
         // add this port to endpoints list
-        current_endpoints.insert(ip_endpoint.port);
+        current_endpoints.insert(port);
+        *bound_port = Some(port);
 
         Ok(())
     }
+}
+
+impl Drop for UDPSocket {
+    fn drop(&mut self) {
+        let port = self.port.lock().take();
+        if let Some(port) = port {
+            types::CURRENT_TL_PORTS.lock().remove(&port);
+        }
+
+        let mut sock_set_lock = types::SOCKETS_SET.lock();
+        if let Some(sock_set) = sock_set_lock.as_mut() {
+            sock_set.remove(self.sock_handle);
+        }
+    }
+}
+
+impl types::SocketFn for UDPSocket {
+    fn bind(&self, addr: types::SocketAddr) -> Result<(), types::SocketError> {
+        let ip_endpoint_opt = addr.to_inet_addr();
+        if ip_endpoint_opt.is_none() {
+            return Err(types::SocketError::InvalidAddress);
+        }
+
+        self.bind_port(ip_endpoint_opt.unwrap().port)
+    }
 
     fn sendto(&self, addr: types::SocketAddr, buffer: &[u8]) -> Result<usize, types::SocketError> {
         let ip_endpoint_opt = addr.to_inet_addr();
@@ -77,13 +120,25 @@ impl types::SocketFn for UDPSocket {
 
         let ip_endpoint = ip_endpoint_opt.unwrap();
 
+        // like the other systems, a socket that was never bound gets a port.
+        if self.port.lock().is_none() {
+            let bind_res = self.bind_port(0);
+            if bind_res.is_err() {
+                return Err(bind_res.unwrap_err());
+            }
+        }
+
         let mut sockets_lock = types::SOCKETS_SET.lock();
         let all_socks = sockets_lock.as_mut().unwrap();
 
         let mut udp_socket = all_socks.get::<socket::UdpSocket>(self.sock_handle);
         let send_res = udp_socket.send(buffer.len(), ip_endpoint);
         if send_res.is_err() {
-            return Err(types::SocketError::SendError);
+            return match send_res.unwrap_err() {
+                // the transmit buffer is full
+                smoltcp::Error::Exhausted => Err(types::SocketError::WouldBlock),
+                _ => Err(types::SocketError::SendError),
+            };
         }
 
         let dest_buffer_region = send_res.unwrap();
@@ -93,37 +148,60 @@ impl types::SocketFn for UDPSocket {
         drop(udp_socket);
         drop(sockets_lock);
 
-        log::debug!("sent!");
-
-        // process packets
-        process_network_packet_event();
+        // the network worker sends it, together with whatever else is queued.
+        iface::schedule_network_work();
 
         Ok(buffer.len())
     }
 
     fn recvfrom(&self, buffer: &mut [u8]) -> Result<(usize, types::SocketAddr), types::SocketError> {
         cpu::enable_interrupts();
-        let wait_res = tasking::wait_until_return(|| {
-            let mut sock_lock = types::SOCKETS_SET.lock();
-            let all_socks = sock_lock.as_mut().unwrap();
-
-            let mut udp_socket = all_socks.get::<socket::UdpSocket>(self.sock_handle);
-            let recv_result = udp_socket.recv();
-            match recv_result {
-                Ok((payload, ip_endpoint)) => {
-                    buffer[0..payload.len()].copy_from_slice(payload);
-                    let sock_addr = types::SocketAddr::from_inet_addr(&ip_endpoint);
-                    return Ok(Some((payload.len(), sock_addr)))
-                }
+        let wait_res = tasking::wait_for_event(WaitEvent::NetworkReceive, || {
+            match self.try_recvfrom(buffer) {
+                Ok(received) => Ok(Some(received)),
                 // this buffer is empty, No data
-                Err(smoltcp::Error::Exhausted) => Ok(None),
-                Err(_) => {
-                    return Err(types::SocketError::RecvError)
-                } 
+                Err(types::SocketError::WouldBlock) => Ok(None),
+                Err(err) => Err(err),
             }
         });
 
         // handle the error
         wait_res
     }
-}
\ No newline at end of file
+
+    /// a datagram longer than `buffer` is cut short, the rest of it is lost.
+    fn try_recvfrom(&self, buffer: &mut [u8]) -> Result<(usize, types::SocketAddr), types::SocketError> {
+        let mut sock_lock = types::SOCKETS_SET.lock();
+        let all_socks = sock_lock.as_mut().unwrap();
+
+        let mut udp_socket = all_socks.get::<socket::UdpSocket>(self.sock_handle);
+        let recv_result = udp_socket.recv();
+        match recv_result {
+            Ok((payload, ip_endpoint)) => {
+                let length = payload.len().min(buffer.len());
+                buffer[0..length].copy_from_slice(&payload[0..length]);
+                let sock_addr = types::SocketAddr::from_inet_addr(&ip_endpoint);
+                Ok((length, sock_addr))
+            }
+            Err(smoltcp::Error::Exhausted) => Err(types::SocketError::WouldBlock),
+            Err(_) => Err(types::SocketError::RecvError),
+        }
+    }
+
+    fn poll_events(&self) -> PollEvents {
+        let mut sock_lock = types::SOCKETS_SET.lock();
+        let all_socks = sock_lock.as_mut().unwrap();
+
+        let udp_socket = all_socks.get::<socket::UdpSocket>(self.sock_handle);
+        let mut events = PollEvents::empty();
+        if udp_socket.can_recv() {
+            events |= PollEvents::POLLIN;
+        }
+
+        if udp_socket.can_send() {
+            events |= PollEvents::POLLOUT;
+        }
+
+        events
+    }
+}
@@ -0,0 +1,236 @@
+extern crate alloc;
+extern crate log;
+extern crate spin;
+
+use crate::mm::p_to_v;
+use crate::mm::phy::{Frame, PhysicalMemoryManager};
+use crate::mm::MemorySizes;
+use crate::system::filesystem::FileDescriptor;
+
+use alloc::{collections::BTreeMap, collections::VecDeque, string::String, vec::Vec};
+use core::ptr;
+use core::sync::atomic::{AtomicU64, Ordering};
+use lazy_static::lazy_static;
+use spin::Mutex;
+
+const PAGE_SIZE: usize = 4 * MemorySizes::OneKiB as usize;
+
+/// file pages kept by the cache, 16MiB.
+const PAGE_CACHE_MAX_FILE_PAGES: usize = 4096;
+
+/// the cache gives unmapped file pages back once the free frames drop below this.
+const PAGE_CACHE_LOW_WATERMARK: usize = 2048;
+const PAGE_CACHE_SHRINK_BATCH: usize = 32;
+
+/// Things whose pages are cached, pages of the same object are mapped
+/// from the same frames by every address space.
+#[derive(Debug, Clone, PartialEq, Eq, PartialOrd, Ord)]
+pub enum CacheObject {
+    /// a tarfs file, by it's device and the offset of it's data.
+    TarFile(String, usize),
+    /// pages of a shared anonymous mapping, they have no other copy.
+    Anonymous(u64),
+}
+
+impl CacheObject {
+    /// files whose pages can be cached, `None` for the others.
+    pub fn from_fd(fd: &FileDescriptor) -> Option<CacheObject> {
+        match fd {
+            FileDescriptor::TarFSNode(tarfd) => Some(CacheObject::TarFile(
+                tarfd.driver.device.clone(),
+                tarfd.offset,
+            )),
+            _ => None,
+        }
+    }
+}
+
+static NEXT_ANONYMOUS_ID: AtomicU64 = AtomicU64::new(1);
+
+/// pages of a MAP_SHARED anonymous mapping, kept while any area refers to it.
+#[derive(Debug)]
+pub struct SharedMemoryObject {
+    pub id: u64,
+}
+
+impl SharedMemoryObject {
+    pub fn new() -> Self {
+        SharedMemoryObject {
+            id: NEXT_ANONYMOUS_ID.fetch_add(1, Ordering::SeqCst),
+        }
+    }
+
+    #[inline]
+    pub fn object(&self) -> CacheObject {
+        CacheObject::Anonymous(self.id)
+    }
+}
+
+impl Drop for SharedMemoryObject {
+    fn drop(&mut self) {
+        release_object(&self.object());
+    }
+}
+
+/// The cache owns one reference to each of it's frames, every mapping of a
+/// frame adds one more. A frame that is not shared is mapped nowhere.
+struct PageCache {
+    pages: BTreeMap<(CacheObject, u64), Frame>,
+    /// file pages in the order they were cached, dropped oldest first.
+    file_pages: VecDeque<(CacheObject, u64)>,
+}
+
+impl PageCache {
+    fn empty() -> Self {
+        PageCache {
+            pages: BTreeMap::new(),
+            file_pages: VecDeque::new(),
+        }
+    }
+
+    /// drops the reference of the cache, the frame is freed if it is
+    /// not mapped anywhere.
+    #[inline]
+    fn drop_frame(frame: Frame) {
+        if !PhysicalMemoryManager::unshare(frame) {
+            PhysicalMemoryManager::free(frame);
+        }
+    }
+
+    /// frees up to `n_pages` file pages that are not mapped anywhere.
+    fn shrink(&mut self, n_pages: usize) -> usize {
+        let mut released = 0;
+        let mut scanned = 0;
+        let n_file_pages = self.file_pages.len();
+
+        while released < n_pages && scanned < n_file_pages {
+            let key = self.file_pages.pop_front().unwrap();
+            scanned += 1;
+
+            let frame_opt = self.pages.get(&key).cloned();
+            if frame_opt.is_none() {
+                continue;
+            }
+
+            let frame = frame_opt.unwrap();
+            if PhysicalMemoryManager::is_shared(frame) {
+                // still mapped, look at it again later.
+                self.file_pages.push_back(key);
+                continue;
+            }
+
+            self.pages.remove(&key);
+            PhysicalMemoryManager::free(frame);
+            released += 1;
+        }
+
+        released
+    }
+
+    fn insert(&mut self, key: (CacheObject, u64), frame: Frame) {
+        if let CacheObject::TarFile(_, _) = key.0 {
+            let under_pressure = PhysicalMemoryManager::free_frames() < PAGE_CACHE_LOW_WATERMARK;
+            if under_pressure || self.file_pages.len() >= PAGE_CACHE_MAX_FILE_PAGES {
+                self.shrink(PAGE_CACHE_SHRINK_BATCH);
+            }
+
+            self.file_pages.push_back(key.clone());
+        }
+
+        self.pages.insert(key, frame);
+    }
+}
+
+lazy_static! {
+    static ref PAGE_CACHE: Mutex<PageCache> = Mutex::new(PageCache::empty());
+}
+
+/// returns the frame with page `page_no` of the object, with a reference
+/// taken for the caller's mapping. A missing page is read by `fill` into a
+/// zeroed frame, `fill` returns false if the page could not be read.
+pub fn get_page<F>(object: &CacheObject, page_no: u64, fill: F) -> Option<Frame>
+where
+    F: FnOnce(*mut u8) -> bool,
+{
+    let key = (object.clone(), page_no);
+    {
+        let cache = PAGE_CACHE.lock();
+        if let Some(&frame) = cache.pages.get(&key) {
+            if !PhysicalMemoryManager::share(frame) {
+                return None;
+            }
+            return Some(frame);
+        }
+    }
+
+    // the page is read without the lock, reads can sleep.
+    let frame_opt = PhysicalMemoryManager::alloc();
+    if frame_opt.is_none() {
+        return None;
+    }
+
+    let frame = frame_opt.unwrap();
+    let frame_ptr = p_to_v(frame.addr()).get_mut_ptr::<u8>();
+    unsafe {
+        ptr::write_bytes(frame_ptr, 0, PAGE_SIZE);
+    }
+
+    if !fill(frame_ptr) {
+        PhysicalMemoryManager::free(frame);
+        return None;
+    }
+
+    let mut cache = PAGE_CACHE.lock();
+    if let Some(&cached_frame) = cache.pages.get(&key) {
+        // read by someone else meanwhile
+        PhysicalMemoryManager::free(frame);
+        if !PhysicalMemoryManager::share(cached_frame) {
+            return None;
+        }
+        return Some(cached_frame);
+    }
+
+    if !PhysicalMemoryManager::share(frame) {
+        PhysicalMemoryManager::free(frame);
+        return None;
+    }
+
+    cache.insert(key, frame);
+    Some(frame)
+}
+
+/// drops all the cached pages of the object, mapped pages stay with
+/// their mappings.
+pub fn release_object(object: &CacheObject) {
+    let mut cache = PAGE_CACHE.lock();
+    let start = (object.clone(), 0);
+    let end = (object.clone(), u64::MAX);
+
+    let mut keys = Vec::new();
+    for (key, frame) in cache.pages.range(start..=end) {
+        keys.push((key.clone(), *frame));
+    }
+
+    for (key, frame) in keys {
+        cache.pages.remove(&key);
+        PageCache::drop_frame(frame);
+    }
+
+    cache
+        .file_pages
+        .retain(|(page_object, _)| page_object != object);
+}
+
+/// gives up to `n_pages` unmapped file pages back to the physical allocator,
+/// returns the number of pages released. Called by the physical allocator
+/// when it runs out, nothing is released if the cache is busy.
+pub fn shrink(n_pages: usize) -> usize {
+    PAGE_CACHE
+        .try_lock()
+        .map_or(0, |mut cache| cache.shrink(n_pages))
+}
+
+/// number of pages in the cache
+pub fn cached_pages() -> usize {
+    PAGE_CACHE.lock().pages.len()
+}
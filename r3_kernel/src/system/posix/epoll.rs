@@ -0,0 +1,202 @@
+extern crate alloc;
+extern crate spin;
+
+use crate::mm::VirtualAddress;
+use crate::system::abi;
+use crate::system::filesystem::epoll::{
+    EpollDescriptor, EpollError, EpollInstance, EpollInterest, PollSource,
+};
+use crate::system::filesystem::{FileDescriptor, PollEvents};
+use crate::system::posix::io;
+use crate::system::tasking::{self, wait_queue::WaitEvent};
+use crate::system::timer::{PosixTimeval, SystemTimer};
+use crate::system::utils::ProcessFDPool;
+use crate::system::vma;
+
+use alloc::sync::Arc;
+use core::{mem, ptr};
+use spin::Mutex;
+
+const EPOLL_CTL_ADD: usize = 1;
+const EPOLL_CTL_DEL: usize = 2;
+const EPOLL_CTL_MOD: usize = 3;
+
+/// most events returned by one epoll_wait call.
+const EPOLL_MAX_EVENTS: usize = 1024;
+
+/// same layout as linux on x86_64.
+#[derive(Debug, Clone, Copy)]
+#[repr(C, packed)]
+pub struct EpollEvent {
+    pub events: u32,
+    pub data: u64,
+}
+
+#[inline]
+fn user_range_valid(addr: u64, size: usize) -> bool {
+    let end = addr.checked_add(size as u64);
+    end.is_some() && abi::is_in_userspace(addr) && abi::is_in_userspace(end.unwrap())
+}
+
+#[inline]
+fn epoll_errno(err: EpollError) -> abi::Errno {
+    match err {
+        EpollError::AlreadyExist => abi::Errno::EEXIST,
+        EpollError::NotFound => abi::Errno::ENOENT,
+    }
+}
+
+/// `size` is only a hint and is ignored, like linux does.
+pub fn sys_epoll_create(_size: usize) -> Result<isize, abi::Errno> {
+    io::with_process_files(|proc_data| {
+        let fd = FileDescriptor::EpollNode(EpollDescriptor::new());
+        let fd_res = ProcessFDPool::put(proc_data, fd);
+        if fd_res.is_err() {
+            return Err(abi::Errno::EMFILE);
+        }
+
+        Ok(fd_res.unwrap() as isize)
+    })
+}
+
+/// adds, modifies or removes the interest of `epfd` in `fd`. Only devices
+/// and sockets can be watched, regular files are always ready.
+pub fn sys_epoll_ctl(
+    epfd: usize,
+    op: usize,
+    fd_index: usize,
+    event_addr: VirtualAddress,
+) -> Result<isize, abi::Errno> {
+    if op != EPOLL_CTL_ADD && op != EPOLL_CTL_DEL && op != EPOLL_CTL_MOD {
+        return Err(abi::Errno::EINVAL);
+    }
+
+    if epfd == fd_index {
+        return Err(abi::Errno::EINVAL);
+    }
+
+    // the event is ignored for removals.
+    let mut event = EpollEvent { events: 0, data: 0 };
+    if op != EPOLL_CTL_DEL {
+        if !user_range_valid(event_addr.as_u64(), mem::size_of::<EpollEvent>()) {
+            return Err(abi::Errno::EFAULT);
+        }
+
+        vma::prefault_range(event_addr, mem::size_of::<EpollEvent>());
+        event = unsafe { ptr::read_unaligned(event_addr.get_ptr::<EpollEvent>()) };
+    }
+
+    let events = PollEvents::from_bits_truncate(event.events);
+    io::with_process_files(|proc_data| {
+        let instance = match ProcessFDPool::get_mut(proc_data, epfd) {
+            None => return Err(abi::Errno::EBADF),
+            Some(fdref) => match &fdref.fd {
+                FileDescriptor::EpollNode(epfd_desc) => epfd_desc.instance.clone(),
+                _ => return Err(abi::Errno::EINVAL),
+            },
+        };
+
+        let source = match ProcessFDPool::get_mut(proc_data, fd_index) {
+            None => return Err(abi::Errno::EBADF),
+            Some(fdref) => PollSource::from_fd(&fdref.fd),
+        };
+
+        let mut instance_lock = instance.lock();
+        let ctl_res = match op {
+            EPOLL_CTL_ADD => {
+                if source.is_none() {
+                    return Err(abi::Errno::EPERM);
+                }
+
+                let interest = EpollInterest {
+                    source: source.unwrap(),
+                    events,
+                    data: event.data,
+                };
+                instance_lock.add(fd_index, interest)
+            }
+            EPOLL_CTL_MOD => instance_lock.modify(fd_index, events, event.data),
+            _ => instance_lock.remove(fd_index),
+        };
+
+        if ctl_res.is_err() {
+            return Err(epoll_errno(ctl_res.unwrap_err()));
+        }
+
+        Ok(0)
+    })
+}
+
+/// the system tick at which a wait of `timeout_ms` ends, `None` waits forever.
+#[inline]
+fn deadline_ticks(timeout_ms: isize) -> Option<u64> {
+    if timeout_ms < 0 {
+        return None;
+    }
+
+    let timeout = PosixTimeval {
+        tv_sec: (timeout_ms / 1000) as abi::CTime,
+        tv_usec: ((timeout_ms % 1000) * 1000) as abi::CSubSeconds,
+    };
+
+    Some(SystemTimer::current_ticks() + timeout.to_ticks() as u64)
+}
+
+/// waits until one of the watched sources is ready or `timeout_ms` passes,
+/// a negative timeout waits forever and 0 only checks. The process is not
+/// locked while it waits, readiness is re-checked every time the interface
+/// or the keyboard reports new data.
+pub fn sys_epoll_wait(
+    epfd: usize,
+    events_addr: VirtualAddress,
+    max_events: usize,
+    timeout_ms: isize,
+) -> Result<isize, abi::Errno> {
+    if max_events == 0 || max_events > EPOLL_MAX_EVENTS {
+        return Err(abi::Errno::EINVAL);
+    }
+
+    let events_size = max_events * mem::size_of::<EpollEvent>();
+    if !user_range_valid(events_addr.as_u64(), events_size) {
+        return Err(abi::Errno::EFAULT);
+    }
+
+    let instance: Arc<Mutex<EpollInstance>> = io::with_fd(epfd, |_fs, fd| match fd {
+        FileDescriptor::EpollNode(epfd_desc) => Ok(epfd_desc.instance.clone()),
+        _ => Err(abi::Errno::EINVAL),
+    })?;
+
+    let till_ticks = deadline_ticks(timeout_ms);
+    let ready_res = tasking::wait_for_event_until(
+        WaitEvent::Readiness,
+        till_ticks,
+        || -> Result<Option<_>, abi::Errno> {
+            let ready = instance.lock().ready_events(max_events);
+            if ready.is_empty() && timeout_ms != 0 {
+                return Ok(None);
+            }
+
+            Ok(Some(ready))
+        },
+    )?;
+
+    // timed out with nothing ready.
+    if ready_res.is_none() {
+        return Ok(0);
+    }
+
+    let ready = ready_res.unwrap();
+    vma::prefault_range(events_addr, events_size);
+    let events_ptr = events_addr.get_mut_ptr::<EpollEvent>();
+    for (index, (events, data)) in ready.iter().enumerate() {
+        let event = EpollEvent {
+            events: events.bits(),
+            data: *data,
+        };
+        unsafe {
+            ptr::write_unaligned(events_ptr.add(index), event);
+        }
+    }
+
+    Ok(ready.len() as isize)
+}
@@ -1,17 +1,38 @@
+extern crate alloc;
 extern crate bitflags;
 
 use crate::mm::VirtualAddress;
 use crate::system;
 use crate::system::abi;
-use crate::system::filesystem::{vfs::FILESYSTEM, FDOps, FSOps, POSIXOpenFlags, SeekType};
+use crate::system::filesystem::vfs::{FILESYSTEM, VFS};
+use crate::system::filesystem::{FDOps, FSOps, FileDescriptor, POSIXOpenFlags, SeekType};
 use crate::system::process::{Process, PROCESS_POOL};
-use crate::system::utils::ProcessFDPool;
+use crate::system::utils::{ProcessData, ProcessFDPool};
+use crate::system::vma;
 
-use core::ptr;
+use alloc::vec::Vec;
+use core::{mem, ptr};
 
 // TODO: lot of things needs to be handled properly here.
 
-pub fn sys_open(path: &str, flags: POSIXOpenFlags) -> Result<isize, abi::Errno> {
+/// one buffer of readv and writev, same layout as `struct iovec`.
+#[derive(Debug, Clone, Copy)]
+#[repr(C)]
+pub struct IOVec {
+    pub base: u64,
+    pub len: u64,
+}
+
+/// maximum buffers in one readv or writev call.
+pub const IOV_MAX: usize = 1024;
+
+/// runs `func` over the descriptors of the calling process, the process
+/// stays locked meanwhile. `func` must not call into the file-system, reads
+/// and opens can sleep on the device, see `with_fd`.
+pub fn with_process_files<R, F>(func: F) -> Result<R, abi::Errno>
+where
+    F: FnOnce(&mut ProcessData) -> Result<R, abi::Errno>,
+{
     let pid = system::current_pid();
     if pid.is_none() {
         log::error!("PID is null.");
@@ -20,12 +41,68 @@ pub fn sys_open(path: &str, flags: POSIXOpenFlags) -> Result<isize, abi::Errno>
 
     let mut proc_pool = PROCESS_POOL.lock();
     let proc_ref: &mut Process = proc_pool.get_mut_ref(&pid.unwrap()).unwrap();
+    let proc_data = proc_ref.proc_data.as_mut().unwrap();
+
+    func(proc_data)
+}
+
+/// runs `func` over a copy of a descriptor of the process without the
+/// process locked, the copy is stored back afterwards so the offset moves.
+/// A descriptor closed meanwhile is not brought back.
+pub fn with_fd<R, F>(fd_index: usize, func: F) -> Result<R, abi::Errno>
+where
+    F: FnOnce(&VFS, &mut FileDescriptor) -> Result<R, abi::Errno>,
+{
+    let fd_res = with_process_files(|proc_data| {
+        let fdref_opt = ProcessFDPool::get_mut(proc_data, fd_index);
+        if fdref_opt.is_none() {
+            return Err(abi::Errno::EBADF);
+        }
+
+        Ok(fdref_opt.unwrap().fd.clone())
+    });
+
+    if fd_res.is_err() {
+        return Err(fd_res.unwrap_err());
+    }
+
+    let mut fd = fd_res.unwrap();
+
+    let result = func(&FILESYSTEM, &mut fd);
+
+    let stored = with_process_files(|proc_data| {
+        if let Some(fdref) = ProcessFDPool::get_mut(proc_data, fd_index) {
+            fdref.fd = fd;
+        }
+        Ok(())
+    });
+
+    if stored.is_err() {
+        return Err(stored.unwrap_err());
+    }
+
+    result
+}
+
+#[inline]
+pub unsafe fn user_buffer<'a>(addr: VirtualAddress, size: usize) -> &'a [u8] {
+    &*ptr::slice_from_raw_parts(addr.get_ptr::<u8>(), size)
+}
+
+#[inline]
+pub unsafe fn user_buffer_mut<'a>(addr: VirtualAddress, size: usize) -> &'a mut [u8] {
+    &mut *ptr::slice_from_raw_parts_mut(addr.get_mut_ptr::<u8>(), size)
+}
+
+/// opens the file and adds it to the descriptors of the process, the
+/// process is only locked to add it.
+pub fn open_file(fs: &VFS, path: &str, flags: POSIXOpenFlags) -> Result<isize, abi::Errno> {
     if flags.contains(POSIXOpenFlags::O_CREAT) {
         log::error!("File creation is not implemented yet.");
         return Err(abi::Errno::EINVAL);
     }
 
-    let fd_result = FILESYSTEM.lock().open(&path, flags.bits());
+    let fd_result = fs.open(&path, flags.bits());
     if fd_result.is_err() {
         log::error!("File {} not found {:?}.", path, fd_result.unwrap_err());
         return Err(abi::Errno::EEXIST);
@@ -33,122 +110,229 @@ pub fn sys_open(path: &str, flags: POSIXOpenFlags) -> Result<isize, abi::Errno>
 
     // create the file-descriptor-index
     let fd = fd_result.unwrap();
-    let fd_res = ProcessFDPool::put(&mut proc_ref.proc_data.as_mut().unwrap(), fd);
+    let fd_res = with_process_files(|proc_data| {
+        ProcessFDPool::put(proc_data, fd.clone()).map_err(|_| abi::Errno::EMFILE)
+    });
+
     if fd_res.is_err() {
         log::error!("Process wide number of open file-descriptors limit has been reached.");
-        return Err(abi::Errno::EMFILE);
+        let _ = fs.close(&fd);
+        return Err(fd_res.unwrap_err());
     }
 
     let fd_index = fd_res.unwrap();
     Ok(fd_index as isize)
 }
 
-pub fn sys_read(
-    fd_index: usize,
-    buffer_addr: VirtualAddress,
-    size: usize,
-) -> Result<isize, abi::Errno> {
-    let pid = system::current_pid();
-    if pid.is_none() {
-        log::error!("PID is null.");
-        return Err(abi::Errno::EINVAL);
+/// removes the descriptor from the process and closes it, the process is
+/// not locked while the file-system closes it.
+pub fn close_file(fs: &VFS, fd_index: usize) -> Result<isize, abi::Errno> {
+    let fd_opt = with_process_files(|proc_data| Ok(ProcessFDPool::take(proc_data, fd_index)))?;
+    if fd_opt.is_none() {
+        return Err(abi::Errno::EBADF);
     }
 
-    let mut proc_pool = PROCESS_POOL.lock();
-    let proc_ref: &mut Process = proc_pool.get_mut_ref(&pid.unwrap()).unwrap();
-
-    let proc_data = proc_ref.proc_data.as_mut().unwrap();
-    let fdref_opt = ProcessFDPool::get_mut(proc_data, fd_index);
-    if fdref_opt.is_none() {
-        return Err(abi::Errno::EBADF);
+    let close_res = fs.close(&fd_opt.unwrap());
+    if close_res.is_err() {
+        return Err(abi::Errno::EIO);
     }
 
-    let fdref = fdref_opt.unwrap();
+    Ok(0)
+}
 
-    // TODO: Check if the file was opened for reading
-    let mut buffer =
-        unsafe { &mut *ptr::slice_from_raw_parts_mut(buffer_addr.get_mut_ptr::<u8>(), size) };
-    let read_res = FILESYSTEM.lock().read(&mut fdref.fd, &mut buffer);
+/// reads at the offset of the descriptor, or at `offset` without moving
+/// the descriptor if one is given.
+pub fn read_fd(
+    fs: &VFS,
+    fd: &mut FileDescriptor,
+    buffer: &mut [u8],
+    offset: Option<u32>,
+) -> Result<isize, abi::Errno> {
+    let read_res = match offset {
+        None => fs.read(fd, buffer),
+        Some(offset) => {
+            let mut positioned_fd = fd.clone();
+            if fs
+                .seek(&mut positioned_fd, offset, SeekType::SEEK_SET)
+                .is_err()
+            {
+                return Err(abi::Errno::ESPIPE);
+            }
+            fs.read(&mut positioned_fd, buffer)
+        }
+    };
 
     if read_res.is_err() {
         return Err(abi::Errno::EIO);
     }
 
-    // seek to length:
-    // TODO: as of now, only 512 bytes can be seeked at a time.
-
     // return the number of bytes read
-    return Ok(read_res.unwrap() as isize);
+    Ok(read_res.unwrap() as isize)
 }
 
-pub fn sys_write(
-    fd_index: usize,
-    buffer_addr: VirtualAddress,
-    size: usize,
+/// writes like `read_fd` reads.
+pub fn write_fd(
+    fs: &VFS,
+    fd: &mut FileDescriptor,
+    buffer: &[u8],
+    offset: Option<u32>,
 ) -> Result<isize, abi::Errno> {
-    let pid = system::current_pid();
-    if pid.is_none() {
-        log::error!("PID is null.");
-        return Err(abi::Errno::EINVAL);
+    let write_res = match offset {
+        None => fs.write(fd, buffer),
+        Some(offset) => {
+            let mut positioned_fd = fd.clone();
+            if fs
+                .seek(&mut positioned_fd, offset, SeekType::SEEK_SET)
+                .is_err()
+            {
+                return Err(abi::Errno::ESPIPE);
+            }
+            fs.write(&mut positioned_fd, buffer)
+        }
+    };
+
+    if write_res.is_err() {
+        return Err(abi::Errno::EIO);
     }
 
-    // TODO: make writes possible on all the types of files
-    if fd_index == 0 || fd_index > 2 {
-        log::error!("As of now, writes are possible on stdout, stderr.");
+    // return the number of bytes wrote
+    Ok(write_res.unwrap() as isize)
+}
+
+#[inline]
+fn file_offset(offset: usize) -> Result<u32, abi::Errno> {
+    if offset > u32::MAX as usize {
         return Err(abi::Errno::EINVAL);
     }
 
-    let mut proc_pool = PROCESS_POOL.lock();
-    let proc_ref: &mut Process = proc_pool.get_mut_ref(&pid.unwrap()).unwrap();
+    Ok(offset as u32)
+}
 
-    let proc_data = proc_ref.proc_data.as_mut().unwrap();
-    let fdref_opt = ProcessFDPool::get_mut(proc_data, fd_index);
-    if fdref_opt.is_none() {
-        return Err(abi::Errno::EBADF);
-    }
+pub fn sys_open(path: &str, flags: POSIXOpenFlags) -> Result<isize, abi::Errno> {
+    open_file(&FILESYSTEM, path, flags)
+}
 
-    let fdref = fdref_opt.unwrap();
+pub fn sys_read(
+    fd_index: usize,
+    buffer_addr: VirtualAddress,
+    size: usize,
+) -> Result<isize, abi::Errno> {
+    // TODO: Check if the file was opened for reading
+    let buffer = unsafe { user_buffer_mut(buffer_addr, size) };
+    with_fd(fd_index, |fs, fd| read_fd(fs, fd, buffer, None))
+}
 
+pub fn sys_write(
+    fd_index: usize,
+    buffer_addr: VirtualAddress,
+    size: usize,
+) -> Result<isize, abi::Errno> {
     // TODO: Check if the file was opened for writing
-    let buffer = unsafe { &*ptr::slice_from_raw_parts(buffer_addr.get_ptr::<u8>(), size) };
-    let read_res = FILESYSTEM.lock().write(&mut fdref.fd, &buffer);
+    let buffer = unsafe { user_buffer(buffer_addr, size) };
+    with_fd(fd_index, |fs, fd| write_fd(fs, fd, buffer, None))
+}
 
-    if read_res.is_err() {
-        return Err(abi::Errno::EIO);
-    }
+pub fn sys_pread(
+    fd_index: usize,
+    buffer_addr: VirtualAddress,
+    size: usize,
+    offset: usize,
+) -> Result<isize, abi::Errno> {
+    let offset = file_offset(offset)?;
+    let buffer = unsafe { user_buffer_mut(buffer_addr, size) };
+    with_fd(fd_index, |fs, fd| read_fd(fs, fd, buffer, Some(offset)))
+}
 
-    // return the number of bytes wrote
-    return Ok(read_res.unwrap() as isize);
+pub fn sys_pwrite(
+    fd_index: usize,
+    buffer_addr: VirtualAddress,
+    size: usize,
+    offset: usize,
+) -> Result<isize, abi::Errno> {
+    let offset = file_offset(offset)?;
+    let buffer = unsafe { user_buffer(buffer_addr, size) };
+    with_fd(fd_index, |fs, fd| write_fd(fs, fd, buffer, Some(offset)))
 }
 
-pub fn sys_close(fd_index: usize) -> Result<isize, abi::Errno> {
-    let pid = system::current_pid();
-    if pid.is_none() {
-        log::error!("PID is null.");
+/// copies the iovec array of the caller and pages in the buffers, so the
+/// transfers do not fault while the locks are held.
+pub fn copy_iovecs(iov_addr: VirtualAddress, iov_count: usize) -> Result<Vec<IOVec>, abi::Errno> {
+    if iov_count > IOV_MAX {
         return Err(abi::Errno::EINVAL);
     }
 
-    // call close on the file-system and remove the fd
-    let mut proc_pool = PROCESS_POOL.lock();
-    let proc_ref: &mut Process = proc_pool.get_mut_ref(&pid.unwrap()).unwrap();
+    let array_size = iov_count * mem::size_of::<IOVec>();
+    if !abi::is_in_userspace(iov_addr.as_u64())
+        || !abi::is_in_userspace(iov_addr.as_u64() + array_size as u64)
+    {
+        return Err(abi::Errno::EFAULT);
+    }
 
-    let proc_data = proc_ref.proc_data.as_mut().unwrap();
-    let fdref_opt = ProcessFDPool::get_mut(proc_data, fd_index);
-    if fdref_opt.is_none() {
-        return Err(abi::Errno::EBADF);
+    vma::prefault_range(iov_addr, array_size);
+    let iovecs: Vec<IOVec> =
+        unsafe { (*ptr::slice_from_raw_parts(iov_addr.get_ptr::<IOVec>(), iov_count)).to_vec() };
+
+    for iovec in iovecs.iter() {
+        let end = iovec.base.checked_add(iovec.len);
+        if end.is_none() || !abi::is_in_userspace(iovec.base) || !abi::is_in_userspace(end.unwrap())
+        {
+            return Err(abi::Errno::EFAULT);
+        }
+
+        vma::prefault_range(VirtualAddress::from_u64(iovec.base), iovec.len as usize);
     }
 
-    let fdref = fdref_opt.unwrap();
+    Ok(iovecs)
+}
 
-    // call close
-    let close_res = FILESYSTEM.lock().close(&fdref.fd);
-    if close_res.is_err() {
-        return Err(abi::Errno::EIO);
+/// moves data between the descriptor and each buffer in turn, stops at the
+/// first short transfer like a single read or write would.
+fn transfer_vectored(
+    fs: &VFS,
+    fd: &mut FileDescriptor,
+    iovecs: &[IOVec],
+    is_read: bool,
+) -> Result<isize, abi::Errno> {
+    let mut total: isize = 0;
+    for iovec in iovecs {
+        let addr = VirtualAddress::from_u64(iovec.base);
+        let size = iovec.len as usize;
+
+        let result = if is_read {
+            read_fd(fs, fd, unsafe { user_buffer_mut(addr, size) }, None)
+        } else {
+            write_fd(fs, fd, unsafe { user_buffer(addr, size) }, None)
+        };
+
+        if result.is_err() {
+            // the bytes moved so far are reported, the error is not.
+            if total > 0 {
+                break;
+            }
+            return result;
+        }
+
+        let transferred = result.unwrap();
+        total += transferred;
+        if (transferred as usize) < size {
+            break;
+        }
     }
 
-    // remove from process pool
-    let _ = ProcessFDPool::remove(proc_data, fd_index);
-    Ok(0)
+    Ok(total)
+}
+
+pub fn sys_readv(fd_index: usize, iovecs: &[IOVec]) -> Result<isize, abi::Errno> {
+    with_fd(fd_index, |fs, fd| transfer_vectored(fs, fd, iovecs, true))
+}
+
+pub fn sys_writev(fd_index: usize, iovecs: &[IOVec]) -> Result<isize, abi::Errno> {
+    with_fd(fd_index, |fs, fd| transfer_vectored(fs, fd, iovecs, false))
+}
+
+pub fn sys_close(fd_index: usize) -> Result<isize, abi::Errno> {
+    // call close on the file-system and remove the fd
+    close_file(&FILESYSTEM, fd_index)
 }
 
 pub fn sys_lseek(fd_index: usize, offset: u32, whence: u8) -> Result<isize, abi::Errno> {
@@ -159,54 +343,23 @@ pub fn sys_lseek(fd_index: usize, offset: u32, whence: u8) -> Result<isize, abi:
         _ => return Err(abi::Errno::EINVAL),
     };
 
-    let pid = system::current_pid();
-    if pid.is_none() {
-        log::error!("PID is null.");
-        return Err(abi::Errno::EINVAL);
-    }
-
-    // call close on the file-system and remove the fd
-    let mut proc_pool = PROCESS_POOL.lock();
-    let proc_ref: &mut Process = proc_pool.get_mut_ref(&pid.unwrap()).unwrap();
-
-    let proc_data = proc_ref.proc_data.as_mut().unwrap();
-    let fdref_opt = ProcessFDPool::get_mut(proc_data, fd_index);
-    if fdref_opt.is_none() {
-        return Err(abi::Errno::EBADF);
-    }
-
-    let fdref = fdref_opt.unwrap();
-    let seek_res = FILESYSTEM.lock().seek(&mut fdref.fd, offset, seek_type);
-    if seek_res.is_err() {
-        return Err(abi::Errno::EINVAL);
-    }
+    with_fd(fd_index, |fs, fd| {
+        let seek_res = fs.seek(fd, offset, seek_type);
+        if seek_res.is_err() {
+            return Err(abi::Errno::EINVAL);
+        }
 
-    Ok(seek_res.unwrap() as isize)
+        Ok(seek_res.unwrap() as isize)
+    })
 }
 
 pub fn sys_fstat(fd_index: usize, stat_buf: VirtualAddress) -> Result<isize, abi::Errno> {
-    let pid = system::current_pid();
-    if pid.is_none() {
-        log::error!("PID is null.");
-        return Err(abi::Errno::EINVAL);
-    }
-
-    // call close on the file-system and remove the fd
-    let mut proc_pool = PROCESS_POOL.lock();
-    let proc_ref: &mut Process = proc_pool.get_mut_ref(&pid.unwrap()).unwrap();
-
-    let proc_data = proc_ref.proc_data.as_mut().unwrap();
-    let fdref_opt = ProcessFDPool::get_mut(proc_data, fd_index);
-
-    if fdref_opt.is_none() {
-        return Err(abi::Errno::EBADF);
-    }
-
-    let mut fd = fdref_opt.unwrap().fd.clone();
-    let stat_result = FILESYSTEM.lock().fstat(&mut fd);
+    let stat_result = with_fd(fd_index, |fs, fd| {
+        fs.fstat(fd).map_err(|_| abi::Errno::ENOENT)
+    });
 
     if stat_result.is_err() {
-        return Err(abi::Errno::ENOENT);
+        return Err(stat_result.unwrap_err());
     }
 
     // copy the status buffer to this location:
@@ -215,38 +368,23 @@ pub fn sys_fstat(fd_index: usize, stat_buf: VirtualAddress) -> Result<isize, abi
 }
 
 pub fn sys_lstat(path: &str, stat_buf: VirtualAddress) -> Result<isize, abi::Errno> {
-    let open_res = sys_open(&path, POSIXOpenFlags::from_bits_truncate(0));
-    if open_res.is_err() {
-        return open_res;
+    // the file is looked up in the index of it's file-system, not opened.
+    let stat_result = FILESYSTEM.stat(path);
+    if stat_result.is_err() {
+        return Err(abi::Errno::ENOENT);
     }
 
-    let fd_index = open_res.unwrap();
-    sys_fstat(fd_index as usize, stat_buf)
+    abi::copy_to_buffer(stat_result.unwrap(), stat_buf);
+    Ok(0 as isize)
 }
 
 pub fn sys_ioctl(fd_index: usize, command: usize, arg: usize) -> Result<isize, abi::Errno> {
-    let pid = system::current_pid();
-    if pid.is_none() {
-        log::error!("PID is null.");
-        return Err(abi::Errno::EINVAL);
-    }
-
-    // call close on the file-system and remove the fd
-    let mut proc_pool = PROCESS_POOL.lock();
-    let proc_ref: &mut Process = proc_pool.get_mut_ref(&pid.unwrap()).unwrap();
-
-    let proc_data = proc_ref.proc_data.as_mut().unwrap();
-    let fdref_opt = ProcessFDPool::get_mut(proc_data, fd_index);
-    if fdref_opt.is_none() {
-        return Err(abi::Errno::EBADF);
-    }
-
-    let fdref = fdref_opt.unwrap();
-
-    let ioctl_res = FILESYSTEM.lock().ioctl(&mut fdref.fd, command, arg);
-    if ioctl_res.is_err() {
-        return Err(abi::Errno::ENOTTY);
-    }
-
-    Ok(ioctl_res.unwrap() as isize)
+    with_fd(fd_index, |fs, fd| {
+        let ioctl_res = fs.ioctl(fd, command, arg);
+        if ioctl_res.is_err() {
+            return Err(abi::Errno::ENOTTY);
+        }
+
+        Ok(ioctl_res.unwrap() as isize)
+    })
 }
@@ -0,0 +1,276 @@
+extern crate alloc;
+
+use crate::mm::VirtualAddress;
+use crate::system::abi;
+use crate::system::filesystem::vfs::{FILESYSTEM, VFS};
+use crate::system::filesystem::POSIXOpenFlags;
+use crate::system::posix::io;
+use crate::system::vma;
+
+use alloc::string::String;
+use alloc::vec::Vec;
+use core::{mem, ptr};
+
+/// Submission and completion rings shared by a process with the kernel,
+/// they live in the memory of the process. The process queues operations
+/// between `sq_head` and `sq_tail` and calls io_ring_enter, the kernel runs
+/// them in order and posts their results between `cq_head` and `cq_tail`.
+/// Both rings have a power of two entries, indices wrap around freely and
+/// are masked on use.
+#[derive(Debug, Clone, Copy)]
+#[repr(C)]
+pub struct IORing {
+    /// advanced by the kernel past the consumed submissions
+    pub sq_head: u32,
+    /// advanced by the process past the queued submissions
+    pub sq_tail: u32,
+    pub sq_mask: u32,
+    /// advanced by the process past the reaped completions
+    pub cq_head: u32,
+    /// advanced by the kernel past the posted completions
+    pub cq_tail: u32,
+    pub cq_mask: u32,
+    /// address of the submission entries
+    pub sqes: u64,
+    /// address of the completion entries
+    pub cqes: u64,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq)]
+#[repr(u8)]
+pub enum IORingOp {
+    Nop = 0,
+    Read = 1,
+    Write = 2,
+    Open = 3,
+    Close = 4,
+}
+
+impl IORingOp {
+    fn from_u8(value: u8) -> Option<Self> {
+        match value {
+            0 => Some(IORingOp::Nop),
+            1 => Some(IORingOp::Read),
+            2 => Some(IORingOp::Write),
+            3 => Some(IORingOp::Open),
+            4 => Some(IORingOp::Close),
+            _ => None,
+        }
+    }
+}
+
+/// reads and writes use the offset of the descriptor when `offset` is this.
+pub const IORING_CURRENT_OFFSET: u64 = u64::MAX;
+
+/// one queued operation. `addr` is the buffer for reads and writes and the
+/// path for open, `len` is the buffer size for reads and writes and the
+/// flags for open.
+#[derive(Debug, Clone, Copy)]
+#[repr(C)]
+pub struct IOSubmission {
+    pub opcode: u8,
+    pub reserved: [u8; 3],
+    pub fd: u32,
+    pub addr: u64,
+    pub len: u64,
+    pub offset: u64,
+    /// returned as it is with the completion
+    pub user_data: u64,
+}
+
+/// `result` is what the equivalent system call returns.
+#[derive(Debug, Clone, Copy)]
+#[repr(C)]
+pub struct IOCompletion {
+    pub user_data: u64,
+    pub result: i64,
+}
+
+/// most submissions consumed by one io_ring_enter call.
+const IORING_MAX_BATCH: usize = 256;
+
+const IORING_MAX_PATH: usize = 512;
+
+/// a submission checked and paged in, ready to run under the locks.
+enum PreparedOp {
+    Nop,
+    Read(usize, VirtualAddress, usize, Option<u32>),
+    Write(usize, VirtualAddress, usize, Option<u32>),
+    Open(String, POSIXOpenFlags),
+    Close(usize),
+    Failed(abi::Errno),
+}
+
+#[inline]
+fn user_range_valid(addr: u64, size: usize) -> bool {
+    let end = addr.checked_add(size as u64);
+    end.is_some() && abi::is_in_userspace(addr) && abi::is_in_userspace(end.unwrap())
+}
+
+#[inline]
+fn ring_offset(offset: u64) -> Result<Option<u32>, abi::Errno> {
+    if offset == IORING_CURRENT_OFFSET {
+        return Ok(None);
+    }
+
+    if offset > u32::MAX as u64 {
+        return Err(abi::Errno::EINVAL);
+    }
+
+    Ok(Some(offset as u32))
+}
+
+/// does everything that can fault before the locks are taken.
+fn prepare(sqe: &IOSubmission) -> PreparedOp {
+    let op_opt = IORingOp::from_u8(sqe.opcode);
+    if op_opt.is_none() {
+        return PreparedOp::Failed(abi::Errno::EINVAL);
+    }
+
+    match op_opt.unwrap() {
+        IORingOp::Nop => PreparedOp::Nop,
+        IORingOp::Read | IORingOp::Write => {
+            let size = sqe.len as usize;
+            if !user_range_valid(sqe.addr, size) {
+                return PreparedOp::Failed(abi::Errno::EFAULT);
+            }
+
+            let offset_res = ring_offset(sqe.offset);
+            if offset_res.is_err() {
+                return PreparedOp::Failed(offset_res.unwrap_err());
+            }
+
+            let addr = VirtualAddress::from_u64(sqe.addr);
+            vma::prefault_range(addr, size);
+
+            if sqe.opcode == IORingOp::Read as u8 {
+                PreparedOp::Read(sqe.fd as usize, addr, size, offset_res.unwrap())
+            } else {
+                PreparedOp::Write(sqe.fd as usize, addr, size, offset_res.unwrap())
+            }
+        }
+        IORingOp::Open => {
+            if !abi::is_in_userspace(sqe.addr) {
+                return PreparedOp::Failed(abi::Errno::EFAULT);
+            }
+
+            let path_res = abi::copy_cstring(VirtualAddress::from_u64(sqe.addr), IORING_MAX_PATH);
+            if path_res.is_err() {
+                return PreparedOp::Failed(path_res.unwrap_err());
+            }
+
+            PreparedOp::Open(
+                path_res.unwrap(),
+                POSIXOpenFlags::from_bits_truncate(sqe.len as u32),
+            )
+        }
+        IORingOp::Close => PreparedOp::Close(sqe.fd as usize),
+    }
+}
+
+#[inline]
+fn as_result(result: Result<isize, abi::Errno>) -> i64 {
+    match result {
+        Ok(value) => value as i64,
+        Err(err) => err as i64,
+    }
+}
+
+/// runs up to `to_submit` queued operations of the ring at `ring_addr`,
+/// with one system call for the whole batch.
+/// Submission stops early if the completion ring is full. Returns the
+/// number of operations consumed, each of them has a completion posted.
+pub fn sys_io_ring_enter(ring_addr: VirtualAddress, to_submit: usize) -> Result<isize, abi::Errno> {
+    if !user_range_valid(ring_addr.as_u64(), mem::size_of::<IORing>()) {
+        return Err(abi::Errno::EFAULT);
+    }
+
+    vma::prefault_range(ring_addr, mem::size_of::<IORing>());
+    let ring_ptr = ring_addr.get_mut_ptr::<IORing>();
+    let ring = unsafe { ptr::read_volatile(ring_ptr) };
+
+    let sq_entries = ring.sq_mask as usize + 1;
+    let cq_entries = ring.cq_mask as usize + 1;
+    if !sq_entries.is_power_of_two() || !cq_entries.is_power_of_two() {
+        return Err(abi::Errno::EINVAL);
+    }
+
+    let sq_size = sq_entries * mem::size_of::<IOSubmission>();
+    let cq_size = cq_entries * mem::size_of::<IOCompletion>();
+    if !user_range_valid(ring.sqes, sq_size) || !user_range_valid(ring.cqes, cq_size) {
+        return Err(abi::Errno::EFAULT);
+    }
+
+    let queued = ring.sq_tail.wrapping_sub(ring.sq_head) as usize;
+    let cq_free = cq_entries.saturating_sub(ring.cq_tail.wrapping_sub(ring.cq_head) as usize);
+    if queued > sq_entries {
+        return Err(abi::Errno::EINVAL);
+    }
+
+    let n_ops = to_submit.min(queued).min(cq_free).min(IORING_MAX_BATCH);
+    if n_ops == 0 {
+        return Ok(0);
+    }
+
+    vma::prefault_range(VirtualAddress::from_u64(ring.sqes), sq_size);
+    vma::prefault_range(VirtualAddress::from_u64(ring.cqes), cq_size);
+
+    let sqes_ptr = ring.sqes as *const IOSubmission;
+    let mut user_data: Vec<u64> = Vec::with_capacity(n_ops);
+    let mut ops: Vec<PreparedOp> = Vec::with_capacity(n_ops);
+    for index in 0..n_ops {
+        let slot = (ring.sq_head.wrapping_add(index as u32) & ring.sq_mask) as usize;
+        let sqe = unsafe { ptr::read_volatile(sqes_ptr.add(slot)) };
+        user_data.push(sqe.user_data);
+        ops.push(prepare(&sqe));
+    }
+
+    // the process is locked only to look up the descriptors, operations of
+    // the batch still run in order.
+    let fs: &VFS = &FILESYSTEM;
+    let mut results: Vec<i64> = Vec::with_capacity(ops.len());
+    for op in ops.iter() {
+        let result = match op {
+            PreparedOp::Nop => Ok(0),
+            PreparedOp::Failed(err) => Err(err.clone()),
+            PreparedOp::Open(path, flags) => io::open_file(fs, path, *flags),
+            PreparedOp::Close(fd_index) => io::close_file(fs, *fd_index),
+            PreparedOp::Read(fd_index, addr, size, offset) => io::with_fd(*fd_index, |fs, fd| {
+                let buffer = unsafe { io::user_buffer_mut(*addr, *size) };
+                io::read_fd(fs, fd, buffer, *offset)
+            }),
+            PreparedOp::Write(fd_index, addr, size, offset) => io::with_fd(*fd_index, |fs, fd| {
+                let buffer = unsafe { io::user_buffer(*addr, *size) };
+                io::write_fd(fs, fd, buffer, *offset)
+            }),
+        };
+
+        results.push(as_result(result));
+    }
+
+    // post the completions, then publish the new heads and tails.
+    let cqes_ptr = ring.cqes as *mut IOCompletion;
+    for (index, result) in results.into_iter().enumerate() {
+        let slot = (ring.cq_tail.wrapping_add(index as u32) & ring.cq_mask) as usize;
+        let cqe = IOCompletion {
+            user_data: user_data[index],
+            result,
+        };
+        unsafe {
+            ptr::write_volatile(cqes_ptr.add(slot), cqe);
+        }
+    }
+
+    unsafe {
+        ptr::write_volatile(
+            &mut (*ring_ptr).sq_head,
+            ring.sq_head.wrapping_add(n_ops as u32),
+        );
+        ptr::write_volatile(
+            &mut (*ring_ptr).cq_tail,
+            ring.cq_tail.wrapping_add(n_ops as u32),
+        );
+    }
+
+    Ok(n_ops as isize)
+}
@@ -2,10 +2,15 @@ extern crate log;
 
 use crate::system;
 use crate::system::abi;
+use crate::system::filesystem::vfs::FILESYSTEM;
+use crate::system::filesystem::FDOps;
+use crate::system::page_cache::CacheObject;
 use crate::system::process::{Process, PROCESS_POOL};
-use crate::system::utils::ProcessHeapAllocator;
+use crate::system::utils::{ProcessFDPool, ProcessHeapAllocator};
+use crate::system::vma::{self, VMAFlags, VirtualMemoryArea};
 
-use crate::mm::VirtualAddress;
+use crate::mm::paging::KernelVirtualMemoryManager;
+use crate::mm::{Alignment, MemorySizes, VirtualAddress};
 
 pub fn sys_brk(addr: VirtualAddress) -> Result<isize, abi::Errno> {
     let pid = system::current_pid();
@@ -65,3 +70,150 @@ pub fn sys_sbrk(size: usize) -> Result<isize, abi::Errno> {
 
     Ok(current_end_addr.as_u64() as isize)
 }
+
+const PROT_READ: usize = 1;
+const PROT_WRITE: usize = 2;
+const PROT_EXEC: usize = 4;
+
+const MAP_SHARED: usize = 0x01;
+const MAP_PRIVATE: usize = 0x02;
+const MAP_FIXED: usize = 0x10;
+const MAP_ANONYMOUS: usize = 0x20;
+
+const MMAP_PAGE_SIZE: u64 = 4 * MemorySizes::OneKiB as u64;
+
+#[inline]
+fn prot_to_flags(prot: usize) -> VMAFlags {
+    let mut flags = VMAFlags::empty();
+    if prot & PROT_READ != 0 {
+        flags.insert(VMAFlags::READ);
+    }
+    if prot & PROT_WRITE != 0 {
+        flags.insert(VMAFlags::WRITE);
+    }
+    if prot & PROT_EXEC != 0 {
+        flags.insert(VMAFlags::EXEC);
+    }
+
+    flags
+}
+
+/// reserves the range, the pages are mapped when they are touched. File
+/// pages come from the page cache, so every mapping of the file shares them.
+pub fn sys_mmap(
+    addr: VirtualAddress,
+    length: usize,
+    prot: usize,
+    flags: usize,
+    fd_index: usize,
+    offset: usize,
+) -> Result<isize, abi::Errno> {
+    let is_shared = flags & MAP_SHARED != 0;
+    if length == 0 || is_shared == (flags & MAP_PRIVATE != 0) {
+        return Err(abi::Errno::EINVAL);
+    }
+
+    if offset as u64 % MMAP_PAGE_SIZE != 0 || !addr.is_aligned_at(MMAP_PAGE_SIZE) {
+        return Err(abi::Errno::EINVAL);
+    }
+
+    let aligned_length = Alignment::align_up(length as u64, MMAP_PAGE_SIZE);
+    let vma_flags = prot_to_flags(prot);
+
+    let area = if flags & MAP_ANONYMOUS != 0 {
+        VirtualMemoryArea::anonymous(aligned_length, vma_flags, is_shared)
+    } else {
+        let pid = system::current_pid();
+        if pid.is_none() {
+            log::error!("PID is null.");
+            return Err(abi::Errno::EINVAL);
+        }
+
+        let mut fd = {
+            let mut proc_pool = PROCESS_POOL.lock();
+            let proc_ref: &mut Process = proc_pool.get_mut_ref(&pid.unwrap()).unwrap();
+            let proc_data = proc_ref.proc_data.as_mut().unwrap();
+            let fdref_opt = ProcessFDPool::get_mut(proc_data, fd_index);
+            if fdref_opt.is_none() {
+                return Err(abi::Errno::EBADF);
+            }
+
+            fdref_opt.unwrap().fd.clone()
+        };
+
+        if CacheObject::from_fd(&fd).is_none() {
+            return Err(abi::Errno::ENODEV);
+        }
+
+        // the mounted file-systems are read-only.
+        if is_shared && vma_flags.contains(VMAFlags::WRITE) {
+            return Err(abi::Errno::EACCES);
+        }
+
+        let fstat_res = FILESYSTEM.fstat(&mut fd);
+        if fstat_res.is_err() {
+            return Err(abi::Errno::EIO);
+        }
+
+        let file_size = fstat_res.unwrap().file_size as u64;
+        VirtualMemoryArea::from_file(
+            &fd,
+            offset as u64,
+            file_size.saturating_sub(offset as u64),
+            aligned_length,
+            vma_flags,
+            is_shared,
+        )
+    };
+
+    let (vmm, pt_root) = KernelVirtualMemoryManager::current_vmm();
+    let hint = if addr.as_u64() == 0 {
+        None
+    } else {
+        Some(addr.as_u64())
+    };
+
+    if flags & MAP_FIXED != 0 {
+        if hint.is_none() {
+            return Err(abi::Errno::EINVAL);
+        }
+
+        // checked before anything is unmapped, a failing call changes nothing.
+        let start = hint.unwrap();
+        if !vma::is_in_mmap_window(start, aligned_length) {
+            return Err(abi::Errno::ENOMEM);
+        }
+
+        // the new mapping replaces whatever was there.
+        vma::unmap_range(&vmm, pt_root, start, start + aligned_length);
+        if !vma::place_area_at(pt_root, area, start) {
+            // another thread mapped the range meanwhile.
+            return Err(abi::Errno::ENOMEM);
+        }
+
+        return Ok(start as isize);
+    }
+
+    let place_res = vma::place_area(pt_root, area, hint);
+    if place_res.is_none() {
+        return Err(abi::Errno::ENOMEM);
+    }
+
+    Ok(place_res.unwrap() as isize)
+}
+
+pub fn sys_munmap(addr: VirtualAddress, length: usize) -> Result<isize, abi::Errno> {
+    if length == 0 || !addr.is_aligned_at(MMAP_PAGE_SIZE) {
+        return Err(abi::Errno::EINVAL);
+    }
+
+    let start = addr.as_u64();
+    let end = start.saturating_add(Alignment::align_up(length as u64, MMAP_PAGE_SIZE));
+    if !abi::is_in_userspace(start) || !abi::is_in_userspace(end - 1) {
+        return Err(abi::Errno::EINVAL);
+    }
+
+    let (vmm, pt_root) = KernelVirtualMemoryManager::current_vmm();
+    vma::unmap_range(&vmm, pt_root, start, end);
+    Ok(0)
+}
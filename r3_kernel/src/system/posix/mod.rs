@@ -1,17 +1,23 @@
+pub mod epoll;
 pub mod gettime;
 pub mod io;
+pub mod ioring;
 pub mod misc;
 pub mod mm;
 pub mod sched;
+pub mod socket;
 
 use crate::mm::VirtualAddress;
 use crate::system::abi;
-use crate::system::filesystem::POSIXOpenFlags;
+use crate::system::filesystem::{FStatInfo, POSIXOpenFlags};
 use crate::system::process::PID;
+use crate::system::vma;
 
 use crate::cpu::interrupts::InterruptStackFrame;
 use crate::cpu::state::SyscallRegsState;
 
+use core::mem;
+
 const SYSCALL_NO_READ: usize = 0;
 const SYSCALL_NO_WRITE: usize = 1;
 const SYSCALL_NO_OPEN: usize = 2;
@@ -25,17 +31,31 @@ const SYSCALL_NO_PPID: usize = 10;
 const SYSCALL_NO_FORK: usize = 11;
 const SYSCALL_NO_BRK: usize = 12;
 const SYSCALL_NO_SBRK: usize = 13;
+const SYSCALL_NO_MMAP: usize = 14;
+const SYSCALL_NO_MUNMAP: usize = 15;
 const SYSCALL_NO_IOCTL: usize = 16;
+const SYSCALL_NO_PREAD: usize = 17;
+const SYSCALL_NO_PWRITE: usize = 18;
+const SYSCALL_NO_READV: usize = 19;
+const SYSCALL_NO_WRITEV: usize = 20;
+const SYSCALL_NO_SOCKET: usize = 41;
 const SYSCALL_NO_YIELD: usize = 42;
 const SYSCALL_NO_TID: usize = 43;
+const SYSCALL_NO_SENDTO: usize = 44;
+const SYSCALL_NO_RECVFROM: usize = 45;
 const SYSCALL_NO_SLEEP: usize = 46;
 const SYSCALL_NO_WAIT: usize = 47;
 const SYSCALL_NO_SHUTDOWN: usize = 48;
 const SYSCALL_NO_REBOOT: usize = 49;
+const SYSCALL_NO_BIND: usize = 50;
 const SYSCALL_NO_EXECVP: usize = 59;
 const SYSCALL_NO_UNAME: usize = 63;
 const SYSCALL_NO_GETRANDOM: usize = 64;
+const SYSCALL_NO_EPOLL_CREATE: usize = 213;
 const SYSCALL_NO_GETTIME: usize = 228;
+const SYSCALL_NO_EPOLL_WAIT: usize = 232;
+const SYSCALL_NO_EPOLL_CTL: usize = 233;
+const SYSCALL_NO_IORING_ENTER: usize = 426;
 
 #[inline]
 pub fn dispatch_syscall(regs: &mut SyscallRegsState, frame: &mut InterruptStackFrame) -> isize {
@@ -45,14 +65,6 @@ pub fn dispatch_syscall(regs: &mut SyscallRegsState, frame: &mut InterruptStackF
     let arg1 = regs.rsi as usize;
     let arg2 = regs.rdx as usize;
 
-    log::debug!(
-        "SYSCALL: sys_no={}, arg0=0x{:x}, arg1=0x{:x}, arg2=0x{:x}",
-        sys_no,
-        arg0,
-        arg1,
-        arg2
-    );
-
     let syscall_result = match sys_no {
         SYSCALL_NO_GETTIME => {
             // is the pointer null?
@@ -87,6 +99,7 @@ pub fn dispatch_syscall(regs: &mut SyscallRegsState, frame: &mut InterruptStackF
             let res = if !abi::is_in_userspace(arg1 as u64) {
                 Err(abi::Errno::EFAULT)
             } else {
+                vma::prefault_range(VirtualAddress::from_u64(arg1 as u64), arg2);
                 io::sys_read(arg0, VirtualAddress::from_u64(arg1 as u64), arg2)
             };
             res
@@ -95,10 +108,82 @@ pub fn dispatch_syscall(regs: &mut SyscallRegsState, frame: &mut InterruptStackF
             let res = if !abi::is_in_userspace(arg1 as u64) {
                 Err(abi::Errno::EFAULT)
             } else {
+                vma::prefault_range(VirtualAddress::from_u64(arg1 as u64), arg2);
                 io::sys_write(arg0, VirtualAddress::from_u64(arg1 as u64), arg2)
             };
             res
         }
+        SYSCALL_NO_PREAD => {
+            // the offset is passed in r10.
+            let res = if !abi::is_in_userspace(arg1 as u64) {
+                Err(abi::Errno::EFAULT)
+            } else {
+                vma::prefault_range(VirtualAddress::from_u64(arg1 as u64), arg2);
+                io::sys_pread(
+                    arg0,
+                    VirtualAddress::from_u64(arg1 as u64),
+                    arg2,
+                    regs.r10 as usize,
+                )
+            };
+            res
+        }
+        SYSCALL_NO_PWRITE => {
+            let res = if !abi::is_in_userspace(arg1 as u64) {
+                Err(abi::Errno::EFAULT)
+            } else {
+                vma::prefault_range(VirtualAddress::from_u64(arg1 as u64), arg2);
+                io::sys_pwrite(
+                    arg0,
+                    VirtualAddress::from_u64(arg1 as u64),
+                    arg2,
+                    regs.r10 as usize,
+                )
+            };
+            res
+        }
+        SYSCALL_NO_READV => match io::copy_iovecs(VirtualAddress::from_u64(arg1 as u64), arg2) {
+            Ok(iovecs) => io::sys_readv(arg0, &iovecs),
+            Err(err_code) => Err(err_code),
+        },
+        SYSCALL_NO_WRITEV => match io::copy_iovecs(VirtualAddress::from_u64(arg1 as u64), arg2) {
+            Ok(iovecs) => io::sys_writev(arg0, &iovecs),
+            Err(err_code) => Err(err_code),
+        },
+        SYSCALL_NO_IORING_ENTER => {
+            ioring::sys_io_ring_enter(VirtualAddress::from_u64(arg0 as u64), arg1)
+        }
+        SYSCALL_NO_SOCKET => socket::sys_socket(arg0, arg1, arg2),
+        SYSCALL_NO_BIND => socket::sys_bind(arg0, VirtualAddress::from_u64(arg1 as u64), arg2),
+        SYSCALL_NO_SENDTO => {
+            // flags, the destination and it's length are passed in r10, r8 and r9.
+            socket::sys_sendto(
+                arg0,
+                VirtualAddress::from_u64(arg1 as u64),
+                arg2,
+                regs.r10 as usize,
+                VirtualAddress::from_u64(regs.r8),
+                regs.r9 as usize,
+            )
+        }
+        SYSCALL_NO_RECVFROM => socket::sys_recvfrom(
+            arg0,
+            VirtualAddress::from_u64(arg1 as u64),
+            arg2,
+            regs.r10 as usize,
+            VirtualAddress::from_u64(regs.r8),
+            VirtualAddress::from_u64(regs.r9),
+        ),
+        SYSCALL_NO_EPOLL_CREATE => epoll::sys_epoll_create(arg0),
+        SYSCALL_NO_EPOLL_CTL => {
+            epoll::sys_epoll_ctl(arg0, arg1, arg2, VirtualAddress::from_u64(regs.r10))
+        }
+        SYSCALL_NO_EPOLL_WAIT => epoll::sys_epoll_wait(
+            arg0,
+            VirtualAddress::from_u64(arg1 as u64),
+            arg2,
+            regs.r10 as i32 as isize,
+        ),
         SYSCALL_NO_LSEEK => io::sys_lseek(arg0, arg1 as u32, arg2 as u8),
         SYSCALL_NO_CLOSE => io::sys_close(arg0),
         SYSCALL_NO_EXIT => sched::sys_exit(arg0 as i64),
@@ -106,6 +191,10 @@ pub fn dispatch_syscall(regs: &mut SyscallRegsState, frame: &mut InterruptStackF
             let res = if !abi::is_in_userspace(arg1 as u64) {
                 Err(abi::Errno::EFAULT)
             } else {
+                vma::prefault_range(
+                    VirtualAddress::from_u64(arg1 as u64),
+                    mem::size_of::<FStatInfo>(),
+                );
                 io::sys_fstat(arg0, VirtualAddress::from_u64(arg1 as u64))
             };
             res
@@ -117,7 +206,13 @@ pub fn dispatch_syscall(regs: &mut SyscallRegsState, frame: &mut InterruptStackF
                 let path_res = abi::copy_cstring(VirtualAddress::from_u64(arg0 as u64), 512);
                 let open_res = match path_res {
                     Err(err_code) => Err(err_code),
-                    Ok(path) => io::sys_lstat(&path, VirtualAddress::from_u64(arg1 as u64)),
+                    Ok(path) => {
+                        vma::prefault_range(
+                            VirtualAddress::from_u64(arg1 as u64),
+                            mem::size_of::<FStatInfo>(),
+                        );
+                        io::sys_lstat(&path, VirtualAddress::from_u64(arg1 as u64))
+                    }
                 };
 
                 open_res
@@ -136,6 +231,24 @@ pub fn dispatch_syscall(regs: &mut SyscallRegsState, frame: &mut InterruptStackF
         }
         SYSCALL_NO_BRK => mm::sys_brk(VirtualAddress::from_u64(arg0 as u64)),
         SYSCALL_NO_SBRK => mm::sys_sbrk(arg0),
+        SYSCALL_NO_MMAP => {
+            // the last three arguments are passed in r10, r8 and r9.
+            let res = if arg0 != 0 && !abi::is_in_userspace(arg0 as u64) {
+                Err(abi::Errno::EINVAL)
+            } else {
+                mm::sys_mmap(
+                    VirtualAddress::from_u64(arg0 as u64),
+                    arg1,
+                    arg2,
+                    regs.r10 as usize,
+                    regs.r8 as usize,
+                    regs.r9 as usize,
+                )
+            };
+
+            res
+        }
+        SYSCALL_NO_MUNMAP => mm::sys_munmap(VirtualAddress::from_u64(arg0 as u64), arg1),
         SYSCALL_NO_IOCTL => io::sys_ioctl(arg0, arg1, arg2),
         SYSCALL_NO_YIELD => sched::sys_yield(),
         SYSCALL_NO_SLEEP => {
@@ -173,6 +286,7 @@ pub fn dispatch_syscall(regs: &mut SyscallRegsState, frame: &mut InterruptStackF
             let res = if !abi::is_in_userspace(arg0 as u64) {
                 Err(abi::Errno::EFAULT)
             } else {
+                vma::prefault_range(VirtualAddress::from_u64(arg0 as u64), arg1);
                 let rand_result = misc::sys_getrandom(
                     VirtualAddress::from_u64(arg0 as u64),
                     arg1 as usize,
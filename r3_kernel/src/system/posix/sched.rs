@@ -27,9 +27,7 @@ pub fn sys_sleep_us(timeval_addr: VirtualAddress) -> Result<isize, abi::Errno> {
     let ticks = timeval_buffer.to_ticks();
 
     // sleep this thread for {ticks given
-    SCHEDULER
-        .lock()
-        .suspend_thread(ThreadSuspendType::SuspendSleep(ticks));
+    SCHEDULER.suspend_thread(ThreadSuspendType::SuspendSleep(ticks));
 
     // yield
     schedule_yield();
@@ -38,12 +36,12 @@ pub fn sys_sleep_us(timeval_addr: VirtualAddress) -> Result<isize, abi::Errno> {
 }
 
 pub fn sys_pid() -> Result<isize, abi::Errno> {
-    let current_pid = SCHEDULER.lock().current_pid().unwrap();
+    let current_pid = SCHEDULER.current_pid().unwrap();
     Ok(current_pid.as_u64() as isize)
 }
 
 pub fn sys_ppid() -> Result<isize, abi::Errno> {
-    let current_pid = SCHEDULER.lock().current_pid().unwrap();
+    let current_pid = SCHEDULER.current_pid().unwrap();
     let ppid = PROCESS_POOL
         .lock()
         .get_mut_ref(&current_pid)
@@ -54,7 +52,7 @@ pub fn sys_ppid() -> Result<isize, abi::Errno> {
 }
 
 pub fn sys_tid() -> Result<isize, abi::Errno> {
-    let current_tid = SCHEDULER.lock().current_tid().unwrap().as_u64();
+    let current_tid = SCHEDULER.current_tid().unwrap().as_u64();
     Ok(current_tid as isize)
 }
 
@@ -62,7 +60,7 @@ pub fn sys_fork(regs: &SyscallRegsState, frame: &InterruptStackFrame) -> Result<
     // disable interrupts
     pause_events();
 
-    let parent_pid = SCHEDULER.lock().current_pid().unwrap();
+    let parent_pid = SCHEDULER.current_pid().unwrap();
 
     // spawn a new process, which is the child
     let child = Process::create_from_parent(&parent_pid);
@@ -104,7 +102,7 @@ pub fn sys_fork(regs: &SyscallRegsState, frame: &InterruptStackFrame) -> Result<
     resume_events();
 
     // add this thread to the queue:
-    SCHEDULER.lock().add_new_thread(thread);
+    SCHEDULER.add_new_thread(thread);
     // from here, the process will be the child
     // tell the scheduler to run our new process next, by creating a new thread.
     Ok(child_pid.as_u64() as isize)
@@ -112,10 +110,10 @@ pub fn sys_fork(regs: &SyscallRegsState, frame: &InterruptStackFrame) -> Result<
 
 pub fn sys_execvp(path: &str, ist: &mut InterruptStackFrame) -> Result<isize, abi::Errno> {
     pause_events();
-    let pid = SCHEDULER.lock().current_pid().unwrap();
+    let pid = SCHEDULER.current_pid().unwrap();
     let code_start = PROCESS_POOL.lock().reset_process(&pid, path);
     // reset the thread's internal stack to point to the start from end
-    let stack_addr = SCHEDULER.lock().reset_current_thread_stack();
+    let stack_addr = SCHEDULER.reset_current_thread_stack();
 
     // set the interrupt stack frame registers
     ist.stack_pointer = stack_addr.as_u64();
@@ -126,17 +124,15 @@ pub fn sys_execvp(path: &str, ist: &mut InterruptStackFrame) -> Result<isize, ab
 
 pub fn sys_exit(code: i64) -> Result<isize, abi::Errno> {
     pause_events();
-    let pid = SCHEDULER.lock().current_pid().unwrap();
+    let pid = SCHEDULER.current_pid().unwrap();
 
-    SCHEDULER.lock().exit(code);
+    SCHEDULER.exit(code);
     PROCESS_POOL
         .lock()
         .remove_process(&pid, code)
         .expect("Failed to remove process");
     // wakeup waiting threads
-    SCHEDULER
-        .lock()
-        .check_wakeup(ThreadWakeupType::FromWait(pid));
+    SCHEDULER.check_wakeup(ThreadWakeupType::FromWait(pid));
 
     resume_events();
     schedule_yield();
@@ -147,9 +143,7 @@ pub fn sys_exit(code: i64) -> Result<isize, abi::Errno> {
 
 pub fn sys_wait(pid: PID) -> Result<isize, abi::Errno> {
     // suspend the current thread
-    SCHEDULER
-        .lock()
-        .suspend_thread(ThreadSuspendType::SuspendWait(pid));
+    SCHEDULER.suspend_thread(ThreadSuspendType::SuspendWait(pid));
     // yield the scheduler until next time
     schedule_yield();
 
@@ -0,0 +1,195 @@
+extern crate alloc;
+
+use crate::mm::VirtualAddress;
+use crate::system::abi;
+use crate::system::filesystem::{FileDescriptor, POSIXOpenFlags};
+use crate::system::net::types::{
+    NetworkSocketAddress, SocketAddr, SocketDescriptor, SocketError, SocketRef,
+};
+use crate::system::net::udp::UDPSocket;
+use crate::system::posix::io;
+use crate::system::utils::ProcessFDPool;
+use crate::system::vma;
+
+use alloc::sync::Arc;
+use core::mem;
+
+const AF_INET: usize = 2;
+const SOCK_DGRAM: usize = 2;
+const IPPROTO_UDP: usize = 17;
+
+/// the lower bits of the socket type are the type, the others are flags.
+const SOCK_TYPE_MASK: usize = 0xf;
+const SOCK_NONBLOCK: usize = POSIXOpenFlags::O_NONBLOCK.bits() as usize;
+
+const MSG_DONTWAIT: usize = 0x40;
+
+#[inline]
+fn socket_errno(err: SocketError) -> abi::Errno {
+    match err {
+        SocketError::InvalidAddress => abi::Errno::EINVAL,
+        SocketError::PortAlreadyInUse => abi::Errno::EADDRINUSE,
+        SocketError::BindError => abi::Errno::EINVAL,
+        SocketError::WouldBlock => abi::Errno::EAGAIN,
+        SocketError::SendError | SocketError::RecvError => abi::Errno::EIO,
+        SocketError::WIP => abi::Errno::ENOSYS,
+    }
+}
+
+#[inline]
+fn user_range_valid(addr: u64, size: usize) -> bool {
+    let end = addr.checked_add(size as u64);
+    end.is_some() && abi::is_in_userspace(addr) && abi::is_in_userspace(end.unwrap())
+}
+
+/// the socket of the descriptor, the process is not locked once it returns
+/// so the socket can block.
+fn socket_of(fd_index: usize) -> Result<(SocketRef, u32), abi::Errno> {
+    io::with_fd(fd_index, |_fs, fd| match fd {
+        FileDescriptor::SocketNode(sockfd) => Ok((sockfd.socket.clone(), sockfd.flags)),
+        _ => Err(abi::Errno::ENOTSOCK),
+    })
+}
+
+/// reads a socket address of the process, only internet addresses are taken.
+fn copy_socket_addr(addr: VirtualAddress, addr_len: usize) -> Result<SocketAddr, abi::Errno> {
+    if addr_len < mem::size_of::<NetworkSocketAddress>()
+        || !user_range_valid(addr.as_u64(), mem::size_of::<NetworkSocketAddress>())
+    {
+        return Err(abi::Errno::EINVAL);
+    }
+
+    vma::prefault_range(addr, mem::size_of::<NetworkSocketAddress>());
+    match SocketAddr::from_memory_view(addr) {
+        Some(sock_addr @ SocketAddr::Network(_)) => Ok(sock_addr),
+        _ => Err(abi::Errno::EAFNOSUPPORT),
+    }
+}
+
+/// only UDP sockets over IPv4 are supported.
+pub fn sys_socket(domain: usize, sock_type: usize, protocol: usize) -> Result<isize, abi::Errno> {
+    if domain != AF_INET {
+        return Err(abi::Errno::EAFNOSUPPORT);
+    }
+
+    if sock_type & SOCK_TYPE_MASK != SOCK_DGRAM || (protocol != 0 && protocol != IPPROTO_UDP) {
+        return Err(abi::Errno::EPROTONOSUPPORT);
+    }
+
+    let flags = if sock_type & SOCK_NONBLOCK != 0 {
+        POSIXOpenFlags::O_NONBLOCK.bits()
+    } else {
+        0
+    };
+
+    let socket: SocketRef = Arc::new(UDPSocket::empty());
+    io::with_process_files(|proc_data| {
+        let fd = FileDescriptor::SocketNode(SocketDescriptor { flags, socket });
+        let fd_res = ProcessFDPool::put(proc_data, fd);
+        if fd_res.is_err() {
+            return Err(abi::Errno::EMFILE);
+        }
+
+        Ok(fd_res.unwrap() as isize)
+    })
+}
+
+pub fn sys_bind(
+    fd_index: usize,
+    addr: VirtualAddress,
+    addr_len: usize,
+) -> Result<isize, abi::Errno> {
+    let sock_addr = copy_socket_addr(addr, addr_len)?;
+    let (socket, _) = socket_of(fd_index)?;
+
+    let bind_res = socket.bind(sock_addr);
+    if bind_res.is_err() {
+        return Err(socket_errno(bind_res.unwrap_err()));
+    }
+
+    Ok(0)
+}
+
+/// sends one datagram to `dest_addr`, sockets are not connected so the
+/// destination is required.
+pub fn sys_sendto(
+    fd_index: usize,
+    buffer_addr: VirtualAddress,
+    size: usize,
+    _flags: usize,
+    dest_addr: VirtualAddress,
+    addr_len: usize,
+) -> Result<isize, abi::Errno> {
+    if dest_addr.as_u64() == 0 {
+        return Err(abi::Errno::EDESTADDRREQ);
+    }
+
+    if !user_range_valid(buffer_addr.as_u64(), size) {
+        return Err(abi::Errno::EFAULT);
+    }
+
+    let sock_addr = copy_socket_addr(dest_addr, addr_len)?;
+    let (socket, _) = socket_of(fd_index)?;
+
+    vma::prefault_range(buffer_addr, size);
+    let buffer = unsafe { io::user_buffer(buffer_addr, size) };
+    let send_res = socket.sendto(sock_addr, buffer);
+    if send_res.is_err() {
+        return Err(socket_errno(send_res.unwrap_err()));
+    }
+
+    Ok(send_res.unwrap() as isize)
+}
+
+/// receives one datagram, blocks unless the socket is non-blocking or
+/// MSG_DONTWAIT is given. The sender is written to `src_addr` if it is not null.
+pub fn sys_recvfrom(
+    fd_index: usize,
+    buffer_addr: VirtualAddress,
+    size: usize,
+    flags: usize,
+    src_addr: VirtualAddress,
+    addr_len_ptr: VirtualAddress,
+) -> Result<isize, abi::Errno> {
+    if !user_range_valid(buffer_addr.as_u64(), size) {
+        return Err(abi::Errno::EFAULT);
+    }
+
+    let addr_size = mem::size_of::<NetworkSocketAddress>();
+    if src_addr.as_u64() != 0 && !user_range_valid(src_addr.as_u64(), addr_size) {
+        return Err(abi::Errno::EFAULT);
+    }
+
+    if addr_len_ptr.as_u64() != 0 && !user_range_valid(addr_len_ptr.as_u64(), 4) {
+        return Err(abi::Errno::EFAULT);
+    }
+
+    let (socket, sock_flags) = socket_of(fd_index)?;
+    let non_blocking =
+        flags & MSG_DONTWAIT != 0 || sock_flags & POSIXOpenFlags::O_NONBLOCK.bits() != 0;
+
+    vma::prefault_range(buffer_addr, size);
+    let buffer = unsafe { io::user_buffer_mut(buffer_addr, size) };
+    let recv_res = if non_blocking {
+        socket.try_recvfrom(buffer)
+    } else {
+        socket.recvfrom(buffer)
+    };
+
+    if recv_res.is_err() {
+        return Err(socket_errno(recv_res.unwrap_err()));
+    }
+
+    let (length, sender) = recv_res.unwrap();
+    if src_addr.as_u64() != 0 {
+        vma::prefault_range(src_addr, addr_size);
+        sender.write_to_memory(src_addr);
+    }
+
+    if addr_len_ptr.as_u64() != 0 {
+        vma::prefault_range(addr_len_ptr, 4);
+        abi::copy_to_buffer(addr_size as u32, addr_len_ptr);
+    }
+
+    Ok(length as isize)
+}
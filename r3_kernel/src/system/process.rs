@@ -228,8 +228,6 @@ impl Process {
     #[inline]
     pub fn exit(&mut self, _code: i64) {
         log::debug!("Exiting process {}", self.pid.as_u64());
-        // TODO: unmap all the memory, because as of now
-        // physical memory is not freed.
         if !self.is_usermode() {
             return;
         }
@@ -240,6 +238,10 @@ impl Process {
             &mut self.pt_root.as_mut().unwrap(),
             false,
         );
+
+        // the stacks and the page tables go once the exiting thread is off
+        // the processor, it is still running on them.
+        KernelVirtualMemoryManager::retire_vmm(self.pt_root.as_ref().unwrap().l4_phy_addr);
     }
 }
 
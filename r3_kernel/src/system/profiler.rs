@@ -0,0 +1,311 @@
+extern crate alloc;
+extern crate spin;
+
+use crate::acpi::lapic::MAX_PROCESSORS;
+use crate::cpu::mmu;
+use crate::cpu::percpu::PerCPU;
+use crate::cpu::state::CPURegistersState;
+use crate::cpu::tsc::TSC;
+use crate::mm::{paging::KernelVirtualMemoryManager, VirtualAddress};
+use crate::system::abi;
+use crate::system::filesystem::devfs::{self, DevFSDescriptor, DevOps};
+use crate::system::filesystem::{FSError, SeekType};
+use crate::system::ring::RecordRing;
+
+use alloc::{boxed::Box, string::String, vec, vec::Vec};
+use core::fmt::Write;
+use core::ptr;
+use core::sync::atomic::{AtomicPtr, AtomicU64, Ordering};
+use spin::Mutex;
+
+/// samples kept per processor, older ones are overwritten.
+const PROFILE_SAMPLES: usize = 4096;
+
+/// return addresses taken from the frame pointer chain of every sample.
+const PROFILE_STACK_DEPTH: usize = 4;
+
+const PROFILE_DEFAULT_HZ: u64 = 1000;
+const PROFILE_MAX_HZ: u64 = 10000;
+
+/// ioctl commands of `/dev/profile`, the argument of start is the rate in
+/// samples per second, 0 takes the default.
+pub const PROFILE_IOCTL_START: usize = 1;
+pub const PROFILE_IOCTL_STOP: usize = 2;
+pub const PROFILE_IOCTL_CLEAR: usize = 3;
+
+#[derive(Clone, Copy)]
+struct Sample {
+    tsc: u64,
+    rip: u64,
+    cr3: u64,
+    pid: u64,
+    is_user: bool,
+    depth: usize,
+    stack: [u64; PROFILE_STACK_DEPTH],
+}
+
+const SAMPLE_INIT: Sample = Sample {
+    tsc: 0,
+    rip: 0,
+    cr3: 0,
+    pid: 0,
+    is_user: false,
+    depth: 0,
+    stack: [0; PROFILE_STACK_DEPTH],
+};
+
+/// written only from the timer interrupt of it's own processor.
+type SampleBuffer = RecordRing<Sample, Box<[Sample]>>;
+
+/// a buffer for every processor online when profiling is first started,
+/// allocated once and kept.
+static SAMPLE_BUFFERS: AtomicPtr<Vec<Option<SampleBuffer>>> = AtomicPtr::new(ptr::null_mut());
+static SETUP_LOCK: Mutex<()> = Mutex::new(());
+
+/// TSC ticks between two samples, 0 when the profiler is stopped.
+static SAMPLE_INTERVAL: AtomicU64 = AtomicU64::new(0);
+
+const ZERO: AtomicU64 = AtomicU64::new(0);
+
+/// TSC at which every processor takes it's next sample.
+static NEXT_SAMPLE: [AtomicU64; MAX_PROCESSORS] = [ZERO; MAX_PROCESSORS];
+
+#[inline]
+fn sample_buffers() -> Option<&'static Vec<Option<SampleBuffer>>> {
+    let buffers_ptr = SAMPLE_BUFFERS.load(Ordering::Acquire);
+    if buffers_ptr.is_null() {
+        return None;
+    }
+
+    Some(unsafe { &*buffers_ptr })
+}
+
+fn setup_sample_buffers() {
+    let _setup_lock = SETUP_LOCK.lock();
+    if sample_buffers().is_some() {
+        return;
+    }
+
+    let mut buffers = Vec::with_capacity(MAX_PROCESSORS);
+    for index in 0..MAX_PROCESSORS {
+        if PerCPU::is_online(index) || index == PerCPU::current_index() {
+            buffers.push(Some(RecordRing::new(
+                vec![SAMPLE_INIT; PROFILE_SAMPLES].into_boxed_slice(),
+            )));
+        } else {
+            buffers.push(None);
+        }
+    }
+
+    SAMPLE_BUFFERS.store(Box::into_raw(Box::new(buffers)), Ordering::Release);
+}
+
+/// the earlier of `deadline` and the next sample of this processor, used
+/// by the timer to arm it's shot.
+#[inline]
+pub fn next_sample_before(deadline: u64) -> u64 {
+    let interval = SAMPLE_INTERVAL.load(Ordering::Relaxed);
+    if interval == 0 {
+        return deadline;
+    }
+
+    let next_sample = &NEXT_SAMPLE[PerCPU::current_index()];
+    let mut at = next_sample.load(Ordering::Relaxed);
+    if at == 0 {
+        at = TSC::read_tsc().u64() + interval;
+        next_sample.store(at, Ordering::Relaxed);
+    }
+
+    deadline.min(at)
+}
+
+/// reads a word of the interrupted code's stack, only if it is mapped so
+/// a bad frame pointer cannot fault.
+#[inline]
+fn read_stack_word(address: u64, is_user: bool) -> Option<u64> {
+    if address % 8 != 0 || address == 0 {
+        return None;
+    }
+
+    if is_user && !abi::is_in_userspace(address) {
+        return None;
+    }
+
+    let (vmm, _) = KernelVirtualMemoryManager::current_vmm();
+    if vmm.translate(VirtualAddress::from_u64(address)).is_none() {
+        return None;
+    }
+
+    Some(unsafe { ptr::read_volatile(address as *const u64) })
+}
+
+/// follows the frame pointers from `rbp`, the callers' frames are always
+/// higher up on the stack.
+fn walk_frames(mut rbp: u64, is_user: bool, stack: &mut [u64; PROFILE_STACK_DEPTH]) -> usize {
+    let mut depth = 0;
+    while depth < PROFILE_STACK_DEPTH {
+        let next_rbp = read_stack_word(rbp, is_user);
+        let return_address = read_stack_word(rbp.wrapping_add(8), is_user);
+        if next_rbp.is_none() || return_address.is_none() || return_address.unwrap() == 0 {
+            break;
+        }
+
+        stack[depth] = return_address.unwrap();
+        depth += 1;
+
+        if next_rbp.unwrap() <= rbp {
+            break;
+        }
+        rbp = next_rbp.unwrap();
+    }
+
+    depth
+}
+
+/// called on every timer interrupt with the interrupted state, takes a
+/// sample if this processor is due for one.
+pub fn sample_if_due(state: &CPURegistersState) {
+    let interval = SAMPLE_INTERVAL.load(Ordering::Relaxed);
+    if interval == 0 {
+        return;
+    }
+
+    let index = PerCPU::current_index();
+    let now = TSC::read_tsc().u64();
+    let next_sample = NEXT_SAMPLE[index].load(Ordering::Relaxed);
+    if next_sample != 0 && now < next_sample {
+        return;
+    }
+
+    NEXT_SAMPLE[index].store(now + interval, Ordering::Relaxed);
+
+    let buffers_opt = sample_buffers();
+    if buffers_opt.is_none() {
+        return;
+    }
+
+    if let Some(buffer) = buffers_opt.unwrap()[index].as_ref() {
+        let is_user = state.cs & 3 == 3;
+        let mut sample = Sample {
+            tsc: now,
+            rip: state.rip,
+            cr3: mmu::get_page_table_address().as_u64(),
+            pid: PerCPU::current_pid().unwrap_or(0),
+            is_user,
+            depth: 0,
+            stack: [0; PROFILE_STACK_DEPTH],
+        };
+
+        sample.depth = walk_frames(state.rbp, is_user, &mut sample.stack);
+        buffer.push(sample);
+    }
+}
+
+fn start_profiling(rate: u64) {
+    setup_sample_buffers();
+
+    let frequency = TSC::read_cpu_frequency();
+    if frequency == 0 {
+        return;
+    }
+
+    let hz = if rate == 0 {
+        PROFILE_DEFAULT_HZ
+    } else {
+        rate.min(PROFILE_MAX_HZ)
+    };
+
+    for next_sample in NEXT_SAMPLE.iter() {
+        next_sample.store(0, Ordering::Relaxed);
+    }
+
+    SAMPLE_INTERVAL.store(frequency / hz, Ordering::SeqCst);
+}
+
+fn stop_profiling() {
+    SAMPLE_INTERVAL.store(0, Ordering::SeqCst);
+}
+
+/// the samples of all the processors, oldest first, one per line as
+/// `cpu tsc pid cr3 k|u rip callers..` with addresses in hex.
+fn snapshot() -> String {
+    let mut text = String::new();
+    let buffers_opt = sample_buffers();
+    if buffers_opt.is_none() {
+        return text;
+    }
+
+    let mut samples: Vec<(usize, Sample)> = Vec::new();
+    for (index, buffer_opt) in buffers_opt.unwrap().iter().enumerate() {
+        if let Some(buffer) = buffer_opt.as_ref() {
+            for sample in buffer.snapshot() {
+                samples.push((index, sample));
+            }
+        }
+    }
+
+    samples.sort_by_key(|(_, sample)| sample.tsc);
+
+    for (index, sample) in samples.iter() {
+        let _ = write!(
+            text,
+            "{} {} {} 0x{:x} {} 0x{:x}",
+            index,
+            sample.tsc,
+            sample.pid,
+            sample.cr3,
+            if sample.is_user { "u" } else { "k" },
+            sample.rip
+        );
+        for return_address in sample.stack[0..sample.depth].iter() {
+            let _ = write!(text, " 0x{:x}", return_address);
+        }
+        text.push('\n');
+    }
+
+    text
+}
+
+/// `/dev/profile`, reads return the samples taken so far. The profiler is
+/// started, stopped and cleared with ioctl.
+pub struct ProfileDriver;
+
+impl ProfileDriver {
+    pub fn empty() -> Self {
+        ProfileDriver {}
+    }
+}
+
+impl DevOps for ProfileDriver {
+    fn read(&self, fd: &mut DevFSDescriptor, buffer: &mut [u8]) -> Result<usize, FSError> {
+        Ok(devfs::read_text(fd, buffer, snapshot))
+    }
+
+    fn write(&self, _fd: &mut DevFSDescriptor, _buffer: &[u8]) -> Result<usize, FSError> {
+        Ok(0)
+    }
+
+    fn ioctl(&self, command: usize, arg: usize) -> Result<usize, FSError> {
+        match command {
+            PROFILE_IOCTL_START => start_profiling(arg as u64),
+            PROFILE_IOCTL_STOP => stop_profiling(),
+            PROFILE_IOCTL_CLEAR => {
+                if let Some(buffers) = sample_buffers() {
+                    for buffer in buffers.iter().flatten() {
+                        buffer.clear();
+                    }
+                }
+            }
+            _ => return Err(FSError::NotYetImplemented),
+        }
+
+        Ok(0)
+    }
+
+    fn seek(&self, fd: &mut DevFSDescriptor, offset: u32, st: SeekType) -> Result<u32, FSError> {
+        Ok(devfs::seek_text(fd, offset, st, snapshot))
+    }
+}
+
+unsafe impl Sync for ProfileDriver {}
+unsafe impl Send for ProfileDriver {}
@@ -0,0 +1,117 @@
+extern crate alloc;
+
+use alloc::vec::Vec;
+use core::cell::UnsafeCell;
+use core::marker::PhantomData;
+use core::ptr;
+use core::sync::atomic::{AtomicU64, Ordering};
+
+/// A ring of records written only by it's own processor, from an interrupt
+/// handler or with interrupts disabled, and read from any processor. Readers
+/// copy the records and then check `head` again, records that may have been
+/// overwritten meanwhile are dropped. `B` holds the slots, an array for the
+/// rings that live in statics and a boxed slice for the large ones.
+pub struct RecordRing<T, B> {
+    /// sequence number of the next record, never moves backwards.
+    head: AtomicU64,
+    /// records before this sequence number were cleared, readers skip them.
+    /// The writer does not look at it, so a clear cannot be lost to a push.
+    cleared: AtomicU64,
+    records: UnsafeCell<B>,
+    _record: PhantomData<T>,
+}
+
+unsafe impl<T: Send, B: Send> Sync for RecordRing<T, B> {}
+
+impl<T, B> RecordRing<T, B> {
+    pub const fn new(records: B) -> Self {
+        RecordRing {
+            head: AtomicU64::new(0),
+            cleared: AtomicU64::new(0),
+            records: UnsafeCell::new(records),
+            _record: PhantomData,
+        }
+    }
+}
+
+impl<T: Copy, B: AsRef<[T]> + AsMut<[T]>> RecordRing<T, B> {
+    /// only called by the owning processor, see above.
+    #[inline]
+    pub fn push(&self, record: T) {
+        let head = self.head.load(Ordering::Relaxed);
+        let records = unsafe { (&mut *self.records.get()).as_mut() };
+        let n_records = records.len();
+        records[head as usize % n_records] = record;
+        self.head.store(head + 1, Ordering::Release);
+    }
+
+    /// sequence number of the next record.
+    #[inline]
+    pub fn head(&self) -> u64 {
+        self.head.load(Ordering::Acquire)
+    }
+
+    /// sequence number of the oldest record kept since the last clear.
+    #[inline]
+    pub fn tail(&self) -> u64 {
+        self.tail_of(self.head())
+    }
+
+    #[inline]
+    fn tail_of(&self, head: u64) -> u64 {
+        let n_records = unsafe { (&*self.records.get()).as_ref().len() } as u64;
+        head.saturating_sub(n_records)
+            .max(self.cleared.load(Ordering::Acquire))
+            .min(head)
+    }
+
+    /// the record `seq`, `None` if it is not written yet or was overwritten,
+    /// for readers that follow the ring with their own cursor.
+    pub fn read(&self, seq: u64) -> Option<T> {
+        let records = unsafe { (&*self.records.get()).as_ref() };
+        let n_records = records.len() as u64;
+        if seq >= self.head() {
+            return None;
+        }
+
+        let record = unsafe { ptr::read_volatile(&records[(seq % n_records) as usize]) };
+
+        // the same check as in `snapshot`, for a single record.
+        if seq + n_records <= self.head() {
+            return None;
+        }
+
+        Some(record)
+    }
+
+    /// the records stored since the last clear, oldest first.
+    pub fn snapshot(&self) -> Vec<T> {
+        let records = unsafe { (&*self.records.get()).as_ref() };
+        let n_records = records.len() as u64;
+
+        let head = self.head();
+        let tail = self.tail_of(head);
+
+        let mut copied = Vec::with_capacity((head - tail) as usize);
+        for seq in tail..head {
+            copied.push(unsafe { ptr::read_volatile(&records[(seq % n_records) as usize]) });
+        }
+
+        // the writer may have gone around while copying, and may be writing
+        // the slot of `new_head` right now, which is that of the oldest one.
+        let new_head = self.head.load(Ordering::Acquire);
+        let first_intact = (new_head + 1).saturating_sub(n_records);
+        if first_intact > tail {
+            let n_dropped = ((first_intact - tail) as usize).min(copied.len());
+            copied.drain(0..n_dropped);
+        }
+
+        copied
+    }
+
+    /// forgets the records stored so far, safe to call from any processor.
+    pub fn clear(&self) {
+        let head = self.head.load(Ordering::Acquire);
+        self.cleared.fetch_max(head, Ordering::AcqRel);
+    }
+}
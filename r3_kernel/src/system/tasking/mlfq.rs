@@ -0,0 +1,679 @@
+extern crate alloc;
+extern crate spin;
+
+use crate::acpi::lapic::MAX_PROCESSORS;
+use crate::cpu;
+use crate::cpu::percpu::PerCPU;
+use crate::cpu::state::CPURegistersState;
+use crate::cpu::tsc::{safe_ticks_from_ns, TSC};
+use crate::mm::VirtualAddress;
+use crate::system::process::PID;
+use crate::system::tasking::wait_queue::WaitQueue;
+use crate::system::tasking::{Sched, ThreadSuspendType, ThreadWakeupType};
+use crate::system::thread::{LeasedThread, Thread, ThreadID};
+use crate::system::trace::{self, TraceEvent};
+
+use alloc::collections::VecDeque;
+use alloc::vec::Vec;
+use core::mem;
+use core::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+use spin::Mutex;
+
+/// number of priority levels, 0 is the highest priority.
+pub const MLFQ_LEVELS: usize = 8;
+
+/// all the threads of a processor go back to the top level after these
+/// many scheduling rounds, so that batch threads do not starve.
+const MLFQ_BOOST_ROUNDS: u64 = 128;
+
+/// timer period, a thread that ran for less than 3/4 of this before
+/// getting back to the scheduler gave up the CPU on it's own.
+const MLFQ_TICK_NS: u64 = 100 * 1000000;
+
+/// number of timer ticks a thread can run at given level before it is demoted,
+/// lower levels hold cpu bound threads and get longer slices.
+#[inline]
+fn level_quantum(level: usize) -> u32 {
+    1 << (level / 2)
+}
+
+#[inline]
+fn current_cpu() -> usize {
+    PerCPU::current_index()
+}
+
+#[derive(Debug, Clone)]
+/// Thread control block, lives in the scheduler's arena for the whole life
+/// of the thread. Queues refer to it by it's slot.
+struct SchedEntity {
+    thread: Thread,
+    level: usize,
+    /// timer ticks used at the current level
+    ticks_used: u32,
+    /// TSC value when the thread was last leased
+    leased_at: u64,
+}
+
+impl SchedEntity {
+    #[inline]
+    fn new(thread: Thread) -> Self {
+        SchedEntity {
+            thread,
+            level: 0,
+            ticks_used: 0,
+            leased_at: 0,
+        }
+    }
+}
+
+#[derive(Debug, Clone)]
+/// Run queue of a processor, one FIFO of slots per priority level and a bitmap
+/// of the non-empty levels, so the next thread is found with a single bit scan.
+struct RunQueue {
+    levels: Vec<VecDeque<usize>>,
+    bitmap: u32,
+    n_queued: usize,
+    current: Option<usize>,
+    suspend_next: bool,
+    suspend_type: ThreadSuspendType,
+    rounds: u64,
+}
+
+impl RunQueue {
+    fn empty() -> Self {
+        let mut levels = Vec::with_capacity(MLFQ_LEVELS);
+        for _ in 0..MLFQ_LEVELS {
+            levels.push(VecDeque::new());
+        }
+
+        RunQueue {
+            levels,
+            bitmap: 0,
+            n_queued: 0,
+            current: None,
+            suspend_next: false,
+            suspend_type: ThreadSuspendType::Nothing,
+            rounds: 0,
+        }
+    }
+
+    #[inline]
+    fn push_back(&mut self, slot: usize, level: usize) {
+        self.bitmap |= 1 << level;
+        self.levels[level].push_back(slot);
+        self.n_queued += 1;
+    }
+
+    #[inline]
+    fn push_front(&mut self, slot: usize, level: usize) {
+        self.bitmap |= 1 << level;
+        self.levels[level].push_front(slot);
+        self.n_queued += 1;
+    }
+
+    #[inline]
+    fn take_from(&mut self, level: usize, front: bool) -> Option<usize> {
+        let slot_opt = if front {
+            self.levels[level].pop_front()
+        } else {
+            self.levels[level].pop_back()
+        };
+
+        if self.levels[level].is_empty() {
+            self.bitmap &= !(1 << level);
+        }
+
+        if slot_opt.is_some() {
+            self.n_queued -= 1;
+        }
+
+        slot_opt
+    }
+
+    /// takes the first thread of the highest non-empty level
+    #[inline]
+    fn pop_highest(&mut self) -> Option<usize> {
+        if self.bitmap == 0 {
+            return None;
+        }
+
+        self.take_from(self.bitmap.trailing_zeros() as usize, true)
+    }
+
+    /// takes the last thread of the highest non-empty level, used by the
+    /// thieves so that the owner keeps the threads that ran recently.
+    #[inline]
+    fn steal(&mut self) -> Option<usize> {
+        if self.bitmap == 0 {
+            return None;
+        }
+
+        self.take_from(self.bitmap.trailing_zeros() as usize, false)
+    }
+
+    /// moves all the threads to the top level
+    fn boost(&mut self, threads: &mut [Option<SchedEntity>]) {
+        for level in 1..MLFQ_LEVELS {
+            while let Some(slot) = self.levels[level].pop_front() {
+                if let Some(entity) = threads[slot].as_mut() {
+                    entity.level = 0;
+                    entity.ticks_used = 0;
+                }
+                self.levels[0].push_back(slot);
+            }
+        }
+
+        if self.n_queued > 0 {
+            self.bitmap = 1;
+        }
+    }
+
+    #[inline]
+    fn load(&self) -> usize {
+        self.n_queued + self.current.is_some() as usize
+    }
+
+    /// grows every level to hold `n_threads`, all of them can end up in one.
+    fn reserve(&mut self, n_threads: usize) {
+        for level in self.levels.iter_mut() {
+            level.reserve(n_threads.saturating_sub(level.len()));
+        }
+    }
+}
+
+#[derive(Debug, Clone)]
+/// Slots of the threads, a thread keeps it's slot till it exits.
+struct ThreadArena {
+    threads: Vec<Option<SchedEntity>>,
+    free_slots: Vec<usize>,
+}
+
+impl ThreadArena {
+    #[inline]
+    fn entity_mut(&mut self, slot: usize) -> &mut SchedEntity {
+        self.threads[slot].as_mut().unwrap()
+    }
+
+    /// places the thread in a free slot of the arena
+    #[inline]
+    fn insert(&mut self, entity: SchedEntity) -> usize {
+        if let Some(slot) = self.free_slots.pop() {
+            self.threads[slot] = Some(entity);
+            return slot;
+        }
+
+        self.threads.push(Some(entity));
+        self.threads.len() - 1
+    }
+
+    #[inline]
+    fn remove(&mut self, slot: usize) -> SchedEntity {
+        let entity = self.threads[slot].take().unwrap();
+        self.free_slots.push(slot);
+        entity
+    }
+
+    /// number of threads the queues must hold, the capacity of the arena so
+    /// that they grow as seldom as it does.
+    #[inline]
+    fn capacity(&self) -> usize {
+        self.threads.capacity()
+    }
+
+    /// leaves room for `n_threads` free slots, the exits push theirs there.
+    fn reserve(&mut self, n_threads: usize) {
+        let free_slots = self.free_slots.len();
+        self.free_slots
+            .reserve(n_threads.saturating_sub(free_slots));
+    }
+}
+
+/// Run queue of a processor behind it's own lock. The counters mirror the
+/// queue, the other processors read them without the lock to pick a target
+/// for new threads or a victim to steal from.
+struct ProcessorQueue {
+    queue: Mutex<RunQueue>,
+    queued: AtomicUsize,
+    load: AtomicUsize,
+}
+
+impl ProcessorQueue {
+    fn empty() -> Self {
+        ProcessorQueue {
+            queue: Mutex::new(RunQueue::empty()),
+            queued: AtomicUsize::new(0),
+            load: AtomicUsize::new(0),
+        }
+    }
+
+    /// updates the counters, called with the queue locked after changing it.
+    #[inline]
+    fn publish(&self, rq: &RunQueue) {
+        self.queued.store(rq.n_queued, Ordering::Relaxed);
+        self.load.store(rq.load(), Ordering::Relaxed);
+    }
+}
+
+#[derive(Debug, Clone)]
+/// Threads that are not runnable, with the buffer the woken slots are
+/// collected in.
+struct Waiters {
+    queue: WaitQueue<usize>,
+    woken: Vec<usize>,
+}
+
+/// Multi level feedback queue scheduler with a run queue per processor.
+/// Threads that use up their slice are moved down to the batch levels,
+/// threads that block or yield early move up. An idle processor steals
+/// work from the most loaded one.
+/// Threads are kept in an arena and only their slots move between the queues,
+/// the scheduling path does not clone threads or allocate.
+/// Each run queue, the waiters and the arena have their own lock, they are
+/// taken in this order. A processor only locks the run queue of another one
+/// to steal from it.
+pub struct MultiLevelFeedbackScheduler {
+    arena: Mutex<ThreadArena>,
+    run_queues: Vec<ProcessorQueue>,
+    /// processors that have called into the scheduler at least once
+    online: AtomicU64,
+    waiters: Mutex<Waiters>,
+    /// earliest tick a waiter wakes up at, `u64::MAX` if there is none. The
+    /// ticks only take the waiters lock once it is due.
+    next_deadline: AtomicU64,
+    /// TSC ticks in 3/4 of the timer period
+    full_slice_ticks: u64,
+    /// number of threads the queues can hold without allocating
+    reserved: AtomicUsize,
+}
+
+impl MultiLevelFeedbackScheduler {
+    #[inline]
+    pub fn n_threads(&self) -> usize {
+        self.run_queues
+            .iter()
+            .map(|queue| queue.load.load(Ordering::Relaxed))
+            .sum()
+    }
+
+    /// threads waiting to run on the current processor.
+    pub fn queued_threads(&self) -> usize {
+        let queue = &self.run_queues[current_cpu()];
+        queue.queued.load(Ordering::Relaxed)
+    }
+
+    /// tick at which the earliest sleeping or timed event thread wakes up
+    #[inline]
+    pub fn next_deadline(&self) -> Option<u64> {
+        let deadline = self.next_deadline.load(Ordering::Relaxed);
+        if deadline == u64::MAX {
+            return None;
+        }
+
+        Some(deadline)
+    }
+
+    /// called with the waiters locked after changing them.
+    #[inline]
+    fn publish_deadline(&self, waiters: &Waiters) {
+        let deadline = waiters.queue.next_deadline().unwrap_or(u64::MAX);
+        self.next_deadline.store(deadline, Ordering::Relaxed);
+    }
+
+    /// online processor with the least runnable threads, new threads go here.
+    #[inline]
+    fn least_loaded_cpu(&self) -> usize {
+        let online = self.online.load(Ordering::Relaxed);
+        let mut target = current_cpu();
+        let mut target_load = self.run_queues[target].load.load(Ordering::Relaxed);
+        for cpu in 0..MAX_PROCESSORS {
+            if online & (1 << cpu) == 0 {
+                continue;
+            }
+
+            let load = self.run_queues[cpu].load.load(Ordering::Relaxed);
+            if load < target_load {
+                target = cpu;
+                target_load = load;
+            }
+        }
+
+        target
+    }
+
+    /// takes a thread from the processor with the most queued threads,
+    /// returns it's slot and the processor it was taken from.
+    fn steal_for(&self, thief: usize) -> Option<(usize, usize)> {
+        let mut victim = None;
+        let mut victim_load = 0;
+        for cpu in 0..MAX_PROCESSORS {
+            let queued = self.run_queues[cpu].queued.load(Ordering::Relaxed);
+            if cpu != thief && queued > victim_load {
+                victim = Some(cpu);
+                victim_load = queued;
+            }
+        }
+
+        if victim.is_none() {
+            return None;
+        }
+
+        let victim_queue = &self.run_queues[victim.unwrap()];
+        let mut rq = victim_queue.queue.lock();
+        let slot_opt = rq.steal();
+        victim_queue.publish(&rq);
+
+        slot_opt.map(|slot| (slot, victim.unwrap()))
+    }
+
+    /// moves the woken up threads to the run queue of the current processor,
+    /// called with all three locks held.
+    fn wake_locked(
+        &self,
+        rq: &mut RunQueue,
+        waiters: &mut Waiters,
+        arena: &mut ThreadArena,
+        wakeup_mode: ThreadWakeupType,
+    ) {
+        waiters
+            .queue
+            .dispatch_wakeup(wakeup_mode, &mut waiters.woken);
+        self.publish_deadline(waiters);
+
+        // threads that blocked are interactive, they start at the top level.
+        for index in 0..waiters.woken.len() {
+            let slot = waiters.woken[index];
+            let entity = arena.entity_mut(slot);
+            entity.level = 0;
+            entity.ticks_used = 0;
+            rq.push_back(slot, 0);
+        }
+
+        waiters.woken.clear();
+    }
+
+    /// grows the run queues and the waiters to hold `n_threads`, so that the
+    /// ticks only move slots between them and never allocate. Called with
+    /// interrupts off and no scheduler lock held.
+    fn reserve_queues(&self, n_threads: usize) {
+        if n_threads <= self.reserved.load(Ordering::Relaxed) {
+            return;
+        }
+
+        for queue in self.run_queues.iter() {
+            queue.queue.lock().reserve(n_threads);
+        }
+
+        {
+            let mut waiters = self.waiters.lock();
+            waiters.queue.reserve(n_threads);
+            let woken = waiters.woken.len();
+            waiters.woken.reserve(n_threads.saturating_sub(woken));
+        }
+
+        self.arena.lock().reserve(n_threads);
+        self.reserved.fetch_max(n_threads, Ordering::Relaxed);
+    }
+}
+
+impl Sched for MultiLevelFeedbackScheduler {
+    fn empty() -> Self {
+        let mut run_queues = Vec::with_capacity(MAX_PROCESSORS);
+        for _ in 0..MAX_PROCESSORS {
+            run_queues.push(ProcessorQueue::empty());
+        }
+
+        MultiLevelFeedbackScheduler {
+            arena: Mutex::new(ThreadArena {
+                threads: Vec::new(),
+                free_slots: Vec::new(),
+            }),
+            run_queues,
+            online: AtomicU64::new(0),
+            waiters: Mutex::new(Waiters {
+                queue: WaitQueue::empty(),
+                woken: Vec::new(),
+            }),
+            next_deadline: AtomicU64::new(u64::MAX),
+            full_slice_ticks: (safe_ticks_from_ns(MLFQ_TICK_NS).u64() / 4) * 3,
+            reserved: AtomicUsize::new(0),
+        }
+    }
+
+    fn add_new_thread(&self, thread: Thread) {
+        // the timer takes the run queue locks too.
+        let interrupts_enabled = cpu::are_enabled();
+        cpu::disable_interrupts();
+
+        let target = self.least_loaded_cpu();
+        let (slot, capacity) = {
+            let mut arena = self.arena.lock();
+            let slot = arena.insert(SchedEntity::new(thread));
+            (slot, arena.capacity())
+        };
+
+        // the queues grow here, with the arena, and not in the ticks.
+        self.reserve_queues(capacity);
+
+        {
+            let queue = &self.run_queues[target];
+            let mut rq = queue.queue.lock();
+            rq.push_back(slot, 0);
+            queue.publish(&rq);
+        }
+
+        if interrupts_enabled {
+            cpu::enable_interrupts();
+        }
+    }
+
+    fn save_current_ctx(&self, state: CPURegistersState) {
+        let now = TSC::read_tsc().u64();
+        let queue = &self.run_queues[current_cpu()];
+        let mut rq = queue.queue.lock();
+
+        let current_opt = rq.current.take();
+        if current_opt.is_none() {
+            return;
+        }
+
+        let slot = current_opt.unwrap();
+        PerCPU::clear_current_thread();
+
+        if rq.suspend_next {
+            rq.suspend_next = false;
+            let suspend_type = mem::replace(&mut rq.suspend_type, ThreadSuspendType::Nothing);
+
+            let mut waiters = self.waiters.lock();
+            let level = {
+                // the registers are written over the previous context.
+                let mut arena = self.arena.lock();
+                let entity = arena.entity_mut(slot);
+                entity.thread.save_context(state);
+                entity.level
+            };
+
+            if let Some(slot) = waiters.queue.dispatch_suspend(slot, suspend_type) {
+                // the event it waited for already happened.
+                rq.push_front(slot, level);
+            }
+            self.publish_deadline(&waiters);
+            queue.publish(&rq);
+            return;
+        }
+
+        let mut arena = self.arena.lock();
+        let entity = arena.entity_mut(slot);
+        entity.thread.save_context(state);
+
+        if now - entity.leased_at < self.full_slice_ticks {
+            // gave up the cpu before the tick, treat it as interactive.
+            entity.level = entity.level.saturating_sub(1);
+            entity.ticks_used = 0;
+            rq.push_back(slot, entity.level);
+        } else {
+            entity.ticks_used += 1;
+            if entity.ticks_used >= level_quantum(entity.level) {
+                // used up the slice, treat it as batch.
+                if entity.level + 1 < MLFQ_LEVELS {
+                    entity.level += 1;
+                }
+                entity.ticks_used = 0;
+                rq.push_back(slot, entity.level);
+            } else {
+                // continues unless something of higher priority is waiting.
+                rq.push_front(slot, entity.level);
+            }
+        }
+
+        queue.publish(&rq);
+    }
+
+    fn exit(&self, _code: i64) {
+        let queue = &self.run_queues[current_cpu()];
+        let slot = {
+            let mut rq = queue.queue.lock();
+            let current_opt = rq.current.take();
+            if current_opt.is_none() {
+                return;
+            }
+
+            queue.publish(&rq);
+            current_opt.unwrap()
+        };
+
+        PerCPU::clear_current_thread();
+
+        let mut entity = self.arena.lock().remove(slot);
+        entity.thread.exit();
+    }
+
+    fn lease_next_thread(&self) -> Option<LeasedThread> {
+        let cpu = current_cpu();
+        self.online.fetch_or(1 << cpu, Ordering::Relaxed);
+
+        let queue = &self.run_queues[cpu];
+        let mut slot_opt = {
+            let mut rq = queue.queue.lock();
+            rq.rounds += 1;
+            if rq.rounds % MLFQ_BOOST_ROUNDS == 0 {
+                rq.boost(&mut self.arena.lock().threads);
+            }
+
+            let slot_opt = rq.pop_highest();
+            queue.publish(&rq);
+            slot_opt
+        };
+
+        // the own queue is not held while stealing.
+        let mut victim = None;
+        if slot_opt.is_none() {
+            if let Some((slot, from)) = self.steal_for(cpu) {
+                slot_opt = Some(slot);
+                victim = Some(from);
+            }
+        }
+
+        if slot_opt.is_none() {
+            return None;
+        }
+
+        let slot = slot_opt.unwrap();
+        let mut rq = queue.queue.lock();
+        let leased = {
+            let mut arena = self.arena.lock();
+            let entity = arena.entity_mut(slot);
+            if let Some(from) = victim {
+                trace::record(
+                    TraceEvent::ThreadSteal,
+                    entity.thread.thread_id.as_u64(),
+                    from as u32,
+                );
+            }
+
+            entity.thread.sched_count += 1;
+            entity.leased_at = TSC::read_tsc().u64();
+            PerCPU::set_current_thread(
+                entity.thread.thread_id.as_u64(),
+                entity.thread.parent_pid.as_u64(),
+            );
+            entity.thread.leased()
+        };
+
+        rq.current = Some(slot);
+        queue.publish(&rq);
+        Some(leased)
+    }
+
+    fn current_tid(&self) -> Option<ThreadID> {
+        PerCPU::current_tid().map(|tid| ThreadID::new(tid))
+    }
+
+    fn current_pid(&self) -> Option<PID> {
+        PerCPU::current_pid().map(|pid| PID::new(pid))
+    }
+
+    fn check_wakeup(&self, wakeup_mode: ThreadWakeupType) {
+        // nobody is due yet, the waiters are not locked on every tick.
+        if let ThreadWakeupType::FromSleep(now) = wakeup_mode {
+            if (now as u64) < self.next_deadline.load(Ordering::Relaxed) {
+                return;
+            }
+        }
+
+        let queue = &self.run_queues[current_cpu()];
+        let mut rq = queue.queue.lock();
+        let mut waiters = self.waiters.lock();
+        let mut arena = self.arena.lock();
+
+        self.wake_locked(&mut rq, &mut waiters, &mut arena, wakeup_mode);
+        queue.publish(&rq);
+    }
+
+    fn try_check_wakeup(&self, wakeup_mode: ThreadWakeupType) -> bool {
+        let queue = &self.run_queues[current_cpu()];
+        let rq_opt = queue.queue.try_lock();
+        if rq_opt.is_none() {
+            return false;
+        }
+
+        let waiters_opt = self.waiters.try_lock();
+        if waiters_opt.is_none() {
+            return false;
+        }
+
+        let arena_opt = self.arena.try_lock();
+        if arena_opt.is_none() {
+            return false;
+        }
+
+        let mut rq = rq_opt.unwrap();
+        self.wake_locked(
+            &mut rq,
+            &mut waiters_opt.unwrap(),
+            &mut arena_opt.unwrap(),
+            wakeup_mode,
+        );
+        queue.publish(&rq);
+        true
+    }
+
+    fn suspend_thread(&self, suspend_type: ThreadSuspendType) {
+        let mut rq = self.run_queues[current_cpu()].queue.lock();
+        if rq.current.is_none() {
+            // no threads running currently
+            return;
+        }
+
+        rq.suspend_next = true;
+        rq.suspend_type = suspend_type;
+    }
+
+    fn reset_current_thread_stack(&self) -> VirtualAddress {
+        let rq = self.run_queues[current_cpu()].queue.lock();
+        if let Some(slot) = rq.current {
+            return self.arena.lock().entity_mut(slot).thread.reset_stack();
+        }
+
+        VirtualAddress::from_u64(0)
+    }
+}
@@ -1,20 +1,26 @@
+pub mod mlfq;
 pub mod srbs;
 pub mod wait_queue;
 
 extern crate alloc;
 extern crate log;
-extern crate spin;
 
 use crate::acpi::lapic::LAPICUtils;
+use crate::cpu;
+use crate::cpu::percpu::PerCPU;
 use crate::cpu::state::CPURegistersState;
+use crate::cpu::tsc::TSC;
 use crate::mm::VirtualAddress;
 use crate::system::process::PID;
-use crate::system::tasking::srbs::SimpleRoundRobinSchduler;
-use crate::system::thread::{Thread, ThreadID};
+use crate::system::profiler;
+use crate::system::tasking::mlfq::MultiLevelFeedbackScheduler;
+use crate::system::tasking::wait_queue::WaitEvent;
+use crate::system::thread::{LeasedThread, Thread, ThreadID};
 use crate::system::timer::SystemTimer;
+use crate::system::trace::{self, TraceEvent};
 
+use core::sync::atomic::{AtomicU64, Ordering};
 use lazy_static::lazy_static;
-use spin::Mutex;
 
 #[derive(Debug, Clone)]
 pub enum SchedAction {
@@ -27,16 +33,22 @@ pub enum ThreadSuspendType {
     Nothing,
     SuspendSleep(usize),
     SuspendWait(PID),
+    /// blocks on the event, the generation is the one seen before blocking.
+    /// The thread also wakes up at the tick given, if any.
+    SuspendEvent(WaitEvent, u64, Option<u64>),
 }
 
 #[derive(Debug, Clone)]
 pub enum ThreadWakeupType {
     Nothing,
+    /// wakes the threads sleeping till the given system tick
     FromSleep(usize),
     FromWait(PID),
+    FromEvent(WaitEvent),
 }
 
-/// The trait can be implemented by any schedulable entity.
+/// The trait can be implemented by any schedulable entity. The scheduler is
+/// shared by all the processors, so it does it's own locking.
 pub trait Sched {
     /// Should return an empty instance of scheduler.
     /// Use this to initialize the scheduler.
@@ -44,22 +56,22 @@ pub trait Sched {
 
     /// Adds a new thread to internal scheduler's structure.
     /// This can be any structure.
-    fn add_new_thread(&mut self, thread: Thread);
+    fn add_new_thread(&self, thread: Thread);
 
     /// Provides a next thread that is runnable on the given core.
     /// which called this function. Note: This function does not actually
-    /// run the thread. Instead it just returns a copy of the instance of
-    /// that thread.
-    fn lease_next_thread(&mut self) -> Option<Thread>;
+    /// run the thread. Instead it just returns a copy of the state needed
+    /// to switch to that thread.
+    fn lease_next_thread(&self) -> Option<LeasedThread>;
 
     /// saves the current context of the thread. Requires the complete
     /// CPU state.
-    fn save_current_ctx(&mut self, state: CPURegistersState);
+    fn save_current_ctx(&self, state: CPURegistersState);
 
     /// This function is called by the currently running this, calling
     /// this function will automatically make the thread non-schedulable
     /// and it's entry will be removed from everywhere. Including the process
-    fn exit(&mut self, code: i64);
+    fn exit(&self, code: i64);
 
     /// this function should return the current thread ID
     /// that called this function, or that was scheduled.
@@ -68,24 +80,72 @@ pub trait Sched {
     fn current_pid(&self) -> Option<PID>;
 
     /// check how many threads can be woken up from wait queue.
-    fn check_wakeup(&mut self, wakeup_mode: ThreadWakeupType);
+    fn check_wakeup(&self, wakeup_mode: ThreadWakeupType);
+
+    /// like `check_wakeup`, but returns false without waking anything if
+    /// the scheduler is busy. Used from interrupt handlers.
+    fn try_check_wakeup(&self, wakeup_mode: ThreadWakeupType) -> bool;
 
     /// suspend current thread to sleep for x ticks
-    fn suspend_thread(&mut self, suspend_type: ThreadSuspendType);
+    fn suspend_thread(&self, suspend_type: ThreadSuspendType);
 
     /// reset current thread
-    fn reset_current_thread_stack(&mut self) -> VirtualAddress;
+    fn reset_current_thread_stack(&self) -> VirtualAddress;
 }
 
 lazy_static! {
-    pub static ref SCHEDULER: Mutex<SimpleRoundRobinSchduler> =
-        Mutex::new(SimpleRoundRobinSchduler::empty());
+    pub static ref SCHEDULER: MultiLevelFeedbackScheduler = MultiLevelFeedbackScheduler::empty();
+}
+
+/// context switches made by the timer handler and the TSC cycles spent in
+/// them, from entering the handler to loading the next thread.
+static SWITCH_COUNT: AtomicU64 = AtomicU64::new(0);
+static SWITCH_TOTAL_CYCLES: AtomicU64 = AtomicU64::new(0);
+static SWITCH_MAX_CYCLES: AtomicU64 = AtomicU64::new(0);
+
+#[derive(Debug, Clone, Copy)]
+pub struct SwitchLatency {
+    pub switches: u64,
+    pub total_cycles: u64,
+    pub max_cycles: u64,
+}
+
+impl SwitchLatency {
+    #[inline]
+    pub fn avg_cycles(&self) -> u64 {
+        if self.switches == 0 {
+            return 0;
+        }
+
+        self.total_cycles / self.switches
+    }
+}
+
+#[inline]
+fn record_switch(entered_at: u64) {
+    let cycles = TSC::read_tsc().u64().saturating_sub(entered_at);
+    SWITCH_COUNT.fetch_add(1, Ordering::Relaxed);
+    SWITCH_TOTAL_CYCLES.fetch_add(cycles, Ordering::Relaxed);
+    SWITCH_MAX_CYCLES.fetch_max(cycles, Ordering::Relaxed);
+    trace::record(
+        TraceEvent::ContextSwitch,
+        PerCPU::current_tid().unwrap_or(0),
+        0,
+    );
+}
+
+pub fn switch_latency() -> SwitchLatency {
+    SwitchLatency {
+        switches: SWITCH_COUNT.load(Ordering::Relaxed),
+        total_cycles: SWITCH_TOTAL_CYCLES.load(Ordering::Relaxed),
+        max_cycles: SWITCH_MAX_CYCLES.load(Ordering::Relaxed),
+    }
 }
 
 pub fn setup_scheduler() {
     log::info!(
-        "Setup scheduler successful, initial thread={:?}",
-        SCHEDULER.lock().thread_index
+        "Setup scheduler successful, initial threads={}",
+        SCHEDULER.n_threads()
     );
 }
 
@@ -94,24 +154,54 @@ pub fn setup_scheduler() {
 /// the function will acknowledge the interrupt, selects a thread
 /// and initiates it's state.
 pub extern "sysv64" fn schedule_handle(state_repr: CPURegistersState) {
-
+    let entered_at = TSC::read_tsc().u64();
     LAPICUtils::eoi();
 
-    SCHEDULER.lock().save_current_ctx(state_repr);
+    profiler::sample_if_due(&state_repr);
+    if !SystemTimer::shot_due() {
+        // the shot only came for a sample, the interrupted code goes on.
+        SystemTimer::rearm_shot();
+        CPURegistersState::load_state(&state_repr);
+    }
+
+    // the scheduler locks are all released before switching.
+    SCHEDULER.save_current_ctx(state_repr);
+
+    // if any thread needs to wake up, wake them up. System ticks are
+    // derived from the TSC, so any processor can do this.
+    let now = SystemTimer::sync_ticks();
+    SCHEDULER.check_wakeup(ThreadWakeupType::FromSleep(now as usize));
+
+    // events that were notified while the scheduler was busy
+    let pending = WaitEvent::take_pending();
+    for index in 0..64 {
+        if pending & (1 << index) == 0 {
+            continue;
+        }
 
-    // if any thread needs to wake up, wake them up.
-    SCHEDULER
-        .lock()
-        .check_wakeup(ThreadWakeupType::FromSleep(1));
+        if let Some(event) = WaitEvent::from_index(index) {
+            SCHEDULER.check_wakeup(ThreadWakeupType::FromEvent(event));
+        }
+    }
+
+    let thread_opt = SCHEDULER.lease_next_thread();
+    trace::sample_run_queue(SCHEDULER.queued_threads());
+    let next_wakeup = SCHEDULER.next_deadline();
 
-    let thread_opt = SCHEDULER.lock().lease_next_thread();
     if thread_opt.is_some() {
         let thread = thread_opt.unwrap();
-        SystemTimer::next_shot();
+        SystemTimer::next_shot_before(next_wakeup);
+        record_switch(entered_at);
         thread.load_state();
-    } else {
+    } else if PerCPU::is_idle() {
         // no threads were returned. Load and continue normally.
-        SystemTimer::next_shot();
+        SystemTimer::next_shot_before(next_wakeup);
+        CPURegistersState::load_state(&state_repr);
+    } else {
+        // the interrupted thread was suspended or exited, it's context can
+        // be picked up by another processor, so it must not be resumed here.
+        SystemTimer::next_shot_before(next_wakeup);
+        PerCPU::enter_idle();
         CPURegistersState::load_state(&state_repr);
     }
 }
@@ -122,16 +212,60 @@ pub fn schedule_yield() {
     SystemTimer::manual_shot();
 }
 
+/// puts the calling thread to sleep for `ticks` system ticks.
+pub fn sleep_ticks(ticks: usize) {
+    // the timer takes the run queue lock too.
+    let interrupts_enabled = cpu::are_enabled();
+    cpu::disable_interrupts();
+    SCHEDULER.suspend_thread(ThreadSuspendType::SuspendSleep(ticks));
+    if interrupts_enabled {
+        cpu::enable_interrupts();
+    }
+
+    schedule_yield();
+}
+
 pub fn handle_exit(thread: &mut Thread) {
     thread.free_stack();
 }
 
+/// wakes up the threads blocked on `event`, called by the producer of the
+/// event. This is safe to call from interrupt handlers.
+pub fn notify_event(event: WaitEvent) {
+    event.signal();
+
+    // the interrupted code may hold the scheduler, leave it to the next tick.
+    if !SCHEDULER.try_check_wakeup(ThreadWakeupType::FromEvent(event)) {
+        event.set_pending();
+    }
+}
+
 // design inspired from: https://github.com/nuta/kerla/blob/main/kernel/process/wait_queue.rs
-pub fn wait_until_return<W, R, E>(mut wait_func: W) -> Result<R, E>
+/// calls `wait_func` until it returns a value or an error, the thread is
+/// blocked on `event` in between and does not run until it is notified.
+pub fn wait_for_event<W, R, E>(event: WaitEvent, wait_func: W) -> Result<R, E>
+where
+    W: FnMut() -> Result<Option<R>, E>,
+{
+    // without a deadline, it returns only with a value or an error.
+    wait_for_event_until(event, None, wait_func).map(|value| value.unwrap())
+}
+
+/// like `wait_for_event`, but gives up at the system tick `till_ticks` and
+/// returns `None` then.
+pub fn wait_for_event_until<W, R, E>(
+    event: WaitEvent,
+    till_ticks: Option<u64>,
+    mut wait_func: W,
+) -> Result<Option<R>, E>
 where
     W: FnMut() -> Result<Option<R>, E>,
 {
     loop {
+        // an event that occurs after this point and before the thread is
+        // queued changes the generation, so the thread is not put to sleep.
+        let generation = event.generation();
+
         // check the return value:
         let func_ret_value = wait_func();
         let wait_ret_value: Option<Result<R, E>> = match func_ret_value {
@@ -139,12 +273,27 @@ where
             Err(err) => Some(Err(err)),
         };
 
-        if wait_ret_value.is_none() {
-            // continue to wait if the task has not returned.
-            schedule_yield();
-        } else {
+        if wait_ret_value.is_some() {
             // return the value back to the caller
-            return wait_ret_value.unwrap();
+            return wait_ret_value.unwrap().map(|value| Some(value));
         }
+
+        if let Some(till) = till_ticks {
+            if SystemTimer::current_ticks() >= till {
+                return Ok(None);
+            }
+        }
+
+        // the timer takes the run queue lock too.
+        let interrupts_enabled = cpu::are_enabled();
+        cpu::disable_interrupts();
+        SCHEDULER.suspend_thread(ThreadSuspendType::SuspendEvent(
+            event, generation, till_ticks,
+        ));
+        if interrupts_enabled {
+            cpu::enable_interrupts();
+        }
+
+        schedule_yield();
     }
 }
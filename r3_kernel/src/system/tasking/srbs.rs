@@ -1,72 +1,88 @@
 extern crate alloc;
+extern crate spin;
 
-use crate::alloc::boxed::Box;
 use crate::cpu::state::CPURegistersState;
 use crate::mm::VirtualAddress;
 use crate::system::process::PID;
 use crate::system::tasking::wait_queue::WaitQueue;
 use crate::system::tasking::{Sched, ThreadSuspendType, ThreadWakeupType};
-use crate::system::thread::{ContextType, Thread, ThreadID};
+use crate::system::thread::{LeasedThread, Thread, ThreadID};
 
 use alloc::vec::Vec;
+use spin::Mutex;
 
 #[derive(Debug, Clone)]
+/// threads of the round robin scheduler.
+pub struct RoundRobinQueue {
+    pub thread_list: Vec<Thread>,
+    pub thread_index: Option<usize>,
+    pub wait_queue: WaitQueue<Thread>,
+    pub suspend_next: bool,
+    pub suspend_type: ThreadSuspendType,
+}
+
 /// A scheduler that schedules tasks from
 /// thread queue. As of now, this scheduler is not
 /// actually multiprocessor, and it schedules only for BSP.
 /// the name is in par with future ideas. This is based on a simple round
-/// robin approach, with simple semantics.
+/// robin approach, with simple semantics. The queue is behind a single lock.
 pub struct SimpleRoundRobinSchduler {
-    pub thread_list: Vec<Thread>,
-    pub thread_index: Option<usize>,
-    pub wait_queue: WaitQueue,
-    pub suspend_next: bool,
-    pub suspend_type: ThreadSuspendType,
+    pub queue: Mutex<RoundRobinQueue>,
 }
 
 impl Sched for SimpleRoundRobinSchduler {
     fn empty() -> Self {
         SimpleRoundRobinSchduler {
-            thread_list: Vec::new(),
-            thread_index: None,
-            wait_queue: WaitQueue::empty(),
-            suspend_next: false,
-            suspend_type: ThreadSuspendType::Nothing,
+            queue: Mutex::new(RoundRobinQueue {
+                thread_list: Vec::new(),
+                thread_index: None,
+                wait_queue: WaitQueue::empty(),
+                suspend_next: false,
+                suspend_type: ThreadSuspendType::Nothing,
+            }),
         }
     }
 
     /// Adds a new function to the list
-    fn add_new_thread(&mut self, thread: Thread) {
+    fn add_new_thread(&self, thread: Thread) {
+        let mut queue = self.queue.lock();
         log::debug!("Adding thread {:?} to the thread queue.", thread.thread_id);
-        self.thread_list.push(thread);
+        queue.thread_list.push(thread);
     }
 
-    fn save_current_ctx(&mut self, state: CPURegistersState) {
-        if let Some(thread_id) = self.thread_index {
-            if let Some(thread_ref) = self.thread_list.get_mut(thread_id) {
-                thread_ref.context = Box::new(ContextType::SavedContext(state));
+    fn save_current_ctx(&self, state: CPURegistersState) {
+        let mut queue_guard = self.queue.lock();
+        let queue = &mut *queue_guard;
+        if let Some(thread_id) = queue.thread_index {
+            if let Some(thread_ref) = queue.thread_list.get_mut(thread_id) {
+                thread_ref.save_context(state);
             }
         }
 
-        if self.suspend_next {
+        if queue.suspend_next {
             // suspend this thread
-            let thread_idx = self.thread_index.unwrap();
-            let thread = self.thread_list.remove(thread_idx);
-            self.wait_queue
-                .dispatch_suspend(thread, self.suspend_type.clone());
-            self.thread_index = None;
-            self.suspend_next = false;
-            self.suspend_type = ThreadSuspendType::Nothing;
+            let thread_idx = queue.thread_index.unwrap();
+            let thread = queue.thread_list.remove(thread_idx);
+            let thread_opt = queue
+                .wait_queue
+                .dispatch_suspend(thread, queue.suspend_type.clone());
+            if let Some(thread) = thread_opt {
+                queue.thread_list.push(thread);
+            }
+            queue.thread_index = None;
+            queue.suspend_next = false;
+            queue.suspend_type = ThreadSuspendType::Nothing;
         }
     }
 
-    fn exit(&mut self, code: i64) {
+    fn exit(&self, code: i64) {
+        let mut queue = self.queue.lock();
         // initiate exit operation:
         // 1. get the thread index
-        if let Some(thread_index) = self.thread_index {
+        if let Some(thread_index) = queue.thread_index {
             // remove the thread from the queue
             // get the thread ID
-            let thread_ref = self.thread_list.get_mut(thread_index).unwrap();
+            let thread_ref = queue.thread_list.get_mut(thread_index).unwrap();
             thread_ref.exit();
             log::debug!(
                 "Thread {} exited with code={}",
@@ -74,72 +90,94 @@ impl Sched for SimpleRoundRobinSchduler {
                 code
             );
             // remove the thread
-            self.thread_list.remove(thread_index);
-            self.thread_index = None;
+            queue.thread_list.remove(thread_index);
+            queue.thread_index = None;
         }
     }
 
-    fn lease_next_thread(&mut self) -> Option<Thread> {
+    fn lease_next_thread(&self) -> Option<LeasedThread> {
+        let mut queue = self.queue.lock();
         // got a schedule request
-        if self.thread_list.is_empty() {
+        if queue.thread_list.is_empty() {
             return None;
         }
 
         // we have a thread
         let thread_ref_opt = {
-            let n_threads = self.thread_list.len();
-            let thread_idx_ref = self.thread_index.get_or_insert(0);
+            let n_threads = queue.thread_list.len();
+            let thread_idx_ref = queue.thread_index.get_or_insert(0);
             // round robin
             let next_thread_idx = (*thread_idx_ref + 1) % n_threads;
             *thread_idx_ref = next_thread_idx;
 
-            self.thread_list.get_mut(next_thread_idx)
+            queue.thread_list.get_mut(next_thread_idx)
         };
 
         if let Some(thread_ref) = thread_ref_opt {
             thread_ref.sched_count += 1;
-            return Some(thread_ref.clone());
+            return Some(thread_ref.leased());
         };
 
         None
     }
 
     fn current_tid(&self) -> Option<ThreadID> {
-        if self.thread_index.is_none() {
+        let queue = self.queue.lock();
+        if queue.thread_index.is_none() {
             return None;
         }
 
-        let thread = self.thread_list.get(self.thread_index.unwrap());
+        let thread = queue.thread_list.get(queue.thread_index.unwrap());
         Some(thread.as_ref().unwrap().thread_id)
     }
 
     fn current_pid(&self) -> Option<PID> {
-        if self.thread_index.is_none() {
+        let queue = self.queue.lock();
+        if queue.thread_index.is_none() {
             return None;
         }
 
-        let thread = self.thread_list.get(self.thread_index.unwrap());
+        let thread = queue.thread_list.get(queue.thread_index.unwrap());
         Some(thread.as_ref().unwrap().parent_pid.clone())
     }
 
-    fn check_wakeup(&mut self, wakeup_mode: ThreadWakeupType) {
-        self.wait_queue
-            .dispatch_wakeup(wakeup_mode, &mut self.thread_list);
+    fn check_wakeup(&self, wakeup_mode: ThreadWakeupType) {
+        let mut queue_guard = self.queue.lock();
+        let queue = &mut *queue_guard;
+        queue
+            .wait_queue
+            .dispatch_wakeup(wakeup_mode, &mut queue.thread_list);
+    }
+
+    fn try_check_wakeup(&self, wakeup_mode: ThreadWakeupType) -> bool {
+        let queue_opt = self.queue.try_lock();
+        if queue_opt.is_none() {
+            return false;
+        }
+
+        let mut queue_guard = queue_opt.unwrap();
+        let queue = &mut *queue_guard;
+        queue
+            .wait_queue
+            .dispatch_wakeup(wakeup_mode, &mut queue.thread_list);
+        true
     }
 
-    fn suspend_thread(&mut self, suspend_type: ThreadSuspendType) {
-        if self.thread_index.is_none() {
+    fn suspend_thread(&self, suspend_type: ThreadSuspendType) {
+        let mut queue = self.queue.lock();
+        if queue.thread_index.is_none() {
             // no threads running currently
             return;
         }
 
-        self.suspend_next = true;
-        self.suspend_type = suspend_type;
+        queue.suspend_next = true;
+        queue.suspend_type = suspend_type;
     }
 
-    fn reset_current_thread_stack(&mut self) -> VirtualAddress {
-        if let Some(thread_idx) = self.thread_index {
-            let thread_ref: &mut Thread = self.thread_list.get_mut(thread_idx).unwrap();
+    fn reset_current_thread_stack(&self) -> VirtualAddress {
+        let mut queue = self.queue.lock();
+        if let Some(thread_idx) = queue.thread_index {
+            let thread_ref: &mut Thread = queue.thread_list.get_mut(thread_idx).unwrap();
             return thread_ref.reset_stack();
         }
 
@@ -2,53 +2,244 @@ extern crate alloc;
 
 use crate::system::process::PID;
 use crate::system::tasking::{ThreadSuspendType, ThreadWakeupType};
-use crate::system::thread::Thread;
+use crate::system::timer::SystemTimer;
 
+use alloc::collections::BinaryHeap;
 use alloc::vec::Vec;
+use core::cmp::Ordering;
+use core::sync::atomic::{self, AtomicU64};
 
+/// Sources of events that threads can block on, the producer of the event
+/// wakes up the threads when it occurs.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
+pub enum WaitEvent {
+    KeyboardInput = 0,
+    NetworkReceive = 1,
+    DiskCompletion = 2,
+    /// some pollable source may have become readable or writable.
+    Readiness = 3,
+    /// the network device interrupted, the network worker has frames to take.
+    NetworkWork = 4,
+    /// the ATA DMA channel was released by the thread that held it.
+    DiskChannel0 = 5,
+    DiskChannel1 = 6,
+    /// a kernel log ring is half full, the log drainer has lines to take.
+    KmsgBacklog = 7,
+}
+
+const N_WAIT_EVENTS: usize = 8;
+
+/// incremented every time the event occurs, a thread that saw an older value
+/// before deciding to block is not put to sleep.
+static EVENT_GENERATIONS: [AtomicU64; N_WAIT_EVENTS] = [
+    AtomicU64::new(0),
+    AtomicU64::new(0),
+    AtomicU64::new(0),
+    AtomicU64::new(0),
+    AtomicU64::new(0),
+    AtomicU64::new(0),
+    AtomicU64::new(0),
+    AtomicU64::new(0),
+];
+
+/// events that could not wake up their threads immediately, handled
+/// on the next scheduler tick.
+static PENDING_EVENTS: AtomicU64 = AtomicU64::new(0);
+
+impl WaitEvent {
+    #[inline]
+    pub fn from_index(index: usize) -> Option<Self> {
+        match index {
+            0 => Some(WaitEvent::KeyboardInput),
+            1 => Some(WaitEvent::NetworkReceive),
+            2 => Some(WaitEvent::DiskCompletion),
+            3 => Some(WaitEvent::Readiness),
+            4 => Some(WaitEvent::NetworkWork),
+            5 => Some(WaitEvent::DiskChannel0),
+            6 => Some(WaitEvent::DiskChannel1),
+            7 => Some(WaitEvent::KmsgBacklog),
+            _ => None,
+        }
+    }
+
+    #[inline]
+    pub fn generation(&self) -> u64 {
+        EVENT_GENERATIONS[*self as usize].load(atomic::Ordering::SeqCst)
+    }
+
+    #[inline]
+    pub fn signal(&self) {
+        EVENT_GENERATIONS[*self as usize].fetch_add(1, atomic::Ordering::SeqCst);
+    }
+
+    #[inline]
+    pub fn set_pending(&self) {
+        PENDING_EVENTS.fetch_or(1 << (*self as usize), atomic::Ordering::SeqCst);
+    }
+
+    /// returns the bitmap of pending events and clears it
+    #[inline]
+    pub fn take_pending() -> u64 {
+        PENDING_EVENTS.swap(0, atomic::Ordering::SeqCst)
+    }
+}
+
+#[derive(Debug, Clone)]
+pub struct SleepingThread<T> {
+    /// absolute system tick at which the thread wakes up
+    pub till_ticks: u64,
+    /// insertion order, threads with the same deadline wake up in FIFO order
+    pub seq: u64,
+    pub thread: T,
+}
+
+// ordered by deadline, reversed so that the max-heap keeps the earliest on top.
+impl<T> Ord for SleepingThread<T> {
+    fn cmp(&self, other: &Self) -> Ordering {
+        (other.till_ticks, other.seq).cmp(&(self.till_ticks, self.seq))
+    }
+}
+
+impl<T> PartialOrd for SleepingThread<T> {
+    fn partial_cmp(&self, other: &Self) -> Option<Ordering> {
+        Some(self.cmp(other))
+    }
+}
+
+impl<T> PartialEq for SleepingThread<T> {
+    fn eq(&self, other: &Self) -> bool {
+        self.till_ticks == other.till_ticks && self.seq == other.seq
+    }
+}
+
+impl<T> Eq for SleepingThread<T> {}
+
+/// a thread blocked on an event, it is also woken up at `till_ticks` if the
+/// event does not occur by then.
 #[derive(Debug, Clone)]
-pub struct SleepingThread {
-    pub till_ticks: usize,
-    pub thread: Thread,
+pub struct EventWaiter<T> {
+    pub till_ticks: Option<u64>,
+    pub thread: T,
 }
 
 #[derive(Debug, Clone)]
-pub struct WaitingThread {
+pub struct WaitingThread<T> {
     pub pid: PID,
-    pub thread: Thread,
+    pub thread: T,
 }
 
 #[derive(Debug, Clone)]
-pub struct WaitQueue {
-    /// contains a list of threads that are waiting
-    pub sleep_threads: Vec<SleepingThread>,
-    pub waiting_threads: Vec<WaitingThread>,
+/// Threads that are not runnable, `T` is whatever the scheduler uses to refer
+/// to a thread. Threads are moved in and out, never copied, and the queues
+/// keep their capacity so that moving threads does not allocate once warm.
+pub struct WaitQueue<T> {
+    /// sleeping threads, min-heap on the wake up tick
+    pub sleep_threads: BinaryHeap<SleepingThread<T>>,
+    pub waiting_threads: Vec<WaitingThread<T>>,
+    /// threads blocked on each event, in the order they blocked
+    pub event_threads: Vec<Vec<EventWaiter<T>>>,
+    /// number of event waiters with a deadline, the ticks only look for
+    /// expired waiters when there are some.
+    timed_event_waiters: usize,
+    sleep_seq: u64,
 }
 
-impl WaitQueue {
+impl<T> WaitQueue<T> {
     #[inline]
     pub fn empty() -> Self {
+        let mut event_threads = Vec::with_capacity(N_WAIT_EVENTS);
+        for _ in 0..N_WAIT_EVENTS {
+            event_threads.push(Vec::new());
+        }
+
         WaitQueue {
-            sleep_threads: Vec::new(),
+            sleep_threads: BinaryHeap::new(),
             waiting_threads: Vec::new(),
+            event_threads,
+            timed_event_waiters: 0,
+            sleep_seq: 0,
         }
     }
 
+    /// grows every queue to hold `n_threads`, so that moving that many threads
+    /// in and out of them does not allocate.
+    pub fn reserve(&mut self, n_threads: usize) {
+        let sleeping = self.sleep_threads.len();
+        self.sleep_threads
+            .reserve(n_threads.saturating_sub(sleeping));
+        let waiting = self.waiting_threads.len();
+        self.waiting_threads
+            .reserve(n_threads.saturating_sub(waiting));
+        for waiters in self.event_threads.iter_mut() {
+            waiters.reserve(n_threads.saturating_sub(waiters.len()));
+        }
+    }
+
+    /// puts the thread to sleep for `ticks` system ticks from now.
     #[inline]
-    pub fn put_sleep(&mut self, thread: Thread, ticks: usize) {
+    pub fn put_sleep(&mut self, thread: T, ticks: usize) {
+        let till_ticks = SystemTimer::current_ticks() + ticks.max(1) as u64;
+        self.sleep_seq += 1;
         self.sleep_threads.push(SleepingThread {
-            till_ticks: ticks,
+            till_ticks,
+            seq: self.sleep_seq,
             thread,
         });
     }
 
+    /// tick at which the earliest sleeping or timed event thread wakes up
+    #[inline]
+    pub fn next_deadline(&self) -> Option<u64> {
+        let sleep_deadline = self.sleep_threads.peek().map(|entry| entry.till_ticks);
+        if self.timed_event_waiters == 0 {
+            return sleep_deadline;
+        }
+
+        let event_deadline = self
+            .event_threads
+            .iter()
+            .flat_map(|waiters| waiters.iter())
+            .filter_map(|waiter| waiter.till_ticks)
+            .min();
+
+        match (sleep_deadline, event_deadline) {
+            (Some(sleep), Some(event)) => Some(sleep.min(event)),
+            (sleep, None) => sleep,
+            (None, event) => event,
+        }
+    }
+
     #[inline]
-    pub fn put_wait(&mut self, thread: Thread, pid: PID) {
+    pub fn put_wait(&mut self, thread: T, pid: PID) {
         self.waiting_threads.push(WaitingThread { pid, thread });
     }
 
+    /// blocks the thread on `event` till the tick `till_ticks` at most, unless
+    /// the event occurred after the thread read `generation`, then the thread
+    /// is returned back.
     #[inline]
-    pub fn dispatch_suspend(&mut self, thread: Thread, suspend_type: ThreadSuspendType) {
+    pub fn put_event_wait(
+        &mut self,
+        thread: T,
+        event: WaitEvent,
+        generation: u64,
+        till_ticks: Option<u64>,
+    ) -> Option<T> {
+        if event.generation() != generation {
+            return Some(thread);
+        }
+
+        if till_ticks.is_some() {
+            self.timed_event_waiters += 1;
+        }
+
+        self.event_threads[event as usize].push(EventWaiter { till_ticks, thread });
+        None
+    }
+
+    /// returns the thread if it must continue to run.
+    #[inline]
+    pub fn dispatch_suspend(&mut self, thread: T, suspend_type: ThreadSuspendType) -> Option<T> {
         match suspend_type {
             ThreadSuspendType::SuspendWait(pid) => {
                 self.put_wait(thread, pid);
@@ -56,58 +247,84 @@ impl WaitQueue {
             ThreadSuspendType::SuspendSleep(ticks) => {
                 self.put_sleep(thread, ticks);
             }
-            ThreadSuspendType::Nothing => {}
+            ThreadSuspendType::SuspendEvent(event, generation, till_ticks) => {
+                return self.put_event_wait(thread, event, generation, till_ticks);
+            }
+            ThreadSuspendType::Nothing => return Some(thread),
         }
+
+        None
     }
 
     #[inline]
-    pub fn wake_waiting_threads(&mut self, pid: PID, run_queue: &mut Vec<Thread>) {
-        self.waiting_threads = self
-            .waiting_threads
-            .drain_filter(|entry| {
-                let should_retain = if entry.pid.as_u64() == pid.as_u64() {
-                    run_queue.push(entry.thread.clone());
-                    false
-                } else {
-                    true
-                };
-
-                should_retain
-            })
-            .collect();
+    pub fn wake_waiting_threads(&mut self, pid: PID, run_queue: &mut Vec<T>) {
+        let mut index = 0;
+        while index < self.waiting_threads.len() {
+            if self.waiting_threads[index].pid.as_u64() == pid.as_u64() {
+                run_queue.push(self.waiting_threads.remove(index).thread);
+            } else {
+                index += 1;
+            }
+        }
+    }
+
+    /// moves the threads whose deadline is at or before `now` to the run queue,
+    /// only the expired entries are touched.
+    #[inline]
+    pub fn wake_sleeping_threads(&mut self, now: usize, run_queue: &mut Vec<T>) {
+        while let Some(entry) = self.sleep_threads.peek() {
+            if entry.till_ticks > now as u64 {
+                break;
+            }
+
+            run_queue.push(self.sleep_threads.pop().unwrap().thread);
+        }
+
+        if self.timed_event_waiters != 0 {
+            self.wake_expired_event_threads(now as u64, run_queue);
+        }
+    }
+
+    /// moves the event waiters whose deadline is at or before `now` to the
+    /// run queue, the event did not occur in time for them.
+    fn wake_expired_event_threads(&mut self, now: u64, run_queue: &mut Vec<T>) {
+        for waiters in self.event_threads.iter_mut() {
+            let mut index = 0;
+            while index < waiters.len() {
+                match waiters[index].till_ticks {
+                    Some(till_ticks) if till_ticks <= now => {
+                        run_queue.push(waiters.remove(index).thread);
+                        self.timed_event_waiters -= 1;
+                    }
+                    _ => index += 1,
+                }
+            }
+        }
     }
 
     #[inline]
-    pub fn wake_sleeping_threads(&mut self, ticks: usize, run_queue: &mut Vec<Thread>) {
-        // decrement the tick of each of thread
-        // if ticks = 0 after decrementing, remove those threads and put them
-        // into the run queue, this algorithm can be improved too much.
-        // this is a rough implementation.
-        self.sleep_threads = self
-            .sleep_threads
-            .drain_filter(|entry| {
-                let should_retain = if entry.till_ticks - 1 == 0 {
-                    // add this to run queue
-                    run_queue.push(entry.thread.clone());
-                    false
-                } else {
-                    entry.till_ticks = entry.till_ticks - ticks;
-                    true
-                };
-                should_retain
-            })
-            .collect();
+    pub fn wake_event_threads(&mut self, event: WaitEvent, run_queue: &mut Vec<T>) {
+        for waiter in self.event_threads[event as usize].drain(..) {
+            if waiter.till_ticks.is_some() {
+                self.timed_event_waiters -= 1;
+            }
+
+            run_queue.push(waiter.thread);
+        }
     }
 
     #[inline]
-    pub fn dispatch_wakeup(&mut self, wakeup_mode: ThreadWakeupType, run_queue: &mut Vec<Thread>) {
+    pub fn dispatch_wakeup(&mut self, wakeup_mode: ThreadWakeupType, run_queue: &mut Vec<T>) {
         match wakeup_mode {
-            ThreadWakeupType::FromSleep(ticks) => {
-                self.wake_sleeping_threads(ticks, run_queue);
+            ThreadWakeupType::FromSleep(now) => {
+                self.wake_sleeping_threads(now, run_queue);
             }
             ThreadWakeupType::FromWait(pid) => {
                 self.wake_waiting_threads(pid, run_queue);
             }
+            ThreadWakeupType::FromEvent(event) => {
+                self.wake_event_threads(event, run_queue);
+            }
             ThreadWakeupType::Nothing => {}
         }
     }
@@ -3,7 +3,8 @@ extern crate log;
 extern crate spin;
 
 use crate::cpu::{
-    mmu, segments, state::bootstrap_kernel_thread, state::CPURegistersState, syscall,
+    mmu, percpu::PerCPU, segments, state::bootstrap_kernel_thread, state::CPURegistersState,
+    syscall,
 };
 use crate::mm::{stack::STACK_ALLOCATOR, stack::STACK_SIZE, PhysicalAddress, VirtualAddress};
 use crate::system::process::{PID, PROCESS_POOL};
@@ -11,7 +12,7 @@ use crate::system::tasking::{Sched, SCHEDULER};
 
 use crate::system::utils;
 
-use alloc::{boxed::Box, string::String};
+use alloc::string::String;
 use core::mem;
 use core::sync::atomic::{AtomicU64, Ordering};
 
@@ -48,6 +49,11 @@ pub enum ContextType {
 pub struct ThreadID(u64);
 
 impl ThreadID {
+    #[inline]
+    pub fn new(tid: u64) -> Self {
+        ThreadID(tid)
+    }
+
     #[inline]
     pub fn as_u64(&self) -> u64 {
         self.0
@@ -78,11 +84,69 @@ impl Context {
     }
 }
 
+/// The part of a thread needed to switch to it. The scheduler hands out a
+/// copy of this instead of the whole thread, so no allocation is made.
+#[derive(Debug, Clone)]
+pub struct LeasedThread {
+    pub context: ContextType,
+    pub is_user: bool,
+    pub cr3: u64,
+    pub syscall_stack_start: Option<VirtualAddress>,
+}
+
+impl LeasedThread {
+    #[inline]
+    fn load_syscall_stack(&self) {
+        if self.syscall_stack_start.is_some() {
+            // load this custom stack:
+            let stack_end =
+                self.syscall_stack_start.unwrap().as_u64() + utils::THREAD_SYSCALL_STACK_SIZE;
+            // set this stack
+            syscall::set_syscall_stack(stack_end);
+        } else {
+            syscall::set_default_syscall_stack();
+        }
+    }
+
+    #[inline]
+    pub fn load_state(&self) {
+        match &self.context {
+            ContextType::InitContext(ctx) => {
+                // initial context, create a new context object:
+                let (code_sel, data_sel) = if self.is_user {
+                    (segments::get_user_cs().0, segments::get_user_ds().0)
+                } else {
+                    (segments::get_kernel_cs().0, segments::get_kernel_ds().0)
+                };
+
+                self.load_syscall_stack();
+
+                PerCPU::load_page_table(PhysicalAddress::from_u64(ctx.cr3_base));
+
+                mmu::reload_flush();
+
+                bootstrap_kernel_thread(
+                    ctx.stack_end.as_u64(),
+                    ctx.rip_address.as_u64(),
+                    code_sel,
+                    data_sel,
+                )
+            }
+            ContextType::SavedContext(ctx) => {
+                // load page tables:
+                self.load_syscall_stack();
+                PerCPU::load_page_table(PhysicalAddress::from_u64(self.cr3));
+                CPURegistersState::load_state(&ctx)
+            }
+        }
+    }
+}
+
 #[derive(Debug, Clone)]
 pub struct Thread {
     pub thread_id: ThreadID,
     pub parent_pid: PID,
-    pub context: Box<ContextType>,
+    pub context: ContextType,
     pub name: String,
     pub state: ThreadState,
     pub sched_count: u64,
@@ -156,7 +220,7 @@ impl Thread {
         Ok(Thread {
             is_user: true,
             parent_pid: parent_proc.pid.clone(),
-            context: Box::new(context),
+            context,
             name,
             thread_id: tid,
             state: ThreadState::Waiting,
@@ -181,8 +245,8 @@ impl Thread {
             ContextType::SavedContext(ctx) => ctx.rsp,
         };
 
-        // allocate a new stack and copy the parent stack:
-        let stack_start = utils::ProcessStackManager::allocate_and_clone(
+        // share the parent stack copy-on-write:
+        let stack_start = utils::ProcessStackManager::clone_stack(
             &mut child.proc_data.as_mut().unwrap(),
             &mut child.pt_root.as_mut().unwrap(),
             rsp,
@@ -202,7 +266,7 @@ impl Thread {
         Ok(Thread {
             is_user: true,
             parent_pid: pid,
-            context: Box::new(state.clone()),
+            context: state.clone(),
             name,
             thread_id: tid,
             state: ThreadState::Waiting,
@@ -284,7 +348,7 @@ impl Thread {
         Ok(Thread {
             is_user: proc.is_usermode(),
             parent_pid: pid,
-            context: Box::new(context),
+            context,
             name,
             thread_id: tid,
             state: ThreadState::Waiting,
@@ -310,52 +374,25 @@ impl Thread {
         VirtualAddress::from_u64(self.stack_start.as_u64() + STACK_SIZE as u64)
     }
 
+    /// saves the registers over the current context, the first save
+    /// replaces the initial context.
     #[inline]
-    pub fn load_state(&self) {
-        match self.context.as_ref() {
-            ContextType::InitContext(ctx) => {
-                // initial context, create a new context object:
-                let (code_sel, data_sel) = if self.is_user {
-                    (segments::get_user_cs().0, segments::get_user_ds().0)
-                } else {
-                    (segments::get_kernel_cs().0, segments::get_kernel_ds().0)
-                };
-
-                if self.syscall_stack_start.is_some() {
-                    // load this custom stack:
-                    let stack_end = self.syscall_stack_start.unwrap().as_u64()
-                        + utils::THREAD_SYSCALL_STACK_SIZE;
-                    // set this stack
-                    syscall::set_syscall_stack(stack_end);
-                } else {
-                    syscall::set_default_syscall_stack();
-                }
-
-                mmu::set_page_table_address(PhysicalAddress::from_u64(ctx.cr3_base));
+    pub fn save_context(&mut self, state: CPURegistersState) {
+        if let ContextType::SavedContext(ctx) = &mut self.context {
+            *ctx = state;
+            return;
+        }
 
-                mmu::reload_flush();
+        self.context = ContextType::SavedContext(state);
+    }
 
-                bootstrap_kernel_thread(
-                    ctx.stack_end.as_u64(),
-                    ctx.rip_address.as_u64(),
-                    code_sel,
-                    data_sel,
-                )
-            }
-            ContextType::SavedContext(ctx) => {
-                // load page tables:
-                if self.syscall_stack_start.is_some() {
-                    // load this custom stack:
-                    let stack_end = self.syscall_stack_start.unwrap().as_u64()
-                        + utils::THREAD_SYSCALL_STACK_SIZE;
-                    // set this stack
-                    syscall::set_syscall_stack(stack_end);
-                } else {
-                    syscall::set_default_syscall_stack();
-                }
-                mmu::set_page_table_address(PhysicalAddress::from_u64(self.cr3));
-                CPURegistersState::load_state(&ctx)
-            }
+    #[inline]
+    pub fn leased(&self) -> LeasedThread {
+        LeasedThread {
+            context: self.context.clone(),
+            is_user: self.is_user,
+            cr3: self.cr3,
+            syscall_stack_start: self.syscall_stack_start,
         }
     }
 
@@ -378,9 +415,10 @@ pub fn new_from_function(
     }
 
     let thread = th_res.unwrap();
+    let tid = thread.thread_id;
 
-    SCHEDULER.lock().add_new_thread(thread.clone());
-    Ok(thread.thread_id)
+    SCHEDULER.add_new_thread(thread);
+    Ok(tid)
 }
 
 pub fn new_main_thread(pid: &PID, name: String) -> Result<ThreadID, ThreadError> {
@@ -391,6 +429,6 @@ pub fn new_main_thread(pid: &PID, name: String) -> Result<ThreadID, ThreadError>
     let thread = th_res.unwrap();
     let tid = thread.thread_id;
 
-    SCHEDULER.lock().add_new_thread(thread.clone());
+    SCHEDULER.add_new_thread(thread);
     Ok(tid)
 }
@@ -0,0 +1,122 @@
+extern crate log;
+extern crate spin;
+
+use crate::cpu::mmu;
+use crate::mm::p_to_v;
+use crate::mm::paging::{Page, PageEntryFlags, VirtualMemoryManager};
+use crate::mm::phy::{Frame, PhysicalMemoryManager};
+use crate::mm::{MemorySizes, VirtualAddress};
+use crate::system::utils::USER_TIME_PAGE_ADDRESS;
+
+use core::ptr;
+use core::sync::atomic::{fence, AtomicU64, Ordering};
+use lazy_static::lazy_static;
+use spin::Mutex;
+
+const PAGE_SIZE: usize = 4 * MemorySizes::OneKiB as usize;
+
+/// Layout of the time page as seen by user code, user code reads the clock
+/// with rdtsc and these values instead of calling clock_gettime.
+///
+/// The kernel makes `sequence` odd while it updates the page, a reader
+/// retries if `sequence` was odd or changed while it read the other fields.
+#[repr(C)]
+pub struct TimePageData {
+    pub sequence: AtomicU64,
+    /// TSC ticks per second, 0 until the TSC is calibrated.
+    pub tsc_frequency: AtomicU64,
+    /// TSC value at which the monotonic clock started.
+    pub tsc_origin: AtomicU64,
+    /// nanoseconds from the unix epoch to `tsc_origin`, the kernel has no
+    /// wall clock yet so this stays 0 like CLOCK_REALTIME in clock_gettime.
+    pub epoch_offset_ns: AtomicU64,
+}
+
+/// allocated once at boot and never freed, every process maps the same frame.
+struct TimePage {
+    frame: Frame,
+}
+
+impl TimePage {
+    fn new() -> Self {
+        let frame_opt = PhysicalMemoryManager::alloc();
+        if frame_opt.is_none() {
+            panic!("Failed to allocate the time page.");
+        }
+
+        let frame = frame_opt.unwrap();
+        unsafe {
+            ptr::write_bytes(p_to_v(frame.addr()).get_mut_ptr::<u8>(), 0, PAGE_SIZE);
+        }
+
+        TimePage { frame }
+    }
+
+    #[inline]
+    fn data(&self) -> &'static TimePageData {
+        unsafe { &*p_to_v(self.frame.addr()).get_ptr::<TimePageData>() }
+    }
+}
+
+lazy_static! {
+    static ref TIME_PAGE: TimePage = TimePage::new();
+    /// serializes the writers of the page.
+    static ref WRITE_LOCK: Mutex<()> = Mutex::new(());
+}
+
+/// updates the clock parameters, readers never see a partial update.
+pub fn publish(tsc_frequency: u64, tsc_origin: u64) {
+    let _guard = WRITE_LOCK.lock();
+    let data = TIME_PAGE.data();
+
+    let sequence = data.sequence.load(Ordering::Relaxed);
+    data.sequence.store(sequence + 1, Ordering::Relaxed);
+    fence(Ordering::Release);
+
+    data.tsc_frequency.store(tsc_frequency, Ordering::Relaxed);
+    data.tsc_origin.store(tsc_origin, Ordering::Relaxed);
+
+    data.sequence.store(sequence + 2, Ordering::Release);
+
+    log::debug!(
+        "Published time page, tsc_frequency={}, tsc_origin={}",
+        tsc_frequency,
+        tsc_origin
+    );
+}
+
+/// maps the time page read-only at `USER_TIME_PAGE_ADDRESS`. The frame is
+/// permanent, the mappings do not count references to it, so any number of
+/// processes can map it.
+pub fn map_into(vmm: &mut VirtualMemoryManager) {
+    let flags = PageEntryFlags::PRESENT | PageEntryFlags::USERSPACE | PageEntryFlags::PERMANENT;
+    let page = Page::from_address(VirtualAddress::from_u64(USER_TIME_PAGE_ADDRESS));
+
+    let result = vmm.map_page(page, TIME_PAGE.frame, flags);
+    if result.is_err() {
+        log::error!("Failed to map the time page, err={:?}", result.unwrap_err());
+    }
+}
+
+/// true if the time page of `vmm` is the shared frame, forked children are
+/// checked with this as user code reads the clock without a syscall.
+pub fn is_mapped_in(vmm: &VirtualMemoryManager) -> bool {
+    let page_addr = VirtualAddress::from_u64(USER_TIME_PAGE_ADDRESS);
+    vmm.translate_to_frame(&page_addr).map_or(false, |frame| {
+        frame.addr().as_u64() == TIME_PAGE.frame.addr().as_u64()
+    })
+}
+
+/// drops the mapping of the time page, the frame itself stays.
+pub fn unmap_from(vmm: &mut VirtualMemoryManager) {
+    let page_addr = VirtualAddress::from_u64(USER_TIME_PAGE_ADDRESS);
+    if vmm.translate_to_frame(&page_addr).is_none() {
+        return;
+    }
+
+    // only the entry goes, the frame is not returned to the allocator.
+    let page = Page::from_address(page_addr);
+    if vmm.unmap_page_deferred(page).is_ok() {
+        mmu::shootdown_tlb();
+    }
+}
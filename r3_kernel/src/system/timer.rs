@@ -1,11 +1,14 @@
 extern crate log;
-extern crate spin;
 
+use crate::acpi::lapic::MAX_PROCESSORS;
 use crate::cpu::{enable_interrupts, disable_interrupts};
-use crate::cpu::tsc::{safe_ticks_from_ns, TSCTimerShot, TSC};
+use crate::cpu::percpu::PerCPU;
+use crate::cpu::tsc::{safe_ticks_from_ns, TSCTicks, TSCTimerShot, TSC};
 use crate::mm::Alignment;
 use crate::system::abi;
-use spin::Mutex;
+use crate::system::profiler;
+use crate::system::time_page;
+use core::sync::atomic::{AtomicU64, Ordering};
 
 #[derive(Debug)]
 #[repr(u64)]
@@ -17,71 +20,80 @@ pub enum Time {
 }
 
 /// each tick contains these many time nanoseconds.
-const SYSTEM_TICK_DURATION: u64 = 100 * 1000000;
+pub const SYSTEM_TICK_DURATION: u64 = 100 * 1000000;
 
-/// SystemTicker that keeps tracks of number of
-/// ticks and provides few functions to manage timer.
+/// TSC value at the first system tick, 0 until the ticks are started.
+static TICKS_START_TSC: AtomicU64 = AtomicU64::new(0);
+
+const NO_DEADLINE: AtomicU64 = AtomicU64::new(0);
+
+/// TSC at which every processor has to schedule again, 0 if it has to on
+/// the next shot. The shot can come earlier for the profiler.
+static SHOT_DEADLINES: [AtomicU64; MAX_PROCESSORS] = [NO_DEADLINE; MAX_PROCESSORS];
+
+/// SystemTicker that keeps tracks of number of ticks, it is read and
+/// advanced without locks from any processor.
 pub struct SystemTicker {
-    ticks: u64,
-    epochs: u64,
+    ticks: AtomicU64,
 }
 
 impl SystemTicker {
     #[inline]
-    pub fn reset(&mut self) {
-        self.ticks = 0;
-        self.epochs = 0;
+    pub fn reset(&self) {
+        self.ticks.store(0, Ordering::SeqCst);
     }
 
     #[inline]
-    pub fn ticks_in_epoch(&self) -> u64 {
-        self.ticks
+    pub fn total_ticks(&self) -> u64 {
+        self.ticks.load(Ordering::Relaxed)
     }
 
+    /// moves the ticks forward to `ticks`, never backwards.
     #[inline]
-    pub fn total_ticks(&self) -> u64 {
-        (self.epochs * u64::max_value() + self.ticks) as u64
+    pub fn advance_to(&self, ticks: u64) {
+        self.ticks.fetch_max(ticks, Ordering::Relaxed);
     }
 
     #[inline]
-    pub fn update_tick(&mut self) {
-        if self.ticks >= u64::max_value() {
-            self.epochs += 1;
-            self.ticks = 0;
-        }
-
-        self.ticks += 1;
+    pub fn update_tick(&self) {
+        self.ticks.fetch_add(1, Ordering::Relaxed);
     }
 
     #[inline]
-    pub fn as_ns(&mut self) -> u64 {
+    pub fn as_ns(&self) -> u64 {
         self.total_ticks() * SYSTEM_TICK_DURATION as u64
     }
 
     #[inline]
     pub const fn empty() -> Self {
         SystemTicker {
-            ticks: 0,
-            epochs: 0,
+            ticks: AtomicU64::new(0),
         }
     }
 }
 
-static SYSTEM_TICKS: Mutex<SystemTicker> = Mutex::new(SystemTicker::empty());
+static SYSTEM_TICKS: SystemTicker = SystemTicker::empty();
+
+/// TSC ticks in one system tick, computed once the TSC is calibrated.
+static TICK_TSC_TICKS: AtomicU64 = AtomicU64::new(0);
 
 /// Provides methods to control timer
 pub struct SystemTimer;
 
 impl SystemTimer {
+    /// arms the shot one tick from now, the deadline is recorded so that
+    /// `shot_due` does not compare against the one armed before.
     #[inline]
     pub fn next_shot() {
-        TSCTimerShot::reset_current_shot();
-        TSCTimerShot::create_shot_after_ns(SYSTEM_TICK_DURATION);
+        let now = TSC::read_tsc().u64();
+        let deadline = now + Self::tick_tsc_ticks();
+        SHOT_DEADLINES[PerCPU::current_index()].store(deadline, Ordering::Relaxed);
+        Self::arm_shot(deadline, now);
     }
 
     #[inline]
     pub fn enable_shot() {
-        TSCTimerShot::create_shot_from_ns(SYSTEM_TICK_DURATION);
+        Self::next_shot();
     }
 
     #[inline]
@@ -92,13 +104,13 @@ impl SystemTimer {
     /// This function will be called after every timer show
     #[inline]
     pub fn post_shot() {
-        let mut ticks_lock = SYSTEM_TICKS.lock();
-        ticks_lock.update_tick();
+        SYSTEM_TICKS.update_tick();
         Self::next_shot();
     }
 
     #[inline]
     pub fn manual_shot() {
+        SHOT_DEADLINES[PerCPU::current_index()].store(0, Ordering::Relaxed);
         TSCTimerShot::reset_current_shot();
         // creates a manual time shot:
         unsafe {
@@ -110,8 +122,100 @@ impl SystemTimer {
 
     #[inline]
     pub fn start_ticks() {
+        // the first processor to start ticking sets the origin.
+        let _ = TICKS_START_TSC.compare_exchange(
+            0,
+            TSC::read_tsc().u64(),
+            Ordering::SeqCst,
+            Ordering::SeqCst,
+        );
+        time_page::publish(
+            TSC::read_cpu_frequency(),
+            TICKS_START_TSC.load(Ordering::SeqCst),
+        );
         Self::next_shot();
     }
+
+    /// the frequency does not change after calibration, so the length of
+    /// a tick is only computed once.
+    #[inline]
+    fn tick_tsc_ticks() -> u64 {
+        let tick_tsc_ticks = TICK_TSC_TICKS.load(Ordering::Relaxed);
+        if tick_tsc_ticks != 0 {
+            return tick_tsc_ticks;
+        }
+
+        let tick_tsc_ticks = safe_ticks_from_ns(SYSTEM_TICK_DURATION).u64();
+        TICK_TSC_TICKS.store(tick_tsc_ticks, Ordering::Relaxed);
+        tick_tsc_ticks
+    }
+
+    /// number of system ticks elapsed since the ticks were started, this is
+    /// based on the TSC so it does not depend on how often the timer fired.
+    #[inline]
+    pub fn current_ticks() -> u64 {
+        let start = TICKS_START_TSC.load(Ordering::Relaxed);
+        let tick_tsc_ticks = Self::tick_tsc_ticks();
+        if start == 0 || tick_tsc_ticks == 0 {
+            return 0;
+        }
+
+        TSC::read_tsc().u64().saturating_sub(start) / tick_tsc_ticks
+    }
+
+    /// updates the system ticker and returns the current tick
+    #[inline]
+    pub fn sync_ticks() -> u64 {
+        let ticks = Self::current_ticks();
+        SYSTEM_TICKS.advance_to(ticks);
+        ticks
+    }
+
+    /// arms the timer of this processor for the next tick, or earlier if a
+    /// sleeping thread wakes up at `next_wakeup` before that. Idle processors
+    /// keep ticking too, that is how they find threads to steal.
+    pub fn next_shot_before(next_wakeup: Option<u64>) {
+        let start = TICKS_START_TSC.load(Ordering::Relaxed);
+        if start == 0 {
+            Self::next_shot();
+            return;
+        }
+
+        let now = TSC::read_tsc().u64();
+        let tick_tsc_ticks = Self::tick_tsc_ticks();
+
+        let mut deadline = now + tick_tsc_ticks;
+
+        if let Some(wakeup_tick) = next_wakeup {
+            deadline = deadline.min(wakeup_tick * tick_tsc_ticks + start);
+        }
+
+        SHOT_DEADLINES[PerCPU::current_index()].store(deadline, Ordering::Relaxed);
+        Self::arm_shot(deadline, now);
+    }
+
+    /// arms the shot at `deadline`, or earlier for the next profiler sample.
+    #[inline]
+    fn arm_shot(deadline: u64, now: u64) {
+        let shot_at = profiler::next_sample_before(deadline);
+        TSCTimerShot::reset_current_shot();
+        TSCTimerShot::set_shot_at(TSCTicks::from_u64(shot_at.max(now + 1)));
+    }
+
+    /// true if the shot that fired is the one armed for scheduling, not one
+    /// that only came for a profiler sample.
+    #[inline]
+    pub fn shot_due() -> bool {
+        let deadline = SHOT_DEADLINES[PerCPU::current_index()].load(Ordering::Relaxed);
+        deadline == 0 || TSC::read_tsc().u64() >= deadline
+    }
+
+    /// arms the shot again after a profiler sample, for the same deadline.
+    #[inline]
+    pub fn rearm_shot() {
+        let deadline = SHOT_DEADLINES[PerCPU::current_index()].load(Ordering::Relaxed);
+        Self::arm_shot(deadline, TSC::read_tsc().u64());
+    }
 }
 
 #[inline]
@@ -136,11 +240,11 @@ pub struct PosixTimeval {
 
 impl PosixTimeval {
     pub fn from_ticks() -> Self {
-        let ns = SYSTEM_TICKS.lock().as_ns();
+        let ns = SYSTEM_TICKS.as_ns();
         let seconds = ns as i64 / Time::Second as i64;
 
         // get microseconds offset
-        let offset = ns as i64 - (seconds * Time::NanoSecond as i64);
+        let offset = ns as i64 - (seconds * Time::Second as i64);
         let offset_us = offset / Time::MicroSecond as i64;
 
         PosixTimeval {
@@ -177,8 +281,7 @@ pub fn pause_events() {
 
 /// this will enable timer ticks and interrupts
 pub fn resume_events() {
-    TSCTimerShot::reset_current_shot();
-    TSCTimerShot::create_shot_after_ns(SYSTEM_TICK_DURATION);
+    SystemTimer::next_shot();
 }
 
 #[inline]
@@ -0,0 +1,446 @@
+extern crate alloc;
+
+use crate::acpi::lapic::MAX_PROCESSORS;
+use crate::cpu;
+use crate::cpu::percpu::PerCPU;
+use crate::cpu::tsc::TSC;
+use crate::system::filesystem::devfs::{self, DevFSDescriptor, DevOps};
+use crate::system::filesystem::{bcache, FSError, SeekType};
+use crate::system::page_cache;
+use crate::system::ring::RecordRing;
+use crate::system::tasking;
+
+use alloc::{format, string::String, vec::Vec};
+use core::fmt::Write;
+use core::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+
+/// records kept per processor while tracing, older ones are overwritten.
+const TRACE_RING_ENTRIES: usize = 256;
+
+/// syscall numbers above this are counted together in the last slot.
+const MAX_SYSCALL_NO: usize = 512;
+
+/// log2 buckets of TSC cycles, the last one takes everything longer.
+const LATENCY_BUCKETS: usize = 32;
+
+/// run queue lengths above this are counted in the last bucket.
+const RUN_QUEUE_BUCKETS: usize = 16;
+
+/// ioctl commands of `/dev/trace`.
+pub const TRACE_IOCTL_START: usize = 1;
+pub const TRACE_IOCTL_STOP: usize = 2;
+pub const TRACE_IOCTL_CLEAR: usize = 3;
+
+#[repr(u8)]
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum TraceEvent {
+    /// `arg` is the syscall number.
+    SyscallEnter = 0,
+    /// `arg` is the syscall number, `amount` the cycles spent in it.
+    SyscallExit = 1,
+    /// `arg` is the thread that was switched to.
+    ContextSwitch = 2,
+    /// `arg` is the faulting address.
+    PageFault = 3,
+    /// `arg` is the first frame, `amount` the number of frames.
+    FrameAlloc = 4,
+    /// `arg` is the first sector, `amount` the number of sectors.
+    DiskRead = 5,
+    DiskWrite = 6,
+    /// `amount` is the length of the frame in bytes.
+    NetRx = 7,
+    NetTx = 8,
+    /// `arg` is the stolen thread, `amount` the processor it was taken from.
+    ThreadSteal = 9,
+}
+
+const N_TRACE_EVENTS: usize = 10;
+
+impl TraceEvent {
+    fn name(&self) -> &'static str {
+        match self {
+            TraceEvent::SyscallEnter => "sys_enter",
+            TraceEvent::SyscallExit => "sys_exit",
+            TraceEvent::ContextSwitch => "switch",
+            TraceEvent::PageFault => "page_fault",
+            TraceEvent::FrameAlloc => "frame_alloc",
+            TraceEvent::DiskRead => "disk_read",
+            TraceEvent::DiskWrite => "disk_write",
+            TraceEvent::NetRx => "net_rx",
+            TraceEvent::NetTx => "net_tx",
+            TraceEvent::ThreadSteal => "steal",
+        }
+    }
+
+    fn from_index(index: usize) -> Option<Self> {
+        match index {
+            0 => Some(TraceEvent::SyscallEnter),
+            1 => Some(TraceEvent::SyscallExit),
+            2 => Some(TraceEvent::ContextSwitch),
+            3 => Some(TraceEvent::PageFault),
+            4 => Some(TraceEvent::FrameAlloc),
+            5 => Some(TraceEvent::DiskRead),
+            6 => Some(TraceEvent::DiskWrite),
+            7 => Some(TraceEvent::NetRx),
+            8 => Some(TraceEvent::NetTx),
+            9 => Some(TraceEvent::ThreadSteal),
+            _ => None,
+        }
+    }
+}
+
+/// counters of one processor, only it's own processor adds to them so the
+/// cache lines are not shared.
+struct CPUStats {
+    events: [AtomicU64; N_TRACE_EVENTS],
+    /// sectors, frames or bytes moved by the events.
+    amounts: [AtomicU64; N_TRACE_EVENTS],
+    syscall_latency: [AtomicU64; LATENCY_BUCKETS],
+    run_queue: [AtomicU64; RUN_QUEUE_BUCKETS],
+}
+
+const ZERO: AtomicU64 = AtomicU64::new(0);
+
+const CPU_STATS_INIT: CPUStats = CPUStats {
+    events: [ZERO; N_TRACE_EVENTS],
+    amounts: [ZERO; N_TRACE_EVENTS],
+    syscall_latency: [ZERO; LATENCY_BUCKETS],
+    run_queue: [ZERO; RUN_QUEUE_BUCKETS],
+};
+
+static CPU_STATS: [CPUStats; MAX_PROCESSORS] = [CPU_STATS_INIT; MAX_PROCESSORS];
+
+/// calls and cycles by syscall number, of all the processors.
+static SYSCALL_CALLS: [AtomicU64; MAX_SYSCALL_NO] = [ZERO; MAX_SYSCALL_NO];
+static SYSCALL_CYCLES: [AtomicU64; MAX_SYSCALL_NO] = [ZERO; MAX_SYSCALL_NO];
+
+#[derive(Clone, Copy)]
+struct TraceRecord {
+    tsc: u64,
+    arg: u64,
+    amount: u32,
+    pid: u32,
+    event: TraceEvent,
+}
+
+const TRACE_RECORD_INIT: TraceRecord = TraceRecord {
+    tsc: 0,
+    arg: 0,
+    amount: 0,
+    pid: 0,
+    event: TraceEvent::SyscallEnter,
+};
+
+type TraceRing = RecordRing<TraceRecord, [TraceRecord; TRACE_RING_ENTRIES]>;
+
+const TRACE_RING_INIT: TraceRing = RecordRing::new([TRACE_RECORD_INIT; TRACE_RING_ENTRIES]);
+
+static TRACE_RINGS: [TraceRing; MAX_PROCESSORS] = [TRACE_RING_INIT; MAX_PROCESSORS];
+
+/// trace points only count events until tracing is started.
+static TRACING: AtomicBool = AtomicBool::new(false);
+
+#[inline]
+fn bucket_of(cycles: u64) -> usize {
+    let bucket = 64 - cycles.leading_zeros() as usize;
+    bucket.min(LATENCY_BUCKETS - 1)
+}
+
+/// counts `event` on the current processor, and records it in the trace
+/// ring if tracing. This is safe to call from interrupt handlers.
+#[inline]
+pub fn record(event: TraceEvent, arg: u64, amount: u32) {
+    let interrupts_enabled = cpu::are_enabled();
+    cpu::disable_interrupts();
+
+    let index = PerCPU::current_index();
+    let stats = &CPU_STATS[index];
+    stats.events[event as usize].fetch_add(1, Ordering::Relaxed);
+    stats.amounts[event as usize].fetch_add(amount as u64, Ordering::Relaxed);
+
+    if TRACING.load(Ordering::Relaxed) {
+        TRACE_RINGS[index].push(TraceRecord {
+            tsc: TSC::read_tsc().u64(),
+            arg,
+            amount,
+            pid: PerCPU::current_pid().unwrap_or(0) as u32,
+            event,
+        });
+    }
+
+    if interrupts_enabled {
+        cpu::enable_interrupts();
+    }
+}
+
+/// called before a syscall is dispatched, returns the TSC to give to
+/// `syscall_exit`.
+#[inline]
+pub fn syscall_enter(sys_no: usize) -> u64 {
+    record(TraceEvent::SyscallEnter, sys_no as u64, 0);
+    TSC::read_tsc().u64()
+}
+
+/// the syscall may have slept, so the latency covers the time it was blocked.
+#[inline]
+pub fn syscall_exit(sys_no: usize, entered_at: u64) {
+    let cycles = TSC::read_tsc().u64().saturating_sub(entered_at);
+    let slot = sys_no.min(MAX_SYSCALL_NO - 1);
+    SYSCALL_CALLS[slot].fetch_add(1, Ordering::Relaxed);
+    SYSCALL_CYCLES[slot].fetch_add(cycles, Ordering::Relaxed);
+
+    // the thread may be running on another processor now.
+    CPU_STATS[PerCPU::current_index()].syscall_latency[bucket_of(cycles)]
+        .fetch_add(1, Ordering::Relaxed);
+    record(
+        TraceEvent::SyscallExit,
+        sys_no as u64,
+        cycles.min(u32::MAX as u64) as u32,
+    );
+}
+
+/// sampled by the scheduler on every tick.
+#[inline]
+pub fn sample_run_queue(length: usize) {
+    let bucket = length.min(RUN_QUEUE_BUCKETS - 1);
+    CPU_STATS[PerCPU::current_index()].run_queue[bucket].fetch_add(1, Ordering::Relaxed);
+}
+
+fn start_tracing() {
+    TRACING.store(true, Ordering::SeqCst);
+}
+
+fn stop_tracing() {
+    TRACING.store(false, Ordering::SeqCst);
+}
+
+/// the records of all the processors, oldest first, one per line.
+fn trace_snapshot() -> String {
+    let mut records: Vec<(usize, TraceRecord)> = Vec::new();
+    for (index, ring) in TRACE_RINGS.iter().enumerate() {
+        for record in ring.snapshot() {
+            records.push((index, record));
+        }
+    }
+
+    records.sort_by_key(|(_, record)| record.tsc);
+
+    let mut text = String::new();
+    for (index, record) in records.iter() {
+        let _ = write!(
+            text,
+            "{} {} {} {} 0x{:x} {}\n",
+            index,
+            record.tsc,
+            record.pid,
+            record.event.name(),
+            record.arg,
+            record.amount
+        );
+    }
+
+    text
+}
+
+#[inline]
+fn sum_over_cpus<F>(func: F) -> u64
+where
+    F: Fn(&CPUStats) -> u64,
+{
+    CPU_STATS.iter().map(|stats| func(stats)).sum()
+}
+
+fn write_histogram<F>(text: &mut String, title: &str, bucket_label: F, counts: &[u64])
+where
+    F: Fn(usize) -> String,
+{
+    let _ = write!(text, "{}:\n", title);
+    for (bucket, count) in counts.iter().enumerate() {
+        if *count != 0 {
+            let _ = write!(text, "  {:>12} {}\n", bucket_label(bucket), count);
+        }
+    }
+}
+
+/// the counters and histograms as text.
+fn stats_snapshot() -> String {
+    let mut text = String::new();
+
+    let _ = write!(text, "{:4}", "cpu");
+    for event_index in 0..N_TRACE_EVENTS {
+        let _ = write!(
+            text,
+            " {:>12}",
+            TraceEvent::from_index(event_index).unwrap().name()
+        );
+    }
+    text.push('\n');
+
+    for (index, stats) in CPU_STATS.iter().enumerate() {
+        let counts: Vec<u64> = stats
+            .events
+            .iter()
+            .map(|count| count.load(Ordering::Relaxed))
+            .collect();
+
+        // processors that never ran are left out.
+        if counts.iter().all(|count| *count == 0) {
+            continue;
+        }
+
+        let _ = write!(text, "{:4}", index);
+        for count in counts.iter() {
+            let _ = write!(text, " {:>12}", count);
+        }
+        text.push('\n');
+    }
+
+    let _ = write!(
+        text,
+        "disk sectors: read={} written={}\nnet bytes: rx={} tx={}\nframes allocated: {}\n",
+        sum_over_cpus(|s| s.amounts[TraceEvent::DiskRead as usize].load(Ordering::Relaxed)),
+        sum_over_cpus(|s| s.amounts[TraceEvent::DiskWrite as usize].load(Ordering::Relaxed)),
+        sum_over_cpus(|s| s.amounts[TraceEvent::NetRx as usize].load(Ordering::Relaxed)),
+        sum_over_cpus(|s| s.amounts[TraceEvent::NetTx as usize].load(Ordering::Relaxed)),
+        sum_over_cpus(|s| s.amounts[TraceEvent::FrameAlloc as usize].load(Ordering::Relaxed)),
+    );
+
+    let switches = tasking::switch_latency();
+    let _ = write!(
+        text,
+        "switch cycles: switches={} avg={} max={}\n",
+        switches.switches,
+        switches.avg_cycles(),
+        switches.max_cycles
+    );
+
+    let _ = write!(
+        text,
+        "block cache: {:?}\npage cache pages: {}\n",
+        bcache::stats(),
+        page_cache::cached_pages()
+    );
+
+    let latency: Vec<u64> = (0..LATENCY_BUCKETS)
+        .map(|bucket| sum_over_cpus(|s| s.syscall_latency[bucket].load(Ordering::Relaxed)))
+        .collect();
+    write_histogram(
+        &mut text,
+        "syscall latency (cycles)",
+        |bucket| {
+            if bucket == 0 {
+                String::from("0")
+            } else {
+                format!("< 2^{}", bucket)
+            }
+        },
+        &latency,
+    );
+
+    let run_queue: Vec<u64> = (0..RUN_QUEUE_BUCKETS)
+        .map(|bucket| sum_over_cpus(|s| s.run_queue[bucket].load(Ordering::Relaxed)))
+        .collect();
+    write_histogram(
+        &mut text,
+        "run queue length (ticks)",
+        |bucket| {
+            if bucket == RUN_QUEUE_BUCKETS - 1 {
+                format!(">= {}", bucket)
+            } else {
+                format!("{}", bucket)
+            }
+        },
+        &run_queue,
+    );
+
+    let _ = write!(text, "syscalls:\n");
+    for sys_no in 0..MAX_SYSCALL_NO {
+        let calls = SYSCALL_CALLS[sys_no].load(Ordering::Relaxed);
+        if calls != 0 {
+            let cycles = SYSCALL_CYCLES[sys_no].load(Ordering::Relaxed);
+            let _ = write!(
+                text,
+                "  {:>4} calls={} avg_cycles={}\n",
+                sys_no,
+                calls,
+                cycles / calls
+            );
+        }
+    }
+
+    text
+}
+
+/// `/dev/trace`, reads return the recorded trace points as
+/// `cpu tsc pid event arg amount` lines. Tracing is started, stopped and
+/// cleared with ioctl.
+pub struct TraceDriver;
+
+impl TraceDriver {
+    pub fn empty() -> Self {
+        TraceDriver {}
+    }
+}
+
+impl DevOps for TraceDriver {
+    fn read(&self, fd: &mut DevFSDescriptor, buffer: &mut [u8]) -> Result<usize, FSError> {
+        Ok(devfs::read_text(fd, buffer, trace_snapshot))
+    }
+
+    fn write(&self, _fd: &mut DevFSDescriptor, _buffer: &[u8]) -> Result<usize, FSError> {
+        Ok(0)
+    }
+
+    fn ioctl(&self, command: usize, _arg: usize) -> Result<usize, FSError> {
+        match command {
+            TRACE_IOCTL_START => start_tracing(),
+            TRACE_IOCTL_STOP => stop_tracing(),
+            TRACE_IOCTL_CLEAR => {
+                for ring in TRACE_RINGS.iter() {
+                    ring.clear();
+                }
+            }
+            _ => return Err(FSError::NotYetImplemented),
+        }
+
+        Ok(0)
+    }
+
+    fn seek(&self, fd: &mut DevFSDescriptor, offset: u32, st: SeekType) -> Result<u32, FSError> {
+        Ok(devfs::seek_text(fd, offset, st, trace_snapshot))
+    }
+}
+
+unsafe impl Sync for TraceDriver {}
+unsafe impl Send for TraceDriver {}
+
+/// `/dev/stats`, reads return the event counters of every processor and
+/// the histograms of syscall latency and run queue length.
+pub struct StatsDriver;
+
+impl StatsDriver {
+    pub fn empty() -> Self {
+        StatsDriver {}
+    }
+}
+
+impl DevOps for StatsDriver {
+    fn read(&self, fd: &mut DevFSDescriptor, buffer: &mut [u8]) -> Result<usize, FSError> {
+        Ok(devfs::read_text(fd, buffer, stats_snapshot))
+    }
+
+    fn write(&self, _fd: &mut DevFSDescriptor, _buffer: &[u8]) -> Result<usize, FSError> {
+        Ok(0)
+    }
+
+    fn ioctl(&self, _command: usize, _arg: usize) -> Result<usize, FSError> {
+        Ok(0)
+    }
+
+    fn seek(&self, fd: &mut DevFSDescriptor, offset: u32, st: SeekType) -> Result<u32, FSError> {
+        Ok(devfs::seek_text(fd, offset, st, stats_snapshot))
+    }
+}
+
+unsafe impl Sync for StatsDriver {}
+unsafe impl Send for StatsDriver {}
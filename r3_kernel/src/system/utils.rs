@@ -1,21 +1,22 @@
 extern crate alloc;
-extern crate object;
 
 use alloc::vec::Vec;
 
+use crate::cpu::mmu;
 use crate::mm::stack::STACK_SIZE;
 use crate::system::filesystem::vfs::FILESYSTEM;
 use crate::system::filesystem::FSOps;
 use crate::system::filesystem::FileDescriptor;
 use crate::system::loader;
+use crate::system::time_page;
+use crate::system::vma;
 
 use core::{mem, ptr};
-use object::{Object, ObjectSegment};
 
 use crate::mm::{
-    paging::KernelVirtualMemoryManager, paging::Page, paging::PageEntryFlags, paging::PageTable,
+    paging::KernelVirtualMemoryManager, paging::Page, paging::PageEntryFlags,
     paging::VirtualMemoryManager, phy::Frame, phy::PhysicalMemoryManager, Alignment, MemorySizes,
-    PageTableLevel, PhysicalAddress, VirtualAddress,
+    PhysicalAddress, VirtualAddress,
 };
 
 /// Area in which user code will be allocated
@@ -50,6 +51,13 @@ pub const STACK_SPACE_OFFSET: u64 = 64 * MemorySizes::OneKiB as u64;
 
 pub const USER_TEMP_STACK_MAPPING: u64 = 0x700000000000;
 
+/// mmap places mappings in this window, above the stacks.
+pub const USER_MMAP_START: u64 = 0x100000000000;
+pub const USER_MMAP_END: u64 = 0x600000000000;
+
+/// read-only clock page shared by all processes, see `time_page`.
+pub const USER_TIME_PAGE_ADDRESS: u64 = 0x600000000000;
+
 /// use huge pages to map heap
 pub const USE_HUGEPAGE_HEAP: bool = true;
 
@@ -101,8 +109,6 @@ pub struct ProcessData {
     pub code_entry: VirtualAddress,
     /// code page count - code segment uses 4KiB pages
     pub code_pages: u64,
-    /// code references - number of child processes referencing the same section
-    pub code_ref: u64,
 }
 
 pub struct ProcessStackManager;
@@ -252,37 +258,41 @@ impl ProcessStackManager {
         Ok(())
     }
 
+    /// maps the parent's stack containing `rsp` into the child at the same
+    /// address, the stack frame is shared copy-on-write. Must be called from
+    /// the parent's address space.
     #[inline]
-    pub fn allocate_and_clone(
+    pub fn clone_stack(
         child: &mut ProcessData,
         child_vmm: &mut VirtualMemoryManager,
-        _rsp: u64,
+        rsp: u64,
     ) -> Result<VirtualAddress, ProcessError> {
-        // allocate a new child stack
-        let child_stk = Self::allocate_stack(child, child_vmm, false);
-        if child_stk.is_err() {
-            return child_stk;
+        // rsp of an empty stack points to the end of it
+        let stack_start = Alignment::align_down(rsp - 1, THREAD_STACK_SIZE);
+        if stack_start < child.stack_space_start.as_u64() {
+            return Err(ProcessError::StackOOB);
         }
 
-        let parent_stack_start = child.stack_space_start;
-        let child_temp_start = VirtualAddress::from_u64(USER_TEMP_STACK_MAPPING);
-
-        // copy
-        unsafe {
-            let parent_ptr = parent_stack_start.get_ptr::<u8>();
-            let child_ptr = child_temp_start.get_mut_ptr::<u8>();
+        let (parent_vmm, _) = KernelVirtualMemoryManager::current_vmm();
+        let clone_result = parent_vmm.clone_cow_range(
+            child_vmm,
+            VirtualAddress::from_u64(stack_start),
+            VirtualAddress::from_u64(stack_start + THREAD_STACK_SIZE),
+        );
 
-            // copy
-            ptr::copy_nonoverlapping(parent_ptr, child_ptr, STACK_SIZE as usize);
+        if clone_result.is_err() {
+            log::error!("Stack clone failed, error={:?}", clone_result.unwrap_err());
+            return Err(ProcessError::StackAllocError);
         }
 
-        // late unmap the kernel region
-        let (current_vmm, _) = KernelVirtualMemoryManager::current_vmm();
-        current_vmm
-            .unmap_page(Page::from_address(child_temp_start))
-            .expect("Failed to unmap child stack.");
+        // reserve the slot, so that the next stack is allocated after it
+        let stack_slot =
+            (stack_start - child.stack_space_start.as_u64()) / (4 * MemorySizes::OneMib as u64);
+        if child.n_stacks < stack_slot + 2 {
+            child.n_stacks = stack_slot + 2;
+        }
 
-        Ok(parent_stack_start)
+        Ok(VirtualAddress::from_u64(stack_start))
     }
 
     #[inline]
@@ -400,6 +410,10 @@ impl ProcessHeapAllocator {
         let current_allocated = proc_data.heap_alloc_pages;
         let unmap_start = proc_data.heap_start;
 
+        // heap frames can be shared copy-on-write with a forked child, and
+        // other processors may still reach them through their TLBs. They are
+        // freed after a single shootdown, and only by their last owner.
+        let mut unmapped = Vec::with_capacity(current_allocated as usize);
         for idx in 0..current_allocated {
             let page = if USE_HUGEPAGE_HEAP {
                 Page::from_address(VirtualAddress::from_u64(
@@ -411,8 +425,17 @@ impl ProcessHeapAllocator {
                 ))
             };
 
-            // unmap the heap page:
-            vmm.unmap_page(page).expect("Failed to unmap the heap page");
+            let frame = vmm
+                .unmap_page_deferred(page)
+                .expect("Failed to unmap the heap page");
+            unmapped.push(frame);
+        }
+
+        if !unmapped.is_empty() {
+            mmu::shootdown_tlb();
+        }
+        for (frame, is_huge) in unmapped {
+            VirtualMemoryManager::free_unmapped_frame(frame, is_huge);
         }
 
         // reset the heap:
@@ -462,105 +485,62 @@ impl ProcessHeapAllocator {
 pub struct CodeMapper;
 
 impl CodeMapper {
+    /// records the loadable segments of the executable as areas of the
+    /// process, their pages are read from the file on first access.
     #[inline]
     pub fn load_elf(
         proc_vmm: &mut ProcessData,
         vmm: &mut VirtualMemoryManager,
         path: &str,
     ) -> Result<(), ProcessError> {
-        let file_buffer_res = loader::read_executable(&path);
-        if file_buffer_res.is_err() {
-            log::error!("{:?}", file_buffer_res.unwrap_err());
-            return Err(ProcessError::InvalidELF);
-        }
-
-        let file_buffer = file_buffer_res.unwrap();
-        // map this buffer as ELF
-        let buffer_ref = &file_buffer[0..];
-        let elf_result = object::File::parse(buffer_ref);
-
-        if elf_result.is_err() {
-            log::error!("ELF Loader Error {:?}", elf_result.unwrap_err());
+        let exec_info_res = loader::read_executable_headers(&path);
+        if exec_info_res.is_err() {
+            log::error!("{:?}", exec_info_res.unwrap_err());
             return Err(ProcessError::InvalidELF);
         }
 
-        let elf = elf_result.unwrap();
+        let exec_info = exec_info_res.unwrap();
+        let mut areas: Vec<vma::VirtualMemoryArea> = Vec::new();
         let mut total_pages = 0;
+        let mut code_end = 0;
 
-        // map all the segments:
-        for segment in elf.segments() {
+        for segment in exec_info.segments.iter() {
             log::debug!(
-                "{} allocation section={:?} at=0x{:x}, size={}",
+                "{} area at=0x{:x}, size={}, file_size={}",
                 path,
-                segment.name(),
-                segment.address(),
-                segment.size()
+                segment.vaddr,
+                segment.mem_size,
+                segment.file_size
             );
 
-            let section_start = segment.address();
-            let aligned_sec_start =
-                Alignment::align_down(section_start, 4 * MemorySizes::OneKiB as u64);
-            let aligned_size = Alignment::align_up(segment.size(), 4 * MemorySizes::OneKiB as u64);
-
-            let n_pages = aligned_size / (4 * MemorySizes::OneKiB as u64);
-            total_pages = total_pages + n_pages;
-
-            for i in 0..n_pages {
-                // map kernel and user pages
-                let frame = PhysicalMemoryManager::alloc().expect("RAM OOM");
-                let page = Page::from_address(VirtualAddress::from_u64(
-                    aligned_sec_start + (i * 4 * MemorySizes::OneKiB as u64),
-                ));
-                KernelVirtualMemoryManager::pt()
-                    .map_page(page, frame, PageEntryFlags::user_flags())
-                    .expect("Failed to map kernel page while mapping code.");
-                vmm.map_page(page, frame, PageEntryFlags::user_flags())
-                    .expect("Failed to map user page while mapping code");
+            if segment.mem_size == 0 {
+                continue;
             }
 
-            if let Ok(data) = segment.data() {
-                // zero this layout
-                let start_ptr = VirtualAddress::from_u64(aligned_sec_start).get_mut_ptr::<u8>();
-                unsafe {
-                    ptr::write_bytes(
-                        start_ptr,
-                        0,
-                        n_pages as usize * 4 * MemorySizes::OneKiB as usize,
-                    );
-                    // write data
-                    ptr::copy_nonoverlapping(
-                        data.as_ptr(),
-                        start_ptr.add((segment.address() - aligned_sec_start) as usize),
-                        segment.size() as usize,
-                    );
-                }
+            let area = vma::VirtualMemoryArea::from_segment(segment, &exec_info.fd);
+            let (first_page, last_page) = area.page_bounds();
+            total_pages = total_pages + (last_page - first_page) / (4 * MemorySizes::OneKiB as u64);
+            if last_page > code_end {
+                code_end = last_page;
             }
 
-            // unmap kernel entries:
-            for i in 0..n_pages {
-                let page = Page::from_address(VirtualAddress::from_u64(
-                    aligned_sec_start + (i * 4 * MemorySizes::OneKiB as u64),
-                ));
-                KernelVirtualMemoryManager::pt()
-                    .unmap_page(page)
-                    .expect("Failed to unmap mapped kernel pages.");
-            }
+            areas.push(area);
         }
 
-        let entry_addr = elf.entry();
-        proc_vmm.code_entry = VirtualAddress::from_u64(entry_addr);
+        vma::register_areas(vmm.l4_phy_addr, areas);
+
+        proc_vmm.code_entry = VirtualAddress::from_u64(exec_info.entry);
         proc_vmm.code_pages = total_pages;
 
-        // mark the end of heap as 2MiB aligned page
-        let aligned_hugepage_size = Alignment::align_up(
-            total_pages * 4 * MemorySizes::OneKiB as u64,
-            2 * MemorySizes::OneMib as u64,
-        );
+        // heap starts at the 2MiB page after the last segment
+        let aligned_hugepage_size = Alignment::align_up(code_end, 2 * MemorySizes::OneMib as u64);
         proc_vmm.heap_start = VirtualAddress::from_u64(aligned_hugepage_size);
 
         Ok(())
     }
 
+    /// shares the code and heap of the parent with the child copy-on-write,
+    /// each of them keeps it's own page tables.
     #[inline]
     pub fn share_pages(
         parent: &mut ProcessData,
@@ -572,46 +552,37 @@ impl CodeMapper {
             return;
         }
 
-        // map the top level table
-        let code_addr = VirtualAddress::from_u64(USER_CODE_ADDRESS);
-
-        // map the page
-        let l4_index = code_addr.get_level_index(PageTableLevel::Level4);
-        // clone this index:
-        let child_pt: &mut PageTable = unsafe { &mut *child_vmm.l4_virtual_address.get_mut_ptr() };
-        let parent_pt: &PageTable = unsafe { &*parent_vmm.l4_virtual_address.get_ptr() };
-
-        child_pt.entries[l4_index.as_usize()] = parent_pt.entries[l4_index.as_usize()].clone();
-
-        parent.code_ref = parent.code_ref + 1;
-        child.code_ref = parent.code_ref;
+        parent_vmm
+            .clone_cow_range(
+                child_vmm,
+                VirtualAddress::from_u64(USER_VIRT_START),
+                parent.stack_space_start,
+            )
+            .expect("Failed to share code and heap pages with the child");
+        parent_vmm
+            .clone_cow_range(
+                child_vmm,
+                VirtualAddress::from_u64(USER_MMAP_START),
+                VirtualAddress::from_u64(USER_MMAP_END),
+            )
+            .expect("Failed to share mapped pages with the child");
+        vma::clone_areas(parent_vmm.l4_phy_addr, child_vmm.l4_phy_addr);
+
+        child.code_entry = parent.code_entry;
         child.code_pages = parent.code_pages;
-        child.heap_start = child.heap_start;
-        child.heap_pages = child.heap_pages;
+        child.heap_start = parent.heap_start;
+        child.heap_pages = parent.heap_pages;
+        child.heap_alloc_pages = parent.heap_alloc_pages;
+        child.max_heap_pages = parent.max_heap_pages;
     }
 
     #[inline]
     pub fn unmap_code(proc_data: &mut ProcessData, vmm: &mut VirtualMemoryManager) {
-        if proc_data.code_ref > 0 {
-            // this is a shared codebase
-            let l4_index =
-                VirtualAddress::from_u64(USER_CODE_ADDRESS).get_level_index(PageTableLevel::Level4);
-            // reset this entry
-            let child_pt: &mut PageTable = unsafe { &mut *vmm.l4_virtual_address.get_mut_ptr() };
-            child_pt.entries[l4_index.as_usize()].unmap_entry();
-            proc_data.code_pages = 0;
-        } else {
-            // unmap
-            let start = VirtualAddress::from_u64(USER_CODE_ADDRESS);
-            for idx in 0..proc_data.code_pages {
-                let page = Page::from_address(VirtualAddress::from_u64(
-                    start.as_u64() + (idx as u64 * MemorySizes::OneKiB as u64 * 4),
-                ));
-                vmm.unmap_page(page).expect("Failed to unmap code-pages");
-            }
-            proc_data.code_pages = 0;
-            proc_data.code_ref = 0;
-        }
+        // only the pages touched so far are mapped, frames shared with a
+        // parent or child are freed by the last process unmapping them.
+        let areas = vma::remove_areas(vmm.l4_phy_addr);
+        vma::unmap_areas(vmm, &areas);
+        proc_data.code_pages = 0;
     }
 }
 
@@ -655,9 +626,7 @@ impl ProcessFDPool {
     pub fn remove(proc_data: &mut ProcessData, fd_index: usize) -> Result<(), ProcessError> {
         for idx in 0..proc_data.file_descriptors.len() {
             if proc_data.file_descriptors[idx].index == fd_index {
-                let _ = FILESYSTEM
-                    .lock()
-                    .close(&mut proc_data.file_descriptors.get_mut(idx).unwrap().fd);
+                let _ = FILESYSTEM.close(&mut proc_data.file_descriptors.get_mut(idx).unwrap().fd);
                 proc_data.file_descriptors.remove(idx);
                 return Ok(());
             }
@@ -666,12 +635,22 @@ impl ProcessFDPool {
         Err(ProcessError::InvalidFD)
     }
 
+    /// removes the descriptor from the process without closing it.
+    #[inline]
+    pub fn take(proc_data: &mut ProcessData, fd_index: usize) -> Option<FileDescriptor> {
+        for idx in 0..proc_data.file_descriptors.len() {
+            if proc_data.file_descriptors[idx].index == fd_index {
+                return Some(proc_data.file_descriptors.remove(idx).fd);
+            }
+        }
+
+        None
+    }
+
     #[inline]
     pub fn remove_all(proc_data: &mut ProcessData) {
         for idx in 0..proc_data.file_descriptors.len() {
-            let _ = FILESYSTEM
-                .lock()
-                .close(&mut proc_data.file_descriptors.get_mut(idx).unwrap().fd);
+            let _ = FILESYSTEM.close(&mut proc_data.file_descriptors.get_mut(idx).unwrap().fd);
         }
 
         proc_data.file_descriptors.clear();
@@ -680,7 +659,6 @@ impl ProcessFDPool {
 
 pub fn create_default_descriptors(proc_data: &mut ProcessData) {
     let dev_fd = FILESYSTEM
-        .lock()
         .open("/dev/tty", 0)
         .expect("/dev/tty not found on this platform, cannot create process stdout.");
 
@@ -713,11 +691,16 @@ pub fn create_cloned_layout(
         fd_index: 0,
         code_entry: VirtualAddress::from_u64(0),
         code_pages: 0,
-        code_ref: 0,
     };
 
     CodeMapper::share_pages(parent, &mut proc_data, parent_vmm, child_vmm);
     ProcessFDPool::clone(parent, &mut proc_data);
+
+    // the time page is outside the ranges shared above.
+    time_page::map_into(child_vmm);
+    if !time_page::is_mapped_in(child_vmm) {
+        log::error!("Forked child cannot read the time page, clocks will fault.");
+    }
     proc_data
 }
 
@@ -740,9 +723,12 @@ pub fn reset_layout(
     ProcessHeapAllocator::reset(layout, vmm);
     // reset the code:
     CodeMapper::unmap_code(layout, vmm);
+    // the time page is dropped on exit and mapped again for the new code.
+    time_page::unmap_from(vmm);
     // allocate the new code:
     if map_new {
         CodeMapper::load_elf(layout, vmm, path).expect("Failed to load user-code");
+        time_page::map_into(vmm);
     }
     layout.code_entry
 }
@@ -763,7 +749,6 @@ pub fn create_process_layout(path: &str, vmm: &mut VirtualMemoryManager) -> Proc
         fd_index: 0,
         code_entry: VirtualAddress::from_u64(0),
         code_pages: 0,
-        code_ref: 0,
     };
 
     // create the code segment
@@ -772,6 +757,8 @@ pub fn create_process_layout(path: &str, vmm: &mut VirtualMemoryManager) -> Proc
         panic!("Failed to allocate code for the process.");
     }
 
+    time_page::map_into(vmm);
+
     let max_heap_size = stack_space_start.as_u64() - proc_data.heap_start.as_u64();
     let max_heap_pages = if USE_HUGEPAGE_HEAP {
         max_heap_size / (4 * MemorySizes::OneMib as u64)
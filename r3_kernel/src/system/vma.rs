@@ -0,0 +1,669 @@
+extern crate alloc;
+extern crate bitflags;
+extern crate log;
+extern crate spin;
+
+use crate::cpu::mmu;
+use crate::mm::paging::{KernelVirtualMemoryManager, Page, PageEntryFlags, VirtualMemoryManager};
+use crate::mm::phy::{Frame, PhysicalMemoryManager};
+use crate::mm::{p_to_v, Alignment, MemorySizes, PhysicalAddress, VirtualAddress};
+use crate::system::filesystem::FileDescriptor;
+use crate::system::loader;
+use crate::system::page_cache::{self, CacheObject, SharedMemoryObject};
+use crate::system::utils::{USER_MMAP_END, USER_MMAP_START};
+
+use alloc::{collections::BTreeMap, sync::Arc, vec::Vec};
+use bitflags::bitflags;
+use core::ptr;
+use lazy_static::lazy_static;
+use spin::Mutex;
+
+const PAGE_SIZE: u64 = 4 * MemorySizes::OneKiB as u64;
+
+bitflags! {
+    pub struct VMAFlags: u32 {
+        const READ = 1;
+        const WRITE = 1 << 1;
+        const EXEC = 1 << 2;
+    }
+}
+
+/// A range of user virtual memory. The first `file_size` bytes come from the
+/// backing file at `file_offset` and are mapped when the area is created,
+/// the rest of the area is zero filled and mapped on first access.
+#[derive(Debug, Clone)]
+pub struct VirtualMemoryArea {
+    pub start: u64,
+    pub end: u64,
+    pub file_offset: u64,
+    pub file_size: u64,
+    pub flags: VMAFlags,
+    pub backing: Option<FileDescriptor>,
+    /// writes are seen by every mapping of the pages, MAP_SHARED.
+    pub shared: bool,
+    /// pages of a shared anonymous area
+    pub shared_object: Option<Arc<SharedMemoryObject>>,
+}
+
+impl VirtualMemoryArea {
+    #[inline]
+    pub fn from_segment(segment: &loader::ProgramSegment, fd: &FileDescriptor) -> Self {
+        let mut flags = VMAFlags::empty();
+        if segment.flags & loader::ELF_PF_R != 0 {
+            flags.insert(VMAFlags::READ);
+        }
+        if segment.flags & loader::ELF_PF_W != 0 {
+            flags.insert(VMAFlags::WRITE);
+        }
+        if segment.flags & loader::ELF_PF_X != 0 {
+            flags.insert(VMAFlags::EXEC);
+        }
+
+        VirtualMemoryArea {
+            start: segment.vaddr,
+            end: segment.vaddr + segment.mem_size,
+            file_offset: segment.file_offset,
+            file_size: segment.file_size,
+            flags,
+            backing: if segment.file_size > 0 {
+                Some(fd.clone())
+            } else {
+                None
+            },
+            shared: false,
+            shared_object: None,
+        }
+    }
+
+    /// a zero filled area of `length` bytes, placed by `place_area`.
+    #[inline]
+    pub fn anonymous(length: u64, flags: VMAFlags, shared: bool) -> Self {
+        VirtualMemoryArea {
+            start: 0,
+            end: length,
+            file_offset: 0,
+            file_size: 0,
+            flags,
+            backing: None,
+            shared,
+            shared_object: if shared {
+                Some(Arc::new(SharedMemoryObject::new()))
+            } else {
+                None
+            },
+        }
+    }
+
+    /// an area of `length` bytes mapping the file from `file_offset`, the part
+    /// past the end of the file reads as zeroes. Placed by `place_area`.
+    #[inline]
+    pub fn from_file(
+        fd: &FileDescriptor,
+        file_offset: u64,
+        file_size: u64,
+        length: u64,
+        flags: VMAFlags,
+        shared: bool,
+    ) -> Self {
+        VirtualMemoryArea {
+            start: 0,
+            end: length,
+            file_offset,
+            file_size: file_size.min(length),
+            flags,
+            backing: Some(fd.clone()),
+            shared,
+            shared_object: None,
+        }
+    }
+
+    #[inline]
+    pub fn overlaps(&self, start: u64, end: u64) -> bool {
+        self.start < end && self.end > start
+    }
+
+    /// first and last+1 page addresses covered by the area
+    #[inline]
+    pub fn page_bounds(&self) -> (u64, u64) {
+        (
+            Alignment::align_down(self.start, PAGE_SIZE),
+            Alignment::align_up(self.end, PAGE_SIZE),
+        )
+    }
+
+    /// true if some of the page at `page_start` comes from the backing file.
+    #[inline]
+    fn has_file_data(&self, page_start: u64) -> bool {
+        self.backing.is_some()
+            && page_start < self.start + self.file_size
+            && page_start + PAGE_SIZE > self.start
+    }
+
+    /// copies the file backed part of the area that falls in the page
+    /// at `page_start` into the page mapped at `dest`.
+    fn fill_page(&mut self, page_start: u64, dest: *mut u8) -> Result<(), loader::LoadError> {
+        let file_end = self.start + self.file_size;
+        let copy_start = page_start.max(self.start);
+        let copy_end = (page_start + PAGE_SIZE).min(file_end);
+
+        if copy_start >= copy_end || self.backing.is_none() {
+            return Ok(());
+        }
+
+        let buffer = unsafe {
+            &mut *ptr::slice_from_raw_parts_mut(
+                dest.add((copy_start - page_start) as usize),
+                (copy_end - copy_start) as usize,
+            )
+        };
+
+        let file_offset = self.file_offset + (copy_start - self.start);
+        let read_res =
+            loader::read_file_at(self.backing.as_mut().unwrap(), file_offset as usize, buffer);
+
+        if read_res.is_err() {
+            return Err(read_res.unwrap_err());
+        }
+
+        Ok(())
+    }
+
+    /// the part of the area in [start, end), the file offsets are moved along.
+    fn slice(&self, start: u64, end: u64) -> Self {
+        let mut part = self.clone();
+        part.start = start.max(self.start);
+        part.end = end.min(self.end);
+
+        let skipped = part.start - self.start;
+        part.file_offset = self.file_offset + skipped;
+        part.file_size = self
+            .file_size
+            .saturating_sub(skipped)
+            .min(part.end - part.start);
+        part
+    }
+
+    /// the cache object and page number of the page at `page_start`, if the
+    /// page can be mapped straight from the page cache. That is the case for
+    /// shared anonymous areas, and for file pages that are page aligned in
+    /// the file and fully inside the file backed part of the area.
+    fn cached_page(&self, page_start: u64) -> Option<(CacheObject, u64)> {
+        if page_start < self.start || page_start + PAGE_SIZE > self.end {
+            return None;
+        }
+
+        if let Some(shared_object) = &self.shared_object {
+            return Some((
+                shared_object.object(),
+                (page_start - self.start) / PAGE_SIZE,
+            ));
+        }
+
+        if self.backing.is_none() || page_start + PAGE_SIZE > self.start + self.file_size {
+            return None;
+        }
+
+        let file_position = self.file_offset + (page_start - self.start);
+        if file_position % PAGE_SIZE != 0 {
+            return None;
+        }
+
+        let object_opt = CacheObject::from_fd(self.backing.as_ref().unwrap());
+        if object_opt.is_none() {
+            return None;
+        }
+
+        Some((object_opt.unwrap(), file_position / PAGE_SIZE))
+    }
+}
+
+lazy_static! {
+    /// areas of every user address space, keyed by the physical address of
+    /// it's root page table. These are kept out of the process pool because
+    /// faults are taken while system calls hold the pool lock.
+    static ref VMA_TABLE: Mutex<BTreeMap<u64, Vec<VirtualMemoryArea>>> =
+        Mutex::new(BTreeMap::new());
+}
+
+/// adds the areas to the address space with root table at `pt_root`
+pub fn register_areas(pt_root: PhysicalAddress, areas: Vec<VirtualMemoryArea>) {
+    let mut vma_table = VMA_TABLE.lock();
+    let space_areas = vma_table.entry(pt_root.as_u64()).or_insert(Vec::new());
+    space_areas.extend(areas);
+}
+
+/// removes and returns all the areas of the address space
+pub fn remove_areas(pt_root: PhysicalAddress) -> Vec<VirtualMemoryArea> {
+    VMA_TABLE
+        .lock()
+        .remove(&pt_root.as_u64())
+        .unwrap_or(Vec::new())
+}
+
+/// the child inherits the areas of the parent, so the pages the parent never
+/// touched are faulted in from the same files.
+pub fn clone_areas(parent_root: PhysicalAddress, child_root: PhysicalAddress) {
+    let mut vma_table = VMA_TABLE.lock();
+    let parent_areas_opt = vma_table.get(&parent_root.as_u64());
+    if parent_areas_opt.is_none() {
+        return;
+    }
+
+    let child_areas = parent_areas_opt.unwrap().clone();
+    vma_table.insert(child_root.as_u64(), child_areas);
+}
+
+/// maps the page containing `addr` if it belongs to an area of the current
+/// address space. This runs in the page fault handler with interrupts off, so
+/// it only maps zero filled pages, which need no I/O. Pages with file data
+/// are left to `resolve_file_fault`. Returns false if `addr` is not covered
+/// by any zero filled area.
+pub fn resolve_demand_fault(addr: VirtualAddress) -> bool {
+    let (vmm, pt_root) = KernelVirtualMemoryManager::current_vmm();
+    let page_start = Alignment::align_down(addr.as_u64(), PAGE_SIZE);
+    let page_end = page_start + PAGE_SIZE;
+
+    // consecutive segments can share a page, all of them contribute to it:
+    let mut n_areas = 0;
+    let mut accessible = false;
+    let mut writable = false;
+    let mut shared_area: Option<VirtualMemoryArea> = None;
+    {
+        let vma_table = VMA_TABLE.lock();
+        let space_areas_opt = vma_table.get(&pt_root.as_u64());
+        if space_areas_opt.is_none() {
+            return false;
+        }
+
+        for area in space_areas_opt.unwrap().iter() {
+            if !area.overlaps(page_start, page_end) {
+                continue;
+            }
+
+            if area.has_file_data(page_start) {
+                return false;
+            }
+
+            n_areas += 1;
+            // PROT_NONE areas are reserved, but never mapped.
+            accessible = accessible || !area.flags.is_empty();
+            writable = writable || area.flags.contains(VMAFlags::WRITE);
+            if area.shared_object.is_some() {
+                // has no backing file, cloning it does not allocate.
+                shared_area = Some(area.clone());
+            }
+        }
+    }
+
+    if n_areas == 0 || !accessible {
+        return false;
+    }
+
+    if n_areas == 1 && shared_area.is_some() {
+        let mut area = shared_area.unwrap();
+        if let Some((object, page_no)) = area.cached_page(page_start) {
+            return map_cached_page(&vmm, &mut area, page_start, object, page_no);
+        }
+    }
+
+    let frame_opt = PhysicalMemoryManager::alloc();
+    if frame_opt.is_none() {
+        return false;
+    }
+
+    let frame = frame_opt.unwrap();
+    let frame_ptr = p_to_v(frame.addr()).get_mut_ptr::<u8>();
+    unsafe {
+        ptr::write_bytes(frame_ptr, 0, PAGE_SIZE as usize);
+    }
+
+    let mut flags = PageEntryFlags::user_flags();
+    if !writable {
+        flags.remove(PageEntryFlags::READ_WRITE);
+    }
+
+    let map_result = vmm.map_page(
+        Page::from_address(VirtualAddress::from_u64(page_start)),
+        frame,
+        flags,
+    );
+
+    if map_result.is_err() {
+        // someone else mapped it meanwhile
+        PhysicalMemoryManager::free(frame);
+    }
+
+    true
+}
+
+/// maps the page containing `addr` from the backing file of it's area, called
+/// by the page fault handler for faults from user mode with interrupts on.
+/// Page aligned file pages are shared through the page cache.
+pub fn resolve_file_fault(addr: VirtualAddress) -> bool {
+    let (vmm, pt_root) = KernelVirtualMemoryManager::current_vmm();
+    load_page(
+        &vmm,
+        pt_root,
+        Alignment::align_down(addr.as_u64(), PAGE_SIZE),
+    )
+}
+
+/// maps the page at `page_start` if it belongs to an area of the address
+/// space, reading it's file part from the backing file. This may wait for
+/// the disk, so it is only called with interrupts on.
+fn load_page(vmm: &VirtualMemoryManager, pt_root: PhysicalAddress, page_start: u64) -> bool {
+    let page_end = page_start + PAGE_SIZE;
+
+    // consecutive segments can share a page, all of them contribute to it:
+    let mut areas: Vec<VirtualMemoryArea> = Vec::new();
+    {
+        let vma_table = VMA_TABLE.lock();
+        let space_areas_opt = vma_table.get(&pt_root.as_u64());
+        if space_areas_opt.is_none() {
+            return false;
+        }
+
+        for area in space_areas_opt.unwrap().iter() {
+            if area.overlaps(page_start, page_end) {
+                areas.push(area.clone());
+            }
+        }
+    }
+
+    if areas.is_empty() {
+        return false;
+    }
+
+    // PROT_NONE areas are reserved, but never mapped.
+    if areas.iter().all(|area| area.flags.is_empty()) {
+        return false;
+    }
+
+    if areas.len() == 1 {
+        if let Some((object, page_no)) = areas[0].cached_page(page_start) {
+            return map_cached_page(vmm, &mut areas[0], page_start, object, page_no);
+        }
+    }
+
+    let frame_opt = PhysicalMemoryManager::alloc();
+    if frame_opt.is_none() {
+        log::error!("Out of memory while paging in address 0x{:x}", page_start);
+        return false;
+    }
+
+    let frame = frame_opt.unwrap();
+    let frame_ptr = p_to_v(frame.addr()).get_mut_ptr::<u8>();
+
+    let mut flags = PageEntryFlags::user_flags();
+    flags.remove(PageEntryFlags::READ_WRITE);
+
+    unsafe {
+        ptr::write_bytes(frame_ptr, 0, PAGE_SIZE as usize);
+    }
+
+    for area in areas.iter_mut() {
+        if area.fill_page(page_start, frame_ptr).is_err() {
+            log::error!(
+                "Failed to read the page at 0x{:x} from the backing file",
+                page_start
+            );
+            PhysicalMemoryManager::free(frame);
+            return false;
+        }
+
+        if area.flags.contains(VMAFlags::WRITE) {
+            flags.insert(PageEntryFlags::READ_WRITE);
+        }
+    }
+
+    let map_result = vmm.map_page(
+        Page::from_address(VirtualAddress::from_u64(page_start)),
+        frame,
+        flags,
+    );
+
+    if map_result.is_err() {
+        // someone else mapped it meanwhile
+        PhysicalMemoryManager::free(frame);
+    }
+
+    true
+}
+
+/// maps the page from the page cache, private writable pages are mapped
+/// copy-on-write so the first write makes a copy.
+fn map_cached_page(
+    vmm: &VirtualMemoryManager,
+    area: &mut VirtualMemoryArea,
+    page_start: u64,
+    object: CacheObject,
+    page_no: u64,
+) -> bool {
+    let file_offset = area.file_offset + (page_start - area.start);
+    let backing = &mut area.backing;
+    let frame_opt: Option<Frame> = page_cache::get_page(&object, page_no, |dest| {
+        if backing.is_none() {
+            return true;
+        }
+
+        let buffer = unsafe { &mut *ptr::slice_from_raw_parts_mut(dest, PAGE_SIZE as usize) };
+        let read_res =
+            loader::read_file_at(backing.as_mut().unwrap(), file_offset as usize, buffer);
+        read_res.is_ok()
+    });
+
+    if frame_opt.is_none() {
+        log::error!(
+            "Failed to get the page at 0x{:x} from the page cache",
+            page_start
+        );
+        return false;
+    }
+
+    let frame = frame_opt.unwrap();
+    let mut flags = PageEntryFlags::user_flags();
+    flags.remove(PageEntryFlags::READ_WRITE);
+
+    if area.shared {
+        flags.insert(PageEntryFlags::SHARED);
+        if area.flags.contains(VMAFlags::WRITE) {
+            flags.insert(PageEntryFlags::READ_WRITE);
+        }
+    } else if area.flags.contains(VMAFlags::WRITE) {
+        flags.insert(PageEntryFlags::COPY_ON_WRITE);
+    }
+
+    let map_result = vmm.map_page(
+        Page::from_address(VirtualAddress::from_u64(page_start)),
+        frame,
+        flags,
+    );
+
+    if map_result.is_err() {
+        // someone else mapped it meanwhile, drop the reference taken for it.
+        PhysicalMemoryManager::unshare(frame);
+    }
+
+    true
+}
+
+/// true if [start, start + length) lies in the mmap window.
+#[inline]
+pub fn is_in_mmap_window(start: u64, length: u64) -> bool {
+    start >= USER_MMAP_START
+        && start
+            .checked_add(length)
+            .map_or(false, |end| end <= USER_MMAP_END)
+}
+
+/// true if the range is in the mmap window and no area has a page in it.
+#[inline]
+fn is_range_free(space_areas: &Vec<VirtualMemoryArea>, start: u64, length: u64) -> bool {
+    is_in_mmap_window(start, length)
+        && !space_areas.iter().any(|other| {
+            let (first_page, last_page) = other.page_bounds();
+            first_page < start + length && last_page > start
+        })
+}
+
+/// places the area at exactly `start`, fails if the range there is taken.
+pub fn place_area_at(pt_root: PhysicalAddress, mut area: VirtualMemoryArea, start: u64) -> bool {
+    let length = area.end - area.start;
+    let mut vma_table = VMA_TABLE.lock();
+    let space_areas = vma_table.entry(pt_root.as_u64()).or_insert(Vec::new());
+    if !is_range_free(space_areas, start, length) {
+        return false;
+    }
+
+    area.start = start;
+    area.end = start + length;
+    space_areas.push(area);
+    true
+}
+
+/// places the area at `hint` if the range there is free, otherwise at the first
+/// free range of the mmap window. The area keeps it's length, returns it's start.
+pub fn place_area(
+    pt_root: PhysicalAddress,
+    mut area: VirtualMemoryArea,
+    hint: Option<u64>,
+) -> Option<u64> {
+    let length = area.end - area.start;
+    let mut vma_table = VMA_TABLE.lock();
+    let space_areas = vma_table.entry(pt_root.as_u64()).or_insert(Vec::new());
+
+    let start = if hint.is_some() && is_range_free(space_areas, hint.unwrap(), length) {
+        hint.unwrap()
+    } else {
+        let mut taken: Vec<(u64, u64)> = space_areas
+            .iter()
+            .map(|other| other.page_bounds())
+            .filter(|&(_, last_page)| last_page > USER_MMAP_START)
+            .collect();
+        taken.sort();
+
+        let mut candidate = USER_MMAP_START;
+        for (first_page, last_page) in taken {
+            if candidate + length <= first_page {
+                break;
+            }
+            candidate = candidate.max(last_page);
+        }
+
+        if candidate + length > USER_MMAP_END {
+            return None;
+        }
+        candidate
+    };
+
+    area.start = start;
+    area.end = start + length;
+    space_areas.push(area);
+    Some(start)
+}
+
+/// unmaps the pages mapped in `areas` and frees their frames, the TLBs are
+/// shot down once for all of them instead of once for every page.
+pub fn unmap_areas(vmm: &VirtualMemoryManager, areas: &[VirtualMemoryArea]) {
+    let mut unmapped: Vec<(Frame, bool)> = Vec::new();
+    for area in areas.iter() {
+        let (first_page, last_page) = area.page_bounds();
+        let mut current = first_page;
+        while current < last_page {
+            let page_addr = VirtualAddress::from_u64(current);
+            if vmm.translate_to_frame(&page_addr).is_some() {
+                if let Ok(frame) = vmm.unmap_page_deferred(Page::from_address(page_addr)) {
+                    unmapped.push(frame);
+                }
+            }
+            current += PAGE_SIZE;
+        }
+    }
+
+    if unmapped.is_empty() {
+        return;
+    }
+
+    // the frames can still be reached through the TLBs until this.
+    mmu::shootdown_tlb();
+    for (frame, is_huge) in unmapped {
+        VirtualMemoryManager::free_unmapped_frame(frame, is_huge);
+    }
+}
+
+/// removes [start, end) from the areas of the address space and unmaps the pages
+/// mapped in it, areas partly in the range are cut.
+pub fn unmap_range(vmm: &VirtualMemoryManager, pt_root: PhysicalAddress, start: u64, end: u64) {
+    let mut removed: Vec<VirtualMemoryArea> = Vec::new();
+    {
+        let mut vma_table = VMA_TABLE.lock();
+        let space_areas_opt = vma_table.get_mut(&pt_root.as_u64());
+        if space_areas_opt.is_none() {
+            return;
+        }
+
+        let space_areas = space_areas_opt.unwrap();
+        let mut kept: Vec<VirtualMemoryArea> = Vec::new();
+        for area in space_areas.drain(..) {
+            if !area.overlaps(start, end) {
+                kept.push(area);
+                continue;
+            }
+
+            if area.start < start {
+                kept.push(area.slice(area.start, start));
+            }
+            if area.end > end {
+                kept.push(area.slice(end, area.end));
+            }
+            removed.push(area.slice(start, end));
+        }
+
+        *space_areas = kept;
+    }
+
+    unmap_areas(vmm, &removed);
+
+    // shared objects of the removed areas are released only after
+    // their pages are unmapped.
+    drop(removed);
+}
+
+/// faults in the pages of the user buffer that are not mapped yet, system
+/// calls do this before taking the locks that the page-in path needs.
+pub fn prefault_range(addr: VirtualAddress, size: usize) {
+    let (vmm, pt_root) = KernelVirtualMemoryManager::current_vmm();
+    let start = addr.as_u64();
+    let end = start.saturating_add(size as u64);
+
+    // only the parts of the buffer covered by areas can be paged in:
+    let mut ranges: Vec<(u64, u64)> = Vec::new();
+    {
+        let vma_table = VMA_TABLE.lock();
+        let space_areas_opt = vma_table.get(&pt_root.as_u64());
+        if space_areas_opt.is_none() {
+            return;
+        }
+
+        for area in space_areas_opt.unwrap().iter() {
+            if area.overlaps(start, end) {
+                let (first_page, last_page) = area.page_bounds();
+                ranges.push((
+                    first_page.max(Alignment::align_down(start, PAGE_SIZE)),
+                    last_page.min(end),
+                ));
+            }
+        }
+    }
+
+    for (range_start, range_end) in ranges {
+        let mut current = range_start;
+        while current < range_end {
+            let page_addr = VirtualAddress::from_u64(current);
+            if vmm.translate_to_frame(&page_addr).is_none() {
+                load_page(&vmm, pt_root, current);
+            }
+            current += PAGE_SIZE;
+        }
+    }
+}
@@ -5,6 +5,7 @@ use core::fmt::Write;
 use core::str;
 use userspace_rs::library;
 
+use library::profiler::{clear_profile, dump_profile, start_profiler, stop_profiler};
 use library::utils::{
     get_uname, read_stdin, str_from_c_like_buffer, power_off_machine,
     lstat,
@@ -62,6 +63,30 @@ fn sizeof(arg_str: &str) {
     }
 }
 
+/// `prof start [rate]`, `prof stop`, `prof clear` or `prof dump`. Samples
+/// taken while dumping are not part of the dump, stop the profiler first.
+fn prof(arg_str: &str) {
+    let mut args = arg_str.split_whitespace();
+    match args.next() {
+        Some("start") => {
+            let rate = args.next().and_then(|rate| rate.parse::<usize>().ok());
+            start_profiler(rate.unwrap_or(0));
+        }
+        Some("stop") => {
+            stop_profiler();
+        }
+        Some("clear") => {
+            clear_profile();
+        }
+        Some("dump") => {
+            dump_profile();
+        }
+        _ => {
+            println!("usage: prof start [rate] | stop | clear | dump");
+        }
+    }
+}
+
 #[inline(always)]
 fn get_string_view(buffer: &[u8], length: usize) -> &str {
     if let Ok(string) = str::from_utf8(&buffer[0..length]) {
@@ -94,6 +119,9 @@ fn exec_command(string: &str) {
         "sizeof" => {
             sizeof(&remaining_str);
         }
+        "prof" => {
+            prof(&remaining_str);
+        }
         _ => {
             println!("unknown command {}", command_str);
         }
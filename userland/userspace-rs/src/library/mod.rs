@@ -1,3 +1,5 @@
+pub mod profiler;
 pub mod syscalls;
+pub mod time;
 pub mod types;
 pub mod utils;
\ No newline at end of file
@@ -0,0 +1,57 @@
+use crate::library;
+
+use library::syscalls;
+use library::utils::write_stdout;
+
+/// ioctl commands of `/dev/profile`, the same as the kernel's.
+pub const PROFILE_IOCTL_START: usize = 1;
+pub const PROFILE_IOCTL_STOP: usize = 2;
+pub const PROFILE_IOCTL_CLEAR: usize = 3;
+
+const PROFILE_DEVICE: &[u8] = b"/dev/profile\0";
+
+fn with_profile_device<F>(func: F) -> usize
+where
+    F: FnOnce(usize) -> usize,
+{
+    let fd = unsafe { syscalls::sys_open(PROFILE_DEVICE, 0) };
+    let result = func(fd);
+    unsafe {
+        syscalls::sys_close(fd);
+    }
+
+    result
+}
+
+/// starts sampling at `rate` samples per second, 0 takes the kernel's default.
+pub fn start_profiler(rate: usize) -> usize {
+    with_profile_device(|fd| unsafe { syscalls::sys_ioctl(fd, PROFILE_IOCTL_START, rate) })
+}
+
+pub fn stop_profiler() -> usize {
+    with_profile_device(|fd| unsafe { syscalls::sys_ioctl(fd, PROFILE_IOCTL_STOP, 0) })
+}
+
+pub fn clear_profile() -> usize {
+    with_profile_device(|fd| unsafe { syscalls::sys_ioctl(fd, PROFILE_IOCTL_CLEAR, 0) })
+}
+
+/// writes the samples to stdout, one per line as
+/// `cpu tsc pid cr3 k|u rip callers..`, returns the bytes written.
+pub fn dump_profile() -> usize {
+    with_profile_device(|fd| {
+        let mut buffer: [u8; 1024] = [0; 1024];
+        let mut total = 0;
+        loop {
+            let length = unsafe { syscalls::sys_read(fd, &mut buffer, 1024) };
+            if length == 0 || length > buffer.len() {
+                break;
+            }
+
+            write_stdout(&buffer, length);
+            total += length;
+        }
+
+        total
+    })
+}
@@ -1,20 +1,42 @@
-use crate::library::types::{UTSName, FStatInfo};
+use crate::library::types::{UTSName, FStatInfo, IOVec, IORing, SockAddrIn, EpollEvent};
 
 pub enum SyscallNumbers {
     Read = 0,
     Write = 1,
+    Open = 2,
+    Close = 3,
     LStat = 6,
+    Mmap = 14,
+    Munmap = 15,
+    Ioctl = 16,
+    Pread = 17,
+    Pwrite = 18,
+    Readv = 19,
+    Writev = 20,
+    Socket = 41,
+    SendTo = 44,
+    RecvFrom = 45,
     Shutdown = 48,
+    Bind = 50,
     Uname = 63,
+    EpollCreate = 213,
+    EpollWait = 232,
+    EpollCtl = 233,
+    IORingEnter = 426,
 }
 
+// syscalls enter the kernel with the `syscall` instruction, it returns the
+// user rip in rcx and rflags in r11. `int 0x80` is still served by the kernel.
+
 #[inline(always)]
 unsafe fn syscall_0(sys_no: usize) -> usize {
     let syscall_result: usize;
     asm!(
-        "int 0x80",
+        "syscall",
         in("rax") sys_no,
-        lateout("rax") syscall_result
+        lateout("rax") syscall_result,
+        out("rcx") _,
+        out("r11") _,
     );
 
     syscall_result
@@ -24,10 +46,12 @@ unsafe fn syscall_0(sys_no: usize) -> usize {
 unsafe fn syscall_1(arg0: usize, sys_no: usize) -> usize {
     let syscall_result: usize;
     asm!(
-        "int 0x80",
+        "syscall",
         in("rax") sys_no,
         in("rdi") arg0,
-        lateout("rax") syscall_result
+        lateout("rax") syscall_result,
+        out("rcx") _,
+        out("r11") _,
     );
 
     syscall_result
@@ -37,11 +61,13 @@ unsafe fn syscall_1(arg0: usize, sys_no: usize) -> usize {
 unsafe fn syscall_2(arg0: usize, arg1: usize, sys_no: usize) -> usize {
     let syscall_result: usize;
     asm!(
-        "int 0x80",
+        "syscall",
         in("rax") sys_no,
         in("rdi") arg0,
         in("rsi") arg1,
         lateout("rax") syscall_result,
+        out("rcx") _,
+        out("r11") _,
     );
 
     syscall_result
@@ -51,12 +77,60 @@ unsafe fn syscall_2(arg0: usize, arg1: usize, sys_no: usize) -> usize {
 unsafe fn syscall_3(arg0: usize, arg1: usize, arg2: usize, sys_no: usize) -> usize {
     let syscall_result : usize;
     asm!(
-        "int 0x80",
+        "syscall",
+        in("rax") sys_no,
+        in("rdi") arg0,
+        in("rsi") arg1,
+        in("rdx") arg2,
+        lateout("rax") syscall_result,
+        out("rcx") _,
+        out("r11") _,
+    );
+
+    syscall_result
+}
+
+#[inline(always)]
+unsafe fn syscall_4(arg0: usize, arg1: usize, arg2: usize, arg3: usize, sys_no: usize) -> usize {
+    let syscall_result: usize;
+    asm!(
+        "syscall",
+        in("rax") sys_no,
+        in("rdi") arg0,
+        in("rsi") arg1,
+        in("rdx") arg2,
+        in("r10") arg3,
+        lateout("rax") syscall_result,
+        out("rcx") _,
+        out("r11") _,
+    );
+
+    syscall_result
+}
+
+#[inline(always)]
+unsafe fn syscall_6(
+    arg0: usize,
+    arg1: usize,
+    arg2: usize,
+    arg3: usize,
+    arg4: usize,
+    arg5: usize,
+    sys_no: usize,
+) -> usize {
+    let syscall_result: usize;
+    asm!(
+        "syscall",
         in("rax") sys_no,
         in("rdi") arg0,
         in("rsi") arg1,
         in("rdx") arg2,
-        lateout("rax") syscall_result
+        in("r10") arg3,
+        in("r8") arg4,
+        in("r9") arg5,
+        lateout("rax") syscall_result,
+        out("rcx") _,
+        out("r11") _,
     );
 
     syscall_result
@@ -72,6 +146,20 @@ pub unsafe fn sys_read(fd: usize, buffer: &mut [u8], size: usize) -> usize {
     syscall_3(fd, addr, size, SyscallNumbers::Read as usize)
 }
 
+/// `path` must end with a nul byte.
+pub unsafe fn sys_open(path: &[u8], flags: usize) -> usize {
+    let path_addr = path.as_ptr() as usize;
+    syscall_2(path_addr, flags, SyscallNumbers::Open as usize)
+}
+
+pub unsafe fn sys_close(fd: usize) -> usize {
+    syscall_1(fd, SyscallNumbers::Close as usize)
+}
+
+pub unsafe fn sys_ioctl(fd: usize, command: usize, arg: usize) -> usize {
+    syscall_3(fd, command, arg, SyscallNumbers::Ioctl as usize)
+}
+
 pub unsafe fn sys_uname(uts: &mut UTSName) -> usize {
     let addr = (uts as *const _) as usize;
     syscall_1(addr, SyscallNumbers::Uname as usize)
@@ -86,4 +174,107 @@ pub unsafe fn sys_lstat(path: &str, stat: &mut FStatInfo) -> usize {
     let stat_addr = (stat as *const _) as usize;
 
     syscall_2(path_addr, stat_addr, SyscallNumbers::LStat as usize)
-}
\ No newline at end of file
+}
+
+pub unsafe fn sys_mmap(
+    addr: usize,
+    length: usize,
+    prot: usize,
+    flags: usize,
+    fd: usize,
+    offset: usize,
+) -> usize {
+    syscall_6(addr, length, prot, flags, fd, offset, SyscallNumbers::Mmap as usize)
+}
+
+pub unsafe fn sys_munmap(addr: usize, length: usize) -> usize {
+    syscall_2(addr, length, SyscallNumbers::Munmap as usize)
+}
+
+pub unsafe fn sys_pread(fd: usize, buffer: &mut [u8], size: usize, offset: usize) -> usize {
+    let addr = buffer.as_ptr() as usize;
+    syscall_4(fd, addr, size, offset, SyscallNumbers::Pread as usize)
+}
+
+pub unsafe fn sys_pwrite(fd: usize, buffer: &[u8], size: usize, offset: usize) -> usize {
+    let addr = buffer.as_ptr() as usize;
+    syscall_4(fd, addr, size, offset, SyscallNumbers::Pwrite as usize)
+}
+
+pub unsafe fn sys_readv(fd: usize, iovecs: &[IOVec]) -> usize {
+    let addr = iovecs.as_ptr() as usize;
+    syscall_3(fd, addr, iovecs.len(), SyscallNumbers::Readv as usize)
+}
+
+pub unsafe fn sys_writev(fd: usize, iovecs: &[IOVec]) -> usize {
+    let addr = iovecs.as_ptr() as usize;
+    syscall_3(fd, addr, iovecs.len(), SyscallNumbers::Writev as usize)
+}
+
+/// runs up to `to_submit` queued submissions of the ring, returns how many
+/// were consumed. Their completions are posted to the ring.
+pub unsafe fn sys_io_ring_enter(ring: &mut IORing, to_submit: usize) -> usize {
+    let addr = (ring as *mut _) as usize;
+    syscall_2(addr, to_submit, SyscallNumbers::IORingEnter as usize)
+}
+
+pub unsafe fn sys_socket(domain: usize, sock_type: usize, protocol: usize) -> usize {
+    syscall_3(domain, sock_type, protocol, SyscallNumbers::Socket as usize)
+}
+
+pub unsafe fn sys_bind(fd: usize, addr: &SockAddrIn) -> usize {
+    let addr_ptr = (addr as *const _) as usize;
+    let addr_len = core::mem::size_of::<SockAddrIn>();
+    syscall_3(fd, addr_ptr, addr_len, SyscallNumbers::Bind as usize)
+}
+
+pub unsafe fn sys_sendto(fd: usize, buffer: &[u8], flags: usize, dest: &SockAddrIn) -> usize {
+    let dest_ptr = (dest as *const _) as usize;
+    let dest_len = core::mem::size_of::<SockAddrIn>();
+    syscall_6(
+        fd,
+        buffer.as_ptr() as usize,
+        buffer.len(),
+        flags,
+        dest_ptr,
+        dest_len,
+        SyscallNumbers::SendTo as usize,
+    )
+}
+
+/// receives one datagram, the sender is written to `src`.
+pub unsafe fn sys_recvfrom(fd: usize, buffer: &mut [u8], flags: usize, src: &mut SockAddrIn) -> usize {
+    let src_ptr = (src as *mut _) as usize;
+    let mut src_len: u32 = core::mem::size_of::<SockAddrIn>() as u32;
+    syscall_6(
+        fd,
+        buffer.as_mut_ptr() as usize,
+        buffer.len(),
+        flags,
+        src_ptr,
+        (&mut src_len as *mut u32) as usize,
+        SyscallNumbers::RecvFrom as usize,
+    )
+}
+
+pub unsafe fn sys_epoll_create() -> usize {
+    syscall_1(1, SyscallNumbers::EpollCreate as usize)
+}
+
+pub unsafe fn sys_epoll_ctl(epfd: usize, op: usize, fd: usize, event: &EpollEvent) -> usize {
+    let event_ptr = (event as *const _) as usize;
+    syscall_4(epfd, op, fd, event_ptr, SyscallNumbers::EpollCtl as usize)
+}
+
+/// waits for the watched descriptors, a negative `timeout_ms` waits forever.
+/// Returns the number of entries of `events` filled.
+pub unsafe fn sys_epoll_wait(epfd: usize, events: &mut [EpollEvent], timeout_ms: isize) -> usize {
+    let events_ptr = events.as_mut_ptr() as usize;
+    syscall_4(
+        epfd,
+        events_ptr,
+        events.len(),
+        timeout_ms as usize,
+        SyscallNumbers::EpollWait as usize,
+    )
+}
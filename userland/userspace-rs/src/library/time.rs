@@ -0,0 +1,93 @@
+use core::ptr;
+use core::sync::atomic::{fence, Ordering};
+
+/// the kernel maps it's clock page read-only at this address in every process.
+const TIME_PAGE_ADDRESS: usize = 0x600000000000;
+
+const NS_PER_SECOND: u64 = 1000000000;
+
+/// same layout as the kernel writes it.
+#[repr(C)]
+struct TimePageData {
+    sequence: u64,
+    tsc_frequency: u64,
+    tsc_origin: u64,
+    epoch_offset_ns: u64,
+}
+
+#[inline(always)]
+fn rdtsc() -> u64 {
+    let (high, low): (u32, u32);
+    unsafe {
+        asm!(
+            "rdtsc",
+            out("edx") high,
+            out("eax") low,
+            options(nomem, nostack)
+        );
+    }
+
+    (high as u64) << 32 | low as u64
+}
+
+#[inline(always)]
+fn read_field(field: &u64) -> u64 {
+    unsafe { ptr::read_volatile(field) }
+}
+
+/// returns (tsc_frequency, tsc_origin, epoch_offset_ns) read consistently,
+/// retries while the kernel is updating the page.
+fn read_time_page() -> (u64, u64, u64) {
+    let page = unsafe { &*(TIME_PAGE_ADDRESS as *const TimePageData) };
+
+    loop {
+        let sequence = read_field(&page.sequence);
+        if sequence & 1 != 0 {
+            core::hint::spin_loop();
+            continue;
+        }
+
+        fence(Ordering::Acquire);
+        let values = (
+            read_field(&page.tsc_frequency),
+            read_field(&page.tsc_origin),
+            read_field(&page.epoch_offset_ns),
+        );
+        fence(Ordering::Acquire);
+
+        if read_field(&page.sequence) == sequence {
+            return values;
+        }
+    }
+}
+
+#[inline]
+fn ns_since(frequency: u64, origin: u64) -> u64 {
+    // split to keep the multiplication in range.
+    let ticks = rdtsc().saturating_sub(origin);
+    let seconds = ticks / frequency;
+    let sub_ns = (ticks % frequency) * NS_PER_SECOND / frequency;
+
+    seconds * NS_PER_SECOND + sub_ns
+}
+
+/// nanoseconds since the kernel clock started, `None` if the kernel
+/// has not published the clock yet.
+pub fn monotonic_ns() -> Option<u64> {
+    let (frequency, origin, _) = read_time_page();
+    if frequency == 0 {
+        return None;
+    }
+
+    Some(ns_since(frequency, origin))
+}
+
+/// nanoseconds since the unix epoch, as far as the kernel knows it.
+pub fn realtime_ns() -> Option<u64> {
+    let (frequency, origin, epoch_offset) = read_time_page();
+    if frequency == 0 {
+        return None;
+    }
+
+    Some(ns_since(frequency, origin) + epoch_offset)
+}
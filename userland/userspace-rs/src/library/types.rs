@@ -49,4 +49,98 @@ pub struct FStatInfo {
     pub atime: usize,
     pub mtime: usize,
     pub ctime: usize,
-}
\ No newline at end of file
+}
+
+/// one buffer of readv and writev.
+#[derive(Debug, Clone, Copy)]
+#[repr(C)]
+pub struct IOVec {
+    pub base: usize,
+    pub len: usize,
+}
+
+/// header of a submission/completion ring, see `sys_io_ring_enter`.
+#[derive(Debug, Default)]
+#[repr(C)]
+pub struct IORing {
+    pub sq_head: u32,
+    pub sq_tail: u32,
+    pub sq_mask: u32,
+    pub cq_head: u32,
+    pub cq_tail: u32,
+    pub cq_mask: u32,
+    pub sqes: usize,
+    pub cqes: usize,
+}
+
+pub enum IORingOp {
+    Nop = 0,
+    Read = 1,
+    Write = 2,
+    Open = 3,
+    Close = 4,
+}
+
+/// reads and writes at the offset of the descriptor.
+pub const IORING_CURRENT_OFFSET: u64 = u64::MAX;
+
+#[derive(Debug, Default, Clone, Copy)]
+#[repr(C)]
+pub struct IOSubmission {
+    pub opcode: u8,
+    pub reserved: [u8; 3],
+    pub fd: u32,
+    pub addr: u64,
+    pub len: u64,
+    pub offset: u64,
+    pub user_data: u64,
+}
+
+#[derive(Debug, Default, Clone, Copy)]
+#[repr(C)]
+pub struct IOCompletion {
+    pub user_data: u64,
+    pub result: i64,
+}
+
+pub const AF_INET: usize = 2;
+pub const SOCK_DGRAM: usize = 2;
+pub const SOCK_NONBLOCK: usize = 0o4000;
+pub const MSG_DONTWAIT: usize = 0x40;
+
+/// an IPv4 socket address, the port and address are in network order.
+#[derive(Debug, Default, Clone, Copy)]
+#[repr(C, packed)]
+pub struct SockAddrIn {
+    pub family: u16,
+    pub port: [u8; 2],
+    pub address: [u8; 4],
+    pub padding: [u8; 8],
+}
+
+impl SockAddrIn {
+    pub fn new(address: [u8; 4], port: u16) -> Self {
+        SockAddrIn {
+            family: AF_INET as u16,
+            port: port.to_be_bytes(),
+            address,
+            padding: [0; 8],
+        }
+    }
+}
+
+pub const EPOLL_CTL_ADD: usize = 1;
+pub const EPOLL_CTL_DEL: usize = 2;
+pub const EPOLL_CTL_MOD: usize = 3;
+
+pub const EPOLLIN: u32 = 0x1;
+pub const EPOLLOUT: u32 = 0x4;
+pub const EPOLLERR: u32 = 0x8;
+pub const EPOLLHUP: u32 = 0x10;
+
+#[derive(Debug, Default, Clone, Copy)]
+#[repr(C, packed)]
+pub struct EpollEvent {
+    pub events: u32,
+    pub data: u64,
+}